@@ -0,0 +1,643 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* attrcache.c - cache file attributes between walk and getattr */
+
+/* Entries are keyed by (st_dev, st_ino) and hold the struct stat most
+ * recently seen for that inode.  They are filled in by walk and create,
+ * which must stat anyway to learn what a name resolves to, and consumed
+ * by getattr, which then needs no system call.
+ *
+ * On local file systems each cached inode carries an inotify watch, and
+ * an entry stays valid until an event for its inode arrives.  Network and
+ * cluster file systems only report changes made on this node, so there
+ * (or if a watch can't be added) entries expire after the export's TTL.
+ * Changes made through diod itself are invalidated synchronously by the
+ * operation that made them, so a client sees its own changes at once.
+ *
+ * A getattr that misses must not re-insert attributes that were already
+ * stale when they were read.  Each invalidation stamps its hash bucket
+ * with a new epoch, and an insert is accepted only if the bucket has not
+ * been stamped since the caller read the epoch, before its stat.
+ *
+ * Atime is not tracked: reads do not invalidate entries.
+ *
+ * A directory's entry can also carry names known not to exist in it
+ * (negative entries, for exports with the negcache option), recorded
+ * when a walk fails with ENOENT.  They are dropped whenever the
+ * directory's attributes are, so they are only trusted while nothing
+ * could have been created there.  A name is only recorded if the
+ * directory's entry was already valid before the failed lookup.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/inotify.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "attrcache.h"
+
+#define AC_HASHSIZE     4096
+#define AC_MAXCOUNT     65536
+#define AC_MAXDEVS      32
+#define AC_MAXNEGS      65536
+#define AC_EVMASK       (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE \
+                       | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+                       | IN_MOVE_SELF)
+#define AC_DIREVMASK    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct Attr;
+
+typedef struct Neg {
+    struct Attr        *parent;
+    int                 h;
+    struct Neg         *hnext;
+    struct Neg         *pnext;
+    int                 len;
+    char                name[];
+} Neg;
+
+typedef struct Attr {
+    dev_t               dev;
+    ino_t               ino;
+    struct stat         st;
+    int                 valid;
+    int                 wd;         /* inotify watch, or -1 */
+    u64                 expires;    /* monotonic nsec, 0 = until notified */
+    Neg                *negs;
+    struct Attr        *hnext;
+    struct Attr        *wnext;
+    struct Attr        *lprev, *lnext;
+} Attr;
+
+/* File systems whose inotify events miss changes made on other nodes.
+ */
+static const unsigned long remote_magic[] = {
+    0x6969,         /* NFS */
+    0x517b,         /* SMB */
+    0xff534d42,     /* CIFS */
+    0xfe534d42,     /* SMB2 */
+    0x0bd00bd0,     /* Lustre */
+    0x47504653,     /* GPFS */
+    0x00c36400,     /* Ceph */
+    0x65735546,     /* FUSE */
+    0x01021997,     /* 9P */
+    0x5346414f,     /* AFS */
+    0x01161970,     /* GFS2 */
+    0x7461636f,     /* OCFS2 */
+    0xaad7aaea,     /* PanFS */
+    0x19830326,     /* BeeGFS */
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_once_t      once;
+    int                 ifd;
+    int                 count;
+    Attr               *hash[AC_HASHSIZE];
+    Attr               *whash[AC_HASHSIZE];
+    Attr               *lru_first, *lru_last;
+    Neg                *nhash[AC_HASHSIZE];
+    int                 negcount;
+    u64                 epoch;
+    u64                 stamp[AC_HASHSIZE]; /* epoch of last invalidation */
+    u64                 flushstamp;         /* ... of the whole cache */
+    struct {
+        dev_t           dev;
+        int             notifies;
+    }                   devs[AC_MAXDEVS];
+    int                 ndevs;
+    u64                 hits;
+    u64                 misses;
+    u64                 invalidations;
+    u64                 suppressed;
+    u64                 recorded;
+} ac = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+    .ifd = -1,
+};
+
+static int
+_hash (dev_t dev, ino_t ino)
+{
+    return (ino ^ (ino >> 12) ^ dev) % AC_HASHSIZE;
+}
+
+static int
+_nhash (dev_t dev, ino_t pino, const char *name, int len)
+{
+    u32 h = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (u8)name[i]) * 16777619U;
+    return (h ^ pino ^ dev) % AC_HASHSIZE;
+}
+
+static u64
+_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Call with ac.lock held.
+ */
+static u64
+_newepoch (void)
+{
+    return __atomic_add_fetch (&ac.epoch, 1, __ATOMIC_RELEASE);
+}
+
+static void
+_lru_unlink (Attr *a)
+{
+    if (a->lprev)
+        a->lprev->lnext = a->lnext;
+    else
+        ac.lru_first = a->lnext;
+    if (a->lnext)
+        a->lnext->lprev = a->lprev;
+    else
+        ac.lru_last = a->lprev;
+    a->lprev = a->lnext = NULL;
+}
+
+static void
+_lru_push (Attr *a)
+{
+    a->lprev = NULL;
+    a->lnext = ac.lru_first;
+    if (ac.lru_first)
+        ac.lru_first->lprev = a;
+    else
+        ac.lru_last = a;
+    ac.lru_first = a;
+}
+
+static Attr *
+_lookup (dev_t dev, ino_t ino)
+{
+    Attr *a;
+
+    for (a = ac.hash[_hash (dev, ino)]; a != NULL; a = a->hnext) {
+        if (a->dev == dev && a->ino == ino)
+            break;
+    }
+    return a;
+}
+
+static Attr *
+_wlookup (int wd)
+{
+    Attr *a;
+
+    for (a = ac.whash[wd % AC_HASHSIZE]; a != NULL; a = a->wnext) {
+        if (a->wd == wd)
+            break;
+    }
+    return a;
+}
+
+/* Drop the negative entries of directory a.
+ * Call with ac.lock held.
+ */
+static void
+_negclear (Attr *a)
+{
+    Neg *n, **np;
+
+    while ((n = a->negs)) {
+        a->negs = n->pnext;
+        np = &ac.nhash[n->h];
+        while (*np && *np != n)
+            np = &(*np)->hnext;
+        if (*np)
+            *np = n->hnext;
+        ac.negcount--;
+        free (n);
+    }
+}
+
+static int
+_current (Attr *a)
+{
+    return (a->valid && (a->expires == 0 || _now () < a->expires));
+}
+
+/* Remove a from the cache.  If rmwatch, also remove its inotify watch
+ * (not needed if the kernel has already dropped it).
+ * Call with ac.lock held.
+ */
+static void
+_remove (Attr *a, int rmwatch)
+{
+    Attr **ap = &ac.hash[_hash (a->dev, a->ino)];
+
+    while (*ap && *ap != a)
+        ap = &(*ap)->hnext;
+    if (*ap)
+        *ap = a->hnext;
+    if (a->wd != -1) {
+        ap = &ac.whash[a->wd % AC_HASHSIZE];
+        while (*ap && *ap != a)
+            ap = &(*ap)->wnext;
+        if (*ap)
+            *ap = a->wnext;
+        if (rmwatch)
+            (void)inotify_rm_watch (ac.ifd, a->wd);
+    }
+    _negclear (a);
+    _lru_unlink (a);
+    ac.count--;
+    free (a);
+}
+
+/* Call with ac.lock held.
+ */
+static void
+_inval (Attr *a)
+{
+    ac.stamp[_hash (a->dev, a->ino)] = _newepoch ();
+    if (a->valid) {
+        a->valid = 0;
+        ac.invalidations++;
+    }
+    _negclear (a);
+}
+
+/* Call with ac.lock held.
+ */
+static void
+_inval_all (void)
+{
+    Attr *a;
+
+    for (a = ac.lru_first; a != NULL; a = a->lnext) {
+        if (a->valid) {
+            a->valid = 0;
+            ac.invalidations++;
+        }
+        _negclear (a);
+    }
+    ac.flushstamp = _newepoch ();
+}
+
+/* Apply inotify events until the descriptor is closed.
+ */
+static void *
+_watch_thread (void *arg)
+{
+    char buf[65536]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    Attr *a;
+
+    for (;;) {
+        if ((n = read (ac.ifd, buf, sizeof (buf))) < 0) {
+            if (errno == EINTR)
+                continue;
+            err ("attrcache: inotify read");
+            break;
+        }
+        if (n == 0)
+            break;
+        pthread_mutex_lock (&ac.lock);
+        for (p = buf; p < buf + n; p += sizeof (*ev) + ev->len) {
+            ev = (struct inotify_event *)p;
+            if ((ev->mask & IN_Q_OVERFLOW)) {
+                _inval_all ();
+                continue;
+            }
+            if (!(a = _wlookup (ev->wd)))
+                continue;
+            if ((ev->mask & IN_IGNORED)) {
+                ac.stamp[_hash (a->dev, a->ino)] = _newepoch ();
+                _remove (a, 0);
+                continue;
+            }
+            /* a named event on a directory is about one of its entries,
+             * which only changes the directory if the name came or went */
+            if (ev->len > 0 && !(ev->mask & AC_DIREVMASK))
+                continue;
+            _inval (a);
+        }
+        pthread_mutex_unlock (&ac.lock);
+    }
+    pthread_mutex_lock (&ac.lock);
+    _inval_all ();
+    pthread_mutex_unlock (&ac.lock);
+    return NULL;
+}
+
+static void
+_watch_init (void)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    int fd;
+
+    if ((fd = inotify_init1 (IN_CLOEXEC)) < 0) {
+        err ("attrcache: inotify_init1 (falling back to TTLs)");
+        return;
+    }
+    ac.ifd = fd;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if ((errno = pthread_create (&t, &attr, _watch_thread, NULL))) {
+        err ("attrcache: pthread_create (falling back to TTLs)");
+        ac.ifd = -1;
+        (void)close (fd);
+    }
+    pthread_attr_destroy (&attr);
+}
+
+/* Return 1 if inotify sees every change to the file system of fd.
+ * Call with ac.lock held.
+ */
+static int
+_notifies (int fd, dev_t dev)
+{
+    struct statfs sb;
+    int i, notifies = 1;
+
+    for (i = 0; i < ac.ndevs; i++) {
+        if (ac.devs[i].dev == dev)
+            return ac.devs[i].notifies;
+    }
+    if (fstatfs (fd, &sb) < 0)
+        return 0;
+    for (i = 0; i < sizeof (remote_magic) / sizeof (remote_magic[0]); i++) {
+        if ((unsigned long)sb.f_type == remote_magic[i])
+            notifies = 0;
+    }
+    if (ac.ndevs < AC_MAXDEVS) {
+        ac.devs[ac.ndevs].dev = dev;
+        ac.devs[ac.ndevs].notifies = notifies;
+        ac.ndevs++;
+    }
+    return notifies;
+}
+
+/* Return the current epoch, to be passed to diod_attrcache_add () along
+ * with attributes read after this call.
+ */
+u64
+diod_attrcache_epoch (void)
+{
+    return __atomic_load_n (&ac.epoch, __ATOMIC_ACQUIRE);
+}
+
+/* Copy cached attributes of (dev, ino) to sb and return 0, or return -1
+ * on a miss.  Either way, set *epochp as diod_attrcache_epoch () does.
+ */
+int
+diod_attrcache_get (dev_t dev, ino_t ino, struct stat *sb, u64 *epochp)
+{
+    Attr *a;
+    int rc = -1;
+
+    pthread_mutex_lock (&ac.lock);
+    *epochp = ac.epoch;
+    if ((a = _lookup (dev, ino)) && _current (a)) {
+        *sb = a->st;
+        _lru_unlink (a);
+        _lru_push (a);
+        ac.hits++;
+        rc = 0;
+    } else
+        ac.misses++;
+    pthread_mutex_unlock (&ac.lock);
+    return rc;
+}
+
+/* Cache sb, the attributes of the object open on fd, as read after
+ * 'epoch' was obtained.  ttl (msec) bounds the life of the entry if
+ * changes to it can't be watched.
+ */
+void
+diod_attrcache_add (int fd, struct stat *sb, int ttl, u64 epoch)
+{
+    int h = _hash (sb->st_dev, sb->st_ino);
+    char path[32];
+    Attr *a;
+
+    pthread_once (&ac.once, _watch_init);
+    pthread_mutex_lock (&ac.lock);
+    if (!(a = _lookup (sb->st_dev, sb->st_ino))) {
+        if (ac.count >= AC_MAXCOUNT && ac.lru_last)
+            _remove (ac.lru_last, 1);
+        if (!(a = malloc (sizeof (*a))))
+            goto done;
+        a->dev = sb->st_dev;
+        a->ino = sb->st_ino;
+        a->wd = -1;
+        a->negs = NULL;
+        a->lprev = a->lnext = NULL;
+        if (ac.ifd != -1 && _notifies (fd, sb->st_dev)) {
+            snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+            a->wd = inotify_add_watch (ac.ifd, path, AC_EVMASK);
+        }
+        a->hnext = ac.hash[h];
+        ac.hash[h] = a;
+        if (a->wd != -1) {
+            a->wnext = ac.whash[a->wd % AC_HASHSIZE];
+            ac.whash[a->wd % AC_HASHSIZE] = a;
+        }
+        ac.count++;
+    } else {
+        if (!_current (a)
+                || a->st.st_mtim.tv_sec != sb->st_mtim.tv_sec
+                || a->st.st_mtim.tv_nsec != sb->st_mtim.tv_nsec
+                || a->st.st_ctim.tv_sec != sb->st_ctim.tv_sec
+                || a->st.st_ctim.tv_nsec != sb->st_ctim.tv_nsec)
+            _negclear (a);
+        _lru_unlink (a);
+    }
+    _lru_push (a);
+    a->st = *sb;
+    a->valid = (ac.stamp[h] <= epoch && ac.flushstamp <= epoch);
+    a->expires = a->wd != -1 ? 0 : _now () + (u64)ttl * 1000000ULL;
+done:
+    pthread_mutex_unlock (&ac.lock);
+}
+
+/* Return 1 if name is known not to exist in directory (dev, pino).
+ */
+int
+diod_attrcache_negative (dev_t dev, ino_t pino, const char *name, int len)
+{
+    Neg *n;
+    int rc = 0;
+
+    pthread_mutex_lock (&ac.lock);
+    for (n = ac.nhash[_nhash (dev, pino, name, len)]; n; n = n->hnext) {
+        if (n->parent->ino == pino && n->parent->dev == dev
+                && n->len == len && !memcmp (n->name, name, len))
+            break;
+    }
+    if (n && _current (n->parent)) {
+        ac.suppressed++;
+        rc = 1;
+    }
+    pthread_mutex_unlock (&ac.lock);
+    return rc;
+}
+
+/* A lookup of name in the directory open on pfd, begun after 'epoch'
+ * was obtained, failed with ENOENT.  Record that if the directory's
+ * attributes were cached and valid throughout; otherwise cache them so
+ * the next miss can be recorded.
+ */
+void
+diod_attrcache_addneg (int pfd, dev_t dev, ino_t pino, const char *name,
+                       int len, int ttl, u64 epoch)
+{
+    struct stat sb;
+    Attr *a, *old;
+    Neg *n;
+    int h = _hash (dev, pino);
+
+    pthread_mutex_lock (&ac.lock);
+    if (!(a = _lookup (dev, pino)) || !_current (a)) {
+        pthread_mutex_unlock (&ac.lock);
+        epoch = diod_attrcache_epoch ();
+        if (fstat (pfd, &sb) == 0)
+            diod_attrcache_add (pfd, &sb, ttl, epoch);
+        return;
+    }
+    if (ac.stamp[h] > epoch || ac.flushstamp > epoch)
+        goto done;
+    for (n = a->negs; n != NULL; n = n->pnext) {
+        if (n->len == len && !memcmp (n->name, name, len))
+            goto done;
+    }
+    for (old = ac.lru_last; old && ac.negcount >= AC_MAXNEGS; old = old->lprev)
+        _negclear (old);
+    if (!(n = malloc (sizeof (*n) + len)))
+        goto done;
+    n->parent = a;
+    n->len = len;
+    memcpy (n->name, name, len);
+    n->h = _nhash (dev, pino, name, len);
+    n->hnext = ac.nhash[n->h];
+    ac.nhash[n->h] = n;
+    n->pnext = a->negs;
+    a->negs = n;
+    ac.negcount++;
+    ac.recorded++;
+done:
+    pthread_mutex_unlock (&ac.lock);
+}
+
+/* Invalidate (dev, ino) after changing it, or the whole cache if ino is 0.
+ */
+void
+diod_attrcache_inval (dev_t dev, ino_t ino)
+{
+    Attr *a;
+
+    pthread_mutex_lock (&ac.lock);
+    if (ino == 0)
+        _inval_all ();
+    else if ((a = _lookup (dev, ino)))
+        _inval (a);
+    else
+        ac.stamp[_hash (dev, ino)] = _newepoch ();
+    pthread_mutex_unlock (&ac.lock);
+}
+
+static char *
+_get_attrcache (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&ac.lock);
+    if (aspf (&s, &len, "%d %d %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              ac.count, AC_MAXCOUNT,
+              ac.hits, ac.misses, ac.invalidations) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&ac.lock);
+    return s;
+}
+
+static char *
+_get_negcache (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&ac.lock);
+    if (aspf (&s, &len, "%d %d %"PRIu64" %"PRIu64"\n",
+              ac.negcount, AC_MAXNEGS, ac.suppressed, ac.recorded) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&ac.lock);
+    return s;
+}
+
+/* Add the "attrcache" and "negcache" ctl files:
+ *   entries limit hits misses invalidations
+ *   names limit suppressed recorded
+ */
+int
+diod_attrcache_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "attrcache", _get_attrcache, NULL))
+        return -1;
+    if (!np_ctl_addfile (srv->ctlroot, "negcache", _get_negcache, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
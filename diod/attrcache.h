@@ -0,0 +1,14 @@
+int      diod_attrcache_init (Npsrv *srv);
+u64      diod_attrcache_epoch (void);
+int      diod_attrcache_get (dev_t dev, ino_t ino, struct stat *sb,
+                             u64 *epochp);
+void     diod_attrcache_add (int fd, struct stat *sb, int ttl, u64 epoch);
+void     diod_attrcache_inval (dev_t dev, ino_t ino);
+int      diod_attrcache_negative (dev_t dev, ino_t pino, const char *name,
+                                  int len);
+void     diod_attrcache_addneg (int pfd, dev_t dev, ino_t pino,
+                                const char *name, int len, int ttl, u64 epoch);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
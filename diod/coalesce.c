@@ -0,0 +1,239 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* coalesce.c - merge adjacent queued reads and writes of a fid */
+
+/* A kernel client streaming a file sends many Treads or Twrites on one
+ * fid at consecutive offsets, and when the workers are busy they wait in
+ * the queue together.  Rather than have each cost its own pread or
+ * pwrite on a different worker, the worker that picks up the first takes
+ * the others out of the queue (np_req_take_adjacent ()) and does them
+ * all with one preadv or pwritev, then splits the result among the
+ * replies in offset order.  When there is nothing to merge, the request
+ * goes on to uring.c as before.
+ *
+ * A merged batch runs on the worker, without RWF_NOWAIT: it is already
+ * one system call for several requests.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "uring.h"
+#include "coalesce.h"
+
+#define COALESCE_MAX    16  /* requests merged behind the first */
+
+typedef struct {
+    pthread_mutex_t lock;
+    u64             rbatches;   /* preadv calls */
+    u64             rmerged;    /* Treads answered by another's preadv */
+    u64             wbatches;   /* pwritev calls */
+    u64             wmerged;    /* Twrites answered by another's pwritev */
+} Coalescestats;
+
+static Coalescestats co_stats = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 };
+
+/* Answer merged request req, whose share of the batch's result is res
+ * (a byte count or negative errno value).
+ */
+static void
+_respond (Npreq *req, Npfcall *rc, int res, UringFun done)
+{
+    Npfcall *ret;
+    int err;
+
+    np_uerror (0);
+    if ((ret = done (req, rc, res)))
+        np_req_respond (req, ret);
+    else {
+        err = np_rerror ();
+        np_req_respond_error (req, err ? err : EIO);
+    }
+}
+
+/* Split n bytes (or -errno) of a batch among more[0..nmore-1], which
+ * follow a first request of count bytes, answering each.  Return the
+ * first request's share.
+ */
+static ssize_t
+_split (ssize_t n, u32 count, Npreq **more, Npfcall **rcs, u32 *counts,
+        int nmore, UringFun done)
+{
+    ssize_t first = n < count ? n : count;
+    int i, res;
+
+    if (n > 0)
+        n -= first;
+    for (i = 0; i < nmore; i++) {
+        res = n < counts[i] ? n : counts[i];
+        if (n > 0)
+            n -= res;
+        _respond (more[i], rcs ? rcs[i] : NULL, res, done);
+    }
+    return first;
+}
+
+static void
+_count (u64 *batches, u64 *merged, int nmore)
+{
+    pthread_mutex_lock (&co_stats.lock);
+    (*batches)++;
+    (*merged) += nmore;
+    pthread_mutex_unlock (&co_stats.lock);
+}
+
+/* Read into Rread rc, up to its count, from fd at offset, like pread (2),
+ * along with any Treads queued behind req that continue it, which are
+ * answered here through done.  A lone read goes to diod_uring_pread ()
+ * with ring as its completion.  Returns as that does, and unless the
+ * read was queued, sets *batch to the bytes read for req and the merged
+ * Treads together.
+ */
+ssize_t
+diod_coalesce_pread (int fd, Npfcall *rc, u64 offset, Npreq *req,
+                     size_t *batch, UringFun done, UringFun ring)
+{
+    Npreq *more[COALESCE_MAX];
+    Npfcall *rcs[COALESCE_MAX];
+    u32 counts[COALESCE_MAX];
+    struct iovec iov[COALESCE_MAX + 1];
+    int i, nmore;
+    ssize_t n;
+
+    if ((nmore = np_req_take_adjacent (req, more, COALESCE_MAX)) == 0) {
+        n = diod_uring_pread (fd, rc, offset, req, ring);
+        if (n >= 0)
+            *batch = n;
+        return n;
+    }
+    iov[0].iov_base = rc->u.rread.data;
+    iov[0].iov_len = rc->u.rread.count;
+    for (i = 0; i < nmore; i++) {
+        counts[i] = more[i]->tcall->u.tread.count;
+        if (!(rcs[i] = np_alloc_rread (counts[i])))
+            break;
+        iov[i + 1].iov_base = rcs[i]->u.rread.data;
+        iov[i + 1].iov_len = counts[i];
+    }
+    if (i < nmore) { /* out of memory: read only what comes before */
+        _split (-ENOMEM, 0, more + i, NULL, counts + i, nmore - i, done);
+        nmore = i;
+    }
+    n = preadv (fd, iov, nmore + 1, offset);
+    _count (&co_stats.rbatches, &co_stats.rmerged, nmore);
+    if (n >= 0)
+        *batch = n;
+    n = _split (n < 0 ? -errno : n, iov[0].iov_len, more, rcs, counts,
+                nmore, done);
+    if (n < 0) {
+        errno = -n;
+        return -1;
+    }
+    return n;
+}
+
+/* Write count bytes of data (which req holds) to fd at offset, like
+ * pwrite (2), along with any Twrites queued behind req that continue it,
+ * which are answered here through done.  A lone write goes to
+ * diod_uring_pwrite () with ring as its completion.  Returns as that
+ * does.
+ */
+ssize_t
+diod_coalesce_pwrite (int fd, u8 *data, u32 count, u64 offset, Npreq *req,
+                      UringFun done, UringFun ring)
+{
+    Npreq *more[COALESCE_MAX];
+    u32 counts[COALESCE_MAX];
+    struct iovec iov[COALESCE_MAX + 1];
+    int i, nmore;
+    ssize_t n;
+
+    if ((nmore = np_req_take_adjacent (req, more, COALESCE_MAX)) == 0) {
+        return diod_uring_pwrite (fd, data, count, offset, req, ring);
+    }
+    iov[0].iov_base = data;
+    iov[0].iov_len = count;
+    for (i = 0; i < nmore; i++) {
+        counts[i] = more[i]->tcall->u.twrite.count;
+        iov[i + 1].iov_base = more[i]->tcall->u.twrite.data;
+        iov[i + 1].iov_len = counts[i];
+    }
+    n = pwritev (fd, iov, nmore + 1, offset);
+    _count (&co_stats.wbatches, &co_stats.wmerged, nmore);
+    n = _split (n < 0 ? -errno : n, count, more, NULL, counts, nmore, done);
+    if (n < 0) {
+        errno = -n;
+        return -1;
+    }
+    return n;
+}
+
+static char *
+_get_coalesce (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&co_stats.lock);
+    if (aspf (&s, &len, "%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              co_stats.rbatches, co_stats.rmerged,
+              co_stats.wbatches, co_stats.wmerged) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&co_stats.lock);
+    return s;
+}
+
+/* Add the "coalesce" ctl file:
+ *   read-batches reads-merged write-batches writes-merged
+ */
+int
+diod_coalesce_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "coalesce", _get_coalesce, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,9 @@
+int      diod_coalesce_init (Npsrv *srv);
+ssize_t  diod_coalesce_pread (int fd, Npfcall *rc, u64 offset, Npreq *req,
+                              size_t *batch, UringFun done, UringFun ring);
+ssize_t  diod_coalesce_pwrite (int fd, u8 *data, u32 count, u64 offset,
+                               Npreq *req, UringFun done, UringFun ring);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
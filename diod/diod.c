@@ -57,6 +57,8 @@
 #include "diod_sock.h"
 
 #include "ops.h"
+#include "restart.h"
+#include "shard.h"
 
 typedef enum { SRV_STDIN, SRV_NORMAL } srvmode_t;
 
@@ -69,7 +71,7 @@ static void          _service_run (srvmode_t mode);
 #define NR_OPEN         1048576 /* works on RHEL 5 x86_64 arch */
 #endif
 
-#define OPTIONS "fsd:l:w:e:Eu:SL:nc:NU:"
+#define OPTIONS "fsd:l:w:e:Eu:SL:nc:NU:B:H:P:D:F:m:R:"
 
 #if HAVE_GETOPT_LONG
 #define GETOPT(ac,av,opt,lopt) getopt_long (ac,av,opt,lopt,NULL)
@@ -88,6 +90,13 @@ static const struct option longopts[] = {
     {"squashuser",      required_argument,  0, 'U'},
     {"logdest",         required_argument,  0, 'L'},
     {"config-file",     required_argument,  0, 'c'},
+    {"busy-poll",       required_argument,  0, 'B'},
+    {"hot-restart",     required_argument,  0, 'H'},
+    {"shards",          required_argument,  0, 'P'},
+    {"dircache",        required_argument,  0, 'D'},
+    {"fdcache",         required_argument,  0, 'F'},
+    {"msize",           required_argument,  0, 'm'},
+    {"uring",           required_argument,  0, 'R'},
     {0, 0, 0, 0},
 };
 #else
@@ -113,6 +122,13 @@ usage()
 "   -L,--logdest DEST      log to DEST, can be syslog, stderr, or file\n"
 "   -d,--debug MASK        set debugging mask\n"
 "   -c,--config-file FILE  set config file path\n"
+"   -B,--busy-poll USEC    poll for requests for USEC before sleeping\n"
+"   -H,--hot-restart PATH  take over from/hand over to diod on socket PATH\n"
+"   -P,--shards INT        spread connections over INT server processes\n"
+"   -D,--dircache MB       share up to MB of directory listings (0 = off)\n"
+"   -F,--fdcache INT       keep up to INT idle file descriptors (0 = off)\n"
+"   -m,--msize BYTES       offer clients messages of up to BYTES\n"
+"   -R,--uring INT         io_uring entries per ring for file I/O (0 = off)\n"
     );
     exit (1);
 }
@@ -204,6 +220,27 @@ main(int argc, char **argv)
                 diod_conf_set_logdest (optarg);
                 diod_log_set_dest (optarg);
                 break;
+            case 'B':   /* --busy-poll USEC */
+                diod_conf_set_busypoll (strtoul (optarg, NULL, 10));
+                break;
+            case 'H':   /* --hot-restart PATH */
+                diod_conf_set_hotrestart (optarg);
+                break;
+            case 'P':   /* --shards INT */
+                diod_conf_set_shards (strtoul (optarg, NULL, 10));
+                break;
+            case 'D':   /* --dircache MB */
+                diod_conf_set_dircache (strtoul (optarg, NULL, 10));
+                break;
+            case 'F':   /* --fdcache INT */
+                diod_conf_set_fdcache (strtoul (optarg, NULL, 10));
+                break;
+            case 'm':   /* --msize BYTES */
+                diod_conf_set_msize (strtoul (optarg, NULL, 10));
+                break;
+            case 'R':   /* --uring INT */
+                diod_conf_set_uring (strtoul (optarg, NULL, 10));
+                break;
             default:
                 usage();
         }
@@ -213,6 +250,12 @@ main(int argc, char **argv)
 
     if (diod_conf_opt_runasuid () && diod_conf_get_allsquash ())
         err_exit ("--runas-uid and allsquash cannot be used together");
+    if (diod_conf_get_shards () > 0 && diod_conf_get_hotrestart ())
+        msg_exit ("shards and hot restart cannot be used together");
+    if (diod_conf_get_msize () < 4096 || diod_conf_get_msize () > MAX_MSIZE)
+        msg_exit ("msize must be between 4096 and %d", MAX_MSIZE);
+    if (diod_conf_get_uring () < 0 || diod_conf_get_uring () > MAX_URING)
+        msg_exit ("uring must be between 0 and %d", MAX_URING);
 
     diod_conf_validate_exports ();
 
@@ -334,9 +377,13 @@ _daemonize (void)
  **/
 
 struct svc_struct {
+    srvmode_t mode;
     Npsrv *srv;
     struct pollfd *fds;
-    int nfds;
+    int nfds;           /* listen fds (hot restart or shard fd follows) */
+    int hfd;
+    int cfd;            /* shard: socket connections arrive on */
+    int acceptor;       /* pass connections to shards instead of serving */
     pthread_t t;
     int shutdown;
     int reload;
@@ -370,33 +417,50 @@ static void *
 _service_loop (void *arg)
 {
     sigset_t sigs;
-    int i;
+    int i, nfds;
 
     sigfillset (&sigs);
     sigdelset (&sigs, SIGHUP);
     sigdelset (&sigs, SIGTERM);
     sigdelset (&sigs, SIGUSR1);
 
-    if (ss.nfds == 0)
+    if (ss.mode == SRV_STDIN)
         diod_sock_startfd (ss.srv, 0, "stdin");
+    nfds = ss.nfds + (ss.hfd != -1 || ss.cfd != -1 ? 1 : 0);
     while (!ss.shutdown) {
         if (ss.reload) {
             diod_conf_init_config_file (NULL);
-            np_usercache_flush (ss.srv);
+            if (ss.acceptor)
+                diod_shard_kill (SIGHUP);
+            else
+                np_usercache_flush (ss.srv);
             ss.reload = 0;
         }
-        for (i = 0; i < ss.nfds; i++) {
+        for (i = 0; i < nfds; i++) {
             ss.fds[i].events = POLLIN;
             ss.fds[i].revents = 0;
         }
-        if (ppoll (ss.fds, ss.nfds, NULL, &sigs) < 0) {
+        if (ppoll (ss.fds, nfds, NULL, &sigs) < 0) {
             if (errno == EINTR)
                 continue;
             err_exit ("ppoll");
         }
         for (i = 0; i < ss.nfds; i++) {
             if ((ss.fds[i].revents & POLLIN)) {
-                diod_sock_accept_one (ss.srv, ss.fds[i].fd);
+                if (ss.acceptor)
+                    diod_shard_accept_one (ss.fds[i].fd);
+                else
+                    diod_sock_accept_one (ss.srv, ss.fds[i].fd);
+            }
+        }
+        if (ss.hfd != -1 && (ss.fds[ss.nfds].revents & POLLIN)) {
+            if (diod_restart_handoff (ss.srv, ss.hfd, ss.fds, ss.nfds) == 0)
+                exit (0); /* successor owns the connections now */
+        }
+        if (ss.cfd != -1 && (ss.fds[ss.nfds].revents & (POLLIN | POLLHUP))) {
+            if (diod_shard_recv (ss.srv, ss.cfd) < 0) {
+                msg ("acceptor has gone away: shutting down");
+                ss.shutdown = 1;
             }
         }
     }
@@ -437,22 +501,40 @@ _service_run (srvmode_t mode)
     int nwthreads = diod_conf_get_nwthreads ();
     int flags = diod_conf_get_debuglevel ();
     uid_t euid = geteuid ();
+    char *hotrestart = diod_conf_get_hotrestart ();
+    int shards = diod_conf_get_shards ();
     int n;
 
+    ss.mode = mode;
     ss.shutdown = 0;
     ss.reload = 0;
     _service_sigsetup ();
 
     ss.fds = NULL;
     ss.nfds = 0;
+    ss.hfd = -1;
+    ss.cfd = -1;
+    ss.acceptor = 0;
     switch (mode) {
         case SRV_STDIN:
             break;
         case SRV_NORMAL:
+            if (hotrestart && diod_restart_takeover (hotrestart, &ss.fds,
+                                                     &ss.nfds))
+                break;
             if (!diod_sock_listen_hostports (l, &ss.fds, &ss.nfds, NULL))
                 msg_exit ("failed to set up listen ports");
             break;
     }
+    if (hotrestart) {
+        if ((ss.hfd = diod_restart_listen (hotrestart)) != -1) {
+            ss.fds = realloc (ss.fds, sizeof (*ss.fds) * (ss.nfds + 1));
+            if (!ss.fds)
+                msg_exit ("out of memory");
+            ss.fds[ss.nfds].fd = ss.hfd;
+        } else
+            msg ("hot restart disabled");
+    }
 
     /* manipulate squash/runas users if not root */
     if (euid != 0) {
@@ -488,6 +570,20 @@ _service_run (srvmode_t mode)
         else if (diod_conf_opt_runasuid ())
             _become_user (NULL, diod_conf_get_runasuid (), 1);
     }
+
+    /* The original process only accepts connections; shards serve them.
+     */
+    if (mode == SRV_NORMAL && shards > 0) {
+        if (diod_shard_spawn (shards, ss.fds, ss.nfds, &ss.cfd) < 0) {
+            ss.acceptor = 1;
+            _service_loop (NULL);
+            diod_shard_kill (SIGTERM);
+            diod_shard_wait ();
+            return;
+        }
+        ss.nfds = 0;
+        ss.fds[0].fd = ss.cfd;
+    }
     
     flags |= SRV_FLAGS_AUTHCONN;
     if (geteuid () == 0)
@@ -498,6 +594,10 @@ _service_run (srvmode_t mode)
         errn_exit (np_rerror (), "np_srv_create");
     if (diod_register_ops (ss.srv) < 0)
         errn_exit (np_rerror (), "diod_register_ops");
+    ss.srv->spin = diod_conf_get_busypoll ();
+    diod_restart_resume (ss.srv);
+    if (ss.cfd != -1 && diod_shard_register (ss.srv) < 0)
+        errn_exit (np_rerror (), "diod_shard_register");
 
     if ((n = pthread_create (&ss.t, NULL, _service_loop, NULL)))
         errn_exit (n, "pthread_create _service_loop");
@@ -513,6 +613,8 @@ _service_run (srvmode_t mode)
     if ((n = pthread_join (ss.t, NULL)))
         errn_exit (n, "pthread_join _service_loop");
 
+    if (ss.hfd != -1)
+        (void)unlink (hotrestart);
     np_srv_destroy (ss.srv);
 }
 
@@ -0,0 +1,474 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* dircache.c - share directory listings between concurrent readers */
+
+/* A snapshot holds a whole directory already serialized as 9P dirents,
+ * keyed by (st_dev, st_ino) and valid while the directory's mtime and
+ * ctime are unchanged.  A Treaddir stream that starts at offset 0 on an
+ * unchanged directory is served from the snapshot with a memcpy.  The
+ * dirents carry the backend's own d_off cookies, so a reader can drop
+ * back to reading the directory itself at any entry.
+ *
+ * When several readers miss at once, the first builds the snapshot and
+ * the rest wait for it.  Snapshots are reference counted, so evicting
+ * one (LRU, to stay under the size limit) does not pull it out from
+ * under a reader.  Directories with more than maxentries entries, or
+ * that change while being read, are not cached; a failed snapshot stays
+ * in the cache as a marker so they are not read again until they change.
+ *
+ * File system timestamps are coarse, so a directory changed within a
+ * tick of being read could look unchanged.  A snapshot of a directory
+ * modified less than DC_RACYNSEC before it was read is given to its
+ * reader but not shared.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "dircache.h"
+
+#define DC_HASHSIZE     256
+#define DC_MAXCOUNT     4096        /* snapshots, including failed ones */
+#define DC_BUFSIZE      65536
+#define DC_QIDSIZE      13          /* type[1] version[4] path[8] */
+#define DC_HDRSIZE      (DC_QIDSIZE + 8 + 1 + 2) /* qid offset type namelen */
+#define DC_RACYNSEC     100000000   /* timestamp granularity allowance */
+
+struct linux_dirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+struct Dirsnap {
+    dev_t               dev;
+    ino_t               ino;
+    struct timespec     mtim;
+    struct timespec     ctim;
+    int                 refcount;
+    int                 building;
+    int                 failed;     /* don't try again until it changes */
+    u8                 *data;       /* packed 9P dirents */
+    u32                 len;
+    int                 nentries;
+    struct Dirsnap     *hnext;
+    struct Dirsnap     *lprev, *lnext;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      built;
+    size_t              limit;
+    int                 maxentries;
+    size_t              size;
+    int                 count;
+    Dirsnap            *hash[DC_HASHSIZE];
+    Dirsnap            *lru_first, *lru_last;
+    u64                 hits;
+    u64                 misses;
+    u64                 uncached;
+} dc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .built = PTHREAD_COND_INITIALIZER,
+};
+
+static int
+_hash (dev_t dev, ino_t ino)
+{
+    return (ino ^ (ino >> 8) ^ dev) % DC_HASHSIZE;
+}
+
+static void
+_lru_unlink (Dirsnap *ds)
+{
+    if (ds->lprev)
+        ds->lprev->lnext = ds->lnext;
+    else
+        dc.lru_first = ds->lnext;
+    if (ds->lnext)
+        ds->lnext->lprev = ds->lprev;
+    else
+        dc.lru_last = ds->lprev;
+    ds->lprev = ds->lnext = NULL;
+}
+
+static void
+_lru_push (Dirsnap *ds)
+{
+    ds->lprev = NULL;
+    ds->lnext = dc.lru_first;
+    if (dc.lru_first)
+        dc.lru_first->lprev = ds;
+    else
+        dc.lru_last = ds;
+    dc.lru_first = ds;
+}
+
+static void
+_snapfree (Dirsnap *ds)
+{
+    if (ds->data)
+        free (ds->data);
+    free (ds);
+}
+
+/* Drop a reference.  Call with dc.lock held.
+ */
+static void
+_snapput (Dirsnap *ds)
+{
+    if (--ds->refcount == 0)
+        _snapfree (ds);
+}
+
+/* Remove ds from the cache and drop the cache's reference.
+ * Call with dc.lock held.
+ */
+static void
+_evict (Dirsnap *ds)
+{
+    Dirsnap **dp = &dc.hash[_hash (ds->dev, ds->ino)];
+
+    while (*dp && *dp != ds)
+        dp = &(*dp)->hnext;
+    if (*dp)
+        *dp = ds->hnext;
+    ds->hnext = NULL;
+    _lru_unlink (ds);
+    dc.size -= ds->len;
+    dc.count--;
+    _snapput (ds);
+}
+
+static int
+_samestat (Dirsnap *ds, struct stat *sb)
+{
+    return (ds->mtim.tv_sec == sb->st_mtim.tv_sec
+         && ds->mtim.tv_nsec == sb->st_mtim.tv_nsec
+         && ds->ctim.tv_sec == sb->st_ctim.tv_sec
+         && ds->ctim.tv_nsec == sb->st_ctim.tv_nsec);
+}
+
+/* Append one entry to ds->data, growing it as needed.
+ */
+static int
+_snapadd (Dirsnap *ds, u32 *sizep, int dfd, struct linux_dirent64 *de)
+{
+    Npqid qid;
+    struct stat sb;
+    u8 *ndata;
+    int n;
+
+    qid.path = de->d_ino;
+    qid.version = 0;
+    qid.type = 0;
+    if (de->d_type == DT_UNKNOWN) {
+        if (fstatat (dfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+            return -1;
+        qid.path = sb.st_ino;
+        if (S_ISDIR (sb.st_mode))
+            qid.type |= P9_QTDIR;
+        if (S_ISLNK (sb.st_mode))
+            qid.type |= P9_QTSYMLINK;
+    } else if (de->d_type == DT_DIR)
+        qid.type |= P9_QTDIR;
+    else if (de->d_type == DT_LNK)
+        qid.type |= P9_QTSYMLINK;
+    while ((n = np_serialize_p9dirent (&qid, de->d_off, de->d_type,
+                                       de->d_name, ds->data + ds->len,
+                                       *sizep - ds->len)) == 0) {
+        if (!(ndata = realloc (ds->data, *sizep * 2))) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ds->data = ndata;
+        *sizep *= 2;
+    }
+    ds->len += n;
+    ds->nentries++;
+    return 0;
+}
+
+static int
+_racy (struct timespec *t, struct timespec *start)
+{
+    int64_t d = (int64_t)(start->tv_sec - t->tv_sec) * 1000000000
+              + (start->tv_nsec - t->tv_nsec);
+
+    return d < DC_RACYNSEC;
+}
+
+/* Read the whole directory behind dfd into ds.
+ * Return 0 on success, 1 if the snapshot is good but must not be shared,
+ * or -1 if it could not or should not be made.
+ */
+static int
+_snapbuild (Dirsnap *ds, int dfd)
+{
+    struct linux_dirent64 *de;
+    struct stat sb;
+    struct timespec start;
+    char *buf = NULL;
+    u32 size = DC_BUFSIZE;
+    long n, i;
+
+    clock_gettime (CLOCK_REALTIME, &start);
+    if (!(buf = malloc (DC_BUFSIZE)) || !(ds->data = malloc (size)))
+        goto error;
+    if (lseek (dfd, 0, SEEK_SET) == (off_t)-1)
+        goto error;
+    while ((n = syscall (SYS_getdents64, dfd, buf, DC_BUFSIZE)) > 0) {
+        for (i = 0; i < n; i += de->d_reclen) {
+            de = (struct linux_dirent64 *)(buf + i);
+            if (ds->nentries == dc.maxentries)
+                goto error;
+            if (_snapadd (ds, &size, dfd, de) < 0)
+                goto error;
+        }
+    }
+    if (n < 0)
+        goto error;
+    /* the directory must not have changed underneath us */
+    if (fstat (dfd, &sb) < 0 || !_samestat (ds, &sb))
+        goto error;
+    free (buf);
+    if (_racy (&ds->mtim, &start) || _racy (&ds->ctim, &start))
+        return 1;
+    return 0;
+error:
+    if (buf)
+        free (buf);
+    return -1;
+}
+
+/* Return a referenced snapshot of the directory open on dfd, whose
+ * current attributes are in sb, or NULL if it is not to be cached.
+ * N.B. may move dfd's file offset.
+ */
+Dirsnap *
+diod_dircache_get (int dfd, struct stat *sb)
+{
+    Dirsnap *ds, *ods, *prev;
+    int rc, h = _hash (sb->st_dev, sb->st_ino);
+
+    if (dc.limit == 0)
+        return NULL;
+    pthread_mutex_lock (&dc.lock);
+again:
+    for (ds = dc.hash[h]; ds != NULL; ds = ds->hnext) {
+        if (ds->dev == sb->st_dev && ds->ino == sb->st_ino)
+            break;
+    }
+    if (ds && _samestat (ds, sb)) {
+        if (ds->building) {
+            pthread_cond_wait (&dc.built, &dc.lock);
+            goto again;
+        }
+        if (ds->failed) {
+            dc.uncached++;
+            pthread_mutex_unlock (&dc.lock);
+            return NULL;
+        }
+        ds->refcount++;
+        _lru_unlink (ds);
+        _lru_push (ds);
+        dc.hits++;
+        pthread_mutex_unlock (&dc.lock);
+        return ds;
+    }
+    if (ds && ds->building) {       /* stale build in progress */
+        dc.uncached++;
+        pthread_mutex_unlock (&dc.lock);
+        return NULL;
+    }
+    if (ds)
+        _evict (ds);
+    dc.misses++;
+
+    /* insert a placeholder so concurrent readers wait for this build */
+    if (!(ds = calloc (1, sizeof (*ds)))) {
+        pthread_mutex_unlock (&dc.lock);
+        return NULL;
+    }
+    ds->dev = sb->st_dev;
+    ds->ino = sb->st_ino;
+    ds->mtim = sb->st_mtim;
+    ds->ctim = sb->st_ctim;
+    ds->refcount = 2;               /* ours and the cache's */
+    ds->building = 1;
+    ds->hnext = dc.hash[h];
+    dc.hash[h] = ds;
+    _lru_push (ds);
+    dc.count++;
+    pthread_mutex_unlock (&dc.lock);
+
+    if ((rc = _snapbuild (ds, dfd)) < 0) {
+        pthread_mutex_lock (&dc.lock);
+        if (ds->data)
+            free (ds->data);
+        ds->data = NULL;
+        ds->len = 0;
+        ds->failed = 1;
+        ds->building = 0;
+        _snapput (ds);
+        dc.uncached++;
+        pthread_cond_broadcast (&dc.built);
+        pthread_mutex_unlock (&dc.lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&dc.lock);
+    ds->building = 0;
+    dc.size += ds->len;
+    if (rc == 1)
+        _evict (ds);
+    for (ods = dc.lru_last; ods != NULL; ods = prev) {
+        prev = ods->lprev;
+        if (dc.size <= dc.limit && dc.count <= DC_MAXCOUNT)
+            break;
+        if (!ods->building)
+            _evict (ods);
+    }
+    pthread_cond_broadcast (&dc.built);
+    pthread_mutex_unlock (&dc.lock);
+    return ds;
+}
+
+void
+diod_dircache_put (Dirsnap *ds)
+{
+    pthread_mutex_lock (&dc.lock);
+    _snapput (ds);
+    pthread_mutex_unlock (&dc.lock);
+}
+
+/* Copy whole entries from the snapshot into buf, starting at byte *posp.
+ * Advance *posp and set *offp to the offset field of the last entry copied.
+ * Return the number of bytes copied.
+ */
+u32
+diod_dirsnap_read (Dirsnap *ds, u32 *posp, u64 *offp, u8 *buf, u32 count)
+{
+    u32 start = *posp, end = start, n;
+    int i;
+
+    while (end < ds->len) {
+        n = DC_HDRSIZE + (ds->data[end + DC_HDRSIZE - 2]
+                       | (ds->data[end + DC_HDRSIZE - 1] << 8));
+        if (end - start + n > count)
+            break;
+        for (*offp = 0, i = 7; i >= 0; i--)
+            *offp = (*offp << 8) | ds->data[end + DC_QIDSIZE + i];
+        end += n;
+    }
+    memcpy (buf, ds->data + start, end - start);
+    *posp = end;
+    return end - start;
+}
+
+/* Find the entry following the one whose offset field is 'offset'.
+ * Return 0 and set *posp on success, -1 if there is no such entry.
+ */
+int
+diod_dirsnap_seek (Dirsnap *ds, u64 offset, u32 *posp)
+{
+    u32 pos = 0, n;
+    u64 off;
+    int i;
+
+    if (offset == 0) {
+        *posp = 0;
+        return 0;
+    }
+    while (pos < ds->len) {
+        for (off = 0, i = 7; i >= 0; i--)
+            off = (off << 8) | ds->data[pos + DC_QIDSIZE + i];
+        n = DC_HDRSIZE + (ds->data[pos + DC_HDRSIZE - 2]
+                       | (ds->data[pos + DC_HDRSIZE - 1] << 8));
+        pos += n;
+        if (off == offset) {
+            *posp = pos;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static char *
+_get_dircache (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&dc.lock);
+    if (aspf (&s, &len, "%d %zu %zu %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              dc.count, dc.size, dc.limit,
+              dc.hits, dc.misses, dc.uncached) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&dc.lock);
+    return s;
+}
+
+/* Set limits and add the "dircache" ctl file:
+ *   snapshots bytes limit hits misses uncached
+ * limit = 0 disables the cache.
+ */
+int
+diod_dircache_init (Npsrv *srv, size_t limit, int maxentries)
+{
+    dc.limit = limit;
+    dc.maxentries = maxentries;
+    if (!np_ctl_addfile (srv->ctlroot, "dircache", _get_dircache, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
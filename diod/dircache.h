@@ -0,0 +1,12 @@
+typedef struct Dirsnap Dirsnap;
+
+int      diod_dircache_init (Npsrv *srv, size_t limit, int maxentries);
+Dirsnap *diod_dircache_get (int dfd, struct stat *sb);
+void     diod_dircache_put (Dirsnap *ds);
+u32      diod_dirsnap_read (Dirsnap *ds, u32 *posp, u64 *offp, u8 *buf,
+                            u32 count);
+int      diod_dirsnap_seek (Dirsnap *ds, u64 offset, u32 *posp);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
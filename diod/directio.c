@@ -0,0 +1,248 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* directio.c - move file data with O_DIRECT on "direct" exports */
+
+/* A fid on a direct export holds a second descriptor opened with
+ * O_DIRECT next to its ordinary one.  O_DIRECT requires the file offset,
+ * length, and buffer address all to be multiples of the file system's
+ * alignment (from statx STATX_DIOALIGN), so each read or write is split
+ * in three: the unaligned head up to the first aligned offset and the
+ * partial block tail go through the page cache on the ordinary
+ * descriptor, and the aligned middle goes to the device on the direct
+ * one.  The transport places Rread and large Twrite buffers so that the
+ * data has the same offset within a page as it has in the file, so the
+ * middle is aligned in memory whenever it is aligned in the file.  When
+ * it is not, or the file system turns the direct request down, the whole
+ * request falls back to the page cache.
+ *
+ * Bulk I/O then bypasses the server's page cache, which spares the copy
+ * through it and keeps a streaming client from evicting everything else.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "directio.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    u64             rdirect;    /* bytes read with O_DIRECT */
+    u64             rbuffered;  /* ... through the page cache */
+    u64             wdirect;    /* bytes written with O_DIRECT */
+    u64             wbuffered;  /* ... through the page cache */
+    u64             fallbacks;  /* aligned requests that fell back */
+} Diostats;
+
+static Diostats dio_stats = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0 };
+
+/* Return the alignment direct I/O on fd requires, or 0 if the file
+ * system does not support it.
+ */
+size_t
+diod_directio_align (int fd)
+{
+    struct statx stx;
+    size_t align;
+
+    if (statx (fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) < 0
+                                    || !(stx.stx_mask & STATX_DIOALIGN)
+                                    || stx.stx_dio_offset_align == 0)
+        return 0;
+    align = stx.stx_dio_offset_align;
+    if (stx.stx_dio_mem_align > align)
+        align = stx.stx_dio_mem_align;
+    return align;
+}
+
+static void
+_count (u64 *direct, u64 *buffered, ssize_t d, ssize_t b, int fallback)
+{
+    pthread_mutex_lock (&dio_stats.lock);
+    if (d > 0)
+        *direct += d;
+    if (b > 0)
+        *buffered += b;
+    if (fallback)
+        dio_stats.fallbacks++;
+    pthread_mutex_unlock (&dio_stats.lock);
+}
+
+/* Split count bytes at offset in buf into an unaligned head, an aligned
+ * middle, and a tail.  Return the middle's length, 0 if there is none
+ * that direct I/O could use.
+ */
+static size_t
+_split (size_t align, void *buf, size_t count, off_t offset, size_t *headp)
+{
+    size_t head = (align - offset % align) % align;
+    size_t mid;
+
+    if (head >= count)
+        return 0;
+    mid = (count - head) / align * align;
+    if (mid == 0 || ((uintptr_t)buf + head) % align != 0)
+        return 0;
+    *headp = head;
+    return mid;
+}
+
+/* Read count bytes at offset into buf, through dfd (opened O_DIRECT)
+ * where alignment allows, else through fd.  Short only at end of file.
+ */
+ssize_t
+diod_directio_pread (int fd, int dfd, size_t align, void *buf, size_t count,
+                     off_t offset)
+{
+    size_t head = 0, mid = _split (align, buf, count, offset, &head);
+    ssize_t n, d = 0, b = 0;
+
+    if (mid == 0)
+        goto buffered;
+    if (head > 0) {
+        if ((b = pread (fd, buf, head, offset)) < 0)
+            return -1;
+        if (b < head)
+            goto done;
+    }
+    if ((d = pread (dfd, buf + head, mid, offset + head)) < 0) {
+        if (errno != EINVAL)
+            return -1;
+        d = 0;
+        if ((n = pread (fd, buf + head, count - head, offset + head)) < 0)
+            return -1;
+        b += n;
+        _count (&dio_stats.rdirect, &dio_stats.rbuffered, 0, b, 1);
+        return b;
+    }
+    if (d == mid && head + mid < count) {
+        if ((n = pread (fd, buf + head + mid, count - head - mid,
+                        offset + head + mid)) < 0)
+            return -1;
+        b += n;
+    }
+done:
+    _count (&dio_stats.rdirect, &dio_stats.rbuffered, d, b, 0);
+    return d + b;
+buffered:
+    if ((b = pread (fd, buf, count, offset)) < 0)
+        return -1;
+    _count (&dio_stats.rdirect, &dio_stats.rbuffered, 0, b, 0);
+    return b;
+}
+
+/* Write count bytes at offset from buf, through dfd (opened O_DIRECT)
+ * where alignment allows, else through fd.
+ */
+ssize_t
+diod_directio_pwrite (int fd, int dfd, size_t align, void *buf, size_t count,
+                      off_t offset)
+{
+    size_t head = 0, mid = _split (align, buf, count, offset, &head);
+    ssize_t n, d = 0, b = 0;
+
+    if (mid == 0)
+        goto buffered;
+    if (head > 0) {
+        if ((b = pwrite (fd, buf, head, offset)) < 0)
+            return -1;
+        if (b < head)
+            goto done;
+    }
+    if ((d = pwrite (dfd, buf + head, mid, offset + head)) < 0) {
+        if (errno != EINVAL)
+            return -1;
+        d = 0;
+        if ((n = pwrite (fd, buf + head, count - head, offset + head)) < 0)
+            return -1;
+        b += n;
+        _count (&dio_stats.wdirect, &dio_stats.wbuffered, 0, b, 1);
+        return b;
+    }
+    if (d == mid && head + mid < count) {
+        if ((n = pwrite (fd, buf + head + mid, count - head - mid,
+                         offset + head + mid)) < 0)
+            return -1;
+        b += n;
+    }
+done:
+    _count (&dio_stats.wdirect, &dio_stats.wbuffered, d, b, 0);
+    return d + b;
+buffered:
+    if ((b = pwrite (fd, buf, count, offset)) < 0)
+        return -1;
+    _count (&dio_stats.wdirect, &dio_stats.wbuffered, 0, b, 0);
+    return b;
+}
+
+static char *
+_get_directio (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&dio_stats.lock);
+    if (aspf (&s, &len, "%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              dio_stats.rdirect, dio_stats.rbuffered,
+              dio_stats.wdirect, dio_stats.wbuffered,
+              dio_stats.fallbacks) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&dio_stats.lock);
+    return s;
+}
+
+/* Add the "directio" ctl file:
+ *   read-direct read-buffered write-direct write-buffered fallbacks
+ * (the first four in bytes).
+ */
+int
+diod_directio_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "directio", _get_directio, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
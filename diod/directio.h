@@ -0,0 +1,10 @@
+int      diod_directio_init (Npsrv *srv);
+size_t   diod_directio_align (int fd);
+ssize_t  diod_directio_pread (int fd, int dfd, size_t align, void *buf,
+                              size_t count, off_t offset);
+ssize_t  diod_directio_pwrite (int fd, int dfd, size_t align, void *buf,
+                               size_t count, off_t offset);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,337 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* elevator.c - limit and order concurrent file I/O per export */
+
+/* An export with the qdepth option lets at most that many Treads and
+ * Twrites at a time at its files.  Those beyond are queued here without
+ * a reply, leaving their worker threads free for other requests (a queue
+ * that held workers could take all of them and starve every other op).
+ * Each elevator has up to qdepth threads of its own, which do the queued
+ * I/O as slots free up and answer it, so no request's reply waits on I/O
+ * done for another.  While requests are queued, new ones queue behind
+ * them, so that the elevator, not the race for a free slot, picks the
+ * order.  A Tflush of a queued request waits for its reply, as it does
+ * for one in progress.
+ *
+ * The next to go is chosen like a disk elevator: the waiter with the
+ * lowest (inode, offset) at or after where the last dispatched I/O
+ * ended, wrapping around to the lowest once the sweep reaches the end
+ * (C-SCAN).  Spinning disks then see I/O in mostly ascending order
+ * instead of in the order workers happened to pick it up.  So that a
+ * steady stream near the sweep cannot hold off a request elsewhere for
+ * good, a read that has waited ELV_READ_MSEC, or a write ELV_WRITE_MSEC,
+ * goes next regardless (oldest deadline first).
+ *
+ * A slot is held until the I/O is done, which for one handed to io_uring
+ * is when the kernel completes it, so the limit holds at the device.
+ * Exports without qdepth have no elevator and are not limited.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "elevator.h"
+
+#define ELV_READ_MSEC   500
+#define ELV_WRITE_MSEC  5000
+
+typedef struct waiter_struct {
+    u64                 ino;
+    u64                 offset;
+    u32                 count;
+    u64                 deadline;   /* usec, CLOCK_MONOTONIC */
+    Npreq              *req;
+    ElevatorFun         run;
+    void               *arg;
+    struct waiter_struct *next;
+} Waiter;
+
+struct elevator_struct {
+    pthread_mutex_t     lock;
+    char               *name;       /* export path */
+    int                 depth;
+    int                 active;     /* I/Os dispatched, not finished */
+    int                 waiting;
+    Waiter             *waiters;    /* sorted by (ino, offset) */
+    pthread_cond_t      cond;       /* a waiter may go */
+    int                 nthreads;   /* that run waiters, up to depth */
+    int                 idle;
+    u64                 ino;        /* where the last dispatched I/O ... */
+    u64                 offset;     /* ... ended */
+    u64                 dispatched;
+    u64                 waited;     /* dispatched after waiting */
+    u64                 expired;    /* dispatched by deadline */
+    Elevator           *next;
+};
+
+static pthread_mutex_t elv_lock = PTHREAD_MUTEX_INITIALIZER;
+static Elevator *elevators = NULL;
+
+static u64
+_now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+_before (u64 ino1, u64 off1, u64 ino2, u64 off2)
+{
+    return ino1 < ino2 || (ino1 == ino2 && off1 < off2);
+}
+
+/* Pick the waiter to dispatch next and unlink it.  Call with el->lock
+ * held and el->waiters non-empty.
+ */
+static Waiter *
+_pick (Elevator *el)
+{
+    Waiter **wp, **pick = NULL, **oldest = &el->waiters, *w;
+    u64 now = _now_usec ();
+
+    for (wp = &el->waiters; (w = *wp); wp = &w->next) {
+        if (w->deadline < (*oldest)->deadline)
+            oldest = wp;
+        if (!pick && !_before (w->ino, w->offset, el->ino, el->offset))
+            pick = wp;
+    }
+    if ((*oldest)->deadline <= now) {
+        pick = oldest;
+        el->expired++;
+    } else if (!pick)
+        pick = &el->waiters;
+    w = *pick;
+    *pick = w->next;
+    el->waiting--;
+    return w;
+}
+
+static void
+_dispatch (Elevator *el, u64 ino, u64 offset, u32 count)
+{
+    el->active++;
+    el->dispatched++;
+    el->ino = ino;
+    el->offset = offset + count;
+}
+
+/* Run waiters as they are let go.
+ */
+static void *
+_runner (void *arg)
+{
+    Elevator *el = arg;
+    Waiter *w;
+
+    pthread_mutex_lock (&el->lock);
+    for (;;) {
+        el->idle++;
+        while (!el->waiters || el->active >= el->depth)
+            pthread_cond_wait (&el->cond, &el->lock);
+        el->idle--;
+        w = _pick (el);
+        _dispatch (el, w->ino, w->offset, w->count);
+        el->waited++;
+        pthread_mutex_unlock (&el->lock);
+
+        w->run (w->req, w->arg);
+        free (w);
+
+        pthread_mutex_lock (&el->lock);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* Make sure a thread will run a newly queued waiter.  Call with el->lock
+ * held.  Return -1 if el has no threads at all.
+ */
+static int
+_runners (Elevator *el)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+
+    if (el->idle == 0 && el->nthreads < el->depth) {
+        pthread_attr_init (&attr);
+        pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+        if ((errno = pthread_create (&t, &attr, _runner, el)))
+            err ("elevator: pthread_create");
+        else
+            el->nthreads++;
+        pthread_attr_destroy (&attr);
+    }
+    return el->nthreads > 0 ? 0 : -1;
+}
+
+/* Ask el to let an I/O of count bytes at offset in file ino go to the
+ * backend on behalf of req.  Return 0 if it may go now; the caller does
+ * it, then calls diod_elevator_exit ().  Otherwise return 1: req is
+ * queued, and when its turn comes, run (req, arg) is called on one of
+ * el's threads to do the I/O, call diod_elevator_exit (), and answer req.
+ * If req cannot be queued, it goes now, over the limit.
+ */
+int
+diod_elevator_enter (Elevator *el, u64 ino, u64 offset, u32 count, int write,
+                     Npreq *req, ElevatorFun run, void *arg)
+{
+    Waiter *w, **wp;
+
+    pthread_mutex_lock (&el->lock);
+    if ((el->active < el->depth && !el->waiters) || _runners (el) < 0
+                                        || !(w = malloc (sizeof (*w)))) {
+        _dispatch (el, ino, offset, count);
+        pthread_mutex_unlock (&el->lock);
+        return 0;
+    }
+    w->ino = ino;
+    w->offset = offset;
+    w->count = count;
+    w->deadline = _now_usec () + (write ? ELV_WRITE_MSEC : ELV_READ_MSEC)
+                                * 1000;
+    w->req = req;
+    w->run = run;
+    w->arg = arg;
+    for (wp = &el->waiters; *wp; wp = &(*wp)->next) {
+        if (_before (ino, offset, (*wp)->ino, (*wp)->offset))
+            break;
+    }
+    w->next = *wp;
+    *wp = w;
+    el->waiting++;
+    if (el->active < el->depth)
+        pthread_cond_signal (&el->cond);
+    pthread_mutex_unlock (&el->lock);
+    return 1;
+}
+
+/* An I/O let through by diod_elevator_enter () is done: free its slot
+ * for the next waiter, if any.
+ */
+void
+diod_elevator_exit (Elevator *el)
+{
+    pthread_mutex_lock (&el->lock);
+    el->active--;
+    if (el->waiters)
+        pthread_cond_signal (&el->cond);
+    pthread_mutex_unlock (&el->lock);
+}
+
+/* Return the elevator of the export at path, creating it with depth
+ * depth if need be (or setting its depth, should the configuration have
+ * been reloaded).  Return NULL on ENOMEM.
+ */
+Elevator *
+diod_elevator_get (char *path, int depth)
+{
+    Elevator *el;
+
+    pthread_mutex_lock (&elv_lock);
+    for (el = elevators; el != NULL; el = el->next) {
+        if (!strcmp (el->name, path))
+            break;
+    }
+    if (el) {
+        pthread_mutex_lock (&el->lock);
+        el->depth = depth;
+        pthread_cond_broadcast (&el->cond);
+        pthread_mutex_unlock (&el->lock);
+    } else if ((el = malloc (sizeof (*el)))) {
+        memset (el, 0, sizeof (*el));
+        if (!(el->name = strdup (path))) {
+            free (el);
+            el = NULL;
+            goto done;
+        }
+        pthread_mutex_init (&el->lock, NULL);
+        pthread_cond_init (&el->cond, NULL);
+        el->depth = depth;
+        el->next = elevators;
+        elevators = el;
+    }
+done:
+    pthread_mutex_unlock (&elv_lock);
+    return el;
+}
+
+static char *
+_get_elevator (void *a)
+{
+    Elevator *el;
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&elv_lock);
+    for (el = elevators; el != NULL; el = el->next) {
+        pthread_mutex_lock (&el->lock);
+        if (aspf (&s, &len, "%s %d %d %d %"PRIu64" %"PRIu64" %"PRIu64"\n",
+                  el->name, el->depth, el->active, el->waiting,
+                  el->dispatched, el->waited, el->expired) < 0) {
+            pthread_mutex_unlock (&el->lock);
+            np_uerror (ENOMEM);
+            if (s)
+                free (s);
+            s = NULL;
+            break;
+        }
+        pthread_mutex_unlock (&el->lock);
+    }
+    pthread_mutex_unlock (&elv_lock);
+    return s; /* NULL if there are none */
+}
+
+/* Add the "elevator" ctl file, a line per export with an elevator:
+ *   path depth active waiting dispatched waited expired
+ */
+int
+diod_elevator_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "elevator", _get_elevator, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,13 @@
+typedef struct elevator_struct Elevator;
+typedef void (*ElevatorFun)(Npreq *req, void *arg);
+
+int       diod_elevator_init (Npsrv *srv);
+Elevator *diod_elevator_get (char *path, int depth);
+int       diod_elevator_enter (Elevator *el, u64 ino, u64 offset, u32 count,
+                               int write, Npreq *req, ElevatorFun run,
+                               void *arg);
+void      diod_elevator_exit (Elevator *el);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
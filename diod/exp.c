@@ -191,6 +191,122 @@ done:
     return res;
 }
 
+/* Called from np_tpool_create () to get the busypoll export option for aname.
+ * Return -1 to use the server default.
+ */
+int
+diod_tpool_spin (char *aname)
+{
+    List exports = diod_conf_get_exports ();
+    ListIterator itr = NULL;
+    Export *x;
+    int usec = -1;
+
+    if (!(itr = list_iterator_create (exports)))
+        return -1;
+    while ((x = list_next (itr))) {
+        if (_match_export_path (x, aname)) {
+            usec = x->busypoll;
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+    return usec;
+}
+
+/* Called from attach to get the attrcache export option (msec) for aname.
+ * Return -1 if attributes are not to be cached.
+ */
+int
+diod_export_attrcache (char *aname)
+{
+    List exports = diod_conf_get_exports ();
+    ListIterator itr = NULL;
+    Export *x;
+    int msec = -1;
+
+    if (!(itr = list_iterator_create (exports)))
+        return -1;
+    while ((x = list_next (itr))) {
+        if (_match_export_path (x, aname)) {
+            msec = x->attrcache;
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+    return msec;
+}
+
+/* Called from attach to get the readahead export option (KiB) for aname.
+ * Return -1 if reads are not to be prefetched.
+ */
+int
+diod_export_readahead (char *aname)
+{
+    List exports = diod_conf_get_exports ();
+    ListIterator itr = NULL;
+    Export *x;
+    int kb = -1;
+
+    if (!(itr = list_iterator_create (exports)))
+        return -1;
+    while ((x = list_next (itr))) {
+        if (_match_export_path (x, aname)) {
+            kb = x->readahead;
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+    return kb;
+}
+
+/* Called from attach to get the iounit export option (bytes) for aname.
+ * Return 0 for as much as fits in a message, -1 for the file's st_blksize.
+ */
+int
+diod_export_iounit (char *aname)
+{
+    List exports = diod_conf_get_exports ();
+    ListIterator itr = NULL;
+    Export *x;
+    int bytes = -1;
+
+    if (!(itr = list_iterator_create (exports)))
+        return -1;
+    while ((x = list_next (itr))) {
+        if (_match_export_path (x, aname)) {
+            bytes = x->iounit;
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+    return bytes;
+}
+
+/* Called from attach to get the qdepth export option for aname, and the
+ * path of the export it belongs to.  Return -1 for no limit.
+ */
+int
+diod_export_qdepth (char *aname, char **pathp)
+{
+    List exports = diod_conf_get_exports ();
+    ListIterator itr = NULL;
+    Export *x;
+    int depth = -1;
+
+    if (!(itr = list_iterator_create (exports)))
+        return -1;
+    while ((x = list_next (itr))) {
+        if (_match_export_path (x, aname)) {
+            depth = x->qdepth;
+            *pathp = x->path;
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+    return depth;
+}
+
 /**
  ** ctl/exports handling
  **/
@@ -1,3 +1,8 @@
 
 int diod_match_exports (char *path, Npconn *conn, Npuser *user, int *xfp);
 char *diod_get_exports (void *a);
+int diod_tpool_spin (char *aname);
+int diod_export_attrcache (char *aname);
+int diod_export_readahead (char *aname);
+int diod_export_iounit (char *aname);
+int diod_export_qdepth (char *aname, char **pathp);
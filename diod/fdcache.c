@@ -0,0 +1,384 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* fdcache.c - share open file descriptors between fids */
+
+/* The kernel client opens a new fid for each open (2), mmap and exec of
+ * a file, so hot files are opened and closed over and over.  Here an
+ * open descriptor is keyed by (st_dev, st_ino, uid, open flags) and
+ * shared by every fid that opens the file the same way.  When the last
+ * fid lets go, the descriptor is kept idle for FC_IDLESEC in case it is
+ * opened again; at most 'limit' idle descriptors are kept, LRU first out.
+ *
+ * A shared descriptor skips the permission check that open (2) would do,
+ * so a hit is checked with faccessat2 () against the caller's fsuid, and
+ * counts as a miss (a fresh open) where that is not available.  Keying by
+ * uid keeps one user's I/O off another's credentials.
+ *
+ * Callers must not use a shared descriptor for anything that is scoped
+ * to the open file description, like an OFD lock; take a private one first.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "fdcache.h"
+
+#define FC_HASHSIZE     1024
+#define FC_IDLESEC      5
+#define FC_KEYFLAGS     (~(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC | O_CLOEXEC))
+
+typedef struct Fdent {
+    dev_t               dev;
+    ino_t               ino;
+    uid_t               uid;
+    int                 flags;
+    int                 fd;
+    int                 refcount;
+    int                 doomed;     /* close when the last reference goes */
+    time_t              idle;       /* when refcount went to 0 */
+    struct Fdent       *hnext;
+    struct Fdent       *fnext;
+    struct Fdent       *lprev, *lnext;
+} Fdent;
+
+static struct {
+    pthread_mutex_t     lock;
+    int                 limit;
+    int                 count;
+    int                 nidle;
+    Fdent              *hash[FC_HASHSIZE];
+    Fdent              *fhash[FC_HASHSIZE];
+    Fdent              *lru_first, *lru_last;    /* idle only */
+    u64                 hits;
+    u64                 misses;
+} fc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int
+_hash (dev_t dev, ino_t ino, uid_t uid, int flags)
+{
+    return (ino ^ (ino >> 10) ^ dev ^ uid ^ flags) % FC_HASHSIZE;
+}
+
+static time_t
+_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void
+_lru_unlink (Fdent *e)
+{
+    if (e->lprev)
+        e->lprev->lnext = e->lnext;
+    else
+        fc.lru_first = e->lnext;
+    if (e->lnext)
+        e->lnext->lprev = e->lprev;
+    else
+        fc.lru_last = e->lprev;
+    e->lprev = e->lnext = NULL;
+}
+
+static void
+_lru_push (Fdent *e)
+{
+    e->lprev = NULL;
+    e->lnext = fc.lru_first;
+    if (fc.lru_first)
+        fc.lru_first->lprev = e;
+    else
+        fc.lru_last = e;
+    fc.lru_first = e;
+}
+
+/* Unhash e and add it to the list to be closed once fc.lock is dropped.
+ * Call with fc.lock held.
+ */
+static void
+_unhash (Fdent *e, Fdent **closep)
+{
+    Fdent **ep;
+
+    ep = &fc.hash[_hash (e->dev, e->ino, e->uid, e->flags)];
+    while (*ep && *ep != e)
+        ep = &(*ep)->hnext;
+    if (*ep)
+        *ep = e->hnext;
+    ep = &fc.fhash[e->fd % FC_HASHSIZE];
+    while (*ep && *ep != e)
+        ep = &(*ep)->fnext;
+    if (*ep)
+        *ep = e->fnext;
+    if (e->refcount == 0) {
+        _lru_unlink (e);
+        fc.nidle--;
+    }
+    fc.count--;
+    e->hnext = *closep;
+    *closep = e;
+}
+
+/* Retire idle descriptors that are too old or too many.
+ * Call with fc.lock held.
+ */
+static void
+_expire (Fdent **closep)
+{
+    time_t now = _now ();
+
+    while (fc.lru_last && (fc.nidle > fc.limit
+                        || fc.lru_last->idle + FC_IDLESEC <= now))
+        _unhash (fc.lru_last, closep);
+}
+
+static void
+_close (Fdent *e)
+{
+    Fdent *next;
+
+    for (; e != NULL; e = next) {
+        next = e->hnext;
+        (void)close (e->fd);
+        free (e);
+    }
+}
+
+/* Check that the caller (by fsuid) could open fd's file with flags.
+ */
+static int
+_access (int fd, int flags)
+{
+#if defined(SYS_faccessat2)
+    int mode = 0;
+
+    switch (flags & O_ACCMODE) {
+        case O_RDONLY:
+            mode = R_OK;
+            break;
+        case O_WRONLY:
+            mode = W_OK;
+            break;
+        default:
+            mode = R_OK | W_OK;
+            break;
+    }
+    return syscall (SYS_faccessat2, fd, "", mode, AT_EACCESS | AT_EMPTY_PATH);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Return a shared descriptor on (dev, ino) opened with flags by uid,
+ * or -1 if there is none to be had.
+ */
+int
+diod_fdcache_get (dev_t dev, ino_t ino, uid_t uid, int flags)
+{
+    Fdent *e, *dead = NULL;
+    int fd = -1;
+
+    if (fc.limit == 0 || (flags & O_TRUNC))
+        return -1;
+    flags &= FC_KEYFLAGS;
+    pthread_mutex_lock (&fc.lock);
+    for (e = fc.hash[_hash (dev, ino, uid, flags)]; e; e = e->hnext) {
+        if (e->ino == ino && e->dev == dev && e->uid == uid
+                          && e->flags == flags && !e->doomed)
+            break;
+    }
+    if (e) {
+        if (e->refcount++ == 0) {
+            _lru_unlink (e);
+            fc.nidle--;
+        }
+        fd = e->fd;
+    }
+    _expire (&dead);
+    pthread_mutex_unlock (&fc.lock);
+    _close (dead);
+
+    if (fd != -1 && _access (fd, flags) < 0) {
+        diod_fdcache_put (fd);
+        fd = -1;
+    }
+    pthread_mutex_lock (&fc.lock);
+    if (fd != -1)
+        fc.hits++;
+    else
+        fc.misses++;
+    pthread_mutex_unlock (&fc.lock);
+    return fd;
+}
+
+/* Offer fd, just opened on (dev, ino) with flags by uid, for sharing.
+ * Return 0 if it was taken (release it with diod_fdcache_put ()), or -1
+ * if the caller keeps sole ownership.
+ */
+int
+diod_fdcache_add (dev_t dev, ino_t ino, uid_t uid, int flags, int fd)
+{
+    Fdent *e;
+    int h, rc = -1;
+
+    if (fc.limit == 0)
+        return -1;
+    flags &= FC_KEYFLAGS;
+    h = _hash (dev, ino, uid, flags);
+    pthread_mutex_lock (&fc.lock);
+    for (e = fc.hash[h]; e; e = e->hnext) {
+        if (e->ino == ino && e->dev == dev && e->uid == uid
+                          && e->flags == flags && !e->doomed)
+            goto done;  /* lost a race with another opener */
+    }
+    if (!(e = malloc (sizeof (*e))))
+        goto done;
+    e->dev = dev;
+    e->ino = ino;
+    e->uid = uid;
+    e->flags = flags;
+    e->fd = fd;
+    e->refcount = 1;
+    e->doomed = 0;
+    e->lprev = e->lnext = NULL;
+    e->hnext = fc.hash[h];
+    fc.hash[h] = e;
+    e->fnext = fc.fhash[fd % FC_HASHSIZE];
+    fc.fhash[fd % FC_HASHSIZE] = e;
+    fc.count++;
+    rc = 0;
+done:
+    pthread_mutex_unlock (&fc.lock);
+    return rc;
+}
+
+/* Release a descriptor obtained from diod_fdcache_get () or taken by
+ * diod_fdcache_add ().
+ */
+void
+diod_fdcache_put (int fd)
+{
+    Fdent *e, *dead = NULL;
+
+    pthread_mutex_lock (&fc.lock);
+    for (e = fc.fhash[fd % FC_HASHSIZE]; e; e = e->fnext) {
+        if (e->fd == fd)
+            break;
+    }
+    assert (e != NULL);
+    if (--e->refcount == 0) {
+        e->idle = _now ();
+        _lru_push (e);
+        fc.nidle++;
+        if (e->doomed)
+            _unhash (e, &dead);
+    }
+    _expire (&dead);
+    pthread_mutex_unlock (&fc.lock);
+    _close (dead);
+}
+
+/* Stop sharing descriptors on (dev, ino), e.g. because it was removed
+ * and an idle descriptor would keep its space allocated.
+ */
+void
+diod_fdcache_forget (dev_t dev, ino_t ino)
+{
+    Fdent *e, *next, *dead = NULL;
+    int i;
+
+    pthread_mutex_lock (&fc.lock);
+    for (i = 0; i < FC_HASHSIZE; i++) {
+        for (e = fc.hash[i]; e; e = next) {
+            next = e->hnext;
+            if (e->ino != ino || e->dev != dev)
+                continue;
+            if (e->refcount == 0)
+                _unhash (e, &dead);
+            else
+                e->doomed = 1;
+        }
+    }
+    pthread_mutex_unlock (&fc.lock);
+    _close (dead);
+}
+
+static char *
+_get_fdcache (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&fc.lock);
+    if (aspf (&s, &len, "%d %d %d %"PRIu64" %"PRIu64"\n",
+              fc.count, fc.nidle, fc.limit, fc.hits, fc.misses) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&fc.lock);
+    return s;
+}
+
+/* Set the idle limit and add the "fdcache" ctl file:
+ *   open idle limit hits misses
+ * limit = 0 disables the cache.
+ */
+int
+diod_fdcache_init (Npsrv *srv, int limit)
+{
+    fc.limit = limit;
+    if (!np_ctl_addfile (srv->ctlroot, "fdcache", _get_fdcache, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
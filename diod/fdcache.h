@@ -0,0 +1,9 @@
+int      diod_fdcache_init (Npsrv *srv, int limit);
+int      diod_fdcache_get (dev_t dev, ino_t ino, uid_t uid, int flags);
+int      diod_fdcache_add (dev_t dev, ino_t ino, uid_t uid, int flags, int fd);
+void     diod_fdcache_put (int fd);
+void     diod_fdcache_forget (dev_t dev, ino_t ino);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,387 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* groupcommit.c - answer concurrent Tfsyncs with shared commits */
+
+/* Tfsync is taken off the worker threads: diod_fsync () queues the fid's
+ * descriptor on its file system's queue and returns without a reply,
+ * leaving the worker free for other requests.  Each file system has one
+ * committer thread, which takes everything that queued while its last
+ * commit was running and answers it with one commit.
+ *
+ * On file systems where syncfs(2) writes out and commits every file
+ * (local journaling file systems, and NFS), a batch of more than one is
+ * committed with a single syncfs.  syncfs only reports write errors
+ * raised since the descriptor it was given was opened, and not to the
+ * files they belong to, so each file is then fsynced as well: that finds
+ * its data already written and returns the file's own error, if any.
+ * Elsewhere, and if the syncfs fails, the files are handed to a pool of
+ * syncer threads shared by all file systems, which fsync them in
+ * parallel, still off the worker threads.  On such a file system Tfsyncs
+ * go straight to the pool, without a committer.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/statfs.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "groupcommit.h"
+
+#define GC_MAXDEVS      64
+#define GC_SYNCERS      8   /* threads that fsync one file at a time */
+
+/* File systems on which one syncfs () stands in for fsync () of each file.
+ */
+static const unsigned long syncfs_magic[] = {
+    0xef53,         /* ext2/3/4 */
+    0x58465342,     /* XFS */
+    0x9123683e,     /* Btrfs */
+    0x6969,         /* NFS */
+};
+
+typedef struct Sync Sync;
+struct Sync {
+    int                 fd;
+    Npreq              *req;
+    u64                 start;      /* usec, when queued */
+    int                 err;
+    Sync               *next;
+};
+
+typedef struct {
+    dev_t               dev;
+    int                 syncfs;
+    Sync               *first, *last;
+    pthread_cond_t      cond;
+} Fsq;
+
+static struct {
+    pthread_mutex_t     lock;
+    Fsq                *q[GC_MAXDEVS];
+    int                 nq;
+    Sync               *first, *last;   /* for the syncers */
+    pthread_cond_t      cond;
+    int                 nsyncers;
+    int                 idle;
+    u64                 requests;
+    u64                 commits;
+    u64                 syncfs;     /* commits done with one syncfs () */
+    u64                 completed;
+    u64                 usec;       /* total latency of completed */
+    u64                 maxusec;
+} gc = { .lock = PTHREAD_MUTEX_INITIALIZER,
+       .cond = PTHREAD_COND_INITIALIZER };
+
+static u64
+_now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+_reply (Sync *s)
+{
+    Npfcall *rc;
+
+    if (s->err)
+        np_req_respond_error (s->req, s->err);
+    else if (!(rc = np_create_rfsync ()))
+        np_req_respond_error (s->req, ENOMEM);
+    else
+        np_req_respond (s->req, rc);
+}
+
+/* Account for completed s.  Call with gc.lock held.
+ */
+static void
+_complete (Sync *s, u64 now)
+{
+    u64 usec = now - s->start;
+
+    gc.completed++;
+    gc.usec += usec;
+    if (usec > gc.maxusec)
+        gc.maxusec = usec;
+}
+
+static void *
+_syncer (void *arg)
+{
+    Sync *s;
+
+    pthread_mutex_lock (&gc.lock);
+    for (;;) {
+        gc.idle++;
+        while (!gc.first)
+            pthread_cond_wait (&gc.cond, &gc.lock);
+        gc.idle--;
+        s = gc.first;
+        if (!(gc.first = s->next))
+            gc.last = NULL;
+        pthread_mutex_unlock (&gc.lock);
+
+        s->err = fsync (s->fd) < 0 ? errno : 0;
+
+        /* count before replying, so the client sees it in the ctl file */
+        pthread_mutex_lock (&gc.lock);
+        gc.commits++;
+        _complete (s, _now_usec ());
+        pthread_mutex_unlock (&gc.lock);
+        _reply (s);
+        free (s);
+        pthread_mutex_lock (&gc.lock);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* Hand the files in list to the syncers, starting more of them if there
+ * are fewer idle than files.  Call with gc.lock held.
+ * Return -1 if there are no syncers at all.
+ */
+static int
+_fanout (Sync *list)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    Sync *s;
+    int n;
+
+    for (s = list, n = 1; s->next != NULL; s = s->next)
+        n++;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    while (gc.idle < n && gc.nsyncers < GC_SYNCERS) {
+        if ((errno = pthread_create (&t, &attr, _syncer, NULL))) {
+            err ("groupcommit: pthread_create");
+            break;
+        }
+        gc.nsyncers++;
+        n--;
+    }
+    pthread_attr_destroy (&attr);
+    if (gc.nsyncers == 0)
+        return -1;
+    if (gc.last)
+        gc.last->next = list;
+    else
+        gc.first = list;
+    gc.last = s;
+    pthread_cond_broadcast (&gc.cond);
+    return 0;
+}
+
+static void *
+_committer (void *arg)
+{
+    Fsq *q = arg;
+    Sync *batch, *s;
+    u64 now;
+
+    pthread_mutex_lock (&gc.lock);
+    for (;;) {
+        while (!q->first)
+            pthread_cond_wait (&q->cond, &gc.lock);
+        batch = q->first;
+        q->first = q->last = NULL;
+        pthread_mutex_unlock (&gc.lock);
+
+        if (batch->next && syncfs (batch->fd) == 0) {
+            for (s = batch; s != NULL; s = s->next)
+                s->err = fsync (s->fd) < 0 ? errno : 0;
+            now = _now_usec ();
+            pthread_mutex_lock (&gc.lock);
+            gc.commits++;
+            gc.syncfs++;
+        } else if (!batch->next) {
+            batch->err = fsync (batch->fd) < 0 ? errno : 0;
+            now = _now_usec ();
+            pthread_mutex_lock (&gc.lock);
+            gc.commits++;
+        } else {
+            pthread_mutex_lock (&gc.lock);
+            if (_fanout (batch) == 0)
+                continue;
+            pthread_mutex_unlock (&gc.lock);
+            /* no syncers could be started, so sync them here */
+            for (s = batch; s != NULL; s = s->next)
+                s->err = fsync (s->fd) < 0 ? errno : 0;
+            now = _now_usec ();
+            pthread_mutex_lock (&gc.lock);
+            for (s = batch; s != NULL; s = s->next)
+                gc.commits++;
+        }
+        /* count before replying, so the client sees it in the ctl file */
+        for (s = batch; s != NULL; s = s->next)
+            _complete (s, now);
+        pthread_mutex_unlock (&gc.lock);
+        while ((s = batch)) {
+            batch = s->next;
+            _reply (s);
+            free (s);
+        }
+        pthread_mutex_lock (&gc.lock);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* Find or start the queue for dev, which fd is open on.  Return NULL if
+ * there is none, and the caller must sync fd itself.  Call with gc.lock
+ * held.
+ */
+static Fsq *
+_getq (int fd, dev_t dev)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    struct statfs sb;
+    Fsq *q;
+    int i;
+
+    for (i = 0; i < gc.nq; i++) {
+        if (gc.q[i]->dev == dev)
+            return gc.q[i];
+    }
+    /* not knowing the file system type, try again next time */
+    if (gc.nq == GC_MAXDEVS || fstatfs (fd, &sb) < 0
+                            || !(q = malloc (sizeof (*q))))
+        return NULL;
+    q->dev = dev;
+    q->syncfs = 0;
+    q->first = q->last = NULL;
+    pthread_cond_init (&q->cond, NULL);
+    for (i = 0; i < sizeof (syncfs_magic) / sizeof (syncfs_magic[0]); i++)
+        if ((unsigned long)sb.f_type == syncfs_magic[i])
+            q->syncfs = 1;
+    if (q->syncfs) {
+        pthread_attr_init (&attr);
+        pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+        if ((errno = pthread_create (&t, &attr, _committer, q))) {
+            err ("groupcommit: pthread_create");
+            pthread_attr_destroy (&attr);
+            pthread_cond_destroy (&q->cond);
+            free (q);
+            return NULL;
+        }
+        pthread_attr_destroy (&attr);
+    }
+    gc.q[gc.nq++] = q;
+    return q;
+}
+
+/* Queue fd, open on file system dev, to be synced and req answered.
+ * fd must stay open until then (the fid req holds keeps it so).
+ * Return 0 if queued, or -1 if the caller must sync it itself.
+ */
+int
+diod_groupcommit_submit (int fd, dev_t dev, Npreq *req)
+{
+    Sync *s;
+    Fsq *q;
+
+    if (!(s = malloc (sizeof (*s))))
+        return -1;
+    s->fd = fd;
+    s->req = req;
+    s->start = _now_usec ();
+    s->err = 0;
+    s->next = NULL;
+    pthread_mutex_lock (&gc.lock);
+    if (!(q = _getq (fd, dev))) {
+        pthread_mutex_unlock (&gc.lock);
+        free (s);
+        return -1;
+    }
+    if (!q->syncfs) {
+        if (_fanout (s) < 0) {
+            pthread_mutex_unlock (&gc.lock);
+            free (s);
+            return -1;
+        }
+    } else {
+        if (q->last)
+            q->last->next = s;
+        else
+            q->first = s;
+        q->last = s;
+        pthread_cond_signal (&q->cond);
+    }
+    gc.requests++;
+    pthread_mutex_unlock (&gc.lock);
+    return 0;
+}
+
+static char *
+_get_fsync (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&gc.lock);
+    if (aspf (&s, &len, "%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              gc.requests, gc.commits, gc.syncfs,
+              gc.completed > 0 ? gc.usec / gc.completed : 0,
+              gc.maxusec) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&gc.lock);
+    return s;
+}
+
+/* Add the "fsync" ctl file:
+ *   requests commits syncfs-commits mean-usec max-usec
+ */
+int
+diod_groupcommit_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "fsync", _get_fsync, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,6 @@
+int      diod_groupcommit_init (Npsrv *srv);
+int      diod_groupcommit_submit (int fd, dev_t dev, Npreq *req);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
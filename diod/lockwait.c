@@ -0,0 +1,361 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* lockwait.c - park blocking Tlocks until the lock can be taken */
+
+/* A Tlock with P9_LOCK_FLAGS_BLOCK that conflicts with a lock held
+ * elsewhere is not answered P9_LOCK_BLOCKED (which has the client sleep
+ * and retry) but queued here, and diod_lock () returns without a reply,
+ * leaving the worker free for other requests.  One waiter thread retries
+ * the queued locks in arrival order whenever diod releases or downgrades
+ * a lock, and every LW_POLL_MSEC in case the holder is not one of our
+ * fids.  When a lock is taken, the 'granted' callback runs and the Tlock
+ * is answered P9_LOCK_SUCCESS.  A Tflush (or the connection going away)
+ * cancels a queued Tlock, answering it with EINTR.
+ *
+ * A parked Tlock holds its request, so a hot restart, which waits for
+ * every request to be answered, first drains the queue: each waiter is
+ * answered P9_LOCK_BLOCKED, as it would have been without this module,
+ * and new ones are refused until service resumes.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "lockwait.h"
+
+#define LW_POLL_MSEC    10
+
+typedef struct Waiter Waiter;
+struct Waiter {
+    int                 fd;
+    struct flock        fl;
+    Npreq              *req;
+    LockwaitFun         granted;
+    u64                 start;      /* usec, when queued */
+    int                 err;
+    int                 blocked;    /* drained: answer P9_LOCK_BLOCKED */
+    Waiter             *next;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    Waiter             *first, *last;
+    int                 wake;
+    int                 draining;
+    u64                 waits;
+    u64                 granted;
+    u64                 cancelled;
+    u64                 usec;       /* total wait of granted */
+    u64                 maxusec;
+} lw = { .lock = PTHREAD_MUTEX_INITIALIZER,
+         .cond = PTHREAD_COND_INITIALIZER };
+
+static u64
+_now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+_reply (Waiter *w)
+{
+    Npfcall *rc;
+
+    if (w->err)
+        np_req_respond_error (w->req, w->err);
+    else if (!(rc = np_create_rlock (w->blocked ? P9_LOCK_BLOCKED
+                                                : P9_LOCK_SUCCESS)))
+        np_req_respond_error (w->req, ENOMEM);
+    else
+        np_req_respond (w->req, rc);
+}
+
+/* Remove waiter for req from the queue.  Call with lw.lock held.
+ */
+static Waiter *
+_dequeue (Npreq *req)
+{
+    Waiter **wp, *w, *prev = NULL;
+
+    for (wp = &lw.first; (w = *wp); prev = w, wp = &w->next) {
+        if (w->req == req) {
+            *wp = w->next;
+            if (lw.last == w)
+                lw.last = prev;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+/* Try each queued lock in turn, moving those that are done (taken or
+ * failed) to a list returned in queue order.  Call with lw.lock held.
+ */
+static Waiter *
+_retry (void)
+{
+    Waiter **wp, *w, *prev = NULL;
+    Waiter *done = NULL, **dp = &done;
+
+    for (wp = &lw.first; (w = *wp); ) {
+        if (fcntl (w->fd, F_OFD_SETLK, &w->fl) < 0) {
+            if (errno == EAGAIN || errno == EACCES) {
+                prev = w;
+                wp = &w->next;
+                continue;
+            }
+            w->err = errno;
+        }
+        *wp = w->next;
+        if (lw.last == w)
+            lw.last = prev;
+        w->next = NULL;
+        *dp = w;
+        dp = &w->next;
+    }
+    return done;
+}
+
+static void *
+_waiter (void *arg)
+{
+    struct timespec ts;
+    Waiter *done, *w;
+    u64 now, usec;
+
+    pthread_mutex_lock (&lw.lock);
+    for (;;) {
+        while (!lw.first)
+            pthread_cond_wait (&lw.cond, &lw.lock);
+        if (!lw.wake) {
+            clock_gettime (CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LW_POLL_MSEC * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            (void)pthread_cond_timedwait (&lw.cond, &lw.lock, &ts);
+        }
+        lw.wake = 0;
+        done = _retry ();
+        /* count before replying, so the client sees it in the ctl file */
+        now = _now_usec ();
+        for (w = done; w != NULL; w = w->next) {
+            if (!w->err) {
+                usec = now - w->start;
+                lw.granted++;
+                lw.usec += usec;
+                if (usec > lw.maxusec)
+                    lw.maxusec = usec;
+            }
+        }
+        pthread_mutex_unlock (&lw.lock);
+
+        while ((w = done)) {
+            done = w->next;
+            if (!w->err)
+                w->granted (w->req);
+            _reply (w);
+            free (w);
+        }
+
+        pthread_mutex_lock (&lw.lock);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* Queue Tlock req to take lock 'fl' on fd once it no longer conflicts.
+ * fd must stay open until req is answered (the fid req holds keeps it so).
+ * Return 0 if queued, or -1 if the caller must answer req itself.
+ */
+int
+diod_lockwait_submit (int fd, struct flock *fl, Npreq *req,
+                      LockwaitFun granted)
+{
+    Waiter *w;
+
+    if (!(w = malloc (sizeof (*w))))
+        return -1;
+    w->fd = fd;
+    w->fl = *fl;
+    w->req = req;
+    w->granted = granted;
+    w->start = _now_usec ();
+    w->err = 0;
+    w->blocked = 0;
+    w->next = NULL;
+    pthread_mutex_lock (&lw.lock);
+    if (lw.draining) {
+        pthread_mutex_unlock (&lw.lock);
+        free (w);
+        return -1;
+    }
+    if (lw.last)
+        lw.last->next = w;
+    else
+        lw.first = w;
+    lw.last = w;
+    lw.waits++;
+    pthread_cond_signal (&lw.cond);
+    pthread_mutex_unlock (&lw.lock);
+
+    /* A flush that arrived before req was queued found nothing to cancel.
+     */
+    if (np_req_flushed (req))
+        (void)diod_lockwait_cancel (req);
+    return 0;
+}
+
+/* Answer queued Tlock req with EINTR.
+ * Return 0 if it was queued, or -1 if not (or no longer).
+ */
+int
+diod_lockwait_cancel (Npreq *req)
+{
+    Waiter *w;
+
+    pthread_mutex_lock (&lw.lock);
+    if ((w = _dequeue (req)))
+        lw.cancelled++;
+    pthread_mutex_unlock (&lw.lock);
+    if (!w)
+        return -1;
+    w->err = EINTR;
+    _reply (w);
+    free (w);
+    return 0;
+}
+
+/* Answer every queued Tlock P9_LOCK_BLOCKED (the client retries), and
+ * refuse new ones until diod_lockwait_resume ().
+ */
+void
+diod_lockwait_drain (void)
+{
+    Waiter *w, *done;
+
+    pthread_mutex_lock (&lw.lock);
+    lw.draining = 1;
+    done = lw.first;
+    lw.first = lw.last = NULL;
+    for (w = done; w != NULL; w = w->next)
+        lw.cancelled++;
+    pthread_mutex_unlock (&lw.lock);
+    while ((w = done)) {
+        done = w->next;
+        w->blocked = 1;
+        _reply (w);
+        free (w);
+    }
+}
+
+void
+diod_lockwait_resume (void)
+{
+    pthread_mutex_lock (&lw.lock);
+    lw.draining = 0;
+    pthread_mutex_unlock (&lw.lock);
+}
+
+/* A lock was released or downgraded: retry the queue now.
+ */
+void
+diod_lockwait_wake (void)
+{
+    pthread_mutex_lock (&lw.lock);
+    if (lw.first) {
+        lw.wake = 1;
+        pthread_cond_signal (&lw.cond);
+    }
+    pthread_mutex_unlock (&lw.lock);
+}
+
+static char *
+_get_lockwait (void *a)
+{
+    Waiter *w;
+    char *s = NULL;
+    int len = 0, n = 0;
+
+    pthread_mutex_lock (&lw.lock);
+    for (w = lw.first; w != NULL; w = w->next)
+        n++;
+    if (aspf (&s, &len, "%d %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64
+              "\n", n, lw.waits, lw.granted, lw.cancelled,
+              lw.granted > 0 ? lw.usec / lw.granted : 0, lw.maxusec) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&lw.lock);
+    return s;
+}
+
+/* Start the waiter thread and add the "lockwait" ctl file:
+ *   waiting waits granted cancelled mean-usec max-usec
+ */
+int
+diod_lockwait_init (Npsrv *srv)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if ((errno = pthread_create (&t, &attr, _waiter, NULL))) {
+        err ("lockwait: pthread_create");
+        pthread_attr_destroy (&attr);
+        return -1;
+    }
+    pthread_attr_destroy (&attr);
+    if (!np_ctl_addfile (srv->ctlroot, "lockwait", _get_lockwait, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,13 @@
+typedef void (*LockwaitFun)(Npreq *req);
+
+int      diod_lockwait_init (Npsrv *srv);
+int      diod_lockwait_submit (int fd, struct flock *fl, Npreq *req,
+                               LockwaitFun granted);
+int      diod_lockwait_cancel (Npreq *req);
+void     diod_lockwait_wake (void);
+void     diod_lockwait_drain (void);
+void     diod_lockwait_resume (void);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
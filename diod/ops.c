@@ -67,13 +67,20 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/types.h>
-#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/statvfs.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#if defined(SYS_openat2)
+#include <linux/openat2.h>
+#endif
 #include <pwd.h>
 #include <grp.h>
 #include <dirent.h>
@@ -93,22 +100,94 @@
 
 #include "ops.h"
 #include "exp.h"
+#include "dircache.h"
+#include "attrcache.h"
+#include "fdcache.h"
+#include "readahead.h"
+#include "writebehind.h"
+#include "groupcommit.h"
+#include "lockwait.h"
+#include "xattrcache.h"
+#include "directio.h"
+#include "uring.h"
+#include "coalesce.h"
+#include "elevator.h"
+
+/* An open directory is read with getdents64 () into a buffer that
+ * persists across Treaddirs.  pos is the directory offset of the next
+ * unconsumed entry, so sequential reads never seek.  A listing that
+ * starts at offset 0 may instead be served from a shared snapshot
+ * (see dircache.c), with snappos/snapoff as its cursor.
+ */
+#define DIR_BUFSIZE     65536
+
+struct linux_dirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
 
+typedef struct {
+    int              fd;
+    u64              pos;
+    int              len;       /* bytes of entries in buf */
+    int              off;       /* offset of next unconsumed entry */
+    Dirsnap         *snap;
+    u32              snappos;
+    u64              snapoff;
+    char             buf[DIR_BUFSIZE];
+} Dir;
+
+/* An xattr fid's value (or list of names) from Txattrwalk, to be read,
+ * or from Txattrcreate, to be written and then set on clunk.
+ */
+typedef struct {
+    char            *name;      /* Txattrcreate only */
+    int              flags;     /* XATTR_CREATE, XATTR_REPLACE */
+    char            *buf;
+    size_t           len;
+    size_t           copied;    /* end of the value written from 0 */
+} Xattr;
+
+/* A fid holds an O_PATH handle (pfd) on the object it names, and one on
+ * its parent directory (ppfd) plus the last path component (name), so
+ * operations resolve at most one component in the kernel.  The export
+ * root has no parent handle and uses its absolute path instead.  After
+ * lcreate, pfd is -1 and the open fd stands in for it.  The full path
+ * is kept for logging and hot restart.  pino is the parent's inode
+ * number (0 if unknown), for invalidating its cached attributes.
+ */
 typedef struct {
     char            *path;
+    char            *name;      /* last component of path */
+    int              pfd;
+    int              ppfd;
     int              fd;
-    DIR             *dir;
-    struct dirent   *dirent;
+    int              fdshared;  /* fd belongs to the fd cache */
+    int              dfd;       /* fd's O_DIRECT twin, direct exports only */
+    size_t           dalign;    /* alignment dfd requires */
+    Dir             *dir;
     struct stat      stat;
     /* advisory locking */
-    int              lock_type;
+    struct lockowner_struct *lock; /* NULL until a byte-range lock is taken */
     /* export flags */
     int              xflags;
+    int              attrttl;   /* msec, -1 = no attribute cache */
+    int              iounit;    /* bytes, 0 = msize, -1 = st_blksize */
+    ino_t            pino;
+    Readahead        ra;
+    Writebehind     *wb;        /* async exports only, once written */
+    Elevator        *el;        /* qdepth exports only */
+    Xattr           *xattr;     /* xattr fids only */
 } Fid;
 
 Npfcall     *diod_attach (Npfid *fid, Npfid *afid, Npstr *aname);
 int          diod_clone  (Npfid *fid, Npfid *newfid);
 int          diod_walk   (Npfid *fid, Npstr *wname, Npqid *wqid);
+int          diod_walkn  (Npfid *fid, int nwname, Npstr *wnames,
+                          Npqid *wqids);
 Npfcall     *diod_read   (Npfid *fid, u64 offset, u32 count, Npreq *req);
 Npfcall     *diod_write  (Npfid *fid, u64 offset, u32 count, u8 *data,
                           Npreq *req);
@@ -130,9 +209,11 @@ Npfcall     *diod_getattr(Npfid *fid, u64 request_mask);
 Npfcall     *diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
                         u64 atime_sec, u64 atime_nsec, u64 mtime_sec, u64 mtime_nsec);
 Npfcall     *diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req);
-Npfcall     *diod_fsync (Npfid *fid);
+Npfcall     *diod_xattrwalk (Npfid *fid, Npfid *attrfid, Npstr *name);
+Npfcall     *diod_xattrcreate (Npfid *fid, Npstr *name, u64 size, u32 flag);
+Npfcall     *diod_fsync (Npfid *fid, Npreq *req);
 Npfcall     *diod_lock (Npfid *fid, u8 type, u32 flags, u64 start, u64 length,
-                        u32 proc_id, Npstr *client_id);
+                        u32 proc_id, Npstr *client_id, Npreq *req);
 Npfcall     *diod_getlock (Npfid *fid, u8 type, u64 start, u64 length,
                         u32 proc_id, Npstr *client_id);
 Npfcall     *diod_link (Npfid *dfid, Npfid *fid, Npstr *name);
@@ -142,22 +223,30 @@ int          diod_remapuser (Npfid *fid, Npstr *uname, u32 n_uname,
 int          diod_auth_required (Npstr *uname, u32 n_uname, Npstr *aname);
 
 static int       _fidstat       (Fid *fid);
+static int       _fidfd         (Fid *fid);
 static void      _ustat2qid     (struct stat *st, Npqid *qid);
 static void      _fidfree       (Fid *f);
+static void      _fidunlock     (Fid *f);
+static int       _fidsetxattr   (Fid *fid, const char *name, void *value,
+                                 size_t size, int flags);
+
+static Npslab   *fidslab = NULL;
 
 int
 diod_register_ops (Npsrv *srv)
 {
-    srv->msize = 65536;
+    srv->msize = diod_conf_get_msize ();
     srv->fiddestroy = diod_fiddestroy;
     srv->logmsg = diod_log_msg;
     srv->remapuser = diod_remapuser;
     srv->auth_required = diod_auth_required;
+    srv->tpool_spin = diod_tpool_spin;
     srv->auth = diod_auth_functions;
 
     srv->attach = diod_attach;
     srv->clone = diod_clone;
     srv->walk = diod_walk;
+    srv->walkn = diod_walkn;
     srv->read = diod_read;
     srv->write = diod_write;
     srv->clunk = diod_clunk;
@@ -172,8 +261,8 @@ diod_register_ops (Npsrv *srv)
     srv->readlink = diod_readlink;
     srv->getattr = diod_getattr;
     srv->setattr = diod_setattr;
-    //srv->xattrwalk = diod_xattrwalk;
-    //srv->xattrcreate = diod_xattrcreate;
+    srv->xattrwalk = diod_xattrwalk;
+    srv->xattrcreate = diod_xattrcreate;
     srv->readdir = diod_readdir;
     srv->fsync = diod_fsync;
     srv->llock = diod_lock;
@@ -181,30 +270,266 @@ diod_register_ops (Npsrv *srv)
     srv->link = diod_link;
     srv->mkdir = diod_mkdir;
 
+    if (!(fidslab = np_slab_create (srv, "diodfid", sizeof (Fid))))
+        return -1;
     if (!np_ctl_addfile (srv->ctlroot, "exports", diod_get_exports, srv))
         return -1;
+    if (diod_attrcache_init (srv) < 0)
+        return -1;
+    if (diod_fdcache_init (srv, diod_conf_get_fdcache ()) < 0)
+        return -1;
+    if (diod_readahead_init (srv) < 0)
+        return -1;
+    if (diod_groupcommit_init (srv) < 0)
+        return -1;
+    if (diod_lockwait_init (srv) < 0)
+        return -1;
+    if (diod_xattrcache_init (srv) < 0)
+        return -1;
+    if (diod_directio_init (srv) < 0)
+        return -1;
+    if (diod_uring_init (srv, diod_conf_get_uring ()) < 0)
+        return -1;
+    if (diod_coalesce_init (srv) < 0)
+        return -1;
+    if (diod_elevator_init (srv) < 0)
+        return -1;
+    if (diod_writebehind_init (srv,
+                               (size_t)diod_conf_get_writebehind () << 20) < 0)
+        return -1;
+    if (diod_dircache_init (srv, (size_t)diod_conf_get_dircache () << 20,
+                            diod_conf_get_dircachemax ()) < 0)
+        return -1;
 
     return 0;
 }
 
+/* Return a descriptor for the object named by fid, suitable for fstat ()
+ * and (if a directory) as the dirfd of *at () calls.
+ */
+static int
+_fidfd (Fid *fid)
+{
+    if (fid->fd != -1)
+        return fid->fd;
+    if (fid->dir != NULL)
+        return fid->dir->fd;
+    return fid->pfd;
+}
+
+/* Return the dirfd and name to reach fid with *at () calls.
+ */
+static char *
+_fidat (Fid *fid, int *dfdp)
+{
+    if (fid->ppfd != -1) {
+        *dfdp = fid->ppfd;
+        return fid->name;
+    }
+    *dfdp = AT_FDCWD;
+    return fid->path;
+}
+
 /* Update stat info contained in fid.
  * Set npfs error state on error.
  */
 static int
 _fidstat (Fid *fid)
 {
-    int n;
-    int fd;
+    if (fstat (_fidfd (fid), &fid->stat) < 0) {
+        np_uerror (errno);
+        return -1;
+    }
+    return 0;
+}
 
-    if (fid->fd != -1)
-        n = fstat (fid->fd, &fid->stat);
-    else if (fid->dir != NULL && (fd = dirfd (fid->dir)) >= 0)
-        n = fstat (fd, &fid->stat);
-    else
-        n = lstat (fid->path, &fid->stat);
-    if (n < 0)
+static const struct {
+    u64             p9;
+    unsigned int    stx;
+} attrmap[] = {
+    { P9_GETATTR_MODE,      STATX_TYPE | STATX_MODE },
+    { P9_GETATTR_NLINK,     STATX_NLINK },
+    { P9_GETATTR_UID,       STATX_UID },
+    { P9_GETATTR_GID,       STATX_GID },
+    { P9_GETATTR_RDEV,      0 },        /* always returned */
+    { P9_GETATTR_ATIME,     STATX_ATIME },
+    { P9_GETATTR_MTIME,     STATX_MTIME },
+    { P9_GETATTR_CTIME,     STATX_CTIME },
+    { P9_GETATTR_INO,       STATX_INO },
+    { P9_GETATTR_SIZE,      STATX_SIZE },
+    { P9_GETATTR_BLOCKS,    STATX_BLOCKS },
+    { P9_GETATTR_BTIME,     STATX_BTIME },
+};
+
+/* Copy the attributes statx () returned into sb, leaving the rest.
+ */
+static void
+_statx2stat (struct statx *stx, struct stat *sb)
+{
+    sb->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_rdev = makedev (stx->stx_rdev_major, stx->stx_rdev_minor);
+    sb->st_blksize = stx->stx_blksize;
+    if ((stx->stx_mask & STATX_TYPE) && (stx->stx_mask & STATX_MODE))
+        sb->st_mode = stx->stx_mode;
+    if ((stx->stx_mask & STATX_NLINK))
+        sb->st_nlink = stx->stx_nlink;
+    if ((stx->stx_mask & STATX_UID))
+        sb->st_uid = stx->stx_uid;
+    if ((stx->stx_mask & STATX_GID))
+        sb->st_gid = stx->stx_gid;
+    if ((stx->stx_mask & STATX_INO))
+        sb->st_ino = stx->stx_ino;
+    if ((stx->stx_mask & STATX_SIZE))
+        sb->st_size = stx->stx_size;
+    if ((stx->stx_mask & STATX_BLOCKS))
+        sb->st_blocks = stx->stx_blocks;
+    if ((stx->stx_mask & STATX_ATIME)) {
+        sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+        sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    }
+    if ((stx->stx_mask & STATX_MTIME)) {
+        sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+        sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    }
+    if ((stx->stx_mask & STATX_CTIME)) {
+        sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+        sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    }
+}
+
+/* Update stat info contained in fid with the attributes in request_mask
+ * (P9_GETATTR_*), from the attribute cache if the export has one, else
+ * with statx () asking for only those.  Set *validp to the attributes
+ * that are current, and fill in btime and gen if asked for and available.
+ * Set npfs error state on error.
+ */
+static int
+_fidgetattr (Fid *fid, u64 request_mask, u64 *validp, struct timespec *btp,
+             u64 *genp)
+{
+    int flags = AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW;
+    unsigned int mask = 0;
+    struct statx stx;
+    u64 valid = 0, epoch = 0;
+    int i, fd, gen;
+
+    if (fid->attrttl >= 0 && diod_attrcache_get (fid->stat.st_dev,
+                                fid->stat.st_ino, &fid->stat, &epoch) == 0) {
+        *validp = P9_GETATTR_BASIC;
+        return 0;
+    }
+    for (i = 0; i < sizeof (attrmap) / sizeof (attrmap[0]); i++) {
+        if ((request_mask & attrmap[i].p9))
+            mask |= attrmap[i].stx;
+    }
+    if ((fid->xflags & XFLAGS_RELAXATTR))
+        flags |= AT_STATX_DONT_SYNC;
+    if (statx (_fidfd (fid), "", flags, mask, &stx) < 0) {
         np_uerror (errno);
-    return n;
+        return -1;
+    }
+    _statx2stat (&stx, &fid->stat);
+    for (i = 0; i < sizeof (attrmap) / sizeof (attrmap[0]); i++) {
+        if ((stx.stx_mask & attrmap[i].stx) == attrmap[i].stx)
+            valid |= attrmap[i].p9;
+    }
+    if ((valid & P9_GETATTR_BTIME)) {
+        btp->tv_sec = stx.stx_btime.tv_sec;
+        btp->tv_nsec = stx.stx_btime.tv_nsec;
+    }
+    /* FS_IOC_GETVERSION needs an open file, so only open fids have it */
+    fd = fid->fd != -1 ? fid->fd : fid->dir ? fid->dir->fd : -1;
+    if ((request_mask & P9_GETATTR_GEN) && fd != -1
+                                && ioctl (fd, FS_IOC_GETVERSION, &gen) == 0) {
+        *genp = (unsigned int)gen;
+        valid |= P9_GETATTR_GEN;
+    }
+    if (fid->attrttl >= 0 && !(flags & AT_STATX_DONT_SYNC)
+            && (stx.stx_mask & STATX_BASIC_STATS) == STATX_BASIC_STATS)
+        diod_attrcache_add (_fidfd (fid), &fid->stat, fid->attrttl, epoch);
+    *validp = valid;
+    return 0;
+}
+
+/* Return the iounit to report for fid opened on a file with preferred
+ * I/O size blksize: the export's iounit option, capped to what fits in a
+ * Tread or Twrite on its connection, or without the option, blksize.
+ */
+static u32
+_fidiounit (Npfid *fid, blksize_t blksize)
+{
+    Fid *f = fid->aux;
+    u32 max = fid->conn->msize - P9_IOHDRSZ;
+
+    if (f->iounit < 0)
+        return blksize;
+    if (f->iounit == 0 || f->iounit > max)
+        return max;
+    return f->iounit;
+}
+
+/* Return the elevator of the export aname belongs to, or NULL if its
+ * file I/O is not limited by the qdepth option (or out of memory).
+ */
+static Elevator *
+_fidelevator (char *aname)
+{
+    char *path;
+    int depth = diod_export_qdepth (aname, &path);
+
+    return depth > 0 ? diod_elevator_get (path, depth) : NULL;
+}
+
+/* Drop cached attributes (and negative entries) of inode ino on fid's
+ * file system after changing it.  ino 0 (an unknown parent) drops them all.
+ */
+static void
+_fidinval (Fid *fid, ino_t ino)
+{
+    if (fid->attrttl >= 0 || (fid->xflags & XFLAGS_NEGCACHE))
+        diod_attrcache_inval (fid->stat.st_dev, ino);
+}
+
+/* Open a new file descriptor on the object named by fid, without
+ * resolving its path again.  Falls back to the path if /proc is not mounted.
+ */
+static int
+_fidreopen (Fid *fid, int flags)
+{
+    char path[32];
+    int fd;
+
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", _fidfd (fid));
+    if ((fd = open (path, flags)) < 0 && errno == ENOENT)
+        fd = open (fid->path, flags);
+    return fd;
+}
+
+/* Take over directory descriptor fd for reading with getdents64 ().
+ */
+static Dir *
+_diropen (int fd)
+{
+    Dir *d;
+
+    if (!(d = malloc (sizeof (*d)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    d->fd = fd;
+    d->pos = 0;
+    d->len = d->off = 0;
+    d->snap = NULL;
+    return d;
+}
+
+static void
+_dirclose (Dir *d)
+{
+    if (d->snap)
+        diod_dircache_put (d->snap);
+    (void)close (d->fd);
+    free (d);
 }
 
 /* Allocate our local fid struct which becomes attached to Npfid->aux.
@@ -213,33 +538,136 @@ _fidstat (Fid *fid)
 static Fid *
 _fidalloc (void)
 {
-    Fid *f = malloc (sizeof(*f));
+    Fid *f = np_slab_alloc (fidslab);
 
     if (f) {
         f->path = NULL;
+        f->name = NULL;
+        f->pfd = -1;
+        f->ppfd = -1;
         f->fd = -1;
+        f->fdshared = 0;
+        f->dfd = -1;
+        f->dalign = 0;
         f->dir = NULL;
-        f->dirent = NULL;
-        f->lock_type = LOCK_UN;
+        f->lock = NULL;
         f->xflags = 0;
+        f->attrttl = -1;
+        f->iounit = -1;
+        diod_readahead_create (&f->ra);
+        f->wb = NULL;
+        f->el = NULL;
+        f->xattr = NULL;
+        f->pino = 0;
     }
   
     return f;
 }
 
+/* On a direct export, open an O_DIRECT twin of regular file fid's open
+ * descriptor, if its file system supports direct I/O.  Without one the
+ * fid just uses the page cache, so failure is not an error.
+ */
+static void
+_fidopendirect (Fid *f, int flags)
+{
+    if (!(f->xflags & XFLAGS_DIRECT) || !S_ISREG (f->stat.st_mode)
+                                     || f->fd == -1 || (flags & O_APPEND))
+        return;
+    if ((f->dalign = diod_directio_align (f->fd)) == 0)
+        return;
+    f->dfd = _fidreopen (f, (flags & O_ACCMODE) | O_DIRECT);
+}
+
+/* Close the open file descriptor of fid, or return it to the fd cache.
+ */
+static void
+_fidclose (Fid *f)
+{
+    if (f->dfd != -1) {
+        (void)close (f->dfd);
+        f->dfd = -1;
+    }
+    if (f->fd != -1) {
+        if (f->fdshared)
+            diod_fdcache_put (f->fd);
+        else
+            (void)close (f->fd);
+        f->fd = -1;
+        f->fdshared = 0;
+    }
+}
+
+/* Write out data buffered for fid by an async export, and pick up any
+ * error deferred from an earlier Twrite.
+ * Set npfs error state on error.
+ */
+static int
+_fidflush (Fid *f)
+{
+    if (f->wb && diod_writebehind_flush (f->wb) < 0) {
+        np_uerror (errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* Give fid an open file description of its own in place of a shared
+ * one, before doing something scoped to it like an OFD lock.
+ * Set npfs error state on error.
+ */
+static int
+_fidprivate (Fid *f)
+{
+    int fd, flags;
+
+    if (!f->fdshared)
+        return 0;
+    if (_fidflush (f) < 0)
+        return -1;
+    flags = fcntl (f->fd, F_GETFL) & ~(O_CREAT | O_EXCL | O_TRUNC);
+    if ((fd = _fidreopen (f, flags)) < 0) {
+        np_uerror (errno);
+        return -1;
+    }
+    diod_fdcache_put (f->fd);
+    f->fd = fd;
+    f->fdshared = 0;
+    return 0;
+}
+
+static void
+_xattrfree (Xattr *xa)
+{
+    if (xa->name)
+        free (xa->name);
+    if (xa->buf)
+        free (xa->buf);
+    free (xa);
+}
+
 /* Free our local fid struct.
  */
 static void
 _fidfree (Fid *f)
 {
     if (f) {
-        if (f->fd != -1)
-            close (f->fd);
+        if (f->wb)
+            diod_writebehind_destroy (f->wb);
+        if (f->xattr)
+            _xattrfree (f->xattr);
+        _fidunlock (f);
+        _fidclose (f);
         if (f->dir) 
-            closedir(f->dir);
+            _dirclose (f->dir);
+        if (f->pfd != -1)
+            close (f->pfd);
+        if (f->ppfd != -1)
+            close (f->ppfd);
         if (f->path)
-            free(f->path);
-        free(f);
+            np_slab_free (f->path);
+        diod_readahead_destroy (&f->ra);
+        np_slab_free (f);
     }
 }
 
@@ -255,15 +683,120 @@ diod_fiddestroy (Npfid *fid)
     fid->aux = NULL;
 }
 
-/* Create a 9P qid from a file's stat info.
+/* Hot restart: report the path and a descriptor (open or O_PATH, or -1)
+ * behind a fid so they can be handed to a successor.
+ */
+int
+diod_fid_describe (Npfid *fid, char **pathp, int *fdp)
+{
+    Fid *f = fid->aux;
+
+    if (!f || !f->path)
+        return -1;
+    *pathp = f->path;
+    if (f->wb && diod_writebehind_flush (f->wb) < 0)
+        err ("diod_fid_describe %s: write-behind", f->path);
+    if (f->fd != -1)
+        *fdp = f->fd;
+    else if (f->dir)
+        *fdp = f->dir->fd;
+    else
+        *fdp = f->pfd;
+    return 0;
+}
+
+/* Hot restart: rebuild the Fid behind a fid handed over by a predecessor.
+ * The export is rechecked against the current configuration.  If the
+ * predecessor's descriptor did not make it across (fd == -1), the file is
+ * looked up again by path, and reopened with the original flags if the
+ * fid was open.  The restored fid has no parent handle, so namespace
+ * operations on it go by path, and an open fid keeps no O_PATH handle
+ * (its open descriptor stands in).  Takes ownership of fd.
+ * Set npfs error state on error.
+ */
+int
+diod_fid_restore (Npfid *fid, char *path, int flags, int fd)
+{
+    Fid *f = NULL;
+
+    if (!(f = _fidalloc ())
+            || !(f->path = np_slab_strdup (fid->conn->srv, path))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    f->name = f->path;
+    if (!diod_match_exports (fid->aname, fid->conn, fid->user, &f->xflags))
+        goto error;
+    f->attrttl = diod_export_attrcache (fid->aname);
+    f->iounit = diod_export_iounit (fid->aname);
+    f->el = _fidelevator (fid->aname);
+    diod_readahead_setup (&f->ra, diod_export_readahead (fid->aname));
+    if (fd == -1) {
+        if (flags != -1) {
+            flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
+            fd = open (path, flags);
+        } else
+            fd = open (path, O_PATH | O_NOFOLLOW);
+        if (fd < 0) {
+            np_uerror (errno);
+            goto error;
+        }
+    }
+    if (fstat (fd, &f->stat) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if ((fcntl (fd, F_GETFL) & O_PATH))
+        f->pfd = fd;
+    else if (S_ISDIR (f->stat.st_mode)) {
+        if (!(f->dir = _diropen (fd))) {
+            np_uerror (errno);
+            goto error;
+        }
+    } else {
+        f->fd = fd;
+        _fidopendirect (f, fcntl (fd, F_GETFL));
+    }
+    fd = -1;
+    fid->aux = f;
+    return 0;
+error:
+    errn (np_rerror (), "diod_fid_restore %s@%s:%s", fid->user->uname,
+          np_conn_get_client_id (fid->conn), path);
+    if (fd != -1)
+        close (fd);
+    if (f)
+        _fidfree (f);
+    return -1;
+}
+
+/* Hash the attributes that change whenever a file's contents or inode
+ * do, for a qid version.  The kernel's own change counter (i_version)
+ * is not exposed to user space.
+ */
+static u32
+_ustat2version (struct stat *st)
+{
+    u64 v[5] = { st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                 st->st_ctim.tv_sec, st->st_ctim.tv_nsec, st->st_size };
+    u8 *p = (u8 *)v;
+    u32 h = 2166136261U;    /* FNV-1a */
+    int i;
+
+    for (i = 0; i < sizeof (v); i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+/* Create a 9P qid from a file's stat info.  The version changes when
+ * the file does, so clients may cache attributes and data until it does.
  * N.B. v9fs maps st_ino = qid->path + 2
  */
 static void
 _ustat2qid (struct stat *st, Npqid *qid)
 {
     qid->path = st->st_ino;
-    //qid->version = st->st_mtime ^ (st->st_size << 8);
-    qid->version = 0;
+    qid->version = _ustat2version (st);
     qid->type = 0;
     if (S_ISDIR(st->st_mode))
         qid->type |= P9_QTDIR;
@@ -271,8 +804,14 @@ _ustat2qid (struct stat *st, Npqid *qid)
         qid->type |= P9_QTSYMLINK;
 }
 
+/* Create a 9P qid for a directory entry.  getdents (2) returns no
+ * attributes, and a stat per entry would cost readdir a system call for
+ * each, so the version is 0.  Clients must not judge their cache by the
+ * qids in Rreaddir; they walk, open or getattr the entry, whose qid has
+ * the version.
+ */
 static void
-_dirent2qid (struct dirent *d, Npqid *qid)
+_dirent2qid (struct linux_dirent64 *d, Npqid *qid)
 {
     assert (d->d_type != DT_UNKNOWN);
     qid->path = d->d_ino;
@@ -284,14 +823,21 @@ _dirent2qid (struct dirent *d, Npqid *qid)
         qid->type |= P9_QTSYMLINK;
 }
 
+/* Build dirname/name.  If namep is non-NULL, point it at the (NUL
+ * terminated) name part of the result.
+ */
 static char *
-_mkpath(char *dirname, Npstr *name)
+_mkpath(Npfid *fid, char *dirname, Npstr *name, char **namep)
 {
-    int slen = strlen(dirname) + name->len + 2;
-    char *s = malloc (slen);
+    int dlen = strlen(dirname);
+    int slen = dlen + name->len + 2;
+    char *s = np_slab_stralloc (fid->conn->srv, slen);
    
-    if (s)
+    if (s) {
         snprintf (s, slen, "%s/%.*s", dirname, name->len, name->str);
+        if (namep)
+            *namep = s + dlen + 1;
+    }
     return s;
 }
 
@@ -336,7 +882,8 @@ diod_attach (Npfid *fid, Npfid *afid, Npstr *aname)
         np_uerror (EPERM);
         goto error;
     }
-    if (!(f = _fidalloc ()) || !(f->path = np_strdup (aname))) {
+    if (!(f = _fidalloc ()) || !(f->path = np_slab_strndup (fid->conn->srv,
+                                                aname->str, aname->len))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -346,8 +893,17 @@ diod_attach (Npfid *fid, Npfid *afid, Npstr *aname)
             goto error;
         }
     }
+    f->name = f->path;
     if (!diod_match_exports (f->path, fid->conn, fid->user, &f->xflags))
         goto error;
+    f->attrttl = diod_export_attrcache (f->path);
+    f->iounit = diod_export_iounit (f->path);
+    f->el = _fidelevator (f->path);
+    diod_readahead_setup (&f->ra, diod_export_readahead (f->path));
+    if ((f->pfd = open (f->path, O_PATH | O_NOFOLLOW)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
     if (_fidstat (f) < 0)
         goto error;
     _ustat2qid (&f->stat, &qid);
@@ -375,12 +931,36 @@ diod_clone (Npfid *fid, Npfid *newfid)
 {
     Fid *f = fid->aux;
     Fid *nf = NULL;
+    char *name;
+    int dfd;
 
-    if (!(nf = _fidalloc ()) || !(nf->path = strdup (f->path))) {
+    if (!(nf = _fidalloc ())
+            || !(nf->path = np_slab_strdup (fid->conn->srv, f->path))) {
         np_uerror (ENOMEM);
         goto error;
     }
+    nf->name = nf->path + (f->name - f->path);
+    if (f->pfd != -1)
+        nf->pfd = dup (f->pfd);
+    else {
+        name = _fidat (f, &dfd);
+        nf->pfd = openat (dfd, name, O_PATH | O_NOFOLLOW);
+    }
+    if (nf->pfd < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (f->ppfd != -1 && (nf->ppfd = dup (f->ppfd)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    nf->stat = f->stat;
     nf->xflags = f->xflags;
+    nf->attrttl = f->attrttl;
+    nf->iounit = f->iounit;
+    nf->el = f->el;
+    diod_readahead_clone (&nf->ra, &f->ra);
+    nf->pino = f->pino;
     newfid->aux = nf;
     return 1;
 error:
@@ -400,14 +980,34 @@ diod_walk (Npfid *fid, Npstr* wname, Npqid *wqid)
 {
     Fid *f = fid->aux;
     struct stat st;
-    char *npath;
+    char *npath = NULL, *name;
+    int fd = -1;
+    u64 epoch = 0;
 
-    if (!(npath = _mkpath (f->path, wname))) {
+    if (f->fd != -1 || f->dir != NULL) {
+        np_uerror (EBUSY);
+        goto error_quiet;
+    }
+    if ((f->xflags & XFLAGS_NEGCACHE) && diod_attrcache_negative (
+                f->stat.st_dev, f->stat.st_ino, wname->str, wname->len)) {
+        np_uerror (ENOENT);
+        goto error_quiet;
+    }
+    if (!(npath = _mkpath (fid, f->path, wname, &name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (lstat (npath, &st) < 0) {
+    if (f->attrttl >= 0 || (f->xflags & XFLAGS_NEGCACHE))
+        epoch = diod_attrcache_epoch ();
+    if ((fd = openat (f->pfd, name, O_PATH | O_NOFOLLOW)) < 0
+                                            || fstat (fd, &st) < 0) {
         np_uerror (errno);
+        if (fd < 0 && np_rerror () == ENOENT
+                   && (f->xflags & XFLAGS_NEGCACHE))
+            diod_attrcache_addneg (f->pfd, f->stat.st_dev, f->stat.st_ino,
+                                   wname->str, wname->len,
+                                   f->attrttl >= 0 ? f->attrttl
+                                                   : DFLT_ATTRCACHE, epoch);
         goto error_quiet;
     }
     /* N.B. inodes would not be unique if we could cross over to another
@@ -416,14 +1016,21 @@ diod_walk (Npfid *fid, Npstr* wname, Npqid *wqid)
      * How does NFS make them appear as empty directories?  That would be
      * prettier.
      */
-    if (_fidstat (f) < 0)
-        goto error;
     if (st.st_dev != f->stat.st_dev) { 
         np_uerror (EXDEV);
         goto error;
     }
-    free (f->path);
+    if (f->attrttl >= 0)
+        diod_attrcache_add (fd, &st, f->attrttl, epoch);
+    if (f->ppfd != -1)
+        close (f->ppfd);
+    f->ppfd = f->pfd;
+    f->pfd = fd;
+    f->pino = f->stat.st_ino;
+    f->stat = st;
+    np_slab_free (f->path);
     f->path = npath;
+    f->name = name;
     _ustat2qid (&st, wqid);
     return 1;
 error:
@@ -431,11 +1038,281 @@ error:
           fid->user->uname, np_conn_get_client_id (fid->conn), f->path,
           wname->len, wname->str);
 error_quiet:
+    if (fd != -1)
+        close (fd);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     return 0;
 }
 
+/* Resolve a relative path beneath dirfd in one system call, refusing
+ * symlinks and mount crossings.  Fails with ENOSYS if openat2 is missing.
+ */
+static int
+_openat2_beneath (int dirfd, char *path, int flags)
+{
+#if defined(SYS_openat2)
+    static int missing = 0;
+    struct open_how how;
+    int fd;
+
+    if (!missing) {
+        memset (&how, 0, sizeof (how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_XDEV | RESOLVE_NO_SYMLINKS
+                    | RESOLVE_NO_MAGICLINKS;
+        fd = syscall (SYS_openat2, dirfd, path, &how, sizeof (how));
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+        missing = 1;
+    }
+#endif
+    errno = ENOSYS;
+    return -1;
+}
+
+/* Twalk - walk several path components at once
+ * Called from fcall.c::np_walk () instead of diod_walk () when nwname > 1.
+ * The parent of the last component is reached with one openat2 (); the
+ * components above it are only fstatat ()'d for their qids.  Anything
+ * unusual (an error, a symlink, "..", a partial walk) falls back to
+ * diod_walk () one component at a time so results match exactly.
+ * Returns the number of components walked; if 0, np_uerror () is set.
+ */
+int
+diod_walkn (Npfid *fid, int nwname, Npstr *wnames, Npqid *wqids)
+{
+    Fid *f = fid->aux;
+    struct stat st;
+    char *npath = NULL, *rel, *last = NULL, *p;
+    int i, len, ppfd = -1, pfd = -1;
+    ino_t pino;
+    u64 epoch = 0;
+
+    /* diod_walk () refuses to move an open fid (EBUSY) */
+    if (nwname < 2 || f->pfd == -1 || f->fd != -1 || f->dir != NULL)
+        goto fallback;
+    len = strlen (f->path) + 1;
+    for (i = 0; i < nwname; i++) {
+        if (wnames[i].len == 0 || memchr (wnames[i].str, '/', wnames[i].len)
+                               || memchr (wnames[i].str, '\0', wnames[i].len))
+            goto fallback;
+        if (wnames[i].str[0] == '.' && (wnames[i].len == 1
+                    || (wnames[i].len == 2 && wnames[i].str[1] == '.')))
+            goto fallback;
+        len += wnames[i].len + 1;
+    }
+    if (!(npath = np_slab_stralloc (fid->conn->srv, len)))
+        goto fallback;
+    p = npath + sprintf (npath, "%s", f->path);
+    rel = p + 1;
+    for (i = 0; i < nwname; i++) {
+        last = p + 1;
+        p += sprintf (p, "/%.*s", wnames[i].len, wnames[i].str);
+    }
+    /* components above the parent: qids only */
+    for (i = 0, p = rel; i < nwname - 2; i++) {
+        p += wnames[i].len;
+        *p = '\0';
+        if (fstatat (f->pfd, rel, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            goto fallback;
+        *p++ = '/';
+        if (!S_ISDIR (st.st_mode) || st.st_dev != f->stat.st_dev)
+            goto fallback;
+        _ustat2qid (&st, &wqids[i]);
+    }
+    /* the parent */
+    last[-1] = '\0';
+    ppfd = _openat2_beneath (f->pfd, rel, O_PATH | O_DIRECTORY);
+    last[-1] = '/';
+    if (ppfd < 0 || fstat (ppfd, &st) < 0)
+        goto fallback;
+    _ustat2qid (&st, &wqids[nwname - 2]);
+    pino = st.st_ino;
+    /* the last component */
+    if (f->attrttl >= 0)
+        epoch = diod_attrcache_epoch ();
+    if ((pfd = openat (ppfd, last, O_PATH | O_NOFOLLOW)) < 0
+                            || fstat (pfd, &st) < 0
+                            || st.st_dev != f->stat.st_dev)
+        goto fallback;
+    _ustat2qid (&st, &wqids[nwname - 1]);
+    if (f->attrttl >= 0)
+        diod_attrcache_add (pfd, &st, f->attrttl, epoch);
+
+    if (f->ppfd != -1)
+        close (f->ppfd);
+    close (f->pfd);
+    f->ppfd = ppfd;
+    f->pfd = pfd;
+    f->pino = pino;
+    f->stat = st;
+    np_slab_free (f->path);
+    f->path = npath;
+    f->name = last;
+    return nwname;
+fallback:
+    if (pfd != -1)
+        close (pfd);
+    if (ppfd != -1)
+        close (ppfd);
+    if (npath)
+        np_slab_free (npath);
+    for (i = 0; i < nwname; ) {
+        if (!diod_walk (fid, &wnames[i], &wqids[i]))
+            break;
+        i++;
+        if (i < nwname && !(wqids[i - 1].type & P9_QTDIR))
+            break;
+    }
+    return i;
+}
+
+/* A Tread merged into another's preadv has completed.  Readahead was
+ * noted for the whole batch by the worker that issued it.
+ */
+static Npfcall *
+_readdone (Npreq *req, Npfcall *rc, int res)
+{
+    if (res < 0) {
+        np_uerror (-res);
+        free (rc);
+        return NULL;
+    }
+    np_set_rread_count (rc, res);
+    return rc;
+}
+
+/* A Tread submitted to io_uring has completed.  Its elevator slot, if
+ * any, was held until now.
+ */
+static Npfcall *
+_uringreaddone (Npreq *req, Npfcall *rc, int res)
+{
+    Fid *f = req->fid->aux;
+
+    if (f->el)
+        diod_elevator_exit (f->el);
+    if (res > 0)
+        diod_readahead (&f->ra, f->fd, req->tcall->u.tread.offset, res);
+    return _readdone (req, rc, res);
+}
+
+/* A Twrite merged into another's pwritev has completed.
+ */
+static Npfcall *
+_writedone (Npreq *req, Npfcall *rc, int res)
+{
+    Fid *f = req->fid->aux;
+    Npfcall *ret;
+
+    if (res < 0) {
+        np_uerror (-res);
+        return NULL;
+    }
+    _fidinval (f, f->stat.st_ino);
+    if (!(ret = np_create_rwrite (res)))
+        np_uerror (ENOMEM);
+    return ret;
+}
+
+/* A Twrite submitted to io_uring has completed.  Its elevator slot, if
+ * any, was held until now.
+ */
+static Npfcall *
+_uringwritedone (Npreq *req, Npfcall *rc, int res)
+{
+    Fid *f = req->fid->aux;
+
+    if (f->el)
+        diod_elevator_exit (f->el);
+    return _writedone (req, rc, res);
+}
+
+/* Answer req with rc, or if NULL, with the npfs error state.
+ */
+static void
+_respond (Npreq *req, Npfcall *rc)
+{
+    int err;
+
+    if (rc)
+        np_req_respond (req, rc);
+    else {
+        err = np_rerror ();
+        np_req_respond_error (req, err ? err : EIO);
+    }
+}
+
+/* Read count bytes at offset into Rread ret, for req.
+ * Returns as diod_coalesce_pread () does.
+ */
+static ssize_t
+_fidpread (Fid *f, Npfcall *ret, u64 offset, u32 count, Npreq *req)
+{
+    size_t batch = 0;
+    ssize_t n;
+
+    if (f->dfd != -1)
+        return diod_directio_pread (f->fd, f->dfd, f->dalign,
+                                    ret->u.rread.data, count, offset);
+    n = diod_coalesce_pread (f->fd, ret, offset, req, &batch, _readdone,
+                             _uringreaddone);
+    if (n >= 0)
+        diod_readahead (&f->ra, f->fd, offset, batch);
+    return n;
+}
+
+/* Write count bytes of data at offset, for req.
+ * Returns as diod_coalesce_pwrite () does.
+ */
+static ssize_t
+_fidpwrite (Fid *f, u8 *data, u32 count, u64 offset, Npreq *req)
+{
+    if (f->dfd != -1)
+        return diod_directio_pwrite (f->fd, f->dfd, f->dalign, data, count,
+                                     offset);
+    return diod_coalesce_pwrite (f->fd, data, count, offset, req,
+                                 _writedone, _uringwritedone);
+}
+
+/* A Tread queued by the elevator has its turn: do it and answer req.
+ */
+static void
+_elvread (Npreq *req, void *arg)
+{
+    Fid *f = req->fid->aux;
+    Npfcall *tc = req->tcall;
+    ssize_t n;
+
+    n = _fidpread (f, arg, tc->u.tread.offset, tc->u.tread.count, req);
+    if (n == URING_QUEUED)
+        return;
+    if (n < 0)
+        n = -errno;
+    diod_elevator_exit (f->el);
+    _respond (req, _readdone (req, arg, n));
+}
+
+/* A Twrite queued by the elevator has its turn: do it and answer req.
+ */
+static void
+_elvwrite (Npreq *req, void *arg)
+{
+    Fid *f = req->fid->aux;
+    Npfcall *tc = req->tcall;
+    ssize_t n;
+
+    n = _fidpwrite (f, tc->u.twrite.data, tc->u.twrite.count,
+                    tc->u.twrite.offset, req);
+    if (n == URING_QUEUED)
+        return;
+    if (n < 0)
+        n = -errno;
+    diod_elevator_exit (f->el);
+    _respond (req, _writedone (req, NULL, n));
+}
+
 /* Tread - read from a file or directory.
  */
 Npfcall*
@@ -445,11 +1322,36 @@ diod_read (Npfid *fid, u64 offset, u32 count, Npreq *req)
     Npfcall *ret = NULL;
     ssize_t n;
 
-    if (!(ret = np_alloc_rread (count))) {
+    if (_fidflush (f) < 0)
+        goto error_quiet;
+    if (f->dfd != -1)
+        ret = np_alloc_rread_aligned (count, f->dalign, offset);
+    else
+        ret = np_alloc_rread (count);
+    if (!ret) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if ((n = pread (f->fd, ret->u.rread.data, count, offset)) < 0) {
+    if (f->xattr) {
+        n = offset < f->xattr->len ? f->xattr->len - offset : 0;
+        if (n > count)
+            n = count;
+        if (n > 0)
+            memcpy (ret->u.rread.data, f->xattr->buf + offset, n);
+        np_set_rread_count (ret, n);
+        return ret;
+    }
+    /* A queued read is answered by _elvread (). */
+    if (f->el && diod_elevator_enter (f->el, f->stat.st_ino, offset, count,
+                                      0, req, _elvread, ret))
+        return NULL;
+    n = _fidpread (f, ret, offset, count, req);
+    /* The reply comes from the reaper thread, which may free fid. */
+    if (n == URING_QUEUED)
+        return NULL;
+    if (f->el)
+        diod_elevator_exit (f->el);
+    if (n < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
@@ -477,10 +1379,53 @@ diod_write (Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if ((n = pwrite (f->fd, data, count, offset)) < 0) {
+    if (f->xattr) {
+        if (!f->xattr->name || offset > f->xattr->len) {
+            np_uerror (f->xattr->name ? ENOSPC : EINVAL);
+            goto error_quiet;
+        }
+        /* Refuse to leave a gap, so that Tclunk can tell from copied
+         * that the whole value has been written.
+         */
+        if (offset > f->xattr->copied) {
+            np_uerror (EINVAL);
+            goto error_quiet;
+        }
+        n = count < f->xattr->len - offset ? count : f->xattr->len - offset;
+        memcpy (f->xattr->buf + offset, data, n);
+        if (offset + n > f->xattr->copied)
+            f->xattr->copied = offset + n;
+        if (!(ret = np_create_rwrite (n))) {
+            np_uerror (ENOMEM);
+            goto error;
+        }
+        return ret;
+    }
+    if ((f->xflags & XFLAGS_ASYNC) && !f->wb
+                                    && !(f->wb = diod_writebehind_create ())) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    if (f->wb)
+        n = diod_writebehind_write (f->wb, f->fd, data, count, offset);
+    else {
+        /* A queued write is answered by _elvwrite (). */
+        if (f->el && diod_elevator_enter (f->el, f->stat.st_ino, offset,
+                                          count, 1, req, _elvwrite, NULL))
+            return NULL;
+        n = _fidpwrite (f, data, count, offset, req);
+        /* a write handed to io_uring frees its slot when it completes */
+        if (f->el && n != URING_QUEUED)
+            diod_elevator_exit (f->el);
+    }
+    /* The reply comes from the reaper thread, which may free fid. */
+    if (n == URING_QUEUED)
+        return NULL;
+    if (n < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _fidinval (f, f->stat.st_ino);
     if (!(ret = np_create_rwrite (n))) {
         np_uerror (ENOMEM);
         goto error;
@@ -503,6 +1448,28 @@ diod_clunk (Npfid *fid)
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
 
+    /* Too late to fail the close: the fid goes away regardless.
+     */
+    if (_fidflush (f) < 0)
+        errn (np_rerror (), "diod_clunk %s@%s:%s: write-behind",
+              fid->user->uname, np_conn_get_client_id (fid->conn), f->path);
+    /* But a Txattrcreate takes effect here, and its failure is reported
+     * (the fid still goes away).  A zero length value removes the attribute.
+     */
+    if (f->xattr && f->xattr->name) {
+        if (f->xattr->copied != f->xattr->len) {
+            np_uerror (EINVAL);
+            goto error_quiet;
+        }
+        if (_fidsetxattr (f, f->xattr->name,
+                          f->xattr->len > 0 ? f->xattr->buf : NULL,
+                          f->xattr->len, f->xattr->flags) < 0) {
+            np_uerror (errno);
+            goto error_quiet;
+        }
+        diod_xattrcache_inval (f->stat.st_dev, f->stat.st_ino);
+        _fidinval (f, f->stat.st_ino);
+    }
     if (!(ret = np_create_rclunk ())) {
         np_uerror (ENOMEM);
         goto error;
@@ -511,6 +1478,7 @@ diod_clunk (Npfid *fid)
 error:
     errn (np_rerror (), "diod_clunk %s@%s:%s",
           fid->user->uname, np_conn_get_client_id (fid->conn), f->path);
+error_quiet:
     if (ret)
         free (ret);
     return NULL;
@@ -523,15 +1491,21 @@ diod_remove (Npfid *fid)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
+    char *name;
+    int dfd;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (remove (f->path) < 0) {
+    name = _fidat (f, &dfd);
+    if (unlinkat (dfd, name, S_ISDIR (f->stat.st_mode) ? AT_REMOVEDIR : 0) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _fidinval (f, f->stat.st_ino);
+    _fidinval (f, f->pino);
+    diod_fdcache_forget (f->stat.st_dev, f->stat.st_ino);
     if (!(ret = np_create_rremove ())) {
         np_uerror (ENOMEM);
         goto error;
@@ -551,7 +1525,7 @@ error_quiet:
 void
 diod_flush(Npreq *req)
 {
-    return;
+    (void)diod_lockwait_cancel (req); /* a blocking Tlock, if anything */
 }
 
 /* Tstatfs - read file system information.
@@ -565,11 +1539,11 @@ diod_statfs (Npfid *fid)
     struct statvfs svb;
     Npfcall *ret = NULL;
 
-    if (statfs (f->path, &sb) < 0) {
+    if (fstatfs (_fidfd (f), &sb) < 0) {
         np_uerror (errno);
         goto error;
     }
-    if (statvfs (f->path, &svb) < 0) {
+    if (fstatvfs (_fidfd (f), &svb) < 0) {
         np_uerror (errno);
         goto error;
     }
@@ -595,6 +1569,8 @@ diod_lopen (Npfid *fid, u32 flags)
     Fid *f = fid->aux;
     Npfcall *res = NULL;
     Npqid qid;
+    u32 iounit;
+    int fd;
 
     if ((f->xflags & XFLAGS_RO) && ((flags & O_WRONLY) || (flags & O_RDWR))) {
         np_uerror (EROFS);
@@ -603,26 +1579,43 @@ diod_lopen (Npfid *fid, u32 flags)
     if ((flags & O_CREAT)) /* can't happen? */
         flags &= ~O_CREAT; /* clear and allow to fail with ENOENT */
 
-    if (_fidstat (f) < 0)
-        goto error_quiet;
-
+    /* N.B. f->stat was filled in by walk/attach and the file type
+     * cannot have changed underneath our handle.
+     */
     if (S_ISDIR (f->stat.st_mode)) {
-        f->dir = opendir (f->path);
-        if (!f->dir) {
+        if ((fd = _fidreopen (f, O_RDONLY | O_DIRECTORY)) < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
+        if (!(f->dir = _diropen (fd))) {
+            np_uerror (errno);
+            (void)close (fd);
+            goto error_quiet;
+        }
+    } else if ((f->fd = diod_fdcache_get (f->stat.st_dev, f->stat.st_ino,
+                                          fid->user->uid, flags)) != -1) {
+        f->fdshared = 1;
     } else {
-        f->fd = open (f->path, flags);
+        f->fd = _fidreopen (f, flags);
         if (f->fd < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
-    }
+        if ((flags & O_TRUNC))
+            _fidinval (f, f->stat.st_ino);
+        if (diod_fdcache_add (f->stat.st_dev, f->stat.st_ino, fid->user->uid,
+                              flags, f->fd) == 0)
+            f->fdshared = 1;
+    }
+    _fidopendirect (f, flags);
+    /* f->stat may be from the attribute cache, or the file may have
+     * changed since the walk: the qid reports it as it is now open.
+     */
     if (_fidstat (f) < 0)
-        goto error; /* can't happen? */
+        goto error;
     _ustat2qid (&f->stat, &qid);
-    if (!(res = np_create_rlopen (&qid, f->stat.st_blksize))) {
+    iounit = _fidiounit (fid, f->stat.st_blksize);
+    if (!(res = np_create_rlopen (&qid, iounit))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -632,13 +1625,10 @@ error:
           fid->user->uname, np_conn_get_client_id (fid->conn), f->path);
 error_quiet:
     if (f->dir) {
-        (void)closedir (f->dir);
+        _dirclose (f->dir);
         f->dir = NULL;
     }
-    if (f->fd != -1) {
-        (void)close (f->fd); 
-        f->fd = -1;
-    }
+    _fidclose (f);
     if (res)
         free (res);
     return NULL;
@@ -649,12 +1639,13 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
-    char *npath = NULL;
+    char *npath = NULL, *nname;
     Npqid qid;
     int fd = -1;
     struct stat sb;
     mode_t saved_umask;
     int created = 0;
+    u64 epoch;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
@@ -662,29 +1653,44 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
     }
     if (!(flags & O_CREAT)) /* can't happen? */
         flags |= O_CREAT;
-    if (!(npath = _mkpath(f->path, name))) {
+    if (!(npath = _mkpath (fid, f->path, name, &nname))) {
         np_uerror (ENOMEM);
         goto error;
     }
     saved_umask = umask(0);
-    if ((fd = open (npath, flags, mode)) < 0) {
+    if ((fd = openat (_fidfd (f), nname, flags, mode)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
     created = 1;
     umask(saved_umask);
+    _fidinval (f, f->stat.st_ino);
+    epoch = diod_attrcache_epoch ();
     if (fstat (fd, &sb) < 0) {
         np_uerror (errno);
         goto error; /* shouldn't happen? */
     }
     _ustat2qid (&sb, &qid);
-    if (!((ret = np_create_rlcreate (&qid, sb.st_blksize)))) {
+    if (!((ret = np_create_rlcreate (&qid, _fidiounit (fid, sb.st_blksize))))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    free (f->path);
+    /* the directory handle becomes the parent of the new file */
+    if (f->ppfd != -1)
+        (void)close (f->ppfd);
+    f->ppfd = f->pfd;
+    f->pfd = -1;
+    np_slab_free (f->path);
     f->path = npath;
+    f->name = nname;
+    f->pino = f->stat.st_ino;
+    f->stat = sb;
     f->fd = fd;
+    if (diod_fdcache_add (sb.st_dev, sb.st_ino, fid->user->uid, flags, fd) == 0)
+        f->fdshared = 1;
+    _fidopendirect (f, flags);
+    if (f->attrttl >= 0)
+        diod_attrcache_add (fd, &sb, f->attrttl, epoch);
     return ret;
 error:
     errn (np_rerror (), "diod_lcreate %s@%s:%s/%.*s",
@@ -695,9 +1701,9 @@ error_quiet:
         (void)close (fd);
     }
     if (created && npath)
-        (void)unlink (npath);
+        (void)unlinkat (_fidfd (f), nname, 0);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     if (ret)
         free (ret);
     return NULL;
@@ -708,7 +1714,7 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
-    char *target = NULL, *npath = NULL;
+    char *target = NULL, *npath = NULL, *nname;
     Npqid qid;
     struct stat sb;
     mode_t saved_umask;
@@ -718,7 +1724,7 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (!(npath = _mkpath(f->path, name))) {
+    if (!(npath = _mkpath (fid, f->path, name, &nname))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -727,13 +1733,14 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
         goto error;
     }
     saved_umask = umask(0);
-    if (symlink (target, npath) < 0) {
+    if (symlinkat (target, _fidfd (f), nname) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
     created = 1;
+    _fidinval (f, f->stat.st_ino);
     umask(saved_umask);
-    if (lstat (npath, &sb) < 0) {
+    if (fstatat (_fidfd (f), nname, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error; /* shouldn't happen? */
     }
@@ -742,7 +1749,7 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
         np_uerror (ENOMEM);
         goto error;
     }
-    free (npath);
+    np_slab_free (npath);
     free (target);
     return ret;
 error:
@@ -751,9 +1758,9 @@ error:
           name->len, name->str);
 error_quiet:
     if (created && npath)
-        (void)unlink (npath);
+        (void)unlinkat (_fidfd (f), nname, 0);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     if (target)
         free (target);
     if (ret)
@@ -766,7 +1773,7 @@ diod_mknod(Npfid *fid, Npstr *name, u32 mode, u32 major, u32 minor, u32 gid)
 {
     Npfcall *ret = NULL;
     Fid *f = fid->aux;
-    char *npath = NULL;
+    char *npath = NULL, *nname;
     Npqid qid;
     struct stat sb;
     mode_t saved_umask;
@@ -776,18 +1783,19 @@ diod_mknod(Npfid *fid, Npstr *name, u32 mode, u32 major, u32 minor, u32 gid)
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (!(npath = _mkpath(f->path, name))) {
+    if (!(npath = _mkpath (fid, f->path, name, &nname))) {
         np_uerror (ENOMEM);
         goto error;
     }
     saved_umask = umask(0);
-    if (mknod (npath, mode, makedev (major, minor)) < 0) {
+    if (mknodat (_fidfd (f), nname, mode, makedev (major, minor)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
     created = 1;
+    _fidinval (f, f->stat.st_ino);
     umask(saved_umask);
-    if (lstat (npath, &sb) < 0) {
+    if (fstatat (_fidfd (f), nname, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error; /* shouldn't happen? */
     }
@@ -796,7 +1804,7 @@ diod_mknod(Npfid *fid, Npstr *name, u32 mode, u32 major, u32 minor, u32 gid)
         np_uerror (ENOMEM);
         goto error;
     }
-    free (npath);
+    np_slab_free (npath);
     return ret;
 error:
     errn (np_rerror (), "diod_mknod %s@%s:%s/%.*s",
@@ -804,9 +1812,9 @@ error:
           name->len, name->str);
 error_quiet:
     if (created && npath)
-        (void)unlink (npath);
+        (void)unlinkat (_fidfd (f), nname, 0);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     if (ret)
         free (ret);
     return NULL;
@@ -820,18 +1828,24 @@ diod_rename (Npfid *fid, Npfid *dfid, Npstr *name)
     Fid *f = fid->aux;
     Fid *d = dfid->aux;
     Npfcall *ret = NULL;
-    char *npath = NULL;
+    char *npath = NULL, *nname, *oname;
     int renamed = 0;
+    int odfd, nppfd = -1;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (!(npath = _mkpath(d->path, name))) {
+    if (!(npath = _mkpath (fid, d->path, name, &nname))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (rename (f->path, npath) < 0) {
+    if ((nppfd = dup (_fidfd (d))) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    oname = _fidat (f, &odfd);
+    if (renameat (odfd, oname, nppfd, nname) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
@@ -840,8 +1854,16 @@ diod_rename (Npfid *fid, Npfid *dfid, Npstr *name)
         np_uerror (ENOMEM);
         goto error;
     }
-    free (f->path);
+    _fidinval (f, f->stat.st_ino);
+    _fidinval (f, f->pino);
+    _fidinval (f, d->stat.st_ino);
+    if (f->ppfd != -1)
+        (void)close (f->ppfd);
+    f->ppfd = nppfd;
+    f->pino = d->stat.st_ino;
+    np_slab_free (f->path);
     f->path = npath;
+    f->name = nname;
     return ret;
 error:
     errn (np_rerror (), "diod_rename %s@%s:%s to %s/%.*s",
@@ -849,11 +1871,13 @@ error:
           d->path, name->len, name->str);
 error_quiet:
     if (renamed && npath)
-        (void)rename (npath, f->path);
+        (void)renameat (nppfd, nname, odfd, oname);
+    if (nppfd != -1)
+        (void)close (nppfd);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     if (ret)
-        free (f);
+        free (ret);
     return NULL;
 }
 
@@ -865,7 +1889,7 @@ diod_readlink(Npfid *fid)
     char target[PATH_MAX + 1];
     int n;
 
-    if ((n = readlink (f->path, target, sizeof(target))) < 0) {
+    if ((n = readlinkat (_fidfd (f), "", target, sizeof(target))) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
@@ -890,11 +1914,15 @@ diod_getattr(Npfid *fid, u64 request_mask)
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
     Npqid qid;
+    struct timespec btime = { 0, 0 };
+    u64 valid, gen = 0;
 
-    if (_fidstat (f) < 0)
+    if (_fidflush (f) < 0)
+        goto error_quiet;
+    if (_fidgetattr (f, request_mask, &valid, &btime, &gen) < 0)
         goto error_quiet;
     _ustat2qid (&f->stat, &qid);
-    if (!(ret = np_create_rgetattr(request_mask, &qid,
+    if (!(ret = np_create_rgetattr(valid, &qid,
                                     f->stat.st_mode,
                                     f->stat.st_uid,
                                     f->stat.st_gid,
@@ -909,7 +1937,8 @@ diod_getattr(Npfid *fid, u64 request_mask)
                                     f->stat.st_mtim.tv_nsec,
                                     f->stat.st_ctim.tv_sec,
                                     f->stat.st_ctim.tv_nsec,
-                                    0, 0, 0, 0))) {
+                                    btime.tv_sec, btime.tv_nsec,
+                                    gen, 0))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -931,11 +1960,15 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
     Fid *f = fid->aux;
     int fidstat_updated = 0;
     int ctime_updated = 0;
+    char *name;
+    int dfd, fd;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
+    if (_fidflush (f) < 0)
+        goto error_quiet;
 
     if ((valid & P9_SETATTR_MODE) || (valid & P9_SETATTR_SIZE)) {
         if (_fidstat(f) < 0)
@@ -950,7 +1983,8 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
 
     /* chmod (N.B. dereferences symlinks) */
     if ((valid & P9_SETATTR_MODE)) {
-        if (chmod (f->path, mode) < 0) {
+        name = _fidat (f, &dfd);
+        if (fchmodat (dfd, name, mode, 0) < 0) {
             np_uerror(errno);
             goto error_quiet;
         }
@@ -959,8 +1993,10 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
 
     /* chown */
     if ((valid & P9_SETATTR_UID) || (valid & P9_SETATTR_GID)) {
-        if (lchown (f->path, (valid & P9_SETATTR_UID) ? uid : -1,
-                             (valid & P9_SETATTR_GID) ? gid : -1) < 0) {
+        name = _fidat (f, &dfd);
+        if (fchownat (dfd, name, (valid & P9_SETATTR_UID) ? uid : -1,
+                                 (valid & P9_SETATTR_GID) ? gid : -1,
+                                 AT_SYMLINK_NOFOLLOW) < 0) {
             np_uerror(errno);
             goto error_quiet;
         }
@@ -969,10 +2005,16 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
 
     /* truncate (N.B. dereferences symlinks) */
     if ((valid & P9_SETATTR_SIZE)) {
-        if (truncate (f->path, size) < 0) {
+        if ((fd = _fidreopen (f, O_WRONLY)) < 0) {
             np_uerror(errno);
             goto error_quiet;
         }
+        if (ftruncate (fd, size) < 0) {
+            np_uerror(errno);
+            (void)close (fd);
+            goto error_quiet;
+        }
+        (void)close (fd);
         ctime_updated = 1;
     }
 
@@ -1003,7 +2045,8 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
             ts[1].tv_nsec = mtime_nsec;
         }
 
-        if (utimensat(-1, f->path, ts, AT_SYMLINK_NOFOLLOW) < 0) {
+        name = _fidat (f, &dfd);
+        if (utimensat(dfd, name, ts, AT_SYMLINK_NOFOLLOW) < 0) {
             np_uerror(errno);
             goto error_quiet;
         }
@@ -1054,11 +2097,13 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
 #endif
     }
     if ((valid & P9_SETATTR_CTIME) && !ctime_updated) {
-        if (lchown (f->path, -1, -1) < 0) {
+        name = _fidat (f, &dfd);
+        if (fchownat (dfd, name, -1, -1, AT_SYMLINK_NOFOLLOW) < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
     }
+    _fidinval (f, f->stat.st_ino);
     if (!(ret = np_create_rsetattr())) {
         np_uerror (ENOMEM);
         goto error;
@@ -1068,58 +2113,95 @@ error:
     errn (np_rerror (), "diod_setattr %s@%s:%s (valid=0x%x)",
           fid->user->uname, np_conn_get_client_id (fid->conn), f->path, valid);
 error_quiet:
+    _fidinval (f, f->stat.st_ino); /* may have partly succeeded */
     if (ret)
         free (ret);
     return NULL;
 }
 
 static u32
-_copy_dirent_linux (Fid *f, u8 *buf, u32 buflen)
+_copy_dirent_linux (Fid *f, struct linux_dirent64 *de, u8 *buf, u32 buflen)
 {
     Npqid qid;
     u32 ret = 0;
 
-    if (f->dirent->d_type == DT_UNKNOWN) {
-        char path[PATH_MAX + 1];
+    if (de->d_type == DT_UNKNOWN) {
         struct stat sb;
-        snprintf (path, sizeof(path), "%s/%s", f->path, f->dirent->d_name);
-        if (lstat (path, &sb) < 0) {
+        if (fstatat (f->dir->fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
             np_uerror (errno);
             goto done;
         }
         _ustat2qid (&sb, &qid);
     } else  {
-        _dirent2qid (f->dirent, &qid);
+        _dirent2qid (de, &qid);
     }
-    ret = np_serialize_p9dirent(&qid, f->dirent->d_off, f->dirent->d_type,
-                                      f->dirent->d_name, buf, buflen);
+    ret = np_serialize_p9dirent(&qid, de->d_off, de->d_type,
+                                      de->d_name, buf, buflen);
 done:
     return ret;
 }
 
-/* FIXME: seekdir(previous d_off) OK?
- * If not, substitute saved_dir_position for d_off in last returned.
- * If so, get rid of saved_dir_position and 2nd seekdir.
+/* Pack as many entries as fit into buf, starting at directory offset
+ * 'offset'.  Only seek if the client asks for something other than where
+ * the last Treaddir left off.  An entry that doesn't fit stays buffered.
  */
 static u32
 _read_dir_linux (Fid *f, u8* buf, u64 offset, u32 count)
 {
+    Dir *d = f->dir;
+    struct linux_dirent64 *de;
+    struct stat sb;
     int i, n = 0;
-    off_t saved_dir_pos;
+    long len;
 
-    if (offset == 0)
-        rewinddir (f->dir);
-    else
-        seekdir (f->dir, offset);
+    /* a listing from the top (re)validates against the shared cache */
+    if (offset == 0) {
+        if (d->snap) {
+            diod_dircache_put (d->snap);
+            d->snap = NULL;
+        }
+        if (fstat (d->fd, &sb) == 0 && S_ISDIR (sb.st_mode))
+            d->snap = diod_dircache_get (d->fd, &sb);
+        d->snappos = 0;
+        d->snapoff = 0;
+        d->pos = (u64)-1;   /* the cache may have moved the file offset */
+    }
+    if (d->snap) {
+        if (offset == d->snapoff
+                    || diod_dirsnap_seek (d->snap, offset, &d->snappos) == 0) {
+            d->snapoff = offset;
+            return diod_dirsnap_read (d->snap, &d->snappos, &d->snapoff,
+                                      buf, count);
+        }
+        diod_dircache_put (d->snap);    /* unknown cookie: read the dir */
+        d->snap = NULL;
+    }
+    if (offset != d->pos) {
+        if (lseek (d->fd, offset, SEEK_SET) == (off_t)-1) {
+            np_uerror (errno);
+            return 0;
+        }
+        d->pos = offset;
+        d->len = d->off = 0;
+    }
     do {
-        saved_dir_pos = telldir (f->dir);
-        if (!(f->dirent = readdir (f->dir))) /* FIXME: use readdir_r */
-            break;
-        i = _copy_dirent_linux (f, buf + n, count - n);
-        if (i == 0) {
-            seekdir (f->dir, saved_dir_pos);
-            break;
+        if (d->off == d->len) {
+            len = syscall (SYS_getdents64, d->fd, d->buf, sizeof (d->buf));
+            if (len < 0) {
+                np_uerror (errno);
+                break;
+            }
+            if (len == 0)
+                break;
+            d->len = len;
+            d->off = 0;
         }
+        de = (struct linux_dirent64 *)(d->buf + d->off);
+        i = _copy_dirent_linux (f, de, buf + n, count - n);
+        if (i == 0)
+            break;
+        d->off += de->d_reclen;
+        d->pos = de->d_off;
         n += i;
     } while (n < count);
     return n;
@@ -1152,16 +2234,26 @@ error:
 }
 
 Npfcall*
-diod_fsync (Npfid *fid)
+diod_fsync (Npfid *fid, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
+    int fd;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (fsync(f->dir ? dirfd (f->dir) : f->fd) < 0) {
+    if (_fidflush (f) < 0)
+        goto error_quiet;
+    /* The reply comes from the committer thread, which may free fid. */
+    if ((fd = f->dir ? f->dir->fd : f->fd) == -1) {
+        np_uerror (EBADF);
+        goto error_quiet;
+    }
+    if (diod_groupcommit_submit (fd, f->stat.st_dev, req) == 0)
+        return NULL;
+    if (fsync (fd) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
@@ -1180,56 +2272,240 @@ error_quiet:
 }
 
 /* Locking note:
- * Implement POSIX locks in terms of BSD flock locks.
- * This at least gets distributed whole-file locking to work.
- * Strategies for distributed record locking will deadlock.
+ * POSIX locks are implemented with open file description (OFD) locks,
+ * which belong to the fid's own descriptor rather than to the diod
+ * process, so byte ranges locked through different fids conflict just as
+ * they would between processes, and closing one fid can't drop another's
+ * locks.  A conflicting Tlock is answered P9_LOCK_BLOCKED, unless it has
+ * P9_LOCK_FLAGS_BLOCK, in which case it waits in lockwait.c.
+ *
+ * The kernel reports l_pid = -1 for a conflicting OFD lock, so the proc_id
+ * and client_id of whoever took locks through a fid are kept in a list for
+ * Tgetlock.  An owner records the span of all the ranges it has locked
+ * since it last held none, which is enough to tell the lock holders on a
+ * file apart in practice.
+ */
+typedef struct lockowner_struct {
+    dev_t            dev;
+    ino_t            ino;
+    u64              start;
+    u64              end;       /* inclusive */
+    u32              proc_id;
+    char            *client_id;
+    struct lockowner_struct *next;
+} Lockowner;
+
+static Lockowner *lockowners = NULL;
+static pthread_mutex_t lockowners_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Convert a 9P lock type and range to a struct flock.
+ * Set npfs error state on error.
+ */
+static int
+_lockrange (u8 type, u64 start, u64 length, struct flock *fl)
+{
+    if ((type != F_RDLCK && type != F_WRLCK && type != F_UNLCK)
+                        || start > INT64_MAX || length > INT64_MAX) {
+        np_uerror (EINVAL);
+        return -1;
+    }
+    memset (fl, 0, sizeof (*fl));
+    fl->l_type = type;
+    fl->l_whence = SEEK_SET;
+    fl->l_start = start;
+    fl->l_len = length;         /* 0 = to EOF in both */
+    return 0;
+}
+
+static u64
+_lockend (u64 start, u64 length)
+{
+    return length == 0 ? UINT64_MAX : start + length - 1;
+}
+
+static void
+_lockowner_free (Lockowner *o)
+{
+    if (o->client_id)
+        free (o->client_id);
+    free (o);
+}
+
+/* Make sure fid has a lock owner record before it takes a lock.
+ * Set npfs error state on error.
+ */
+static int
+_lockowner_get (Fid *f, Npstr *client_id)
+{
+    Lockowner *o;
+
+    if (f->lock)
+        return 0;
+    if (!(o = malloc (sizeof (*o))) || !(o->client_id = np_strdup (client_id))) {
+        if (o)
+            free (o);
+        np_uerror (ENOMEM);
+        return -1;
+    }
+    o->dev = f->stat.st_dev;
+    o->ino = f->stat.st_ino;
+    o->start = UINT64_MAX;
+    o->end = 0;
+    o->proc_id = 0;
+    pthread_mutex_lock (&lockowners_lock);
+    o->next = lockowners;
+    lockowners = o;
+    pthread_mutex_unlock (&lockowners_lock);
+    f->lock = o;
+    return 0;
+}
+
+/* Drop fid's lock owner record.
+ */
+static void
+_lockowner_put (Fid *f)
+{
+    Lockowner **op;
+
+    if (!f->lock)
+        return;
+    pthread_mutex_lock (&lockowners_lock);
+    for (op = &lockowners; *op; op = &(*op)->next) {
+        if (*op == f->lock) {
+            *op = f->lock->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&lockowners_lock);
+    _lockowner_free (f->lock);
+    f->lock = NULL;
+}
+
+/* Account for a successful Tlock on fid.
+ */
+static void
+_lockowner_update (Fid *f, u8 type, u64 start, u64 length, u32 proc_id,
+                   Npstr *client_id)
+{
+    Lockowner *o = f->lock;
+    u64 end = _lockend (start, length);
+    char *cid;
+
+    if (!o)
+        return;
+    if (type == F_UNLCK) {
+        if (start <= o->start && end >= o->end)
+            _lockowner_put (f);
+        return;
+    }
+    pthread_mutex_lock (&lockowners_lock);
+    if (start < o->start)
+        o->start = start;
+    if (end > o->end)
+        o->end = end;
+    o->proc_id = proc_id;
+    if (np_strcmp (client_id, o->client_id) != 0
+                                    && (cid = np_strdup (client_id))) {
+        free (o->client_id);
+        o->client_id = cid;
+    }
+    pthread_mutex_unlock (&lockowners_lock);
+}
+
+/* Find who took the lock in 'fl' that conflicts with a Tgetlock on fid,
+ * and return a copy of its client_id (or NULL if not found or no memory).
+ */
+static char *
+_lockowner_find (Fid *f, struct flock *fl, u32 *proc_idp)
+{
+    u64 start = fl->l_start;
+    u64 end = _lockend (fl->l_start, fl->l_len);
+    char *cid = NULL;
+    Lockowner *o;
+
+    pthread_mutex_lock (&lockowners_lock);
+    for (o = lockowners; o; o = o->next) {
+        if (o == f->lock || o->dev != f->stat.st_dev
+                         || o->ino != f->stat.st_ino)
+            continue;
+        if (o->start <= o->end && o->start <= end && o->end >= start) {
+            *proc_idp = o->proc_id;
+            cid = strdup (o->client_id);
+            break;
+        }
+    }
+    pthread_mutex_unlock (&lockowners_lock);
+    return cid;
+}
+
+/* Release any locks fid holds before its descriptor goes away.  Closing
+ * the descriptor would do it, but not if another copy of it is still open.
+ */
+static void
+_fidunlock (Fid *f)
+{
+    struct flock fl;
+
+    if (!f->lock)
+        return;
+    if (f->fd != -1) {
+        (void)_lockrange (F_UNLCK, 0, 0, &fl);
+        (void)fcntl (f->fd, F_OFD_SETLK, &fl);
+        diod_lockwait_wake ();
+    }
+    _lockowner_put (f);
+}
+
+/* A blocking Tlock has waited its turn and taken the lock.
  */
+static void
+_lockgranted (Npreq *req)
+{
+    Npfcall *tc = req->tcall;
+
+    _lockowner_update (req->fid->aux, tc->u.tlock.type, tc->u.tlock.start,
+                       tc->u.tlock.length, tc->u.tlock.proc_id,
+                       &tc->u.tlock.client_id);
+}
+
 Npfcall*
 diod_lock (Npfid *fid, u8 type, u32 flags, u64 start, u64 length, u32 proc_id,
-           Npstr *client_id)
+           Npstr *client_id, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
-    u8 status = P9_LOCK_ERROR;
+    struct flock fl;
+    u8 status;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
     if (flags & ~P9_LOCK_FLAGS_BLOCK) { /* only one valid flag for now */
-        np_uerror (EINVAL);             /*  (which we ignore) */
+        np_uerror (EINVAL);
         goto error;
     }
-    if (_fidstat(f) < 0)
-        goto error_quiet;
-    switch (type) {
-        case F_UNLCK:
-            if (flock (f->fd, LOCK_UN) >= 0) {
-                status = P9_LOCK_SUCCESS;
-                f->lock_type = LOCK_UN;
-            } else
-                status = P9_LOCK_ERROR;
-            break;
-        case F_RDLCK:
-            if (flock (f->fd, LOCK_SH | LOCK_NB) >= 0) {
-                status = P9_LOCK_SUCCESS;
-                f->lock_type = LOCK_SH;
-            } else if (errno == EWOULDBLOCK) {
-                status = P9_LOCK_BLOCKED;
-            } else
-                status = P9_LOCK_ERROR;
-            break;
-        case F_WRLCK:
-            if (flock (f->fd, LOCK_EX | LOCK_NB) >= 0) {
-                status = P9_LOCK_SUCCESS;
-                f->lock_type = LOCK_EX;
-            } else if (errno == EWOULDBLOCK) {
-                status  = P9_LOCK_BLOCKED;
-            }
-            break;
-        default:
-            np_uerror (EINVAL);
+    if (_lockrange (type, start, length, &fl) < 0)
+        goto error;
+    if (_fidprivate (f) < 0)
+        goto error;
+    if (type != F_UNLCK && _lockowner_get (f, client_id) < 0)
+        goto error;
+    if (fcntl (f->fd, F_OFD_SETLK, &fl) < 0) {
+        if (errno != EAGAIN && errno != EACCES) {
+            np_uerror (errno);
             goto error;
+        }
+        /* The reply comes from the waiter thread, which may free fid. */
+        if ((flags & P9_LOCK_FLAGS_BLOCK)
+                && diod_lockwait_submit (f->fd, &fl, req, _lockgranted) == 0)
+            return NULL;
+        status = P9_LOCK_BLOCKED;
+    } else {
+        _lockowner_update (f, type, start, length, proc_id, client_id);
+        if (type != F_WRLCK)
+            diod_lockwait_wake ();
+        status = P9_LOCK_SUCCESS;
     }
     if (!((ret = np_create_rlock (status)))) {
         np_uerror (ENOMEM);
@@ -1245,66 +2521,46 @@ error_quiet:
     return NULL;
 }
 
+/* A fid whose descriptor is shared through the fd cache holds no locks,
+ * so F_OFD_GETLK on it sees every lock on the file, as it should.
+ */
 Npfcall*
 diod_getlock (Npfid *fid, u8 type, u64 start, u64 length, u32 proc_id,
              Npstr *client_id)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
+    struct flock fl;
     char *cid = NULL;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (!(cid = np_strdup (client_id))) {
-        np_uerror (ENOMEM);
+    if (type == F_UNLCK) {
+        np_uerror (EINVAL);
         goto error;
     }
-    if (_fidstat(f) < 0)
-        goto error_quiet;
-    switch (type) {
-        case F_RDLCK:
-            switch (f->lock_type) {
-                case LOCK_EX:
-                case LOCK_SH:
-                    type = LOCK_UN;
-                    break;
-                case LOCK_UN:
-                    if (flock (f->fd, LOCK_SH | LOCK_NB) >= 0) {
-                        (void)flock (f->fd, LOCK_UN);
-                        type = LOCK_UN;
-                    } else
-                        type = LOCK_EX;
-                    break;
-            }
-            break;
-        case F_WRLCK:
-            switch (f->lock_type) {
-                case LOCK_EX:
-                    type = LOCK_UN;
-                    break;
-                case LOCK_SH:
-                    /* Rather than upgrade the lock to LOCK_EX and risk
-                     * not reacquiring the LOCK_SH afterwards, lie about
-                     * the lock being available.  Getlock is racy anyway.
-                     */
-                    type = LOCK_UN;
-                    break;
-                case LOCK_UN:
-                    if (flock (f->fd, LOCK_EX | LOCK_NB) >= 0) {
-                        (void)flock (f->fd, LOCK_UN);
-                        type = LOCK_UN;
-                    } else
-                        type = LOCK_EX; /* could also be LOCK_SH actually */
-            }
-            break;
-        default:
-            np_uerror (EINVAL);
-            goto error;
+    if (_lockrange (type, start, length, &fl) < 0)
+        goto error;
+    if (fcntl (f->fd, F_OFD_GETLK, &fl) < 0) {
+        np_uerror (errno);
+        goto error;
     }
-    if (type != LOCK_UN) {
-        /* FIXME: need to fake up start, length, proc_id, cid? */
+    if (fl.l_type == F_UNLCK) {
+        type = F_UNLCK;
+        cid = np_strdup (client_id);
+    } else {
+        type = fl.l_type;
+        start = fl.l_start;
+        length = fl.l_len;
+        proc_id = fl.l_pid > 0 ? fl.l_pid : 0; /* a local POSIX lock */
+        if (!(cid = _lockowner_find (f, &fl, &proc_id)))
+            cid = strdup ("");
+    }
+    if (!cid) {
+        np_uerror (ENOMEM);
+        goto error;
     }
     if (!((ret = np_create_rgetlock(type, start, length, proc_id, cid)))) {
         np_uerror (ENOMEM);
@@ -1329,27 +2585,31 @@ diod_link (Npfid *dfid, Npfid *fid, Npstr *name)
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
     Fid *df = dfid->aux;
-    char *npath = NULL;
+    char *npath = NULL, *nname, *oname;
     int created = 0;
+    int odfd;
 
     if ((f->xflags & XFLAGS_RO)) {
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (!(npath = _mkpath(df->path, name))) {
+    if (!(npath = _mkpath (fid, df->path, name, &nname))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (link (f->path, npath) < 0) {
+    oname = _fidat (f, &odfd);
+    if (linkat (odfd, oname, _fidfd (df), nname, 0) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
     created = 1;
+    _fidinval (f, f->stat.st_ino);
+    _fidinval (f, df->stat.st_ino);
     if (!((ret = np_create_rlink ()))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    free (npath);
+    np_slab_free (npath);
     return ret;
 error:
     errn (np_rerror (), "diod_link %s@%s:%s %s/%.*s",
@@ -1357,9 +2617,9 @@ error:
           df->path, name->len, name->str);
 error_quiet:
     if (created && npath)
-        (void)unlink (npath);
+        (void)unlinkat (_fidfd (df), nname, 0);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     if (ret)
         free (ret);
     return NULL;
@@ -1370,7 +2630,7 @@ diod_mkdir (Npfid *fid, Npstr *name, u32 mode, u32 gid)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
-    char *npath = NULL;
+    char *npath = NULL, *nname;
     Npqid qid;
     struct stat sb;
     mode_t saved_umask;
@@ -1380,18 +2640,19 @@ diod_mkdir (Npfid *fid, Npstr *name, u32 mode, u32 gid)
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if (!(npath = _mkpath(f->path, name))) {
+    if (!(npath = _mkpath (fid, f->path, name, &nname))) {
         np_uerror (ENOMEM);
         goto error;
     }
     saved_umask = umask(0);
-    if (mkdir (npath, mode) < 0) {
+    if (mkdirat (_fidfd (f), nname, mode) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
     created = 1;
+    _fidinval (f, f->stat.st_ino);
     umask(saved_umask);
-    if (lstat (npath, &sb) < 0) {
+    if (fstatat (_fidfd (f), nname, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error; /* shouldn't happen? */
     }
@@ -1400,7 +2661,7 @@ diod_mkdir (Npfid *fid, Npstr *name, u32 mode, u32 gid)
         np_uerror (ENOMEM);
         goto error;
     }
-    free (npath);
+    np_slab_free (npath);
     return ret;
 error:
     errn (np_rerror (), "diod_mkdir %s@%s:%s/%.*s",
@@ -1408,14 +2669,191 @@ error:
           name->len, name->str);
 error_quiet:
     if (created && npath)
-        (void)rmdir(npath);
+        (void)unlinkat (_fidfd (f), nname, AT_REMOVEDIR);
     if (npath)
-        free (npath);
+        np_slab_free (npath);
     if (ret)
         free (ret);
     return NULL;
 }
 
+/* Get extended attribute name (or the list of names if NULL) of the
+ * object named by fid.  O_PATH descriptors can't be used with fgetxattr (),
+ * so unopened fids go through /proc, or failing that, the path.
+ */
+static ssize_t
+_fidgetxattr (Fid *fid, const char *name, void *buf, size_t size)
+{
+    int fd = fid->fd != -1 ? fid->fd : fid->dir ? fid->dir->fd : -1;
+    char path[32];
+    ssize_t n;
+
+    if (fd != -1)
+        return name ? fgetxattr (fd, name, buf, size)
+                    : flistxattr (fd, buf, size);
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", fid->pfd);
+    n = name ? getxattr (path, name, buf, size) : listxattr (path, buf, size);
+    if (n < 0 && errno == ENOENT)
+        n = name ? lgetxattr (fid->path, name, buf, size)
+                 : llistxattr (fid->path, buf, size);
+    return n;
+}
+
+/* Set extended attribute name of the object named by fid, or remove it
+ * if value is NULL.
+ */
+static int
+_fidsetxattr (Fid *fid, const char *name, void *value, size_t size, int flags)
+{
+    int fd = fid->fd != -1 ? fid->fd : fid->dir ? fid->dir->fd : -1;
+    char path[32];
+    int rc;
+
+    if (fd != -1)
+        return value ? fsetxattr (fd, name, value, size, flags)
+                     : fremovexattr (fd, name);
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", fid->pfd);
+    rc = value ? setxattr (path, name, value, size, flags)
+               : removexattr (path, name);
+    if (rc < 0 && errno == ENOENT)
+        rc = value ? lsetxattr (fid->path, name, value, size, flags)
+                   : lremovexattr (fid->path, name);
+    return rc;
+}
+
+/* Txattrwalk - prepare attrfid to read the value of extended attribute
+ * name of fid, or if name is empty, the list of names.
+ * Names a file is known not to have fail without asking the file system.
+ */
+Npfcall*
+diod_xattrwalk (Npfid *fid, Npfid *attrfid, Npstr *name)
+{
+    Fid *f = fid->aux;
+    Fid *af = attrfid->aux;
+    Npfcall *ret = NULL;
+    Xattr *xa = NULL;
+    char *s = NULL;
+    struct timespec start, bt;
+    u64 valid, gen, epoch;
+    ssize_t n;
+    int err;
+
+    if (name->len > 0 && !(s = np_strdup (name))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    /* a recorded miss is checked against the ctime, so it only saves a
+     * syscall where the attribute cache already holds the ctime
+     */
+    clock_gettime (CLOCK_REALTIME, &start);
+    if (s && f->attrttl >= 0 && diod_attrcache_get (f->stat.st_dev,
+                                    f->stat.st_ino, &f->stat, &epoch) == 0
+          && diod_xattrcache_absent (&f->stat, s)) {
+        np_uerror (ENODATA);
+        goto error_quiet;
+    }
+    if (!(xa = malloc (sizeof (*xa)))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    memset (xa, 0, sizeof (*xa));
+    /* size the value, then fetch it, again if it grew in between */
+    for (;;) {
+        if ((n = _fidgetxattr (f, s, NULL, 0)) < 0) {
+            err = errno;
+            if (err == ENODATA && s && f->attrttl >= 0 && _fidgetattr (f,
+                                P9_GETATTR_BASIC, &valid, &bt, &gen) == 0)
+                diod_xattrcache_add (&f->stat, s, &start);
+            np_uerror (err);
+            goto error_quiet;
+        }
+        if (xa->buf)
+            free (xa->buf);
+        if (!(xa->buf = malloc (n > 0 ? n : 1))) {
+            np_uerror (ENOMEM);
+            goto error;
+        }
+        if ((n = _fidgetxattr (f, s, xa->buf, n)) >= 0)
+            break;
+        if (errno != ERANGE) {
+            np_uerror (errno);
+            goto error_quiet;
+        }
+    }
+    xa->len = n;
+    if (!(ret = np_create_rxattrwalk (xa->len))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    if (af->xattr)
+        _xattrfree (af->xattr);
+    af->xattr = xa;
+    free (s);
+    return ret;
+error:
+    errn (np_rerror (), "diod_xattrwalk %s@%s:%s/%.*s",
+          fid->user->uname, np_conn_get_client_id (fid->conn), f->path,
+          name->len, name->str);
+error_quiet:
+    if (xa)
+        _xattrfree (xa);
+    if (s)
+        free (s);
+    return NULL;
+}
+
+/* Txattrcreate - turn fid into one through which the value of extended
+ * attribute name is written, to be set when it is clunked.
+ */
+Npfcall*
+diod_xattrcreate (Npfid *fid, Npstr *name, u64 size, u32 flag)
+{
+    Fid *f = fid->aux;
+    Npfcall *ret = NULL;
+    Xattr *xa = NULL;
+
+    if ((f->xflags & XFLAGS_RO)) {
+        np_uerror (EROFS);
+        goto error_quiet;
+    }
+    if (size > XATTR_SIZE_MAX) {
+        np_uerror (E2BIG);
+        goto error_quiet;
+    }
+    if ((flag & ~(XATTR_CREATE | XATTR_REPLACE))) {
+        np_uerror (EINVAL);
+        goto error_quiet;
+    }
+    if (!(xa = malloc (sizeof (*xa)))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    memset (xa, 0, sizeof (*xa));
+    xa->flags = flag;
+    xa->len = size;
+    if (!(xa->name = np_strdup (name))
+                                || !(xa->buf = malloc (size ? size : 1))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    if (!(ret = np_create_rxattrcreate ())) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    if (f->xattr)
+        _xattrfree (f->xattr);
+    f->xattr = xa;
+    return ret;
+error:
+    errn (np_rerror (), "diod_xattrcreate %s@%s:%s/%.*s",
+          fid->user->uname, np_conn_get_client_id (fid->conn), f->path,
+          name->len, name->str);
+error_quiet:
+    if (xa)
+        _xattrfree (xa);
+    return NULL;
+}
+
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
  */
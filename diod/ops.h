@@ -22,6 +22,8 @@
  *****************************************************************************/
 
 int diod_register_ops (Npsrv *srv);
+int diod_fid_describe (Npfid *fid, char **pathp, int *fdp);
+int diod_fid_restore (Npfid *fid, char *path, int flags, int fd);
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
@@ -0,0 +1,205 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* readahead.c - detect sequential reads and prefetch ahead of them */
+
+/* Each open fid tracks the offset at which its next read would start if
+ * the client were reading sequentially.  A read that starts there grows
+ * the fid's window, and when the read nears the end of the range already
+ * advised, the next window's worth of the file is handed to the kernel
+ * with POSIX_FADV_WILLNEED, which starts the I/O without waiting for it.
+ * The window starts at four times the read size and doubles up to the
+ * export's limit, so a short sequential run costs little and a long one
+ * keeps the backend busy while the client is still on the wire.
+ *
+ * A read anywhere else collapses the window, so random access issues no
+ * readahead of its own.
+ *
+ * Reads are noted as they complete, which may be on a worker or on the
+ * io_uring reaper thread, so the state is under a per-fid lock.  A batch
+ * of Treads merged into one preadv is noted once, as a single read of the
+ * whole batch.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "readahead.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    u64             sequential; /* reads that continued a sequential run */
+    u64             hits;       /* ... that fell within the advised range */
+    u64             random;     /* reads that broke a run */
+    u64             advised;    /* bytes passed to posix_fadvise () */
+} Rastats;
+
+static Rastats ra_stats = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 };
+
+/* Initialize readahead state for a new fid, with readahead disabled.
+ */
+void
+diod_readahead_create (Readahead *ra)
+{
+    pthread_mutex_init (&ra->lock, NULL);
+    ra->next = 0;
+    ra->end = 0;
+    ra->win = 0;
+    ra->max = 0;
+}
+
+void
+diod_readahead_destroy (Readahead *ra)
+{
+    pthread_mutex_destroy (&ra->lock);
+}
+
+/* Set up readahead state for a newly opened fid.
+ * A limit of 0 KB or less disables readahead.
+ */
+void
+diod_readahead_setup (Readahead *ra, int kb)
+{
+    pthread_mutex_lock (&ra->lock);
+    ra->next = 0;
+    ra->end = 0;
+    ra->win = 0;
+    ra->max = kb > 0 ? (size_t)kb << 10 : 0;
+    pthread_mutex_unlock (&ra->lock);
+}
+
+/* Set up readahead state for a fid cloned from one with state from,
+ * with the same limit.
+ */
+void
+diod_readahead_clone (Readahead *ra, Readahead *from)
+{
+    size_t max;
+
+    pthread_mutex_lock (&from->lock);
+    max = from->max;
+    pthread_mutex_unlock (&from->lock);
+    pthread_mutex_lock (&ra->lock);
+    ra->next = 0;
+    ra->end = 0;
+    ra->win = 0;
+    ra->max = max;
+    pthread_mutex_unlock (&ra->lock);
+}
+
+/* Note a read of count bytes at offset from fd, which has returned,
+ * and advise the kernel of the range we expect to be read next.
+ */
+void
+diod_readahead (Readahead *ra, int fd, u64 offset, size_t count)
+{
+    u64 start, end = offset + count;
+    int seq = 0, hit = 0;
+    size_t len = 0;
+
+    pthread_mutex_lock (&ra->lock);
+    if (ra->max == 0 || count == 0) {
+        pthread_mutex_unlock (&ra->lock);
+        return;
+    }
+    if (offset == ra->next) {
+        seq = 1;
+        hit = (end <= ra->end);
+        if (ra->win == 0)
+            ra->win = count * 4 < ra->max ? count * 4 : ra->max;
+        if (end + ra->win / 2 > ra->end) {
+            start = ra->end > end ? ra->end : end;
+            len = end + ra->win - start;
+            if (posix_fadvise (fd, start, len, POSIX_FADV_WILLNEED) == 0)
+                ra->end = start + len;
+            else
+                len = 0;
+            if (ra->win < ra->max)
+                ra->win = ra->win * 2 < ra->max ? ra->win * 2 : ra->max;
+        }
+    } else {
+        ra->win = 0;
+        ra->end = 0;
+    }
+    ra->next = end;
+    pthread_mutex_unlock (&ra->lock);
+
+    pthread_mutex_lock (&ra_stats.lock);
+    if (seq) {
+        ra_stats.sequential++;
+        if (hit)
+            ra_stats.hits++;
+    } else
+        ra_stats.random++;
+    ra_stats.advised += len;
+    pthread_mutex_unlock (&ra_stats.lock);
+}
+
+static char *
+_get_readahead (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&ra_stats.lock);
+    if (aspf (&s, &len, "%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              ra_stats.sequential, ra_stats.hits, ra_stats.random,
+              ra_stats.advised) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&ra_stats.lock);
+    return s;
+}
+
+/* Add the "readahead" ctl file:
+ *   sequential hits random advised-bytes
+ */
+int
+diod_readahead_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "readahead", _get_readahead, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
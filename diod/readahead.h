@@ -0,0 +1,20 @@
+/* Per-fid readahead state.
+ */
+typedef struct {
+    pthread_mutex_t lock;   /* reads may complete on several threads */
+    u64          next;      /* offset where a sequential read would start */
+    u64          end;       /* end of the range already advised */
+    size_t       win;       /* current window in bytes, 0 = not sequential */
+    size_t       max;       /* largest window in bytes, 0 = disabled */
+} Readahead;
+
+int      diod_readahead_init (Npsrv *srv);
+void     diod_readahead_create (Readahead *ra);
+void     diod_readahead_destroy (Readahead *ra);
+void     diod_readahead_setup (Readahead *ra, int kb);
+void     diod_readahead_clone (Readahead *ra, Readahead *from);
+void     diod_readahead (Readahead *ra, int fd, u64 offset, size_t count);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
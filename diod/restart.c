@@ -0,0 +1,647 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* restart.c - hand live connections over to a new diod (hot restart) */
+
+/* A diod with a hot restart socket listens on it for a successor.
+ * When one connects, the running server stops reading requests (at a
+ * message boundary), lets requests in flight complete, then sends its
+ * listen sockets, client connections and each connection's fid table.
+ * File descriptors travel as SCM_RIGHTS ancillary data.  Open files go
+ * across as descriptors too, so unlinked-but-open files and their locks
+ * survive; the path and open flags are sent as well so a fid can be
+ * reopened if its descriptor is missing.  The successor acknowledges
+ * once it holds everything and the old server exits.  If anything fails
+ * before the acknowledgement, the old server simply resumes service.
+ *
+ * Auth fids and ctl fids are not handed over.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "list.h"
+
+#include "diod_log.h"
+#include "diod_sock.h"
+
+#include "ops.h"
+#include "lockwait.h"
+#include "restart.h"
+
+#define HR_MAGIC        0x64696f64  /* "diod" */
+#define HR_VERSION      1
+#define HR_TIMEOUT      10          /* seconds */
+#define HR_STRMAX       (2*(PATH_MAX + 1))
+
+enum {
+    HR_HELLO = 1,
+    HR_LISTEN,
+    HR_CONN,
+    HR_FID,
+    HR_END,
+    HR_ACK,
+};
+
+typedef struct {
+    uint32_t        type;
+    uint32_t        magic;      /* hello */
+    uint32_t        version;    /* hello */
+    uint32_t        msize;      /* conn */
+    uint32_t        authuser;   /* conn */
+    uint32_t        fid;        /* fid */
+    uint32_t        uid;        /* fid */
+    int32_t         flags;      /* fid: open flags, -1 if not open */
+    uint8_t         qtype;      /* fid */
+    uint16_t        len1;       /* conn: client_id, fid: aname */
+    uint16_t        len2;       /* fid: path */
+} Hrec;
+
+typedef struct {
+    uint32_t        fid;
+    uint32_t        uid;
+    int32_t         flags;
+    uint8_t         qtype;
+    char           *aname;
+    char           *path;
+    int             fd;
+} Hfid;
+
+typedef struct {
+    int             fd;
+    uint32_t        msize;
+    uint32_t        authuser;
+    char           *client_id;
+    List            fids;
+} Hconn;
+
+/* connections received from predecessor awaiting diod_restart_resume () */
+static List         hconns = NULL;
+
+typedef struct {
+    int             s;
+    int             nfids;
+    int             nskipped;
+} Hsend;
+
+static void
+_hfid_destroy (Hfid *hf)
+{
+    if (hf->fd != -1)
+        close (hf->fd);
+    if (hf->aname)
+        free (hf->aname);
+    if (hf->path)
+        free (hf->path);
+    free (hf);
+}
+
+static void
+_hconn_destroy (Hconn *hc)
+{
+    if (hc->fd != -1)
+        close (hc->fd);
+    if (hc->client_id)
+        free (hc->client_id);
+    if (hc->fids)
+        list_destroy (hc->fids);
+    free (hc);
+}
+
+static void
+_set_timeout (int s)
+{
+    struct timeval tv = { .tv_sec = HR_TIMEOUT, .tv_usec = 0 };
+
+    (void)setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    (void)setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+}
+
+/* Only root or our own uid may be on the other end: whoever it is
+ * gets every client connection.
+ */
+static int
+_check_peer (int s)
+{
+    struct ucred cr;
+    socklen_t crlen = sizeof (cr);
+
+    if (getsockopt (s, SOL_SOCKET, SO_PEERCRED, &cr, &crlen) < 0) {
+        err ("hot restart: SO_PEERCRED");
+        return -1;
+    }
+    if (cr.uid != 0 && cr.uid != geteuid ()) {
+        msg ("hot restart: rejecting peer with uid %d", cr.uid);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+_hdr_init (Hrec *h, int type)
+{
+    memset (h, 0, sizeof (*h));
+    h->type = type;
+    h->flags = -1;
+}
+
+/* Send one record: header, up to two strings, and optionally an fd.
+ */
+static int
+_send_rec (int s, Hrec *h, char *s1, char *s2, int fd)
+{
+    struct msghdr mh;
+    struct iovec iov[3];
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE (sizeof (int))];
+    int n, niov = 0;
+
+    h->len1 = s1 ? strlen (s1) : 0;
+    h->len2 = s2 ? strlen (s2) : 0;
+    if (h->len1 + h->len2 > HR_STRMAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    iov[niov].iov_base = h;
+    iov[niov++].iov_len = sizeof (*h);
+    if (h->len1 > 0) {
+        iov[niov].iov_base = s1;
+        iov[niov++].iov_len = h->len1;
+    }
+    if (h->len2 > 0) {
+        iov[niov].iov_base = s2;
+        iov[niov++].iov_len = h->len2;
+    }
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = niov;
+    if (fd != -1) {
+        memset (cbuf, 0, sizeof (cbuf));
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof (cbuf);
+        cmsg = CMSG_FIRSTHDR (&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    }
+    do {
+        n = sendmsg (s, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n < 0 ? -1 : 0;
+}
+
+/* Receive one record.  Strings land in buf (NUL separated), and any
+ * fd that came along is returned in *fdp (else -1).
+ */
+static int
+_recv_rec (int s, Hrec *h, char *buf, char **s1, char **s2, int *fdp)
+{
+    struct msghdr mh;
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE (sizeof (int))];
+    int n;
+
+    *fdp = -1;
+    iov[0].iov_base = h;
+    iov[0].iov_len = sizeof (*h);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = HR_STRMAX;
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof (cbuf);
+    do {
+        n = recvmsg (s, &mh, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR (&mh); cmsg; cmsg = CMSG_NXTHDR (&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy (fdp, CMSG_DATA (cmsg), sizeof (int));
+    }
+    if (n == 0) {
+        errno = ECONNRESET;
+        goto error;
+    }
+    if ((mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || n < sizeof (*h)
+                        || n != sizeof (*h) + h->len1 + h->len2) {
+        errno = EPROTO;
+        goto error;
+    }
+    /* shift the second string up one to make room for a terminator */
+    memmove (buf + h->len1 + 1, buf + h->len1, h->len2);
+    buf[h->len1] = '\0';
+    buf[h->len1 + 1 + h->len2] = '\0';
+    *s1 = buf;
+    *s2 = buf + h->len1 + 1;
+    return 0;
+error:
+    if (*fdp != -1) {
+        close (*fdp);
+        *fdp = -1;
+    }
+    return -1;
+}
+
+static int
+_send_fid (Npfid *fid, void *arg)
+{
+    Hsend *hs = arg;
+    Hrec h;
+    char *path;
+    int fd;
+
+    if ((fid->type & (P9_QTAUTH | P9_QTTMP)) || !fid->user || !fid->aname
+                    || diod_fid_describe (fid, &path, &fd) < 0) {
+        hs->nskipped++;
+        return 0;
+    }
+    _hdr_init (&h, HR_FID);
+    h.fid = fid->fid;
+    h.uid = fid->user->uid;
+    h.qtype = fid->type;
+    if (fd != -1)
+        h.flags = fcntl (fd, F_GETFL);
+    if (_send_rec (hs->s, &h, fid->aname, path, fd) < 0) {
+        err ("hot restart: send fid %d", fid->fid);
+        return -1;
+    }
+    hs->nfids++;
+    return 0;
+}
+
+/* Send our state to the successor.  Called with all readers stopped
+ * and no requests outstanding, so the conns list is stable.
+ */
+static int
+_send_state (Npsrv *srv, int s, struct pollfd *fds, int nfds, Hsend *hs)
+{
+    Npconn *cc;
+    Hrec h;
+    int i;
+
+    _hdr_init (&h, HR_HELLO);
+    h.magic = HR_MAGIC;
+    h.version = HR_VERSION;
+    if (_send_rec (s, &h, NULL, NULL, -1) < 0)
+        goto error;
+    for (i = 0; i < nfds; i++) {
+        _hdr_init (&h, HR_LISTEN);
+        if (_send_rec (s, &h, NULL, NULL, fds[i].fd) < 0)
+            goto error;
+    }
+    for (cc = srv->conns; cc != NULL; cc = cc->next) {
+        if (!cc->trans)
+            continue;
+        _hdr_init (&h, HR_CONN);
+        h.msize = cc->msize;
+        h.authuser = cc->authuser;
+        if (_send_rec (s, &h, np_conn_get_client_id (cc), NULL,
+                       np_fdtrans_get_fd (cc->trans)) < 0)
+            goto error;
+        if (np_fidpool_foreach (cc->fidpool, _send_fid, hs) != 0)
+            return -1;
+    }
+    _hdr_init (&h, HR_END);
+    if (_send_rec (s, &h, NULL, NULL, -1) < 0)
+        goto error;
+    return 0;
+error:
+    err ("hot restart: send");
+    return -1;
+}
+
+/* A successor has connected to our hot restart socket.
+ * Hand over everything and return 0 (caller should exit), or return -1
+ * with service resumed.
+ */
+int
+diod_restart_handoff (Npsrv *srv, int lfd, struct pollfd *fds, int nfds)
+{
+    Hsend hs = { .s = -1, .nfids = 0, .nskipped = 0 };
+    Hrec h;
+    char *buf = NULL, *s1, *s2;
+    int fd, ret = -1;
+
+    if ((hs.s = accept (lfd, NULL, NULL)) < 0) {
+        err ("hot restart: accept");
+        return -1;
+    }
+    if (_check_peer (hs.s) < 0)
+        goto done;
+    _set_timeout (hs.s);
+    if (!(buf = malloc (HR_STRMAX + 2))) {
+        msg ("hot restart: out of memory");
+        goto done;
+    }
+    msg ("hot restart: quiescing for successor");
+    /* parked blocking locks would otherwise hold up the quiesce */
+    diod_lockwait_drain ();
+    if (np_srv_quiesce (srv, HR_TIMEOUT) < 0) {
+        errn (np_rerror (), "hot restart: quiesce");
+        diod_lockwait_resume ();
+        goto done;
+    }
+    if (_send_state (srv, hs.s, fds, nfds, &hs) < 0)
+        goto resume;
+    if (_recv_rec (hs.s, &h, buf, &s1, &s2, &fd) < 0 || h.type != HR_ACK) {
+        if (fd != -1)
+            close (fd);
+        msg ("hot restart: successor did not acknowledge");
+        goto resume;
+    }
+    msg ("hot restart: handed off %d fids (%d not transferable)",
+         hs.nfids, hs.nskipped);
+    ret = 0;
+resume:
+    if (ret < 0) {
+        msg ("hot restart: resuming service");
+        diod_lockwait_resume ();
+        np_srv_resume (srv);
+    }
+done:
+    if (buf)
+        free (buf);
+    close (hs.s);
+    return ret;
+}
+
+static Hconn *
+_hconn_create (Hrec *h, char *client_id, int fd)
+{
+    Hconn *hc;
+
+    if (!(hc = malloc (sizeof (*hc))))
+        msg_exit ("out of memory");
+    hc->fd = fd;
+    hc->msize = h->msize;
+    hc->authuser = h->authuser;
+    if (!(hc->client_id = strdup (client_id)))
+        msg_exit ("out of memory");
+    if (!(hc->fids = list_create ((ListDelF)_hfid_destroy)))
+        msg_exit ("out of memory");
+    return hc;
+}
+
+static Hfid *
+_hfid_create (Hrec *h, char *aname, char *path, int fd)
+{
+    Hfid *hf;
+
+    if (!(hf = malloc (sizeof (*hf))))
+        msg_exit ("out of memory");
+    hf->fid = h->fid;
+    hf->uid = h->uid;
+    hf->flags = h->flags;
+    hf->qtype = h->qtype;
+    hf->fd = fd;
+    if (!(hf->aname = strdup (aname)) || !(hf->path = strdup (path)))
+        msg_exit ("out of memory");
+    return hf;
+}
+
+static void
+_add_listen_fd (int fd, struct pollfd **fdsp, int *nfdsp)
+{
+    struct pollfd *fds;
+
+    if (!(fds = realloc (*fdsp, sizeof (*fds) * (*nfdsp + 1))))
+        msg_exit ("out of memory");
+    fds[*nfdsp].fd = fd;
+    *fdsp = fds;
+    (*nfdsp)++;
+}
+
+/* Connect to a running diod's hot restart socket and take over its
+ * listen sockets (appended to *fdsp) and connections (held until
+ * diod_restart_resume ()).  Return 1 on takeover, 0 if nobody is
+ * listening on path.  Exit on failure.
+ */
+int
+diod_restart_takeover (char *path, struct pollfd **fdsp, int *nfdsp)
+{
+    struct sockaddr_un addr;
+    Hconn *hc = NULL;
+    Hrec h;
+    char *buf, *s1, *s2;
+    int s, fd, nconns = 0, nfids = 0;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+        msg_exit ("hot restart: socket path is too long");
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    if ((s = socket (AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+        err_exit ("hot restart: socket");
+    if (connect (s, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            close (s);
+            return 0;
+        }
+        err_exit ("hot restart: connect %s", path);
+    }
+    if (_check_peer (s) < 0)
+        msg_exit ("hot restart: predecessor is not trusted");
+    _set_timeout (s);
+    if (!(buf = malloc (HR_STRMAX + 2)))
+        msg_exit ("out of memory");
+    if (!(hconns = list_create ((ListDelF)_hconn_destroy)))
+        msg_exit ("out of memory");
+
+    if (_recv_rec (s, &h, buf, &s1, &s2, &fd) < 0)
+        err_exit ("hot restart: receive");
+    if (h.type != HR_HELLO || h.magic != HR_MAGIC || h.version != HR_VERSION)
+        msg_exit ("hot restart: predecessor speaks a different protocol");
+    do {
+        if (_recv_rec (s, &h, buf, &s1, &s2, &fd) < 0)
+            err_exit ("hot restart: receive");
+        switch (h.type) {
+            case HR_LISTEN:
+                if (fd == -1)
+                    msg_exit ("hot restart: listen record without fd");
+                _add_listen_fd (fd, fdsp, nfdsp);
+                break;
+            case HR_CONN:
+                if (fd == -1)
+                    msg_exit ("hot restart: connection record without fd");
+                hc = _hconn_create (&h, s1, fd);
+                if (!list_append (hconns, hc))
+                    msg_exit ("out of memory");
+                nconns++;
+                break;
+            case HR_FID:
+                if (!hc)
+                    msg_exit ("hot restart: fid record without connection");
+                if (!list_append (hc->fids, _hfid_create (&h, s1, s2, fd)))
+                    msg_exit ("out of memory");
+                nfids++;
+                break;
+            case HR_END:
+                break;
+            default:
+                msg_exit ("hot restart: unknown record type %d", h.type);
+        }
+    } while (h.type != HR_END);
+
+    /* Once the predecessor reads this it exits, leaving us in charge.
+     */
+    _hdr_init (&h, HR_ACK);
+    if (_send_rec (s, &h, NULL, NULL, -1) < 0)
+        err_exit ("hot restart: send");
+    close (s);
+    free (buf);
+    msg ("hot restart: took over %d listen sockets, %d connections, %d fids",
+         *nfdsp, nconns, nfids);
+    return 1;
+}
+
+static void
+_restore_fid (Npconn *conn, Hfid *hf)
+{
+    Npsrv *srv = conn->srv;
+    Npuser *user;
+    Npfid *fid;
+
+    if (!(user = np_uid2user (srv, hf->uid))) {
+        errn (np_rerror (), "hot restart: %s fid %d: uid %d",
+              np_conn_get_client_id (conn), hf->fid, hf->uid);
+        return;
+    }
+    if (!(fid = np_fid_restore (conn, hf->fid, hf->qtype, user, hf->aname))) {
+        errn (np_rerror (), "hot restart: %s fid %d",
+              np_conn_get_client_id (conn), hf->fid);
+        np_user_decref (user);
+        return;
+    }
+    if (diod_fid_restore (fid, hf->path, hf->flags, hf->fd) < 0)
+        np_fid_decref (fid);
+    hf->fd = -1; /* diod_fid_restore () took it */
+}
+
+/* Recreate connections and fids taken over from the predecessor and
+ * start reading requests on them.
+ */
+void
+diod_restart_resume (Npsrv *srv)
+{
+    ListIterator itr, fitr;
+    Nptrans *trans;
+    Npconn *conn;
+    Hconn *hc;
+    Hfid *hf;
+
+    if (!hconns)
+        return;
+    if (!(itr = list_iterator_create (hconns)))
+        msg_exit ("out of memory");
+    while ((hc = list_next (itr))) {
+        if (!(trans = diod_sock_trans_create (srv, hc->fd))) {
+            errn (np_rerror (), "hot restart: transport for %s",
+                  hc->client_id);
+            continue;
+        }
+        hc->fd = -1; /* trans owns it */
+        if (!(conn = np_conn_adopt (srv, trans, hc->client_id, hc->msize,
+                                    hc->authuser))) {
+            err ("hot restart: connection for %s", hc->client_id);
+            np_trans_destroy (trans);
+            continue;
+        }
+        if (!(fitr = list_iterator_create (hc->fids)))
+            msg_exit ("out of memory");
+        while ((hf = list_next (fitr)))
+            _restore_fid (conn, hf);
+        list_iterator_destroy (fitr);
+        if ((errno = np_conn_start (conn)) != 0)
+            err ("hot restart: reader for %s", hc->client_id);
+    }
+    list_iterator_destroy (itr);
+    list_destroy (hconns);
+    hconns = NULL;
+}
+
+/* Listen for a successor on path.  Return fd, or -1 on failure.
+ */
+int
+diod_restart_listen (char *path)
+{
+    struct sockaddr_un addr;
+    mode_t omask;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        msg ("hot restart: socket path is too long");
+        return -1;
+    }
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    if ((fd = socket (AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+        err ("hot restart: socket");
+        return -1;
+    }
+    if (unlink (path) < 0 && errno != ENOENT) {
+        err ("hot restart: unlink %s", path);
+        goto error;
+    }
+    omask = umask (077);
+    if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+        umask (omask);
+        err ("hot restart: bind %s", path);
+        goto error;
+    }
+    umask (omask);
+    if (listen (fd, 1) < 0) {
+        err ("hot restart: listen %s", path);
+        goto error;
+    }
+    return fd;
+error:
+    close (fd);
+    return -1;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,10 @@
+struct pollfd;
+
+int  diod_restart_listen (char *path);
+int  diod_restart_handoff (Npsrv *srv, int lfd, struct pollfd *fds, int nfds);
+int  diod_restart_takeover (char *path, struct pollfd **fdsp, int *nfdsp);
+void diod_restart_resume (Npsrv *srv);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
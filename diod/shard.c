@@ -0,0 +1,764 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* shard.c - spread connections across several diod processes */
+
+/* With shards = N, diod forks N server processes once its listen
+ * sockets are set up.  The parent becomes a lightweight acceptor: it
+ * accepts each new connection and passes the socket (SCM_RIGHTS) to the
+ * least loaded shard, which serves it like any other connection.  Each
+ * shard has its own srv, usercache, thread pools and locks.  On a NUMA
+ * machine, shards are pinned round-robin to the CPUs of one node, so
+ * their memory is allocated node-local.
+ *
+ * Shards publish their tpools and connections ctl text in a shared
+ * memory slot.  A shard's ctl files merge its own live view with what
+ * its siblings published, so dtop sees one server whichever shard it
+ * lands on.  Reading a merged ctl file pokes the siblings (SIGUSR2) to
+ * republish; they also republish every second, which keeps the
+ * connection counts the acceptor balances on current.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "list.h"
+
+#include "diod_log.h"
+#include "diod_sock.h"
+
+#include "shard.h"
+
+#define SHARD_SLOTSIZE  (256*1024)  /* ctl text published per shard */
+#define SHARD_PUBLISH   1           /* seconds between publications */
+#define SHARD_POKEWAIT  100         /* msec to wait for fresh publications */
+#define SHARD_NODEDIR   "/sys/devices/system/node"
+
+/* One per shard in shared memory.  The shard is the only writer;
+ * seq is odd while an update is in progress (a seqlock).
+ */
+typedef struct {
+    volatile uint32_t   seq;
+    volatile pid_t      pid;        /* 0 if the shard is not running */
+    int                 node;       /* NUMA node, -1 if not pinned */
+    int                 nconns;
+    uint64_t            received;   /* connections taken from acceptor */
+    int                 tlen;       /* tpools text at buf[0] */
+    int                 clen;       /* connections text at buf[tlen] */
+    char                buf[SHARD_SLOTSIZE];
+} Shslot;
+
+/* A consistent copy of a slot.
+ */
+typedef struct {
+    int                 node;
+    int                 nconns;
+    uint64_t            received;
+    int                 tlen;
+    int                 clen;
+    char               *buf;        /* NULL to skip the text */
+} Shview;
+
+typedef struct {
+    int                 nshards;
+    int                 index;      /* our shard, -1 in the acceptor */
+    Shslot             *slots;
+    int                *chan;       /* acceptor: socket to each shard */
+    uint64_t           *sent;       /* acceptor: connections handed out */
+    Npsrv              *srv;        /* shard */
+    pthread_mutex_t     lock;       /* shard: protects received */
+    uint64_t            received;
+    SynGetF             tpools_getf;
+    void               *tpools_arg;
+    SynGetF             conns_getf;
+    void               *conns_arg;
+} Shstate;
+
+static Shstate sh = { .index = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Parse a kernel list like "0-3,8,10-11" into set.
+ */
+static int
+_parse_list (char *s, cpu_set_t *set)
+{
+    unsigned long a, b;
+    char *end;
+
+    CPU_ZERO (set);
+    while (*s && *s != '\n') {
+        a = b = strtoul (s, &end, 10);
+        if (end == s)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            b = strtoul (s, &end, 10);
+            if (end == s || b < a)
+                return -1;
+        }
+        for (; a <= b && a < CPU_SETSIZE; a++)
+            CPU_SET (a, set);
+        s = end;
+        if (*s == ',')
+            s++;
+    }
+    return 0;
+}
+
+static int
+_read_list (char *path, cpu_set_t *set)
+{
+    char buf[4096];
+    FILE *f;
+    int rc = -1;
+
+    if (!(f = fopen (path, "r")))
+        return -1;
+    if (fgets (buf, sizeof (buf), f))
+        rc = _parse_list (buf, set);
+    fclose (f);
+    return rc;
+}
+
+static int
+_node_cpus (int node, cpu_set_t *set)
+{
+    char path[64];
+
+    snprintf (path, sizeof (path), SHARD_NODEDIR "/node%d/cpulist", node);
+    return _read_list (path, set);
+}
+
+/* Return the number of NUMA nodes that have CPUs, and their ids in
+ * *nodesp (caller frees).
+ */
+static int
+_numa_nodes (int **nodesp)
+{
+    cpu_set_t online, cpus;
+    int i, n = 0, *nodes;
+
+    *nodesp = NULL;
+    if (_read_list (SHARD_NODEDIR "/online", &online) < 0)
+        return 0;
+    if (!(nodes = malloc (sizeof (int) * CPU_COUNT (&online))))
+        msg_exit ("out of memory");
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET (i, &online) && _node_cpus (i, &cpus) == 0
+                                   && CPU_COUNT (&cpus) > 0)
+            nodes[n++] = i;
+    }
+    *nodesp = nodes;
+    return n;
+}
+
+/* Copy slot i.  Fails if the shard is not running or is mid-update
+ * for too long.
+ */
+static int
+_slot_read (int i, Shview *v)
+{
+    Shslot *slot = &sh.slots[i];
+    uint32_t seq;
+    int tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        if (slot->pid == 0)
+            return -1;
+        seq = slot->seq;
+        __sync_synchronize ();
+        if (!(seq & 1)) {
+            v->node = slot->node;
+            v->nconns = slot->nconns;
+            v->received = slot->received;
+            v->tlen = slot->tlen;
+            v->clen = slot->clen;
+            if (v->tlen < 0 || v->clen < 0
+                            || v->tlen + v->clen > SHARD_SLOTSIZE)
+                v->tlen = v->clen = 0;
+            if (v->buf)
+                memcpy (v->buf, slot->buf, v->tlen + v->clen);
+            __sync_synchronize ();
+            if (slot->seq == seq)
+                return 0;
+        }
+        usleep (100);
+    }
+    return -1;
+}
+
+/* Length of the longest run of whole lines of s that fits in max.
+ */
+static int
+_fit (char *s, int max)
+{
+    int len = s ? strlen (s) : 0;
+
+    if (len > max) {
+        len = max;
+        while (len > 0 && s[len - 1] != '\n')
+            len--;
+    }
+    return len;
+}
+
+static void
+_publish (void)
+{
+    Shslot *slot = &sh.slots[sh.index];
+    char *t, *c;
+    uint64_t received;
+    int nconns;
+
+    np_uerror (0);
+    t = sh.tpools_getf (sh.tpools_arg);
+    np_uerror (0);
+    c = sh.conns_getf (sh.conns_arg);
+
+    /* read received before nconns so a connection in between is
+     * counted twice rather than not at all */
+    pthread_mutex_lock (&sh.lock);
+    received = sh.received;
+    pthread_mutex_unlock (&sh.lock);
+    pthread_mutex_lock (&sh.srv->lock);
+    nconns = sh.srv->conncount;
+    pthread_mutex_unlock (&sh.srv->lock);
+
+    slot->seq++;
+    __sync_synchronize ();
+    slot->nconns = nconns;
+    slot->received = received;
+    slot->tlen = _fit (t, SHARD_SLOTSIZE);
+    slot->clen = _fit (c, SHARD_SLOTSIZE - slot->tlen);
+    if (t)
+        memcpy (slot->buf, t, slot->tlen);
+    if (c)
+        memcpy (slot->buf + slot->tlen, c, slot->clen);
+    __sync_synchronize ();
+    slot->seq++;
+
+    if (t)
+        free (t);
+    if (c)
+        free (c);
+}
+
+static void *
+_publisher (void *arg)
+{
+    struct timespec ts = { .tv_sec = SHARD_PUBLISH, .tv_nsec = 0 };
+    sigset_t sigs;
+
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGUSR2);
+    for (;;) {
+        _publish ();
+        (void)sigtimedwait (&sigs, NULL, &ts);
+    }
+    return NULL;
+}
+
+/* Ask the other shards to publish and wait (briefly) until they have.
+ */
+static void
+_poke_siblings (void)
+{
+    uint32_t *seq;
+    int i, waiting, msec;
+
+    if (!(seq = malloc (sizeof (*seq) * sh.nshards))) {
+        msg ("out of memory");
+        return;
+    }
+    for (i = 0; i < sh.nshards; i++) {
+        seq[i] = sh.slots[i].seq;
+        if (i != sh.index && sh.slots[i].pid != 0)
+            (void)kill (sh.slots[i].pid, SIGUSR2);
+    }
+    for (msec = 0; msec < SHARD_POKEWAIT; msec++) {
+        for (waiting = 0, i = 0; i < sh.nshards; i++) {
+            if (i == sh.index || sh.slots[i].pid == 0)
+                continue;
+            if (sh.slots[i].seq == seq[i] || (sh.slots[i].seq & 1))
+                waiting++;
+        }
+        if (!waiting)
+            break;
+        usleep (1000);
+    }
+    free (seq);
+}
+
+static void
+_stats_destroy (Npstats *st)
+{
+    if (st->name)
+        free (st->name);
+    free (st);
+}
+
+static int
+_stats_match (Npstats *st, char *name)
+{
+    return !strcmp (st->name, name);
+}
+
+/* Decode tpools text and add it into l, summing pools with the same name.
+ */
+static void
+_merge_tpools (List l, char *s, int len)
+{
+    Npstats *st, *tot;
+    char *p, *end = s + len;
+    int i;
+
+    for (; s < end; s = p) {
+        if (!(p = memchr (s, '\n', end - s)))
+            p = end;
+        *p++ = '\0';
+        if (!(st = malloc (sizeof (*st))))
+            msg_exit ("out of memory");
+        memset (st, 0, sizeof (*st));
+        if (np_decode_tpools_str (s, st) < 0) {
+            free (st);
+            continue;
+        }
+        if (!(tot = list_find_first (l, (ListFindF)_stats_match, st->name))) {
+            if (!list_append (l, st))
+                msg_exit ("out of memory");
+            continue;
+        }
+        tot->numfids += st->numfids;
+        tot->numreqs += st->numreqs;
+        tot->rbytes += st->rbytes;
+        tot->wbytes += st->wbytes;
+        for (i = 0; i < sizeof (st->nreqs) / sizeof (st->nreqs[0]); i++)
+            tot->nreqs[i] += st->nreqs[i];
+        _stats_destroy (st);
+    }
+}
+
+static char *
+_get_tpools (void *a)
+{
+    ListIterator itr = NULL;
+    List l = NULL;
+    Shview v;
+    Npstats *st;
+    char *s = NULL, *local = NULL;
+    int i, len = 0;
+
+    if (!(v.buf = malloc (SHARD_SLOTSIZE + 1)))
+        goto nomem;
+    if (!(l = list_create ((ListDelF)_stats_destroy)))
+        goto nomem;
+    np_uerror (0);
+    if (!(local = sh.tpools_getf (sh.tpools_arg)) && np_rerror ())
+        goto error;
+    if (local)
+        _merge_tpools (l, local, strlen (local));
+    _poke_siblings ();
+    for (i = 0; i < sh.nshards; i++) {
+        if (i != sh.index && _slot_read (i, &v) == 0)
+            _merge_tpools (l, v.buf, v.tlen);
+    }
+    if (!(itr = list_iterator_create (l)))
+        goto nomem;
+    while ((st = list_next (itr))) {
+        if (np_encode_tpools_str (&s, &len, st) < 0)
+            goto nomem;
+    }
+    list_iterator_destroy (itr);
+    list_destroy (l);
+    free (local);
+    free (v.buf);
+    return s;
+nomem:
+    np_uerror (ENOMEM);
+error:
+    if (itr)
+        list_iterator_destroy (itr);
+    if (l)
+        list_destroy (l);
+    if (local)
+        free (local);
+    if (v.buf)
+        free (v.buf);
+    if (s)
+        free (s);
+    return NULL;
+}
+
+static char *
+_get_connections (void *a)
+{
+    Shview v;
+    char *s = NULL, *ns;
+    int i, len;
+
+    if (!(v.buf = malloc (SHARD_SLOTSIZE)))
+        goto nomem;
+    np_uerror (0);
+    if (!(s = sh.conns_getf (sh.conns_arg)) && np_rerror ())
+        goto error;
+    len = s ? strlen (s) : 0;
+    _poke_siblings ();
+    for (i = 0; i < sh.nshards; i++) {
+        if (i == sh.index || _slot_read (i, &v) < 0 || v.clen == 0)
+            continue;
+        if (!(ns = realloc (s, len + v.clen + 1)))
+            goto nomem;
+        s = ns;
+        memcpy (s + len, v.buf + v.tlen, v.clen);
+        len += v.clen;
+        s[len] = '\0';
+    }
+    free (v.buf);
+    return s;
+nomem:
+    np_uerror (ENOMEM);
+error:
+    if (v.buf)
+        free (v.buf);
+    if (s)
+        free (s);
+    return NULL;
+}
+
+static char *
+_get_shards (void *a)
+{
+    Shview v = { .buf = NULL };
+    char *s = NULL;
+    int i, len = 0;
+
+    _poke_siblings ();
+    for (i = 0; i < sh.nshards; i++) {
+        if (_slot_read (i, &v) < 0)
+            continue;
+        if (i == sh.index) {
+            pthread_mutex_lock (&sh.srv->lock);
+            v.nconns = sh.srv->conncount;
+            pthread_mutex_unlock (&sh.srv->lock);
+        }
+        if (aspf (&s, &len, "%d %d %d %d\n", i, sh.slots[i].pid,
+                  v.node, v.nconns) < 0) {
+            np_uerror (ENOMEM);
+            if (s)
+                free (s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+/* Runs in a new shard before it has any threads.
+ */
+static void
+_shard_init (int index, int node, pid_t ppid)
+{
+    sigset_t sigs;
+    cpu_set_t cpus;
+
+    sh.index = index;
+    if (prctl (PR_SET_PDEATHSIG, SIGTERM) < 0)
+        err_exit ("prctl");
+    if (getppid () != ppid)
+        msg_exit ("shard %d: acceptor exited", index);
+
+    /* SIGUSR2 is taken with sigtimedwait () by the publisher */
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGUSR2);
+    if (sigprocmask (SIG_BLOCK, &sigs, NULL) < 0)
+        err_exit ("sigprocmask");
+
+    if (node != -1) {
+        if (_node_cpus (node, &cpus) < 0
+                || sched_setaffinity (0, sizeof (cpus), &cpus) < 0) {
+            err ("shard %d: could not pin to node %d", index, node);
+            node = -1;
+        }
+    }
+    sh.slots[index].node = node;
+    msg ("shard %d: pid %d node %d", index, getpid (), node);
+}
+
+int
+diod_shard_spawn (int nshards, struct pollfd *fds, int nfds, int *cfdp)
+{
+    int i, j, nnodes, *nodes, sv[2];
+    pid_t pid, ppid = getpid ();
+
+    sh.nshards = nshards;
+    sh.slots = mmap (NULL, sizeof (Shslot) * nshards, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sh.slots == MAP_FAILED)
+        err_exit ("mmap");
+    if (!(sh.chan = malloc (sizeof (int) * nshards)))
+        msg_exit ("out of memory");
+    if (!(sh.sent = calloc (nshards, sizeof (uint64_t))))
+        msg_exit ("out of memory");
+    nnodes = _numa_nodes (&nodes);
+    for (i = 0; i < nshards; i++) {
+        sh.slots[i].node = -1;
+        if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+            err_exit ("socketpair");
+        switch ((pid = fork ())) {
+            case -1:
+                err_exit ("fork");
+            case 0:
+                close (sv[0]);
+                for (j = 0; j < i; j++)
+                    close (sh.chan[j]);
+                for (j = 0; j < nfds; j++)
+                    close (fds[j].fd);
+                _shard_init (i, nnodes > 1 ? nodes[i % nnodes] : -1, ppid);
+                if (nodes)
+                    free (nodes);
+                *cfdp = sv[1];
+                return i;
+            default:
+                close (sv[1]);
+                sh.chan[i] = sv[0];
+                sh.slots[i].pid = pid;
+                break;
+        }
+    }
+    if (nodes)
+        free (nodes);
+    return -1;
+}
+
+int
+diod_shard_register (Npsrv *srv)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    Npfile *file;
+    int err;
+
+    sh.srv = srv;
+    if (!(file = np_ctl_lookup (srv->ctlroot, "tpools")))
+        return -1;
+    sh.tpools_getf = file->getf;
+    sh.tpools_arg = file->getf_arg;
+    file->getf = _get_tpools;
+    file->getf_arg = NULL;
+    if (!(file = np_ctl_lookup (srv->ctlroot, "connections")))
+        return -1;
+    sh.conns_getf = file->getf;
+    sh.conns_arg = file->getf_arg;
+    file->getf = _get_connections;
+    file->getf_arg = NULL;
+    if (!np_ctl_addfile (srv->ctlroot, "shards", _get_shards, NULL))
+        return -1;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create (&t, &attr, _publisher, NULL);
+    pthread_attr_destroy (&attr);
+    if (err) {
+        np_uerror (err);
+        return -1;
+    }
+    return 0;
+}
+
+/* Pick the running shard with the fewest connections, counting ones
+ * sent that it has not yet reported.
+ */
+static int
+_pick_shard (void)
+{
+    Shview v = { .buf = NULL };
+    int64_t load, best_load = 0;
+    int i, best = -1;
+
+    for (i = 0; i < sh.nshards; i++) {
+        if (sh.chan[i] == -1 || _slot_read (i, &v) < 0)
+            continue;
+        load = v.nconns + (int64_t)(sh.sent[i] - v.received);
+        if (best == -1 || load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static void
+_shard_lost (int i)
+{
+    int status;
+
+    msg ("shard %d (pid %d) is gone", i, sh.slots[i].pid);
+    if (waitpid (sh.slots[i].pid, &status, WNOHANG) > 0)
+        sh.slots[i].pid = 0;
+    close (sh.chan[i]);
+    sh.chan[i] = -1;
+}
+
+static int
+_send_fd (int s, int fd)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE (sizeof (int))];
+    char c = 0;
+    int n;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    memset (cbuf, 0, sizeof (cbuf));
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof (cbuf);
+    cmsg = CMSG_FIRSTHDR (&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    do {
+        n = sendmsg (s, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n < 0 ? -1 : 0;
+}
+
+void
+diod_shard_accept_one (int lfd)
+{
+    int i, fd;
+
+    fd = accept (lfd, NULL, NULL);
+    if (fd < 0) {
+        if (!(errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EPROTO
+                                                            || errno == EINTR))
+            err ("accept");
+        return;
+    }
+    while ((i = _pick_shard ()) != -1) {
+        if (_send_fd (sh.chan[i], fd) == 0) {
+            sh.sent[i]++;
+            break;
+        }
+        _shard_lost (i);
+    }
+    close (fd);
+    if (i == -1)
+        msg_exit ("no shards left to serve connections");
+}
+
+int
+diod_shard_recv (Npsrv *srv, int cfd)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE (sizeof (int))];
+    char c;
+    int n, fd = -1;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof (cbuf);
+    n = recvmsg (cfd, &mh, 0);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        err ("recvmsg");
+        return -1;
+    }
+    if (n == 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR (&mh); cmsg; cmsg = CMSG_NXTHDR (&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+    }
+    if (fd == -1) {
+        msg ("shard %d: message from acceptor without a socket", sh.index);
+        return 0;
+    }
+    diod_sock_startpeer (srv, fd);
+    pthread_mutex_lock (&sh.lock);
+    sh.received++;
+    pthread_mutex_unlock (&sh.lock);
+    return 0;
+}
+
+void
+diod_shard_kill (int sig)
+{
+    int i;
+
+    for (i = 0; i < sh.nshards; i++) {
+        if (sh.slots[i].pid != 0)
+            (void)kill (sh.slots[i].pid, sig);
+    }
+}
+
+void
+diod_shard_wait (void)
+{
+    int i, status;
+
+    for (i = 0; i < sh.nshards; i++) {
+        if (sh.slots[i].pid == 0)
+            continue;
+        if (waitpid (sh.slots[i].pid, &status, 0) < 0)
+            err ("waitpid shard %d", i);
+        else if (WIFSIGNALED (status))
+            msg ("shard %d killed by signal %d", i, WTERMSIG (status));
+        else if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
+            msg ("shard %d exited with rc=%d", i, WEXITSTATUS (status));
+        sh.slots[i].pid = 0;
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,12 @@
+struct pollfd;
+
+int  diod_shard_spawn (int nshards, struct pollfd *fds, int nfds, int *cfdp);
+int  diod_shard_register (Npsrv *srv);
+void diod_shard_accept_one (int lfd);
+int  diod_shard_recv (Npsrv *srv, int cfd);
+void diod_shard_kill (int sig);
+void diod_shard_wait (void);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
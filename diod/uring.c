@@ -0,0 +1,442 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* uring.c - hand file reads and writes to the kernel with io_uring */
+
+/* A Tread or Twrite on an open file is first tried with RWF_NOWAIT,
+ * which succeeds when the page cache can satisfy it without blocking;
+ * the worker answers it at once, as before.  When it would block, it is
+ * submitted to an io_uring instead, and diod_read () or diod_write ()
+ * returns without a reply, leaving the worker free for other requests.
+ * A reaper thread per ring waits for completions and answers each
+ * request through its callback.  The number of reads and writes waiting
+ * on the backend is then bounded by the rings, not by the worker threads,
+ * and cache hits do not pay for the trip through the reaper.
+ *
+ * Workers share a few rings, so that submitting to one does not wait on
+ * the others.  The kernel does the I/O with the credentials (fsuid) of
+ * the thread that submitted it.
+ *
+ * The rings are driven with the raw system calls.  If the kernel lacks
+ * io_uring, or it is disabled, or a ring's completion queue is full, or
+ * the file system cannot tell whether a buffered write would block (it
+ * then punts every such write to a kernel thread anyway), the worker
+ * does the I/O itself as before.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "uring.h"
+
+#define UR_MAXRINGS     4
+
+typedef struct {
+    Npreq               *req;
+    Npfcall             *rc;
+    UringFun             done;
+} Op;
+
+typedef struct {
+    pthread_mutex_t      lock;      /* serializes submission */
+    int                  fd;
+    unsigned            *sqhead, *sqtail, *sqarray;
+    unsigned             sqmask, sqentries;
+    struct io_uring_sqe *sqes;
+    unsigned            *cqhead, *cqtail;
+    unsigned             cqmask, cqentries;
+    struct io_uring_cqe *cqes;
+    unsigned             inflight;
+    u64                  submitted;
+    u64                  completed;
+    unsigned             maxinflight;
+} Ring;
+
+static struct {
+    Ring                 r[UR_MAXRINGS];
+    int                  nr;
+    int                  entries;
+    unsigned             next;      /* ring to try first */
+    u64                  nowait;    /* done at once from the page cache */
+    u64                  blocking;  /* done by the worker, maybe blocking */
+} ur;
+
+static int
+_enter (int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall (__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/* Return 1 if the kernel supports the operations we submit.
+ */
+static int
+_probe (int fd)
+{
+    struct io_uring_probe *p;
+    size_t len = sizeof (*p) + 256 * sizeof (struct io_uring_probe_op);
+    int ok;
+
+    if (!(p = calloc (1, len)))
+        return 0;
+    ok = (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p,
+                   256) == 0
+            && p->ops_len > IORING_OP_WRITE
+            && (p->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+            && (p->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED));
+    free (p);
+    return ok;
+}
+
+/* Create ring r with entries submission queue entries and map it.
+ * Return 0 on success, or -1 with errno set.
+ */
+static int
+_setup (Ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t size, cqsize;
+    void *q;
+
+    memset (&p, 0, sizeof (p));
+    if ((r->fd = syscall (__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !_probe (r->fd)) {
+        errno = ENOSYS;
+        goto error;
+    }
+    size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (cqsize > size)
+        size = cqsize;
+    q = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              r->fd, IORING_OFF_SQ_RING);
+    if (q == MAP_FAILED)
+        goto error;
+    r->sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap (q, size);
+        goto error;
+    }
+    r->sqhead = q + p.sq_off.head;
+    r->sqtail = q + p.sq_off.tail;
+    r->sqarray = q + p.sq_off.array;
+    r->sqmask = *(unsigned *)(q + p.sq_off.ring_mask);
+    r->sqentries = p.sq_entries;
+    r->cqhead = q + p.cq_off.head;
+    r->cqtail = q + p.cq_off.tail;
+    r->cqes = q + p.cq_off.cqes;
+    r->cqmask = *(unsigned *)(q + p.cq_off.ring_mask);
+    r->cqentries = p.cq_entries;
+    pthread_mutex_init (&r->lock, NULL);
+    r->inflight = r->maxinflight = 0;
+    r->submitted = r->completed = 0;
+    return 0;
+error:
+    (void)close (r->fd);
+    r->fd = -1;
+    return -1;
+}
+
+/* Answer op's request with what its callback makes of result res.
+ */
+static void
+_complete (Op *op, int res)
+{
+    Npfcall *rc;
+    int err;
+
+    np_uerror (0);
+    if ((rc = op->done (op->req, op->rc, res)))
+        np_req_respond (op->req, rc);
+    else {
+        err = np_rerror ();
+        np_req_respond_error (op->req, err ? err : EIO);
+    }
+    free (op);
+}
+
+static void *
+_reaper (void *arg)
+{
+    Ring *r = arg;
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    Op *op;
+    int res;
+
+    for (;;) {
+        if (_enter (r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+                                                    && errno != EINTR) {
+            err ("uring: io_uring_enter");
+            usleep (1000);
+            continue;
+        }
+        head = *r->cqhead;
+        tail = __atomic_load_n (r->cqtail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &r->cqes[head & r->cqmask];
+            op = (Op *)(uintptr_t)cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n (r->cqhead, ++head, __ATOMIC_RELEASE);
+            /* count it before the client can see the reply */
+            pthread_mutex_lock (&r->lock);
+            r->inflight--;
+            r->completed++;
+            pthread_mutex_unlock (&r->lock);
+            _complete (op, res);
+        }
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* Lock a ring that no other worker is submitting to, if there is one.
+ */
+static Ring *
+_getring (void)
+{
+    unsigned i, first = __atomic_fetch_add (&ur.next, 1, __ATOMIC_RELAXED);
+    Ring *r;
+
+    for (i = 0; i < ur.nr; i++) {
+        r = &ur.r[(first + i) % ur.nr];
+        if (pthread_mutex_trylock (&r->lock) == 0)
+            return r;
+    }
+    r = &ur.r[first % ur.nr];
+    pthread_mutex_lock (&r->lock);
+    return r;
+}
+
+/* Submit one read or write of len bytes at off in buf.
+ * Return 0 if submitted, or -1 if the caller must do the I/O itself.
+ */
+static int
+_submit (u8 opcode, int fd, void *buf, u32 len, u64 off,
+         Npreq *req, Npfcall *rc, UringFun done)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    Ring *r;
+    Op *op;
+    int n;
+
+    if (ur.nr == 0 || !(op = malloc (sizeof (*op))))
+        return -1;
+    op->req = req;
+    op->rc = rc;
+    op->done = done;
+
+    r = _getring ();
+    tail = *r->sqtail;
+    if (r->inflight == r->cqentries
+            || tail - __atomic_load_n (r->sqhead, __ATOMIC_ACQUIRE)
+                                                        == r->sqentries)
+        goto fallback;
+    sqe = &r->sqes[tail & r->sqmask];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)op;
+    r->sqarray[tail & r->sqmask] = tail & r->sqmask;
+    __atomic_store_n (r->sqtail, tail + 1, __ATOMIC_RELEASE);
+    r->inflight++;
+    while ((n = _enter (r->fd, 1, 0, 0)) < 0 && errno == EINTR)
+        ;
+    if (n < 1 && __atomic_load_n (r->sqhead, __ATOMIC_ACQUIRE) == tail) {
+        /* the kernel did not take it, so take it back */
+        __atomic_store_n (r->sqtail, tail, __ATOMIC_RELEASE);
+        r->inflight--;
+        goto fallback;
+    }
+    r->submitted++;
+    if (r->inflight > r->maxinflight)
+        r->maxinflight = r->inflight;
+    pthread_mutex_unlock (&r->lock);
+    return 0;
+fallback:
+    pthread_mutex_unlock (&r->lock);
+    free (op);
+    return -1;
+}
+
+static void
+_count (u64 *counter)
+{
+    __atomic_fetch_add (counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Read into Rread rc, up to its count, from fd at offset, like pread (2).
+ * If that would block, submit it to a ring if possible and return
+ * URING_QUEUED; when it completes, done makes the reply to req.
+ */
+ssize_t
+diod_uring_pread (int fd, Npfcall *rc, u64 offset, Npreq *req,
+                  UringFun done)
+{
+    struct iovec iov = { rc->u.rread.data, rc->u.rread.count };
+    ssize_t n, m;
+
+    if (ur.nr == 0)
+        return pread (fd, iov.iov_base, iov.iov_len, offset);
+    if ((n = preadv2 (fd, &iov, 1, offset, RWF_NOWAIT)) >= 0) {
+        _count (&ur.nowait);
+        /* only part was cached, or the file ends early */
+        if (n > 0 && n < iov.iov_len
+                  && (m = pread (fd, iov.iov_base + n, iov.iov_len - n,
+                                 offset + n)) > 0)
+            n += m;
+        return n;
+    }
+    if (errno != EAGAIN && errno != EOPNOTSUPP)
+        return -1;
+    if (_submit (IORING_OP_READ, fd, iov.iov_base, iov.iov_len, offset,
+                 req, rc, done) == 0)
+        return URING_QUEUED;
+    _count (&ur.blocking);
+    return pread (fd, iov.iov_base, iov.iov_len, offset);
+}
+
+/* Write count bytes of data (which req holds) to fd at offset, like
+ * pwrite (2).  If that would block, submit it to a ring if possible and
+ * return URING_QUEUED; when it completes, done makes the reply to req.
+ */
+ssize_t
+diod_uring_pwrite (int fd, u8 *data, u32 count, u64 offset, Npreq *req,
+                   UringFun done)
+{
+    struct iovec iov = { data, count };
+    ssize_t n, m;
+
+    if (ur.nr == 0)
+        return pwrite (fd, data, count, offset);
+    if ((n = pwritev2 (fd, &iov, 1, offset, RWF_NOWAIT)) >= 0) {
+        _count (&ur.nowait);
+        if (n < count && (m = pwrite (fd, data + n, count - n,
+                                      offset + n)) > 0)
+            n += m;
+        return n;
+    }
+    if (errno != EAGAIN || _submit (IORING_OP_WRITE, fd, data, count, offset,
+                                    req, NULL, done) < 0) {
+        _count (&ur.blocking);
+        return pwrite (fd, data, count, offset);
+    }
+    return URING_QUEUED;
+}
+
+static char *
+_get_uring (void *a)
+{
+    u64 submitted = 0, completed = 0;
+    unsigned inflight = 0, maxinflight = 0;
+    char *s = NULL;
+    int i, len = 0;
+
+    for (i = 0; i < ur.nr; i++) {
+        pthread_mutex_lock (&ur.r[i].lock);
+        submitted += ur.r[i].submitted;
+        completed += ur.r[i].completed;
+        inflight += ur.r[i].inflight;
+        if (ur.r[i].maxinflight > maxinflight)
+            maxinflight = ur.r[i].maxinflight;
+        pthread_mutex_unlock (&ur.r[i].lock);
+    }
+    if (aspf (&s, &len, "%d %d %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64
+              " %u %u\n", ur.nr, ur.nr > 0 ? ur.entries : 0,
+              __atomic_load_n (&ur.nowait, __ATOMIC_RELAXED),
+              __atomic_load_n (&ur.blocking, __ATOMIC_RELAXED),
+              submitted, completed, inflight, maxinflight) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    return s;
+}
+
+/* Set up rings of entries entries (none if 0), one per CPU up to
+ * UR_MAXRINGS, and start their reapers.  Without io_uring, log it and
+ * carry on without.  Add the "uring" ctl file:
+ *   rings entries nowait blocking submitted completed inflight max-inflight
+ */
+int
+diod_uring_init (Npsrv *srv, int entries)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    int i, n;
+
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n > UR_MAXRINGS)
+        n = UR_MAXRINGS;
+    if (entries <= 0)
+        n = 0;
+    ur.entries = entries;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < n; i++) {
+        if (_setup (&ur.r[i], entries) < 0) {
+            if (i == 0)
+                err ("uring: io_uring unavailable, using worker threads");
+            break;
+        }
+        if ((errno = pthread_create (&t, &attr, _reaper, &ur.r[i]))) {
+            err ("uring: pthread_create");
+            (void)close (ur.r[i].fd);
+            break;
+        }
+        ur.nr++;
+    }
+    pthread_attr_destroy (&attr);
+    if (!np_ctl_addfile (srv->ctlroot, "uring", _get_uring, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
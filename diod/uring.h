@@ -0,0 +1,19 @@
+/* Make the reply to req from the result of an operation submitted for it
+ * (a byte count, or a negative errno value), given the reply buffer rc
+ * passed in, if any.  Return NULL with np_uerror () set on error.
+ * Called from the reaper thread, or for a request merged into another's
+ * system call (coalesce.c), from that one's worker.
+ */
+typedef Npfcall *(*UringFun)(Npreq *req, Npfcall *rc, int res);
+
+#define URING_QUEUED    (-2)
+
+int      diod_uring_init (Npsrv *srv, int entries);
+ssize_t  diod_uring_pread (int fd, Npfcall *rc, u64 offset, Npreq *req,
+                           UringFun done);
+ssize_t  diod_uring_pwrite (int fd, u8 *data, u32 count, u64 offset,
+                            Npreq *req, UringFun done);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,391 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* writebehind.c - gather small sequential writes into large ones */
+
+/* Fids on exports with the async option get a write-behind buffer.  A
+ * Twrite that continues where the buffered data ends is copied into it
+ * and answered at once; the buffer is written out with one pwrite when
+ * it reaches a WB_BUFSIZE boundary of the file, so that the backend sees
+ * large aligned writes.  A write somewhere else, or on another
+ * descriptor, writes out what is buffered first.  Writes of WB_BUFSIZE
+ * or more bypass the buffer.
+ *
+ * A buffer's memory is only allocated while it holds data, and the total
+ * is bounded by the configured limit.  A write that would exceed it goes
+ * straight to the file and wakes the flusher to empty the oldest buffer.
+ * The flusher also writes out any buffer that has been dirty for longer
+ * than WB_TIMEOUT seconds.
+ *
+ * An error writing out a buffer on behalf of a Twrite that has already
+ * been answered is remembered, and returned by the next write or flush.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "writebehind.h"
+
+#define WB_BUFSIZE      (4*1024*1024)
+#define WB_TIMEOUT      1       /* sec a buffer may hold data */
+
+struct Writebehind {
+    pthread_mutex_t     lock;
+    int                 fd;
+    u8                 *buf;    /* NULL when empty */
+    u64                 off;    /* file offset of buf[0] */
+    size_t              len;
+    int                 err;    /* deferred errno */
+    time_t              dirtied;
+    Writebehind        *next, *prev;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_once_t      once;
+    int                 running;    /* flusher thread is up */
+    int                 urgent;     /* flusher should free memory now */
+    Writebehind        *list;       /* every buffer, dirty or not */
+    size_t              limit;
+    size_t              used;
+    u64                 writes;     /* Twrites absorbed by a buffer */
+    u64                 flushes;    /* pwrites of buffered data */
+    u64                 pressure;   /* writes passed through at the limit */
+    u64                 timeouts;   /* buffers written out by age */
+} wb = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+/* Write out the contents of w.  Call with w->lock held.
+ * Return 0 on success, or -1 with errno set (the data is discarded).
+ */
+static int
+_flush (Writebehind *w)
+{
+    size_t done = 0;
+    ssize_t n;
+    int rc = 0;
+
+    if (!w->buf)
+        return 0;
+    while (done < w->len) {
+        if ((n = pwrite (w->fd, w->buf + done, w->len - done,
+                         w->off + done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+        done += n;
+    }
+    free (w->buf);
+    w->buf = NULL;
+    w->len = 0;
+    pthread_mutex_lock (&wb.lock);
+    wb.used -= WB_BUFSIZE;
+    wb.flushes++;
+    pthread_mutex_unlock (&wb.lock);
+    return rc;
+}
+
+/* Find the dirty buffer to write out next, if any, and return it locked.
+ * Call with wb.lock held.
+ */
+static Writebehind *
+_next_victim (time_t now)
+{
+    Writebehind *w, *oldest = NULL;
+
+    for (w = wb.list; w != NULL; w = w->next) {
+        if (w->buf && (!oldest || w->dirtied < oldest->dirtied))
+            oldest = w;
+    }
+    if (!oldest)
+        return NULL;
+    if (!wb.urgent && oldest->dirtied + WB_TIMEOUT > now)
+        return NULL;
+    if (pthread_mutex_trylock (&oldest->lock) != 0)
+        return NULL;            /* busy, so not idle: try next tick */
+    if (wb.urgent)
+        wb.urgent = 0;
+    else
+        wb.timeouts++;
+    return oldest;
+}
+
+static void *
+_flusher (void *arg)
+{
+    struct timespec ts;
+    Writebehind *w;
+
+    pthread_mutex_lock (&wb.lock);
+    for (;;) {
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100*1000*1000;
+        if (ts.tv_nsec >= 1000*1000*1000) {
+            ts.tv_nsec -= 1000*1000*1000;
+            ts.tv_sec++;
+        }
+        if (!wb.urgent)
+            (void)pthread_cond_timedwait (&wb.cond, &wb.lock, &ts);
+        while ((w = _next_victim (time (NULL)))) {
+            pthread_mutex_unlock (&wb.lock);
+            if (_flush (w) < 0)
+                w->err = errno;
+            pthread_mutex_unlock (&w->lock);
+            pthread_mutex_lock (&wb.lock);
+        }
+        wb.urgent = 0;
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+static void
+_flusher_init (void)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if ((errno = pthread_create (&t, &attr, _flusher, NULL)))
+        err ("writebehind: pthread_create (writing through)");
+    else
+        wb.running = 1;
+    pthread_attr_destroy (&attr);
+}
+
+Writebehind *
+diod_writebehind_create (void)
+{
+    Writebehind *w;
+
+    pthread_once (&wb.once, _flusher_init);
+    if (!(w = malloc (sizeof (*w))))
+        return NULL;
+    pthread_mutex_init (&w->lock, NULL);
+    w->fd = -1;
+    w->buf = NULL;
+    w->off = 0;
+    w->len = 0;
+    w->err = 0;
+    w->dirtied = 0;
+    pthread_mutex_lock (&wb.lock);
+    w->prev = NULL;
+    w->next = wb.list;
+    if (wb.list)
+        wb.list->prev = w;
+    wb.list = w;
+    pthread_mutex_unlock (&wb.lock);
+    return w;
+}
+
+/* Write out and free w.  An error here can only be logged.
+ */
+void
+diod_writebehind_destroy (Writebehind *w)
+{
+    pthread_mutex_lock (&w->lock);
+    if (_flush (w) < 0)
+        err ("writebehind: pwrite");
+    pthread_mutex_unlock (&w->lock);
+    pthread_mutex_lock (&wb.lock);
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        wb.list = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    pthread_mutex_unlock (&wb.lock);
+    pthread_mutex_destroy (&w->lock);
+    free (w);
+}
+
+/* Write out whatever w holds, and return any error deferred from an
+ * earlier write.  Return 0 on success, or -1 with errno set.
+ */
+int
+diod_writebehind_flush (Writebehind *w)
+{
+    int rc = 0;
+
+    pthread_mutex_lock (&w->lock);
+    if (_flush (w) < 0)
+        rc = -1;
+    else if (w->err) {
+        errno = w->err;
+        rc = -1;
+    }
+    w->err = 0;
+    pthread_mutex_unlock (&w->lock);
+    return rc;
+}
+
+/* Claim memory for a buffer, or if there is none to spare, ask the
+ * flusher to make some and return -1.
+ */
+static int
+_reserve (void)
+{
+    int rc = 0;
+
+    pthread_mutex_lock (&wb.lock);
+    if (!wb.running || wb.used + WB_BUFSIZE > wb.limit) {
+        if (wb.running) {
+            wb.pressure++;
+            wb.urgent = 1;
+            pthread_cond_signal (&wb.cond);
+        }
+        rc = -1;
+    } else
+        wb.used += WB_BUFSIZE;
+    pthread_mutex_unlock (&wb.lock);
+    return rc;
+}
+
+/* Write count bytes of data at offset to fd through w.
+ * Return count on success, or -1 with errno set, possibly by an earlier
+ * write whose data was buffered.
+ */
+ssize_t
+diod_writebehind_write (Writebehind *w, int fd, void *data, size_t count,
+                        u64 offset)
+{
+    size_t room, n, done = 0;
+    ssize_t rc = count;
+
+    pthread_mutex_lock (&w->lock);
+    if (w->err) {
+        errno = w->err;
+        w->err = 0;
+        rc = -1;
+        goto done;
+    }
+    if (w->buf && (fd != w->fd || offset != w->off + w->len)) {
+        if (_flush (w) < 0) {
+            rc = -1;
+            goto done;
+        }
+    }
+    while (done < count) {
+        if (!w->buf) {
+            if (count - done >= WB_BUFSIZE || _reserve () < 0)
+                break;
+            if (!(w->buf = malloc (WB_BUFSIZE))) {
+                pthread_mutex_lock (&wb.lock);
+                wb.used -= WB_BUFSIZE;
+                pthread_mutex_unlock (&wb.lock);
+                break;
+            }
+            w->fd = fd;
+            w->off = offset + done;
+            w->dirtied = time (NULL);
+        }
+        /* fill only up to the next aligned boundary of the file */
+        room = WB_BUFSIZE - (w->off % WB_BUFSIZE) - w->len;
+        n = count - done < room ? count - done : room;
+        memcpy (w->buf + w->len, (u8 *)data + done, n);
+        w->len += n;
+        done += n;
+        if (n == room && _flush (w) < 0) {
+            rc = -1;
+            goto done;
+        }
+    }
+    if (done < count) {
+        while (done < count) {
+            ssize_t m = pwrite (fd, (u8 *)data + done, count - done,
+                                offset + done);
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                rc = -1;
+                goto done;
+            }
+            done += m;
+        }
+    } else {
+        pthread_mutex_lock (&wb.lock);
+        wb.writes++;
+        pthread_mutex_unlock (&wb.lock);
+    }
+done:
+    pthread_mutex_unlock (&w->lock);
+    return rc;
+}
+
+static char *
+_get_writebehind (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&wb.lock);
+    if (aspf (&s, &len, "%zu %zu %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              wb.used, wb.limit, wb.writes, wb.flushes,
+              wb.pressure, wb.timeouts) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&wb.lock);
+    return s;
+}
+
+/* Set the bound on buffered memory (bytes) and add the "writebehind"
+ * ctl file:
+ *   used limit writes flushes pressure timeouts
+ */
+int
+diod_writebehind_init (Npsrv *srv, size_t limit)
+{
+    wb.limit = limit;
+    if (!np_ctl_addfile (srv->ctlroot, "writebehind", _get_writebehind, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
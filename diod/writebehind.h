@@ -0,0 +1,12 @@
+typedef struct Writebehind Writebehind;
+
+int      diod_writebehind_init (Npsrv *srv, size_t limit);
+Writebehind *diod_writebehind_create (void);
+void     diod_writebehind_destroy (Writebehind *w);
+int      diod_writebehind_flush (Writebehind *w);
+ssize_t  diod_writebehind_write (Writebehind *w, int fd, void *data,
+                                 size_t count, u64 offset);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,255 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* xattrcache.c - remember extended attributes that a file doesn't have */
+
+/* The kernel client asks for security.capability before every write and
+ * for the POSIX ACL attributes on lookups, and nearly always gets ENODATA.
+ * Such misses are recorded here along with the inode's ctime, which any
+ * setxattr or removexattr updates, and a later Txattrwalk for the same
+ * name is answered from them while the ctime is unchanged.  Checking the
+ * ctime costs a stat unless the export's attribute cache holds it, so
+ * only exports with attrcache use this; there a miss is answered without
+ * a syscall, and sees a change made behind diod's back as soon as the
+ * attribute cache does.  diod also drops an inode's entries when it sets
+ * or removes one of its attributes.
+ *
+ * File system timestamps are coarse, so an attribute set within a tick
+ * of a failed lookup could leave the ctime looking unchanged.  A miss on
+ * an inode changed less than XC_RACYNSEC before the lookup started is
+ * not recorded.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+
+#include "xattrcache.h"
+
+#define XC_HASHSIZE     1024
+#define XC_MAXCOUNT     16384
+#define XC_RACYNSEC     100000000   /* timestamp granularity allowance */
+
+typedef struct Absent {
+    dev_t               dev;
+    ino_t               ino;
+    struct timespec     ctim;
+    struct Absent      *hnext;
+    struct Absent      *lprev, *lnext;
+    char                name[];
+} Absent;
+
+static struct {
+    pthread_mutex_t     lock;
+    int                 count;
+    Absent             *hash[XC_HASHSIZE];
+    Absent             *lru_first, *lru_last;
+    u64                 hits;
+    u64                 misses;
+    u64                 recorded;
+} xc = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* All of an inode's names hash together, so they can be dropped at once.
+ */
+static int
+_hash (dev_t dev, ino_t ino)
+{
+    return (ino ^ (ino >> 12) ^ dev) % XC_HASHSIZE;
+}
+
+static int
+_racy (struct timespec *t, struct timespec *start)
+{
+    int64_t d = (int64_t)(start->tv_sec - t->tv_sec) * 1000000000
+              + (start->tv_nsec - t->tv_nsec);
+
+    return d < XC_RACYNSEC;
+}
+
+/* Unlink and free an entry.  Call with xc.lock held.
+ */
+static void
+_drop (Absent **ap)
+{
+    Absent *a = *ap;
+
+    *ap = a->hnext;
+    if (a->lprev)
+        a->lprev->lnext = a->lnext;
+    else
+        xc.lru_first = a->lnext;
+    if (a->lnext)
+        a->lnext->lprev = a->lprev;
+    else
+        xc.lru_last = a->lprev;
+    xc.count--;
+    free (a);
+}
+
+/* Find the hash chain link pointing to the entry for name on sb's inode.
+ * Call with xc.lock held.
+ */
+static Absent **
+_lookup (struct stat *sb, const char *name)
+{
+    Absent **ap;
+
+    for (ap = &xc.hash[_hash (sb->st_dev, sb->st_ino)]; *ap;
+                                                    ap = &(*ap)->hnext) {
+        if ((*ap)->dev == sb->st_dev && (*ap)->ino == sb->st_ino
+                                     && !strcmp ((*ap)->name, name))
+            return ap;
+    }
+    return NULL;
+}
+
+/* Return 1 if the file with attributes sb is known not to have extended
+ * attribute name, else 0.
+ */
+int
+diod_xattrcache_absent (struct stat *sb, const char *name)
+{
+    Absent **ap;
+    int ret = 0;
+
+    pthread_mutex_lock (&xc.lock);
+    if ((ap = _lookup (sb, name))) {
+        if ((*ap)->ctim.tv_sec == sb->st_ctim.tv_sec
+                        && (*ap)->ctim.tv_nsec == sb->st_ctim.tv_nsec)
+            ret = 1;
+        else
+            _drop (ap);
+    }
+    if (ret)
+        xc.hits++;
+    else
+        xc.misses++;
+    pthread_mutex_unlock (&xc.lock);
+    return ret;
+}
+
+/* Record that the file with attributes sb, read after a lookup that
+ * started at 'start' (CLOCK_REALTIME), has no extended attribute name.
+ */
+void
+diod_xattrcache_add (struct stat *sb, const char *name,
+                     struct timespec *start)
+{
+    int h = _hash (sb->st_dev, sb->st_ino);
+    Absent *a, **ap;
+
+    if (_racy (&sb->st_ctim, start))
+        return;
+    if (!(a = malloc (sizeof (*a) + strlen (name) + 1)))
+        return;
+    a->dev = sb->st_dev;
+    a->ino = sb->st_ino;
+    a->ctim = sb->st_ctim;
+    strcpy (a->name, name);
+    pthread_mutex_lock (&xc.lock);
+    if ((ap = _lookup (sb, name)))
+        _drop (ap);
+    while (xc.count >= XC_MAXCOUNT) {
+        for (ap = &xc.hash[_hash (xc.lru_first->dev, xc.lru_first->ino)];
+                                *ap != xc.lru_first; ap = &(*ap)->hnext)
+            ;
+        _drop (ap);
+    }
+    a->hnext = xc.hash[h];
+    xc.hash[h] = a;
+    a->lprev = xc.lru_last;
+    a->lnext = NULL;
+    if (xc.lru_last)
+        xc.lru_last->lnext = a;
+    else
+        xc.lru_first = a;
+    xc.lru_last = a;
+    xc.count++;
+    xc.recorded++;
+    pthread_mutex_unlock (&xc.lock);
+}
+
+/* Forget what is known about inode ino's extended attributes.
+ */
+void
+diod_xattrcache_inval (dev_t dev, ino_t ino)
+{
+    Absent **ap;
+
+    pthread_mutex_lock (&xc.lock);
+    for (ap = &xc.hash[_hash (dev, ino)]; *ap; ) {
+        if ((*ap)->dev == dev && (*ap)->ino == ino)
+            _drop (ap);
+        else
+            ap = &(*ap)->hnext;
+    }
+    pthread_mutex_unlock (&xc.lock);
+}
+
+static char *
+_get_xattrcache (void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    pthread_mutex_lock (&xc.lock);
+    if (aspf (&s, &len, "%d %d %"PRIu64" %"PRIu64" %"PRIu64"\n",
+              xc.count, XC_MAXCOUNT, xc.hits, xc.misses, xc.recorded) < 0) {
+        np_uerror (ENOMEM);
+        s = NULL;
+    }
+    pthread_mutex_unlock (&xc.lock);
+    return s;
+}
+
+/* Add the "xattrcache" ctl file:
+ *   names limit hits misses recorded
+ */
+int
+diod_xattrcache_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "xattrcache", _get_xattrcache, NULL))
+        return -1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
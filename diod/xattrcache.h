@@ -0,0 +1,9 @@
+int      diod_xattrcache_init (Npsrv *srv);
+int      diod_xattrcache_absent (struct stat *sb, const char *name);
+void     diod_xattrcache_add (struct stat *sb, const char *name,
+                              struct timespec *start);
+void     diod_xattrcache_inval (dev_t dev, ino_t ino);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -81,6 +81,15 @@
 #define RO_EXPORTALL        0x1000
 #define RO_ALLSQUASH        0x2000
 #define RO_SQUASHUSER       0x4000
+#define RO_BUSYPOLL         0x8000
+#define RO_HOTRESTART       0x10000
+#define RO_SHARDS           0x20000
+#define RO_DIRCACHE         0x40000
+#define RO_DIRCACHEMAX      0x80000
+#define RO_FDCACHE          0x100000
+#define RO_WRITEBEHIND      0x200000
+#define RO_MSIZE            0x400000
+#define RO_URING            0x800000
 
 typedef struct {
     int          debuglevel;
@@ -96,6 +105,15 @@ typedef struct {
     List         exports;
     char        *configpath;
     char        *logdest;
+    int          busypoll;
+    char        *hotrestart;
+    int          shards;
+    int          dircache;
+    int          dircachemax;
+    int          fdcache;
+    int          writebehind;
+    int          msize;
+    int          uring;
     int          ro_mask; 
 } Conf;
 
@@ -140,6 +158,11 @@ _create_export (char *path)
     x->hosts = NULL;
     x->users = NULL;
     x->oflags = 0;
+    x->busypoll = -1;
+    x->attrcache = -1;
+    x->readahead = -1;
+    x->iounit = -1;
+    x->qdepth = -1;
     return x;
 }
 
@@ -186,6 +209,15 @@ diod_conf_init (void)
     config.configpath = NULL;
 #endif
     config.logdest = _xstrdup (DFLT_LOGDEST);
+    config.busypoll = DFLT_BUSYPOLL;
+    config.hotrestart = NULL;
+    config.shards = DFLT_SHARDS;
+    config.dircache = DFLT_DIRCACHE;
+    config.dircachemax = DFLT_DIRCACHEMAX;
+    config.fdcache = DFLT_FDCACHE;
+    config.writebehind = DFLT_WRITEBEHIND;
+    config.msize = DFLT_MSIZE;
+    config.uring = DFLT_URING;
     config.ro_mask = 0;
 }
 
@@ -202,6 +234,8 @@ diod_conf_fini (void)
         free (config.logdest);
     if (config.squashuser)
         free (config.squashuser);
+    if (config.hotrestart)
+        free (config.hotrestart);
 }
 
 /* logdest - logging destination
@@ -369,6 +403,98 @@ error:
     return NULL;
 }
 
+/* busypoll - usec worker threads and readers poll for work before sleeping
+ */
+int diod_conf_get_busypoll (void) { return config.busypoll; }
+int diod_conf_opt_busypoll (void) { return config.ro_mask & RO_BUSYPOLL; }
+void diod_conf_set_busypoll (int i)
+{
+    config.busypoll = i;
+    config.ro_mask |= RO_BUSYPOLL;
+}
+
+/* hotrestart - unix socket where a successor may take over our connections
+ */
+char *diod_conf_get_hotrestart (void) { return config.hotrestart; }
+int diod_conf_opt_hotrestart (void) { return config.ro_mask & RO_HOTRESTART; }
+void diod_conf_set_hotrestart (char *s)
+{
+    if (config.hotrestart)
+        free (config.hotrestart);
+    config.hotrestart = _xstrdup (s);
+    config.ro_mask |= RO_HOTRESTART;
+}
+
+/* shards - number of server processes connections are spread across
+ */
+int diod_conf_get_shards (void) { return config.shards; }
+int diod_conf_opt_shards (void) { return config.ro_mask & RO_SHARDS; }
+void diod_conf_set_shards (int i)
+{
+    config.shards = i;
+    config.ro_mask |= RO_SHARDS;
+}
+
+/* dircache - MiB of directory snapshots shared between readers (0 = off)
+ */
+int diod_conf_get_dircache (void) { return config.dircache; }
+int diod_conf_opt_dircache (void) { return config.ro_mask & RO_DIRCACHE; }
+void diod_conf_set_dircache (int i)
+{
+    config.dircache = i;
+    config.ro_mask |= RO_DIRCACHE;
+}
+
+/* dircachemax - largest directory (in entries) that will be snapshotted
+ */
+int diod_conf_get_dircachemax (void) { return config.dircachemax; }
+int diod_conf_opt_dircachemax (void) { return config.ro_mask & RO_DIRCACHEMAX; }
+void diod_conf_set_dircachemax (int i)
+{
+    config.dircachemax = i;
+    config.ro_mask |= RO_DIRCACHEMAX;
+}
+
+/* fdcache - idle file descriptors kept open for reuse by later opens
+ */
+int diod_conf_get_fdcache (void) { return config.fdcache; }
+int diod_conf_opt_fdcache (void) { return config.ro_mask & RO_FDCACHE; }
+void diod_conf_set_fdcache (int i)
+{
+    config.fdcache = i;
+    config.ro_mask |= RO_FDCACHE;
+}
+
+/* writebehind - MiB of memory for async exports' write-behind buffers
+ */
+int diod_conf_get_writebehind (void) { return config.writebehind; }
+int diod_conf_opt_writebehind (void) { return config.ro_mask & RO_WRITEBEHIND; }
+void diod_conf_set_writebehind (int i)
+{
+    config.writebehind = i;
+    config.ro_mask |= RO_WRITEBEHIND;
+}
+
+/* msize - largest 9P message (bytes) offered to clients in Tversion
+ */
+int diod_conf_get_msize (void) { return config.msize; }
+int diod_conf_opt_msize (void) { return config.ro_mask & RO_MSIZE; }
+void diod_conf_set_msize (int i)
+{
+    config.msize = i;
+    config.ro_mask |= RO_MSIZE;
+}
+
+/* uring - io_uring submission queue entries per ring (0 = no io_uring)
+ */
+int diod_conf_get_uring (void) { return config.uring; }
+int diod_conf_opt_uring (void) { return config.ro_mask & RO_URING; }
+void diod_conf_set_uring (int i)
+{
+    config.uring = i;
+    config.ro_mask |= RO_URING;
+}
+
 /* exports - list of paths of exported file systems
  */
 List diod_conf_get_exports (void) { return config.exports; }
@@ -404,25 +530,66 @@ void diod_conf_validate_exports (void)
 }
 
 #if defined(HAVE_LUA_H) && defined(HAVE_LUALIB_H)
+static int
+_parse_expopt_int (char *item, char *val)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol (val, &end, 10);
+    if (errno != 0 || *val == '\0' || *end != '\0' || n < 0 || n > INT_MAX)
+        msg_exit ("bad value for export option: %s", item);
+    return (int)n;
+}
+
 static void
-_parse_expopt (char *s, int *fp)
+_parse_expopt (char *s, Export *x)
 {
     int flags = 0;
-    char *cpy, *item;
+    char *cpy, *item, *val;
     char *saveptr = NULL;
 
     if (!(cpy = strdup (s)))
         msg_exit ("out of memory");
     item = strtok_r (cpy, ",", &saveptr);
     while (item) {
-        if (!strcmp (item, "ro"))
+        if ((val = strchr (item, '=')))
+            *val++ = '\0';
+        if (!strcmp (item, "ro") && !val)
             flags |= XFLAGS_RO;
+        else if (!strcmp (item, "negcache") && !val)
+            flags |= XFLAGS_NEGCACHE;
+        else if (!strcmp (item, "async") && !val)
+            flags |= XFLAGS_ASYNC;
+        else if (!strcmp (item, "relaxattr") && !val)
+            flags |= XFLAGS_RELAXATTR;
+        else if (!strcmp (item, "direct") && !val)
+            flags |= XFLAGS_DIRECT;
+        else if (!strcmp (item, "busypoll") && val)
+            x->busypoll = _parse_expopt_int (item, val);
+        else if (!strcmp (item, "attrcache") && val)
+            x->attrcache = _parse_expopt_int (item, val);
+        else if (!strcmp (item, "attrcache"))
+            x->attrcache = DFLT_ATTRCACHE;
+        else if (!strcmp (item, "readahead") && val)
+            x->readahead = _parse_expopt_int (item, val);
+        else if (!strcmp (item, "readahead"))
+            x->readahead = DFLT_READAHEAD;
+        else if (!strcmp (item, "iounit") && val)
+            x->iounit = _parse_expopt_int (item, val);
+        else if (!strcmp (item, "iounit"))
+            x->iounit = 0;
+        else if (!strcmp (item, "qdepth") && val) {
+            if ((x->qdepth = _parse_expopt_int (item, val)) == 0)
+                msg_exit ("bad value for export option: %s", item);
+        }
         else
             msg_exit ("unknown export option: %s", item);
         item = strtok_r (NULL, ",", &saveptr);
     }
     free (cpy);
-    *fp = flags;
+    x->oflags = flags;
 }
 
 static int
@@ -546,7 +713,7 @@ _lua_getglobal_exports (char *path, lua_State *L, List *lp)
                 free (p);
                 _lua_get_expattr (path, i, L, "opts", &x->opts);
                 if (x->opts)
-                    _parse_expopt (x->opts, &x->oflags);
+                    _parse_expopt (x->opts, x);
                 _lua_get_expattr (path, i, L, "users", &x->users);
                 _lua_get_expattr (path, i, L, "hosts", &x->hosts);
                 /* FIXME: check for illegal export attributes */
@@ -628,6 +795,44 @@ diod_conf_init_config_file (char *path) /* FIXME: ENOMEM is fatal */
             config.logdest = _xstrdup (DFLT_LOGDEST);
             _lua_getglobal_string (path, L, "logdest", &config.logdest);
         }
+        if (!(config.ro_mask & RO_BUSYPOLL)) {
+            config.busypoll = DFLT_BUSYPOLL;
+            _lua_getglobal_int (path, L, "busypoll", &config.busypoll);
+        }
+        if (!(config.ro_mask & RO_HOTRESTART)) {
+            if (config.hotrestart)
+                free (config.hotrestart);
+            config.hotrestart = NULL;
+            _lua_getglobal_string (path, L, "hotrestart", &config.hotrestart);
+        }
+        if (!(config.ro_mask & RO_SHARDS)) {
+            config.shards = DFLT_SHARDS;
+            _lua_getglobal_int (path, L, "shards", &config.shards);
+        }
+        if (!(config.ro_mask & RO_DIRCACHE)) {
+            config.dircache = DFLT_DIRCACHE;
+            _lua_getglobal_int (path, L, "dircache", &config.dircache);
+        }
+        if (!(config.ro_mask & RO_DIRCACHEMAX)) {
+            config.dircachemax = DFLT_DIRCACHEMAX;
+            _lua_getglobal_int (path, L, "dircachemax", &config.dircachemax);
+        }
+        if (!(config.ro_mask & RO_FDCACHE)) {
+            config.fdcache = DFLT_FDCACHE;
+            _lua_getglobal_int (path, L, "fdcache", &config.fdcache);
+        }
+        if (!(config.ro_mask & RO_WRITEBEHIND)) {
+            config.writebehind = DFLT_WRITEBEHIND;
+            _lua_getglobal_int (path, L, "writebehind", &config.writebehind);
+        }
+        if (!(config.ro_mask & RO_MSIZE)) {
+            config.msize = DFLT_MSIZE;
+            _lua_getglobal_int (path, L, "msize", &config.msize);
+        }
+        if (!(config.ro_mask & RO_URING)) {
+            config.uring = DFLT_URING;
+            _lua_getglobal_int (path, L, "uring", &config.uring);
+        }
         if (!(config.ro_mask & RO_EXPORTALL)) {
             config.exportall = DFLT_EXPORTALL;
             _lua_getglobal_int (path, L, "exportall", &config.exportall);
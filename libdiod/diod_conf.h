@@ -31,6 +31,18 @@
 #define DFLT_RUNASUID       0
 #define DFLT_LISTEN         "0.0.0.0:564"
 #define DFLT_EXPORTALL      0
+#define DFLT_BUSYPOLL       0
+#define DFLT_SHARDS         0
+#define DFLT_DIRCACHE       32      /* MiB */
+#define DFLT_DIRCACHEMAX    100000  /* entries per directory */
+#define DFLT_ATTRCACHE      1000    /* msec, attrcache export option */
+#define DFLT_FDCACHE        0       /* idle descriptors, 0 = off */
+#define DFLT_READAHEAD      2048    /* KiB, readahead export option */
+#define DFLT_WRITEBEHIND    256     /* MiB */
+#define DFLT_MSIZE          65536   /* bytes */
+#define DFLT_URING          0       /* entries per ring, 0 = off */
+#define MAX_URING           32768
+#define MAX_MSIZE           (16*1024*1024)
 #if defined(HAVE_LUA_H) && defined(HAVE_LUALIB_H)
 #define DFLT_CONFIGPATH     X_SYSCONFDIR "/diod.conf"
 #endif
@@ -84,12 +96,57 @@ int     diod_conf_opt_listen (void);
 void    diod_conf_clr_listen (void);
 void    diod_conf_add_listen (char *s);
 
+int     diod_conf_get_busypoll (void);
+int     diod_conf_opt_busypoll (void);
+void    diod_conf_set_busypoll (int i);
+
+char   *diod_conf_get_hotrestart (void);
+int     diod_conf_opt_hotrestart (void);
+void    diod_conf_set_hotrestart (char *s);
+
+int     diod_conf_get_shards (void);
+int     diod_conf_opt_shards (void);
+void    diod_conf_set_shards (int i);
+
+int     diod_conf_get_dircache (void);
+int     diod_conf_opt_dircache (void);
+void    diod_conf_set_dircache (int i);
+
+int     diod_conf_get_dircachemax (void);
+int     diod_conf_opt_dircachemax (void);
+void    diod_conf_set_dircachemax (int i);
+
+int     diod_conf_get_fdcache (void);
+int     diod_conf_opt_fdcache (void);
+void    diod_conf_set_fdcache (int i);
+
+int     diod_conf_get_writebehind (void);
+int     diod_conf_opt_writebehind (void);
+void    diod_conf_set_writebehind (int i);
+
+int     diod_conf_get_msize (void);
+int     diod_conf_opt_msize (void);
+void    diod_conf_set_msize (int i);
+
+int     diod_conf_get_uring (void);
+int     diod_conf_opt_uring (void);
+void    diod_conf_set_uring (int i);
+
 #define XFLAGS_RO           0x01
+#define XFLAGS_NEGCACHE     0x02
+#define XFLAGS_ASYNC        0x04
+#define XFLAGS_RELAXATTR    0x08
+#define XFLAGS_DIRECT       0x10
 
 typedef struct {
     char         *path;
     char         *opts;
     int          oflags;
+    int          busypoll;  /* usec, -1 = use global setting */
+    int          attrcache; /* msec TTL, -1 = no attribute cache */
+    int          readahead; /* KiB max window, -1 = no readahead */
+    int          iounit;    /* bytes, 0 = msize, -1 = file's st_blksize */
+    int          qdepth;    /* concurrent file I/Os, -1 = unlimited */
     char         *users;
     char         *hosts;
 } Export;
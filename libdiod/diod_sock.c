@@ -179,13 +179,35 @@ done:
     return ret;
 }
 
+/* Create a transport for a connected socket, applying the server's
+ * busy-poll setting.
+ */
+Nptrans *
+diod_sock_trans_create (Npsrv *srv, int fd)
+{
+    Nptrans *trans;
+
+    if (!(trans = np_fdtrans_create (fd, fd)))
+        return NULL;
+    if (srv->spin > 0) {
+#ifdef SO_BUSY_POLL
+        int usec = srv->spin;
+
+        /* needs CAP_NET_ADMIN to exceed net.core.busy_read */
+        (void)setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof (usec));
+#endif
+        np_fdtrans_set_spin (trans, srv->spin);
+    }
+    return trans;
+}
+
 void
 diod_sock_startfd (Npsrv *srv, int fd, char *client_id)
 {
     Npconn *conn;
     Nptrans *trans;
 
-    trans = np_fdtrans_create (fd, fd);
+    trans = diod_sock_trans_create (srv, fd);
     if (!trans) {
         errn (np_rerror (), "error creating transport for %s", client_id);
         close (fd);
@@ -200,31 +222,24 @@ diod_sock_startfd (Npsrv *srv, int fd, char *client_id)
     }
 }
 
-/* Accept one connection on a ready fd and pass it on to the npfs 9P engine.
+/* Look up the peer of connected socket fd, apply tcp wrappers,
+ * and start serving it.
  */
-void
-diod_sock_accept_one (Npsrv *srv, int fd)
+static void
+_startpeer (Npsrv *srv, int fd, struct sockaddr_storage *addr,
+            socklen_t addr_size)
 {
-    struct sockaddr_storage addr;
-    socklen_t addr_size = sizeof(addr);
     char host[NI_MAXHOST], ip[NI_MAXHOST], svc[NI_MAXSERV];
     int res;
 
-    fd = accept (fd, (struct sockaddr *)&addr, &addr_size);
-    if (fd < 0) {
-        if (!(errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EPROTO
-                                                            || errno == EINTR))
-            err ("accept");
-        return;
-    }
-    if ((res = getnameinfo ((struct sockaddr *)&addr, addr_size,
+    if ((res = getnameinfo ((struct sockaddr *)addr, addr_size,
                             ip, sizeof(ip), svc, sizeof(svc),
                             NI_NUMERICHOST | NI_NUMERICSERV))) {
         msg ("getnameinfo: %s", gai_strerror(res));
         close (fd);
         return;
     }
-    if ((res = getnameinfo ((struct sockaddr *)&addr, addr_size,
+    if ((res = getnameinfo ((struct sockaddr *)addr, addr_size,
                             host, sizeof(host), NULL, 0, 0))) {
         msg ("getnameinfo: %s", gai_strerror(res));
         close (fd);
@@ -240,6 +255,41 @@ diod_sock_accept_one (Npsrv *srv, int fd)
 #endif
     diod_sock_startfd (srv, fd, strlen(host) > 0 ? host : ip);
 }
+
+/* Accept one connection on a ready fd and pass it on to the npfs 9P engine.
+ */
+void
+diod_sock_accept_one (Npsrv *srv, int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_size = sizeof(addr);
+
+    fd = accept (fd, (struct sockaddr *)&addr, &addr_size);
+    if (fd < 0) {
+        if (!(errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EPROTO
+                                                            || errno == EINTR))
+            err ("accept");
+        return;
+    }
+    _startpeer (srv, fd, &addr, addr_size);
+}
+
+/* Start serving a socket that was accepted by someone else,
+ * e.g. the shard acceptor.
+ */
+void
+diod_sock_startpeer (Npsrv *srv, int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_size = sizeof(addr);
+
+    if (getpeername (fd, (struct sockaddr *)&addr, &addr_size) < 0) {
+        err ("getpeername");
+        close (fd);
+        return;
+    }
+    _startpeer (srv, fd, &addr, addr_size);
+}
  
 /* Connect to host:port.
  * Return fd on success, -1 on failure.
@@ -4,6 +4,10 @@ void diod_sock_accept_one (Npsrv *srv, int fd);
 
 void diod_sock_startfd (Npsrv *srv, int fd, char *client_id);
 
+void diod_sock_startpeer (Npsrv *srv, int fd);
+
+Nptrans *diod_sock_trans_create (Npsrv *srv, int fd);
+
 int  diod_sock_listen_hostports (List l, struct pollfd **fdsp, int *nfdsp,
                                      char *nport);
 
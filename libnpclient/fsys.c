@@ -143,35 +143,60 @@ done:
 	return ret;	
 }
 
+/* Read exactly count bytes.
+ */
 static int
-_read_response (Npcfsys *fs, Npfcall *rc)
+_read_exact (Npcfsys *fs, u8 *data, int count)
 {
 	int i, n = 0;
-	int size;
-	int ret = -1;
 
-	while ((i = np_trans_read(fs->trans, rc->pkt + n, fs->msize - n)) > 0) {
-		n += i;
-		size = np_peek_size (rc->pkt, n);
-		if (size == 0 || n < size)
-			continue;
-		if (!np_deserialize(rc, rc->pkt)) {
-			np_uerror (EIO); /* failed to parse */
-			break;
+	while (n < count) {
+		if ((i = np_trans_read(fs->trans, data + n, count - n)) < 0) {
+			np_uerror (errno);
+			return -1;
 		}
-		ret = 0;
-		break;
-	}
-	if (i < 0) {
-		np_uerror (errno);
-		goto done;
+		if (i == 0) {
+			np_uerror (EIO);
+			return -1;
+		}
+		n += i;
 	}
-	if (i == 0) {
+	return 0;
+}
+
+/* Read one response into an Npfcall sized to fit it, so a large msize
+ * costs nothing for small messages.
+ */
+static int
+_read_response (Npcfsys *fs, Npfcall **rcp)
+{
+	u8 hdr[4];
+	Npfcall *rc;
+	int size;
+
+	if (_read_exact (fs, hdr, sizeof (hdr)) < 0)
+		return -1;
+	size = np_peek_size (hdr, sizeof (hdr));
+	if (size < 7 || size > fs->msize) {
 		np_uerror (EIO);
-		goto done;
+		return -1;
 	}
-done:
-	return ret;
+	if (!(rc = npc_fcall_alloc(size))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	memcpy (rc->pkt, hdr, sizeof (hdr));
+	if (_read_exact (fs, rc->pkt + sizeof (hdr), size - sizeof (hdr)) < 0)
+		goto error;
+	if (!np_deserialize(rc, rc->pkt)) {
+		np_uerror (EIO); /* failed to parse */
+		goto error;
+	}
+	*rcp = rc;
+	return 0;
+error:
+	npc_fcall_free (rc);
+	return -1;
 }
 
 static int
@@ -194,12 +219,7 @@ npc_rpc(Npcfsys *fs, Npfcall *tc, Npfcall **rcp)
 		pthread_mutex_unlock(&fs->lock);
 		goto done;
 	}
-	if (!(rc = npc_fcall_alloc(fs->msize))) {
-		pthread_mutex_unlock(&fs->lock);
-		np_uerror (ENOMEM);
-		goto done;
-	}
-	if (_read_response (fs, rc) < 0) {
+	if (_read_response (fs, &rc) < 0) {
 		pthread_mutex_unlock(&fs->lock);
 		goto done;
 	}
@@ -135,6 +135,7 @@ npc_attach (Npcfsys *fs, Npcfid *afid, char *aname, uid_t uid)
 	}
 	if (fs->rpc (fs, tc, &rc) < 0)
 		goto done;
+	fid->qid = rc->u.rattach.qid;
 done:
 	if (tc)
 		free (tc);
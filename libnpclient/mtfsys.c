@@ -283,40 +283,54 @@ npc_cancel_fid_requests(Npcfid *fid)
 }
 #endif
 
+/* Read exactly count bytes.
+ */
+static int
+_read_exact(Npcfsys *fs, u8 *data, int count)
+{
+	int i, n = 0;
+
+	while (n < count) {
+		if ((i = np_trans_read(fs->trans, data + n, count - n)) <= 0)
+			return -1;
+		n += i;
+	}
+	return 0;
+}
+
+/* Each response is read into an Npfcall sized to fit it, so a large
+ * msize costs nothing for small messages.
+ */
 static void*
 npc_read_proc(void *a)
 {
-	int i, n, size, msize;
-	Npfcall *fc, *fc1;
+	u8 hdr[4];
+	int size;
+	Npfcall *fc = NULL;
 	Npcreq *req, *req1, *unsent, *pend, *preq;
 	Npcfsys *fs;
 
 	fs = a;
-	msize = fs->msize;
-	fc = npc_fcall_alloc(msize);
-	n = 0;
 	while (fs->trans) {
-		i = np_trans_read(fs->trans, fc->pkt + n, msize - n);
-		if (i <= 0)
+		if (_read_exact(fs, hdr, sizeof(hdr)) < 0)
 			break;
-		n += i;
-again:
-		size = np_peek_size (fc->pkt, n);
-		if (size == 0 || n < size)
-			continue;
-		if (!np_deserialize(fc, fc->pkt)) {
+		size = np_peek_size (hdr, sizeof(hdr));
+		if (size < 7 || size > fs->msize) {
 			np_uerror (EIO);
 			break;
 		}
-
-		fc1 = npc_fcall_alloc(msize);
-		if (!fc1) {
+		fc = npc_fcall_alloc(size);
+		if (!fc) {
 			np_uerror (ENOMEM);
 			break;
 		}
-		if (n > size)
-			memmove(fc1->pkt, fc->pkt + size, n - size);
-		n -= size;
+		memcpy(fc->pkt, hdr, sizeof(hdr));
+		if (_read_exact(fs, fc->pkt + sizeof(hdr), size - sizeof(hdr)) < 0)
+			break;
+		if (!np_deserialize(fc, fc->pkt)) {
+			np_uerror (EIO);
+			break;
+		}
 
 		pthread_mutex_lock(&fs->lock);
 		for(preq = NULL, req = fs->pend_first;
@@ -349,11 +363,7 @@ again:
 			pthread_mutex_unlock(&fs->lock);
 			free(fc);
 		}
-
-		fc = fc1;
-		msize = fs->msize;
-		if (n > 0)
-			goto again;
+		fc = NULL;
 	}
 
 	npc_fcall_free(fc);
@@ -32,6 +32,7 @@ struct Npcfid {
 	Npcfsys*	fsys;
 	u32		fid;
 	u64		offset;
+	Npqid		qid;	/* as last reported by attach/walk/open/create */
 };
 
 typedef int (*AuthFun)(Npcfid *afid, u32 uid);
@@ -119,6 +120,51 @@ int npc_mkdir (Npcfid *fid, char *name, u32 mode);
  */
 int npc_getattr (Npcfid *fid, struct stat *sb);
 
+/* Like npc_getattr () but ask for the P9_GETATTR_* attributes in
+ * 'request_mask', and return those the server says are valid in 'validp',
+ * and the birth time in 'btime', if non-NULL.
+ * Returns 0 on success or -1 on error (retrieve with np_rerror ()).
+ */
+int npc_getattr_mask (Npcfid *fid, u64 request_mask, u64 *validp,
+		      struct stat *sb, struct timespec *btime);
+
+/* Send a READDIR request to read directory entries from open 'fid'
+ * starting at 'offset' into 'buf', which will hold up to 'count' bytes of
+ * packed dirents (decode with np_deserialize_p9dirent ()).  An entry's
+ * offset field is the offset to pass to read the entries following it.
+ * Returns bytes read, 0 on EOF, or -1 on error (retrieve with np_rerror ()).
+ */
+int npc_readdir (Npcfid *fid, u64 offset, void *buf, u32 count);
+
+/* Send a LOCK request on open 'fid' for the byte range 'start', 'length'
+ * with 'type' F_RDLCK, F_WRLCK or F_UNLCK, and 'flags' as in Tlock.
+ * Returns the P9_LOCK_* status or -1 on error (retrieve with np_rerror ()).
+ */
+int npc_lock (Npcfid *fid, u8 type, u32 flags, u64 start, u64 length);
+
+/* Send a GETLOCK request on open 'fid' to test whether a lock of type
+ * '*typep' on the byte range '*startp', '*lengthp' could be taken.  On
+ * return '*typep' is F_UNLCK if so; otherwise all four describe the
+ * conflicting lock, including the process id of its owner.
+ * Returns 0 on success or -1 on error (retrieve with np_rerror ()).
+ */
+int npc_getlock (Npcfid *fid, u8 *typep, u64 *startp, u64 *lengthp,
+		 u32 *proc_idp);
+
+/* Send an XATTRWALK request to read the value of extended attribute 'name'
+ * of 'fid', or if 'name' is empty, the list of attribute names, through a
+ * new fid (read it with npc_read ()).  Its size is returned in '*sizep'.
+ * Returns the new fid or NULL on error (retrieve with np_rerror ()).
+ */
+Npcfid *npc_xattrwalk (Npcfid *fid, char *name, u64 *sizep);
+
+/* Send an XATTRCREATE request to turn 'fid' into one through which the
+ * 'size' byte value of extended attribute 'name' is written.  The attribute
+ * is set, with 'flag' as in setxattr (2), when the fid is clunked.
+ * Returns 0 on success or -1 on error (retrieve with np_rerror ()).
+ */
+int npc_xattrcreate (Npcfid *fid, char *name, u64 size, u32 flag);
+
 /* TODO:
  * npc_remove ()
  * npc_statfs ()
@@ -126,12 +172,6 @@ int npc_getattr (Npcfid *fid, struct stat *sb);
  * npc_rename ()
  * npc_readlink ()
  * npc_setattr ()
- * npc_xattrwalk ()
- * npc_xattrcreate ()
- * npc_readdir ()
- * npc_fsync ()
- * npc_lock ()
- * npc_getlock ()
  * npc_link ()
  */
 
@@ -192,6 +232,11 @@ int npc_put(Npcfid *root, char *path, void *buf, u32 count);
  */
 int npc_puts(Npcfid *fid, char *buf);
 
+/* Send an FSYNC request on open 'fid'.
+ * Returns 0 on success, -1 on error (retrieve with np_rerror ()).
+ */
+int npc_fsync(Npcfid *fid);
+
 /* Change the file offset associated with 'fid'.  This is like lseek (2).
  * The state is local, kept within the fid.  N.B. SEEK_END doesn't work yet.
  */
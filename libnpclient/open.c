@@ -57,8 +57,9 @@ npc_create (Npcfid *fid, char *name, u32 flags, u32 mode, gid_t gid)
 	}
 	if (fid->fsys->rpc(fid->fsys, tc, &rc) < 0)
 		goto done;
+	fid->qid = rc->u.rlcreate.qid;
 	fid->iounit = rc->u.rlcreate.iounit;
-	if (!fid->iounit == 0 || fid->iounit > maxio)
+	if (fid->iounit == 0 || fid->iounit > maxio)
 		fid->iounit = maxio;
 	ret = 0;
 done:
@@ -117,6 +118,7 @@ npc_open (Npcfid *fid, u32 flags)
 	}
 	if (fid->fsys->rpc(fid->fsys, tc, &rc) < 0)
 		goto done;
+	fid->qid = rc->u.rlopen.qid;
 	fid->iounit = rc->u.rlopen.iounit;
 	if (fid->iounit == 0 || fid->iounit > maxio)
 		fid->iounit = maxio;
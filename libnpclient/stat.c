@@ -46,7 +46,13 @@
 int
 npc_getattr (Npcfid *fid, struct stat *sb)
 {
-	u64 request_mask = P9_GETATTR_BASIC;
+	return npc_getattr_mask (fid, P9_GETATTR_BASIC, NULL, sb, NULL);
+}
+
+int
+npc_getattr_mask (Npcfid *fid, u64 request_mask, u64 *validp,
+		  struct stat *sb, struct timespec *btime)
+{
 	Npfcall *tc = NULL, *rc = NULL;
 	int ret = -1;
 
@@ -72,6 +78,12 @@ npc_getattr (Npcfid *fid, struct stat *sb)
 	sb->st_mtim.tv_nsec = rc->u.rgetattr.mtime_nsec;
 	sb->st_ctime = rc->u.rgetattr.ctime_sec;
 	sb->st_ctim.tv_nsec = rc->u.rgetattr.ctime_nsec;
+	if (btime) {
+		btime->tv_sec = rc->u.rgetattr.btime_sec;
+		btime->tv_nsec = rc->u.rgetattr.btime_nsec;
+	}
+	if (validp)
+		*validp = rc->u.rgetattr.valid;
 	ret = 0;
 done:
 	if (tc)
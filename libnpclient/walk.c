@@ -59,6 +59,7 @@ npc_walk(Npcfid *nfid, char *path)
 	fid = npc_fid_alloc(nfid->fsys);
 	if (!fid)
 		goto error;
+	fid->qid = nfid->qid;
 	s = fname;
 	while (1) {
 		n = 0;
@@ -89,6 +90,8 @@ npc_walk(Npcfid *nfid, char *path)
 			np_uerror(ENOENT);
 			goto error;
 		}
+		if (n > 0)
+			fid->qid = rc->u.rwalk.wqids[n - 1];
 		if (tc)
 			free(tc);
 		if (rc)
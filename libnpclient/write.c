@@ -66,6 +66,27 @@ done:
 	return ret;
 }
 
+int
+npc_fsync(Npcfid *fid)
+{
+	Npfcall *tc = NULL, *rc = NULL;
+	int ret = -1;
+
+	if (!(tc = np_create_tfsync(fid->fid))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (fid->fsys->rpc(fid->fsys, tc, &rc) < 0)
+		goto done;
+	ret = 0;
+done:
+	if (tc)
+		free(tc);
+	if (rc)
+		free(rc);
+	return ret;
+}
+
 int
 npc_write(Npcfid *fid, void *buf, u32 count)
 {
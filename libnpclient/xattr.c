@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2006 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+#include "npcimpl.h"
+
+Npcfid *
+npc_xattrwalk (Npcfid *fid, char *name, u64 *sizep)
+{
+	Npfcall *tc = NULL, *rc = NULL;
+	Npcfid *afid;
+
+	if (!(afid = npc_fid_alloc (fid->fsys)))
+		goto error;
+	if (!(tc = np_create_txattrwalk (fid->fid, afid->fid, name))) {
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	if (fid->fsys->rpc (fid->fsys, tc, &rc) < 0)
+		goto error;
+	*sizep = rc->u.rxattrwalk.size;
+	afid->qid = fid->qid;
+	free (tc);
+	free (rc);
+	return afid;
+error:
+	if (rc)
+		free (rc);
+	if (tc)
+		free (tc);
+	if (afid)
+		npc_fid_free (afid);
+	return NULL;
+}
+
+int
+npc_xattrcreate (Npcfid *fid, char *name, u64 size, u32 flag)
+{
+	Npfcall *tc = NULL, *rc = NULL;
+	int ret = -1;
+
+	if (!(tc = np_create_txattrcreate (fid->fid, name, size, flag))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (fid->fsys->rpc (fid->fsys, tc, &rc) < 0)
+		goto done;
+	ret = 0;
+done:
+	if (rc)
+		free (rc);
+	if (tc)
+		free (tc);
+	return ret;
+}
@@ -29,7 +29,7 @@
 
 /* Conn reference counting:
  * . np_conn_create () ref=0
- * . np_conn_read_proc () start ref++, finish ref--
+ * . np_conn_read_proc () start ref++, finish (or cancel) ref--
  * . np_srv_add_conn () ref++,         np_srv_remove_conn () ref--
  * . np_req_alloc () ref++	       np_req_unref () ref--
  */
@@ -45,21 +45,33 @@
 #include <errno.h>
 #include <pthread.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "9p.h"
 #include "npfs.h"
 #include "npfsimpl.h"
 
+/* Reader threads mostly block in read (2) so they get a small stack.
+ * The staging buffer for incoming messages lives there too.
+ */
+#define CONN_STACKSIZE	(64*1024)
+#define CONN_RBUFSIZE	1024
+
+/* Large Twrite data is placed at the same offset within a page as it
+ * will have in the file, so a direct I/O export can write it as is.
+ */
+#define CONN_DATAALIGN	4096
+
 static Npfcall *_alloc_npfcall(int msize);
+static Npfcall *_alloc_npfcall_aligned(int msize, int dataoff, u64 phase);
 static void _free_npfcall(Npfcall *rc);
 static void *np_conn_read_proc(void *);
 static void np_conn_reset(Npconn *conn);
 
-Npconn*
-np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
+static Npconn *
+_conn_alloc(Npsrv *srv, Nptrans *trans, char *client_id)
 {
 	Npconn *conn;
-	int err;
 
 	if (!(conn = malloc(sizeof(*conn)))) {
 		errno = ENOMEM;
@@ -86,13 +98,25 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
 
 	conn->trans = trans;
 	conn->aux = NULL;
+	conn->reading = 0;
+	conn->rbufsize = 0;
+	conn->next = conn->prev = NULL;
 	np_srv_add_conn(srv, conn);
 
-	err = pthread_create(&conn->rthread, NULL, np_conn_read_proc, conn);
-	if (err != 0) {
+	return conn;
+}
+
+Npconn*
+np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
+{
+	Npconn *conn;
+	int err;
+
+	if (!(conn = _conn_alloc(srv, trans, client_id)))
+		return NULL;
+	if ((err = np_conn_start(conn)) != 0) {
+		conn->trans = NULL; /* caller still owns trans */
 		np_srv_remove_conn (srv, conn);
-		np_fidpool_destroy(conn->fidpool);
-		free (conn);
 		errno = err;
 		return NULL;
 	}
@@ -100,6 +124,47 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
 	return conn;
 }
 
+/* Create a connection for a transport inherited from a previous server
+ * instance (hot restart).  The caller restores fids with np_fid_restore ()
+ * and then calls np_conn_start () to begin reading requests.
+ */
+Npconn*
+np_conn_adopt(Npsrv *srv, Nptrans *trans, char *client_id, u32 msize,
+	      u32 authuser)
+{
+	Npconn *conn;
+
+	if (!(conn = _conn_alloc(srv, trans, client_id)))
+		return NULL;
+	conn->msize = msize;
+	conn->authuser = authuser;
+
+	return conn;
+}
+
+/* Start the reader thread.  Returns 0 or an errno value.
+ */
+int
+np_conn_start(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+	pthread_attr_t attr;
+	int err;
+
+	pthread_attr_init(&attr);
+	if (CONN_STACKSIZE > PTHREAD_STACK_MIN)
+		pthread_attr_setstacksize(&attr, CONN_STACKSIZE);
+	xpthread_mutex_lock(&srv->lock);
+	conn->reading = 1;
+	err = pthread_create(&conn->rthread, &attr, np_conn_read_proc, conn);
+	if (err != 0)
+		conn->reading = 0;
+	xpthread_mutex_unlock(&srv->lock);
+	pthread_attr_destroy(&attr);
+
+	return err;
+}
+
 void
 np_conn_incref(Npconn *conn)
 {
@@ -139,78 +204,158 @@ _debug_trace (Npsrv *srv, Npfcall *fc)
 	np_logmsg(srv, "%s", s);
 }
 
+/* Read exactly count bytes, or fail.
+ */
+static int
+_read_exact(Nptrans *trans, u8 *data, int count)
+{
+	int i, n = 0;
+
+	while (n < count) {
+		if ((i = np_trans_read(trans, data + n, count - n)) <= 0)
+			return -1;
+		n += i;
+	}
+	return n;
+}
+
+/* Called as the reader thread goes away, either normally or because
+ * np_srv_quiesce () cancelled it.
+ */
+static void
+_reader_exit(void *a)
+{
+	Npconn *conn = (Npconn *)a;
+	Npsrv *srv = conn->srv;
+
+	xpthread_mutex_lock(&srv->lock);
+	conn->reading = 0;
+	xpthread_cond_broadcast(&srv->conncountcond);
+	xpthread_mutex_unlock(&srv->lock);
+	np_conn_decref(conn);
+}
+
+/* Read with no partial message buffered.  This is the only place the
+ * reader can be cancelled, so a quiesced connection never has a message
+ * half consumed and a successor can pick up the byte stream intact.
+ */
+static int
+_read_boundary(Npconn *conn, u8 *data, int count)
+{
+	int n, old;
+
+	pthread_cleanup_push(_reader_exit, conn);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+	n = np_trans_read(conn->trans, data, count);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	pthread_cleanup_pop(0);
+
+	return n;
+}
+
 /* Per-connection read thread.
+ * Input is staged in a small buffer on the (small) thread stack.
+ * Each message gets an Npfcall sized exactly to fit it, so an idle
+ * connection holds no msize receive buffer.  A message that doesn't fit
+ * in the staging buffer is read directly into its Npfcall.
  */
 static void *
 np_conn_read_proc(void *a)
 {
-	int i, n, size;
+	int i, n, size, dataoff;
+	u64 offset;
 	Npsrv *srv;
 	Npconn *conn = (Npconn *)a;
 	Nptrans *trans;
 	Npreq *req;
-	Npfcall *fc, *fc1;
+	Npfcall *fc = NULL;
+	u8 buf[CONN_RBUFSIZE];
 
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_detach(pthread_self());
 	np_conn_incref(conn);
 	srv = conn->srv;
-	fc = _alloc_npfcall(conn->msize);
 	n = 0;
-	while (fc && conn->trans && (i = np_trans_read(conn->trans, fc->pkt + n, conn->msize - n)) > 0) {
-		n += i;
-again:
-		size = np_peek_size (fc->pkt, n);
-		if (size == 0 || n < size)
-			continue;
-
-		/* Corruption on the transport, unhandled op, etc.
-		 * is fatal to the connection.  We could consider returning
-		 * an error to the client here.   However, various kernels
-		 * may not handle that well, depending on where it happens.
-		 */
-		if (!np_deserialize(fc, fc->pkt)) {
-			_debug_trace (srv, fc);
-			np_logerr (srv, "protocol error - "
-				   "dropping connection to '%s'",
-				   conn->client_id);
+	while (conn->trans) {
+		if (n == 0)
+			i = _read_boundary(conn, buf, sizeof(buf));
+		else
+			i = np_trans_read(conn->trans, buf + n, sizeof(buf) - n);
+		if (i <= 0)
 			break;
-		}
-		if ((srv->flags & SRV_FLAGS_DEBUG_9PTRACE))
-			_debug_trace (srv, fc);
-
-		/* Replace fc, and copy any data past the current packet
-		 * to the replacement.
-		 */
-		fc1 = _alloc_npfcall(conn->msize);
-		if (!fc1) {
-			np_logerr (srv, "out of memory in receive path - "
-				   "dropping connection to '%s'",
-				   conn->client_id);
-			break;
-		}
-		if (n > size)
-			memmove(fc1->pkt, fc->pkt + size, n - size);
-		n -= size;
-
-		/* Encapsulate fc in a request and hand to srv worker threads.
-		 * In np_req_alloc, req->fid is looked up/initialized.
-		 */
-		req = np_req_alloc(conn, fc);
-		if (!req) {
-			np_logerr (srv, "out of memory in receive path - "
-				   "dropping connection to '%s'",
-				   conn->client_id);
-			break;
-		}
-		np_srv_add_req(srv, req);
-		xpthread_mutex_lock(&conn->lock);
-		conn->reqs_in++;
-		xpthread_mutex_unlock(&conn->lock);
-		fc = fc1;
-		if (n > 0)
-			goto again;
+		n += i;
+		while ((size = np_peek_size (buf, n)) > 0) {
+			if (size < 7 || size > conn->msize) {
+				np_logerr (srv, "bad message size %d - "
+					   "dropping connection to '%s'",
+					   size, conn->client_id);
+				goto done;
+			}
+			if (size > sizeof(buf)
+			    && (dataoff = np_peek_twrite(buf, n, &offset)) > 0)
+				fc = _alloc_npfcall_aligned(size, dataoff,
+							    offset);
+			else
+				fc = _alloc_npfcall(size);
+			if (!fc) {
+				np_logerr (srv, "out of memory in receive path - "
+					   "dropping connection to '%s'",
+					   conn->client_id);
+				goto done;
+			}
+			if (n >= size) {
+				memcpy(fc->pkt, buf, size);
+				n -= size;
+				memmove(buf, buf + size, n);
+			} else {
+				memcpy(fc->pkt, buf, n);
+				xpthread_mutex_lock(&conn->lock);
+				conn->rbufsize = size;
+				xpthread_mutex_unlock(&conn->lock);
+				i = _read_exact(conn->trans, fc->pkt + n, size - n);
+				xpthread_mutex_lock(&conn->lock);
+				conn->rbufsize = 0;
+				xpthread_mutex_unlock(&conn->lock);
+				if (i < 0)
+					goto done;
+				n = 0;
+			}
 
+			/* Corruption on the transport, unhandled op, etc.
+			 * is fatal to the connection.  We could consider
+			 * returning an error to the client here.   However,
+			 * various kernels may not handle that well, depending
+			 * on where it happens.
+			 */
+			if (!np_deserialize(fc, fc->pkt)) {
+				_debug_trace (srv, fc);
+				np_logerr (srv, "protocol error - "
+					   "dropping connection to '%s'",
+					   conn->client_id);
+				goto done;
+			}
+			if ((srv->flags & SRV_FLAGS_DEBUG_9PTRACE))
+				_debug_trace (srv, fc);
+
+			/* Encapsulate fc in a request and hand to srv worker
+			 * threads.  In np_req_alloc, req->fid is
+			 * looked up/initialized.
+			 */
+			req = np_req_alloc(conn, fc);
+			if (!req) {
+				np_logerr (srv, "out of memory in receive path - "
+					   "dropping connection to '%s'",
+					   conn->client_id);
+				goto done;
+			}
+			fc = NULL;
+			np_srv_add_req(srv, req);
+			xpthread_mutex_lock(&conn->lock);
+			conn->reqs_in++;
+			xpthread_mutex_unlock(&conn->lock);
+		}
 	}
+done:
 	/* Just got EOF on read, or some other fatal error for the
 	 * connection like out of memory.
 	 */
@@ -228,7 +373,7 @@ again:
 	if (trans)
 		np_trans_destroy(trans);
 
-	np_conn_decref(conn);
+	_reader_exit(conn);
 	return NULL;
 }
 
@@ -308,7 +453,7 @@ _get_working_reqs (Npconn *conn, Npreq ***rp, int *lp)
 
 	/* assert: srv->lock held */
 	n = _count_working_reqs (conn, 0);
-	if ((reqs = malloc(n * sizeof(Npreq *))))
+	if (!(reqs = malloc(n * sizeof(Npreq *))) && n > 0)
 		goto error;
 	for (n = 0, tp = srv->tpool; tp != NULL; tp = tp->next) {
 		xpthread_mutex_lock (&tp->lock);
@@ -456,6 +601,27 @@ _alloc_npfcall(int msize)
 	return fc;
 }
 
+/* Allocate for a message whose payload starts dataoff bytes in,
+ * with the payload address congruent to phase modulo CONN_DATAALIGN.
+ */
+static Npfcall *
+_alloc_npfcall_aligned(int msize, int dataoff, u64 phase)
+{
+	Npfcall *fc;
+	uintptr_t data;
+	void *p;
+
+	if (posix_memalign(&p, CONN_DATAALIGN,
+			   sizeof(*fc) + CONN_DATAALIGN + msize) != 0)
+		return NULL;
+	fc = p;
+	data = (uintptr_t) fc + sizeof(*fc) + dataoff;
+	data += (phase - data) & (CONN_DATAALIGN - 1);
+	fc->pkt = (u8 *) data - dataoff;
+
+	return fc;
+}
+
 static void
 _free_npfcall(Npfcall *rc)
 {
@@ -463,6 +629,23 @@ _free_npfcall(Npfcall *rc)
 		free (rc);
 }
 
+/* Estimate the memory attributable to a connection: the Npconn, its
+ * transport, fid table and fids, any partially received message, and
+ * the reader thread's stack.  Call with conn->lock held.
+ */
+u64
+np_conn_get_memsize(Npconn *conn)
+{
+	u64 n;
+
+	n = sizeof(*conn) + sizeof(Nptrans) + CONN_STACKSIZE + conn->rbufsize;
+	if (conn->fidpool) {
+		n += sizeof(Npfidpool) + conn->fidpool->size * sizeof(Npfid *);
+		n += np_fidpool_count(conn->fidpool) * sizeof(Npfid);
+	}
+	return n;
+}
+
 char *
 np_conn_get_client_id(Npconn *conn)
 {
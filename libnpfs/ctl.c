@@ -194,6 +194,19 @@ np_ctl_adddir (Npfile *parent, char *name)
 	return file;
 }
 
+Npfile *
+np_ctl_lookup (Npfile *parent, char *name)
+{
+	Npfile *file;
+
+	for (file = parent->child; file != NULL; file = file->next) {
+		if (!strcmp (file->name, name))
+			return file;
+	}
+	np_uerror (ENOENT);
+	return NULL;
+}
+
 void
 np_ctl_finalize (Npsrv *srv)
 {
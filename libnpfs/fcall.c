@@ -353,7 +353,8 @@ np_walk(Npreq *req, Npfcall *tc)
 		np_tpool_incref(fid->tpool);
 		newfid->tpool = fid->tpool;
 		newfid->type = fid->type;
-		if (!(newfid->aname = strdup (fid->aname))) {
+		newfid->aname = np_slab_strdup (conn->srv, fid->aname);
+		if (!newfid->aname) {
 			np_uerror (ENOMEM);
 			goto done;
 		}
@@ -365,24 +366,34 @@ np_walk(Npreq *req, Npfcall *tc)
 		if (np_setfsid (req, newfid->user, -1) < 0)
 			goto done;
 	}
-	for(i = 0; i < tc->u.twalk.nwname;) {
-		if (newfid->type & P9_QTTMP) {
-			if (!np_ctl_walk (newfid, &tc->u.twalk.wnames[i],
-					  &wqids[i]))
-				break;
-		} else {
-			if (!conn->srv->walk) {
-				np_uerror (ENOSYS);
-				break;
-			}
-			if (!(*conn->srv->walk)(newfid, &tc->u.twalk.wnames[i],
+	/* let the backend resolve several components at once if it can */
+	if (!(newfid->type & P9_QTTMP) && conn->srv->walkn
+					&& tc->u.twalk.nwname > 1) {
+		i = (*conn->srv->walkn)(newfid, tc->u.twalk.nwname,
+					tc->u.twalk.wnames, wqids);
+		if (i > 0)
+			newfid->type = wqids[i - 1].type;
+	} else {
+		for(i = 0; i < tc->u.twalk.nwname;) {
+			if (newfid->type & P9_QTTMP) {
+				if (!np_ctl_walk (newfid, &tc->u.twalk.wnames[i],
+						  &wqids[i]))
+					break;
+			} else {
+				if (!conn->srv->walk) {
+					np_uerror (ENOSYS);
+					break;
+				}
+				if (!(*conn->srv->walk)(newfid,
+						&tc->u.twalk.wnames[i],
 						&wqids[i]))
+					break;
+			}
+			newfid->type = wqids[i].type;
+			i++;
+			if (i<(tc->u.twalk.nwname) && !(newfid->type & P9_QTDIR))
 				break;
 		}
-		newfid->type = wqids[i].type;
-		i++;
-		if (i<(tc->u.twalk.nwname) && !(newfid->type & P9_QTDIR))
-			break;
 	}
 
 	if (i==0 && tc->u.twalk.nwname!=0)
@@ -537,6 +548,9 @@ np_clunk(Npreq *req, Npfcall *tc)
 			goto done;
 		}
 		rc = (*req->conn->srv->clunk)(fid);
+		/* N.B. the fid is gone even if the clunk failed */
+		if (!rc)
+			np_fid_decref(fid);
 	}
 done:
 	if (rc && rc->type == P9_RCLUNK)
@@ -840,33 +854,63 @@ done:
 Npfcall *
 np_xattrwalk(Npreq *req, Npfcall *tc)
 {
+	Npconn *conn = req->conn;
 	Npfid *fid = req->fid;
-	Npfid *attrfid;
+	Npfid *attrfid = NULL;
 	Npfcall *rc = NULL;
 
 	if (!fid) {
 		np_uerror (EIO);
 		goto done;
 	}
-	if (!(attrfid = np_fid_find(req->conn, tc->u.txattrwalk.attrfid))) {
-		np_uerror(EIO);
-		goto done;
-	}
-	np_fid_incref(attrfid); /* XXX decref needed? */
 	if (fid->type & P9_QTTMP) {
 		np_uerror (EPERM);
 		goto done;
-	} else {
-		if (np_setfsid (req, fid->user, -1) < 0)
+	}
+	if (!conn->srv->xattrwalk || !conn->srv->clone) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (np_setfsid (req, fid->user, -1) < 0)
+		goto done;
+	/* attrfid is a new fid, cloned from fid as in Twalk, through which
+	 * the attribute value (or the list of names) is read.
+	 */
+	if (tc->u.txattrwalk.attrfid != tc->u.txattrwalk.fid) {
+		if (np_fid_find(conn, tc->u.txattrwalk.attrfid)) {
+			np_uerror(EIO);
 			goto done;
-		if (!req->conn->srv->xattrwalk) {
-			np_uerror (ENOSYS);
+		}
+		attrfid = np_fid_create(conn, tc->u.txattrwalk.attrfid, NULL);
+		if (!attrfid) {
+			np_uerror (ENOMEM);
 			goto done;
 		}
-		rc = (*req->conn->srv->xattrwalk)(fid, attrfid,
-						  &tc->u.txattrwalk.name);
+		np_fid_incref(attrfid);
+		if (!(*conn->srv->clone)(fid, attrfid))
+			goto done;
+		np_user_incref(fid->user);
+		attrfid->user = fid->user;
+		np_tpool_incref(fid->tpool);
+		attrfid->tpool = fid->tpool;
+		attrfid->type = fid->type;
+		attrfid->aname = np_slab_strdup (conn->srv, fid->aname);
+		if (!attrfid->aname) {
+			np_uerror (ENOMEM);
+			goto done;
+		}
+	} else {
+		attrfid = fid;
+		np_fid_incref(attrfid);
+	}
+	rc = (*conn->srv->xattrwalk)(fid, attrfid, &tc->u.txattrwalk.name);
+	if (rc) {
+		attrfid->type &= ~P9_QTDIR; /* readable, even for a directory */
+		if (attrfid != fid)
+			np_fid_incref(attrfid);
 	}
 done:
+	np_fid_decref(attrfid);
 	return rc;
 }
 
@@ -894,6 +938,8 @@ np_xattrcreate(Npreq *req, Npfcall *tc)
 						    &tc->u.txattrcreate.name,
 						    tc->u.txattrcreate.size,
 						    tc->u.txattrcreate.flag);
+		if (rc)
+			fid->type &= ~P9_QTDIR; /* now written like a file */
 	}
 done:
 	return rc;
@@ -951,7 +997,7 @@ np_fsync(Npreq *req, Npfcall *tc)
 			np_uerror (ENOSYS);
 			goto done;
 		}
-		rc = (*req->conn->srv->fsync)(fid);
+		rc = (*req->conn->srv->fsync)(fid, req);
 	}
 done:
 	return rc;
@@ -983,7 +1029,8 @@ np_lock(Npreq *req, Npfcall *tc)
 						tc->u.tlock.start,
 						tc->u.tlock.length,
 						tc->u.tlock.proc_id,
-						&tc->u.tlock.client_id);
+						&tc->u.tlock.client_id,
+						req);
 	}
 done:
 	return rc;
@@ -30,6 +30,9 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include "9p.h"
 #include "npfs.h"
 #include "npfsimpl.h"
@@ -40,6 +43,7 @@ struct Fdtrans {
 	Nptrans*	trans;
 	int 		fdin;
 	int		fdout;
+	int		spin;	/* usec to poll for input before blocking */
 };
 
 static int np_fdtrans_read(u8 *data, u32 count, void *a);
@@ -60,6 +64,7 @@ np_fdtrans_create(int fdin, int fdout)
 
 	fdt->fdin = fdin;
 	fdt->fdout = fdout;
+	fdt->spin = 0;
 	npt = np_trans_create(fdt, np_fdtrans_read, np_fdtrans_write,
 			      np_fdtrans_destroy);
 	if (!npt) {
@@ -86,22 +91,82 @@ np_fdtrans_destroy(void *a)
 	free(fdt);
 }
 
+/* Enable polling reads on a transport created by np_fdtrans_create ().
+ * Only socket fds are polled; others quietly fall back to read ().
+ * Polling is disabled with one CPU since it would starve the workers.
+ */
+void
+np_fdtrans_set_spin(Nptrans *trans, int usec)
+{
+	Fdtrans *fdt = trans->aux;
+
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		usec = 0;
+	fdt->spin = usec;
+}
+
+/* Return the input fd of a transport created by np_fdtrans_create ().
+ */
+int
+np_fdtrans_get_fd(Nptrans *trans)
+{
+	Fdtrans *fdt = trans->aux;
+
+	return fdt->fdin;
+}
+
+static u64
+_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int
 np_fdtrans_read(u8 *data, u32 count, void *a)
 {
 	Fdtrans *fdt;
+	u64 start;
+	int n;
 
 	fdt = a;
+	if (fdt->spin > 0) {
+		start = _now_usec();
+		do {
+			n = recv(fdt->fdin, data, count, MSG_DONTWAIT);
+			if (n >= 0)
+				return n;
+			if (errno == ENOTSOCK) {
+				fdt->spin = 0;
+				break;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK
+					    && errno != EINTR)
+				return n;
+		} while (_now_usec() - start < fdt->spin);
+	}
 	return read(fdt->fdin, data, count);
 }
 
+/* A large message may take several writes to go out on a socket.
+ * Callers treat a short write as a broken connection, so finish it here.
+ */
 static int
 np_fdtrans_write(u8 *data, u32 count, void *a)
 {
 	Fdtrans *fdt;
-	int ret;
+	int n, done = 0;
 
 	fdt = a;
-	ret = write(fdt->fdout, data, count);
-	return ret;
-}	
+	while (done < count) {
+		n = write(fdt->fdout, data + done, count - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n;
+		done += n;
+	}
+	return done;
+}
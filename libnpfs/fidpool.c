@@ -80,12 +80,12 @@ np_fidpool_destroy(Npfidpool *pool)
 					(*srv->fiddestroy)(f);
 			}
 			if (f->aname)
-				free(f->aname);
+				np_slab_free(f->aname);
 			if (f->user)
 				np_user_decref(f->user);
 			if (f->tpool)
 				np_tpool_decref(f->tpool);
-			free(f);
+			np_slab_free(f);
 			f = ff;
 		}
 	}
@@ -110,6 +110,25 @@ np_fidpool_count(Npfidpool *pool)
 	return count;
 }
 
+/* Call fn on each fid in the pool, stopping if it returns nonzero.
+ * fn must not create or destroy fids in this pool.
+ */
+int
+np_fidpool_foreach(Npfidpool *pool, int (*fn)(Npfid *, void *), void *arg)
+{
+	int i, ret = 0;
+	Npfid *f;
+
+	xpthread_mutex_lock(&pool->lock);
+	for(i = 0; i < pool->size && ret == 0; i++) {
+		for (f = pool->htable[i]; f != NULL && ret == 0; f = f->next)
+			ret = fn(f, arg);
+	}
+	xpthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
 Npfid *
 np_fid_lookup(Npfidpool *fp, u32 fid, int hash)
 {
@@ -165,9 +184,8 @@ np_fid_create(Npconn *conn, u32 fid, void *aux)
 	hash = fid % FID_HTABLE_SIZE;
 	f = np_fid_lookup(fp, fid, hash);
 	if (!f) {
-		f = malloc(sizeof(*f));
+		f = np_slab_alloc(conn->srv->fidslab);
 		if (!f) {
-			np_uerror (ENOMEM);
 			xpthread_mutex_unlock(&fp->lock);
 			return NULL;
 		}
@@ -243,12 +261,42 @@ np_fid_destroy(Npfid *fid)
 	if (fid->tpool)
 		np_tpool_decref(fid->tpool);
 	if (fid->aname)
-		free (fid->aname);
-	free(fid);
+		np_slab_free (fid->aname);
+	np_slab_free(fid);
 
 	return;
 }
 
+/* Recreate a fid that was handed over by a previous server instance.
+ * The fid holds the client's reference, as after attach or walk.
+ * On success, takes ownership of the user reference.
+ */
+Npfid *
+np_fid_restore(Npconn *conn, u32 fid, u8 type, Npuser *user, char *aname)
+{
+	Npfid *f;
+
+	if (np_fid_find(conn, fid)) {
+		np_uerror(EEXIST);
+		return NULL;
+	}
+	if (!(f = np_fid_create(conn, fid, NULL))) {
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	f->type = type;
+	if (!(f->aname = np_slab_strdup(conn->srv, aname))) {
+		np_fid_destroy(f);
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	f->user = user;
+	np_tpool_select(f);
+	np_fid_incref(f);
+
+	return f;
+}
+
 void
 np_fid_incref(Npfid *fid)
 {
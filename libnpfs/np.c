@@ -249,6 +249,17 @@ np_set_tag(Npfcall *fc, u16 tag)
 	fc->pkt[6] = tag >> 8;
 }
 
+static Npfcall *
+np_init_common(Npfcall *fc, struct cbuf *bufp, u32 size, u8 id)
+{
+	buf_init(bufp, (char *) fc->pkt, size);
+	buf_put_int32(bufp, size, &fc->size);
+	buf_put_int8(bufp, id, &fc->type);
+	buf_put_int16(bufp, P9_NOTAG, &fc->tag);
+
+	return fc;
+}
+
 static Npfcall *
 np_create_common(struct cbuf *bufp, u32 size, u8 id)
 {
@@ -258,12 +269,8 @@ np_create_common(struct cbuf *bufp, u32 size, u8 id)
 	if (!(fc = malloc(sizeof(Npfcall) + size)))
 		return NULL;
 	fc->pkt = (u8 *) fc + sizeof(*fc);
-	buf_init(bufp, (char *) fc->pkt, size);
-	buf_put_int32(bufp, size, &fc->size);
-	buf_put_int8(bufp, id, &fc->type);
-	buf_put_int16(bufp, P9_NOTAG, &fc->tag);
 
-	return fc;
+	return np_init_common(fc, bufp, size, id);
 }
 
 static Npfcall *
@@ -486,6 +493,33 @@ np_alloc_rread(u32 count)
 	return np_post_check(fc, bufp);
 }
 
+/* Like np_alloc_rread(), but place the data at an address congruent to
+ * phase modulo align (a power of two), so a read at file offset phase
+ * can go straight into it with O_DIRECT.  Free the result with free().
+ */
+Npfcall *
+np_alloc_rread_aligned(u32 count, u32 align, u64 phase)
+{
+	int size = 7 + sizeof(u32) + count;
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+	uintptr_t data;
+	void *p;
+
+	if (posix_memalign(&p, align, sizeof(Npfcall) + align + size) != 0)
+		return NULL;
+	fc = p;
+	data = (uintptr_t) fc + sizeof(*fc) + 7 + sizeof(u32);
+	data += (phase - data) & (align - 1);
+	fc->pkt = (u8 *) data - 7 - sizeof(u32);
+	np_init_common(fc, bufp, size, P9_RREAD);
+	buf_put_int32(bufp, count, &fc->u.rread.count);
+	fc->u.rread.data = buf_alloc(bufp, count);
+
+	return np_post_check(fc, bufp);
+}
+
 Npfcall *
 np_create_rread(u32 count, u8* data)
 {
@@ -1251,6 +1285,24 @@ np_peek_size(u8 *buf, int len)
 	return size;
 }
 
+/* If buf holds the fixed part of a Twrite, set *offsetp to the file
+ * offset it writes and return where its data starts in the message.
+ * Otherwise return 0.
+ */
+int
+np_peek_twrite(u8 *buf, int len, u64 *offsetp)
+{
+	u64 offset = 0;
+	int i;
+
+	if (len < 23 || buf[4] != P9_TWRITE)
+		return 0;
+	for (i = 7; i >= 0; i--)
+		offset = (offset << 8) | buf[11 + i];
+	*offsetp = offset;
+	return 23;
+}
+
 int
 np_deserialize(Npfcall *fc, u8 *data)
 {
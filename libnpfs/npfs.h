@@ -37,8 +37,10 @@ typedef struct Nptpool Nptpool;
 typedef struct Npauth Npauth;
 typedef struct Npsrv Npsrv;
 typedef struct Npuser Npuser;
+typedef struct Npslab Npslab;
 
 #define FID_HTABLE_SIZE 64
+#define NP_STRSLAB_CLASSES 8
 
 struct Npfcall {
 	u32		size;
@@ -160,8 +162,11 @@ struct Npconn {
 	Npfidpool*	fidpool;
 	void*		aux;
 	pthread_t	rthread;
+	int		reading;/* rthread is running */
+	u32		rbufsize;/* receive buffer held for a partial message */
 
 	Npconn*		next;	/* list of connections within a server */
+	Npconn*		prev;
 };
 
 struct Npreq {
@@ -214,6 +219,9 @@ struct Nptpool {
 	Npstats		stats;
 	pthread_cond_t	reqcond;
 	pthread_mutex_t lock;
+	int		spin;	/* max usec to poll for work (-1=srv->spin) */
+	int		spinwin;/* current adaptive poll window in usec */
+	int		nspinning;
 	Nptpool		*next;
 };
 
@@ -263,6 +271,7 @@ struct Npsrv {
 	void		(*logmsg)(const char *, va_list);
 	int		(*remapuser)(Npfid *fid, Npstr *, u32, Npstr *);
 	int		(*auth_required)(Npstr *, u32, Npstr *);
+	int		(*tpool_spin)(char *);
 	Npauth*		auth;
 	int		flags;
 
@@ -273,6 +282,8 @@ struct Npsrv {
 	void		(*flush)(Npreq *req);
 	int		(*clone)(Npfid *fid, Npfid *newfid);
 	int		(*walk)(Npfid *fid, Npstr *wname, Npqid *wqid);
+	int		(*walkn)(Npfid *fid, int nwname, Npstr *wnames,
+				 Npqid *wqids);
 	Npfcall*	(*read)(Npfid *fid, u64 offset, u32 count, Npreq *req);
 	Npfcall*	(*write)(Npfid *fid, u64 offset, u32 count, u8 *data, 
 				Npreq *req);
@@ -292,8 +303,9 @@ struct Npsrv {
 	Npfcall*	(*xattrwalk)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*xattrcreate)(Npfid *, Npstr *, u64, u32);
 	Npfcall*	(*readdir)(Npfid *, u64, u32, Npreq *);
-	Npfcall*	(*fsync)(Npfid *);
-	Npfcall*	(*llock)(Npfid *, u8, u32, u64, u64, u32, Npstr *);
+	Npfcall*	(*fsync)(Npfid *, Npreq *);
+	Npfcall*	(*llock)(Npfid *, u8, u32, u64, u64, u32, Npstr *,
+				 Npreq *);
 	Npfcall*	(*getlock)(Npfid *, u8 type, u64, u64, u32, Npstr *);
 	Npfcall*	(*link)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*mkdir)(Npfid *, Npstr *, u32, u32);
@@ -306,6 +318,10 @@ struct Npsrv {
 	Npconn*		conns;
 	Nptpool*	tpool;
 	int		nwthread;
+	int		spin;	/* default usec to poll for work (0=off) */
+	Npslab*		slabs;
+	Npslab*		fidslab;
+	Npslab*		strslab[NP_STRSLAB_CLASSES];
 };
 
 struct Npuser {
@@ -326,6 +342,12 @@ void np_srv_destroy(Npsrv *srv);
 void np_srv_remove_conn(Npsrv *, Npconn *);
 int np_srv_add_conn(Npsrv *, Npconn *);
 void np_srv_wait_conncount(Npsrv *srv, int count);
+int np_srv_quiesce(Npsrv *srv, int timeout);
+void np_srv_resume(Npsrv *srv);
+void np_req_respond(Npreq *req, Npfcall *rc);
+void np_req_respond_error(Npreq *req, int ecode);
+int np_req_flushed(Npreq *req);
+int np_req_take_adjacent(Npreq *req, Npreq **reqs, int max);
 void np_logerr(Npsrv *srv, const char *fmt, ...)
 	__attribute__ ((format (printf, 2, 3)));
 void np_logmsg(Npsrv *srv, const char *fmt, ...)
@@ -336,6 +358,8 @@ int np_decode_tpools_str (char *s, Npstats *stats);
 
 /* conn.c */
 Npconn *np_conn_create(Npsrv *, Nptrans *, char *);
+Npconn *np_conn_adopt(Npsrv *, Nptrans *, char *, u32, u32);
+int np_conn_start(Npconn *);
 void np_conn_incref(Npconn *);
 void np_conn_decref(Npconn *);
 void np_conn_respond(Npreq *req);
@@ -347,11 +371,23 @@ void np_conn_set_authuser(Npconn *, u32);
 Npfidpool *np_fidpool_create(void);
 void np_fidpool_destroy(Npfidpool *);
 int np_fidpool_count(Npfidpool *pool);
+int np_fidpool_foreach(Npfidpool *pool, int (*fn)(Npfid *, void *), void *arg);
 Npfid *np_fid_find(Npconn *, u32);
 Npfid *np_fid_create(Npconn *, u32, void *);
 void np_fid_destroy(Npfid *);
 void np_fid_incref(Npfid *);
 void np_fid_decref(Npfid *);
+Npfid *np_fid_restore(Npconn *, u32, u8, Npuser *, char *);
+
+/* slab.c */
+Npslab *np_slab_create(Npsrv *srv, char *name, int size);
+void *np_slab_alloc(Npslab *slab);
+void np_slab_free(void *p);
+void *np_slab_stralloc(Npsrv *srv, int len);
+char *np_slab_strndup(Npsrv *srv, char *s, int len);
+char *np_slab_strdup(Npsrv *srv, char *s);
+int np_slab_initialize(Npsrv *srv);
+void np_slab_finalize(Npsrv *srv);
 
 /* trans.c */
 Nptrans *np_trans_create(void *aux, int (*read)(u8 *, u32, void *),
@@ -375,6 +411,7 @@ int np_decode_tpools_str (char *s, Npstats *stats);
 
 /* np.c */
 int np_peek_size(u8 *buf, int len);
+int np_peek_twrite(u8 *buf, int len, u64 *offsetp);
 int np_deserialize(Npfcall*, u8*);
 int np_serialize_p9dirent(Npqid *qid, u64 offset, u8 type, char *name, u8 *buf,
                           int buflen);
@@ -402,6 +439,7 @@ Npfcall *np_create_tremove(u32 fid);
 Npfcall *np_create_rremove(void);
 Npfcall *np_create_tread(u32 fid, u64 offset, u32 count);
 Npfcall * np_alloc_rread(u32);
+Npfcall *np_alloc_rread_aligned(u32 count, u32 align, u64 phase);
 void np_set_rread_count(Npfcall *, u32);
 Npfcall *np_create_rlerror(u32 ecode);
 Npfcall *np_create_tstatfs(u32 fid);
@@ -472,6 +510,8 @@ void np_usercache_destroy (Npsrv *srv);
 
 /* fdtrans.c */
 Nptrans *np_fdtrans_create(int, int);
+void np_fdtrans_set_spin(Nptrans *, int);
+int np_fdtrans_get_fd(Nptrans *);
 
 /* error.c */
 unsigned long np_rerror(void);
@@ -492,4 +532,5 @@ int np_ctl_initialize (Npsrv *srv);
 void np_ctl_finalize (Npsrv *srv);
 Npfile *np_ctl_addfile (Npfile *parent, char *name, SynGetF getf, void *arg);
 Npfile *np_ctl_adddir (Npfile *parent, char *name);
+Npfile *np_ctl_lookup (Npfile *parent, char *name);
 void np_ctl_delfile (Npfile *file);
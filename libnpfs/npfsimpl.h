@@ -50,12 +50,16 @@ Npfcall *np_getlock(Npreq *req, Npfcall *tc);
 Npfcall *np_link(Npreq *req, Npfcall *tc);
 Npfcall *np_mkdir(Npreq *req, Npfcall *tc);
 
+/* conn.c */
+u64 np_conn_get_memsize(Npconn *conn);
+
 /* srv.c */
 void np_srv_add_req(Npsrv *srv, Npreq *req);
 void np_srv_remove_req(Nptpool *tp, Npreq *req);
 Npreq *np_req_alloc(Npconn *conn, Npfcall *tc);
 Npreq *np_req_ref(Npreq*);
 void np_req_unref(Npreq*);
+void np_tpool_select(Npfid *fid);
 
 /* pthread wrappers */
 #define xpthread_mutex_lock(a) do { \
@@ -0,0 +1,369 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* slab.c - fixed size object caches for fids and small strings */
+
+/* Walk/clunk pairs allocate and free an Npfid, the file server's
+ * per-fid state, and one or more path strings.  Rather than bounce
+ * those off malloc, objects are carved out of 64K chunks, one cache
+ * per object type (or string size class), and recycled through a
+ * per-cache free list.  Each object is preceded by a small header
+ * pointing back to its chunk so np_slab_free () needs only the pointer.
+ * Chunks that become empty are returned to the system, except for one
+ * which is kept in reserve to absorb alloc/free oscillation.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#define SLAB_CHUNKSIZE	(64*1024)
+#define SLAB_MINOBJS	16
+#define SLAB_ALIGN	16
+
+#define SLAB_ROUNDUP(n)	(((n) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+typedef struct Slabchunk Slabchunk;
+
+struct Slabchunk {
+	Npslab		*slab;
+	int		inuse;
+	void		*freelist;
+	Slabchunk	*next;
+	Slabchunk	*prev;
+};
+
+/* Object header.  A NULL chunk means the object was too large for any
+ * string size class and came straight from malloc.
+ */
+typedef union {
+	Slabchunk	*chunk;
+	char		pad[SLAB_ALIGN];
+} Slabhdr;
+
+struct Npslab {
+	pthread_mutex_t	lock;
+	char		*name;
+	int		size;		/* requested object size */
+	int		objsize;	/* header + rounded object size */
+	int		perchunk;
+	int		nchunks;
+	int		nempty;
+	int		inuse;
+	u64		allocs;
+	Slabchunk	*avail;		/* chunks with at least one free object */
+	Slabchunk	*full;
+	Npslab		*next;		/* list of slabs within a server */
+};
+
+static int strslab_size[NP_STRSLAB_CLASSES] = {
+	32, 64, 128, 256, 512, 1024, 2048, 4096
+};
+
+static char *_ctl_get_slabs (void *a);
+
+static void
+_chunk_unlink (Slabchunk **list, Slabchunk *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		*list = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	c->next = c->prev = NULL;
+}
+
+static void
+_chunk_push (Slabchunk **list, Slabchunk *c)
+{
+	c->prev = NULL;
+	c->next = *list;
+	if (*list)
+		(*list)->prev = c;
+	*list = c;
+}
+
+static Slabchunk *
+_chunk_create (Npslab *slab)
+{
+	Slabchunk *c;
+	char *p;
+	int i;
+
+	if (!(c = malloc (SLAB_ROUNDUP (sizeof (*c))
+				+ slab->perchunk * slab->objsize)))
+		return NULL;
+	c->slab = slab;
+	c->inuse = 0;
+	c->freelist = NULL;
+	c->next = c->prev = NULL;
+	p = (char *)c + SLAB_ROUNDUP (sizeof (*c));
+	for (i = 0; i < slab->perchunk; i++, p += slab->objsize) {
+		((Slabhdr *)p)->chunk = c;
+		*(void **)(p + sizeof (Slabhdr)) = c->freelist;
+		c->freelist = p + sizeof (Slabhdr);
+	}
+	slab->nchunks++;
+	slab->nempty++;
+	return c;
+}
+
+static void
+_chunk_list_destroy (Slabchunk *c)
+{
+	Slabchunk *next;
+
+	for (; c != NULL; c = next) {
+		next = c->next;
+		free (c);
+	}
+}
+
+Npslab *
+np_slab_create (Npsrv *srv, char *name, int size)
+{
+	Npslab *slab;
+
+	if (!(slab = malloc (sizeof (*slab)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	memset (slab, 0, sizeof (*slab));
+	if (!(slab->name = strdup (name))) {
+		free (slab);
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	pthread_mutex_init (&slab->lock, NULL);
+	if (size < sizeof (void *))
+		size = sizeof (void *);
+	slab->size = size;
+	slab->objsize = sizeof (Slabhdr) + SLAB_ROUNDUP (size);
+	slab->perchunk = SLAB_CHUNKSIZE / slab->objsize;
+	if (slab->perchunk < SLAB_MINOBJS)
+		slab->perchunk = SLAB_MINOBJS;
+
+	xpthread_mutex_lock (&srv->lock);
+	slab->next = srv->slabs;
+	srv->slabs = slab;
+	xpthread_mutex_unlock (&srv->lock);
+
+	return slab;
+}
+
+/* Caller must ensure no objects remain in use.
+ */
+static void
+_slab_destroy (Npslab *slab)
+{
+	_chunk_list_destroy (slab->avail);
+	_chunk_list_destroy (slab->full);
+	pthread_mutex_destroy (&slab->lock);
+	free (slab->name);
+	free (slab);
+}
+
+void *
+np_slab_alloc (Npslab *slab)
+{
+	Slabchunk *c;
+	void *p;
+
+	xpthread_mutex_lock (&slab->lock);
+	if (!(c = slab->avail)) {
+		if (!(c = _chunk_create (slab))) {
+			xpthread_mutex_unlock (&slab->lock);
+			np_uerror (ENOMEM);
+			return NULL;
+		}
+		_chunk_push (&slab->avail, c);
+	}
+	p = c->freelist;
+	c->freelist = *(void **)p;
+	if (c->inuse++ == 0)
+		slab->nempty--;
+	if (!c->freelist) {
+		_chunk_unlink (&slab->avail, c);
+		_chunk_push (&slab->full, c);
+	}
+	slab->inuse++;
+	slab->allocs++;
+	xpthread_mutex_unlock (&slab->lock);
+
+	return p;
+}
+
+void
+np_slab_free (void *p)
+{
+	Slabhdr *h;
+	Slabchunk *c;
+	Npslab *slab;
+
+	if (!p)
+		return;
+	h = (Slabhdr *)((char *)p - sizeof (Slabhdr));
+	if (!(c = h->chunk)) {
+		free (h);
+		return;
+	}
+	slab = c->slab;
+	xpthread_mutex_lock (&slab->lock);
+	if (!c->freelist) {
+		_chunk_unlink (&slab->full, c);
+		_chunk_push (&slab->avail, c);
+	}
+	*(void **)p = c->freelist;
+	c->freelist = p;
+	slab->inuse--;
+	if (--c->inuse == 0) {
+		if (slab->nempty > 0) {
+			_chunk_unlink (&slab->avail, c);
+			free (c);
+			slab->nchunks--;
+		} else
+			slab->nempty++;
+	}
+	xpthread_mutex_unlock (&slab->lock);
+}
+
+/* Allocate len bytes from the smallest string size class that fits.
+ */
+void *
+np_slab_stralloc (Npsrv *srv, int len)
+{
+	Slabhdr *h;
+	int i;
+
+	for (i = 0; i < NP_STRSLAB_CLASSES; i++) {
+		if (len <= strslab_size[i])
+			return np_slab_alloc (srv->strslab[i]);
+	}
+	if (!(h = malloc (sizeof (*h) + len))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	h->chunk = NULL;
+	return (char *)h + sizeof (*h);
+}
+
+char *
+np_slab_strndup (Npsrv *srv, char *s, int len)
+{
+	char *cpy;
+
+	if ((cpy = np_slab_stralloc (srv, len + 1))) {
+		memcpy (cpy, s, len);
+		cpy[len] = '\0';
+	}
+	return cpy;
+}
+
+char *
+np_slab_strdup (Npsrv *srv, char *s)
+{
+	return np_slab_strndup (srv, s, strlen (s));
+}
+
+int
+np_slab_initialize (Npsrv *srv)
+{
+	char name[16];
+	int i;
+
+	if (!(srv->fidslab = np_slab_create (srv, "fid", sizeof (Npfid))))
+		return -1;
+	for (i = 0; i < NP_STRSLAB_CLASSES; i++) {
+		snprintf (name, sizeof (name), "str%d", strslab_size[i]);
+		if (!(srv->strslab[i] = np_slab_create (srv, name,
+							strslab_size[i])))
+			return -1;
+	}
+	if (!np_ctl_addfile (srv->ctlroot, "slabs", _ctl_get_slabs, srv))
+		return -1;
+	return 0;
+}
+
+void
+np_slab_finalize (Npsrv *srv)
+{
+	Npslab *slab, *next;
+
+	for (slab = srv->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		if (slab->inuse > 0)
+			np_logmsg (srv, "slab %s: %d objects not freed",
+				   slab->name, slab->inuse);
+		_slab_destroy (slab);
+	}
+	srv->slabs = NULL;
+}
+
+/* One line per cache:
+ *   name objsize inuse capacity bytes allocs
+ */
+static char *
+_ctl_get_slabs (void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npslab *slab;
+	char *s = NULL;
+	int n, len = 0;
+
+	xpthread_mutex_lock (&srv->lock);
+	for (slab = srv->slabs; slab != NULL; slab = slab->next) {
+		xpthread_mutex_lock (&slab->lock);
+		n = aspf (&s, &len, "%s %d %d %d %"PRIu64" %"PRIu64"\n",
+			  slab->name, slab->size, slab->inuse,
+			  slab->nchunks * slab->perchunk,
+			  (u64)slab->nchunks * (SLAB_ROUNDUP (sizeof (Slabchunk))
+				+ slab->perchunk * slab->objsize),
+			  slab->allocs);
+		xpthread_mutex_unlock (&slab->lock);
+		if (n < 0) {
+			np_uerror (ENOMEM);
+			goto error_unlock;
+		}
+	}
+	xpthread_mutex_unlock (&srv->lock);
+	return s;
+error_unlock:
+	xpthread_mutex_unlock (&srv->lock);
+	if (s)
+		free (s);
+	return NULL;
+}
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "9p.h"
 #include "npfs.h"
@@ -49,12 +50,14 @@ struct Reqpool {
 static Nptpool *np_tpool_create(Npsrv *srv, char *name);
 static void np_tpool_cleanup (Npsrv *srv);
 static void *np_wthread_proc(void *a);
+static int np_wthread_spin(Nptpool *tp);
 static void np_respond(Nptpool *tp, Npreq *req, Npfcall *rc);
 static void np_srv_remove_workreq(Nptpool *tp, Npreq *req);
 static void np_srv_add_workreq(Nptpool *tp, Npreq *req);
 
 static char *_ctl_get_version (void *a);
 static char *_ctl_get_connections (void *a);
+static char *_ctl_get_connmem (void *a);
 static char *_ctl_get_tpools (void *a);
 static char *_ctl_get_requests (void *a);
 
@@ -82,10 +85,14 @@ np_srv_create(int nwthread, int flags)
 	if (!np_ctl_addfile (srv->ctlroot, "connections",
 			     _ctl_get_connections, srv))
 		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "connmem", _ctl_get_connmem, srv))
+		goto error;
 	if (!np_ctl_addfile (srv->ctlroot, "tpools", _ctl_get_tpools, srv))
 		goto error;
 	if (!np_ctl_addfile (srv->ctlroot, "requests", _ctl_get_requests, srv))
 		goto error;
+	if (np_slab_initialize (srv) < 0)
+		goto error;
 	if (np_usercache_create (srv) < 0)
 		goto error;
 	srv->nwthread = nwthread;
@@ -106,6 +113,7 @@ np_srv_destroy(Npsrv *srv)
 	np_tpool_cleanup (srv);
 	np_usercache_destroy (srv);
 	np_ctl_finalize (srv);
+	np_slab_finalize (srv);
 	free (srv);
 }
 
@@ -118,7 +126,10 @@ np_srv_add_conn(Npsrv *srv, Npconn *conn)
 	xpthread_mutex_lock(&srv->lock);
 	np_conn_incref(conn);
 	conn->srv = srv;
+	conn->prev = NULL;
 	conn->next = srv->conns;
+	if (srv->conns)
+		srv->conns->prev = conn;
 	srv->conns = conn;
 	ret = 1;
 	srv->conncount++;
@@ -132,21 +143,14 @@ np_srv_add_conn(Npsrv *srv, Npconn *conn)
 void
 np_srv_remove_conn(Npsrv *srv, Npconn *conn)
 {
-	Npconn *c, **pc;
-
 	xpthread_mutex_lock(&srv->lock);
-	pc = &srv->conns;
-	c = *pc;
-	while (c != NULL) {
-		if (c == conn) {
-			*pc = c->next;
-			c->next = NULL;
-			break;
-		}
-
-		pc = &c->next;
-		c = *pc;
-	}
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else if (srv->conns == conn)
+		srv->conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	conn->next = conn->prev = NULL;
 
 	np_conn_decref(conn);
 	srv->conncount--;
@@ -169,10 +173,113 @@ np_srv_wait_conncount(Npsrv *srv, int count)
 	xpthread_mutex_unlock(&srv->lock);
 }
 
+/* Return nonzero if any connection is still reading or has requests
+ * outstanding.  A connection that is only referenced by the srv is idle.
+ * Call with srv->lock held.
+ */
+static int
+_conns_busy(Npsrv *srv)
+{
+	Npconn *cc;
+	int busy = 0;
+
+	for (cc = srv->conns; cc != NULL && !busy; cc = cc->next) {
+		xpthread_mutex_lock(&cc->lock);
+		if (cc->reading || cc->refcount > 1)
+			busy = 1;
+		xpthread_mutex_unlock(&cc->lock);
+	}
+	return busy;
+}
+
+/* Stop reading requests on all connections and wait for those already
+ * read to be answered, leaving conns, transports and fids intact so they
+ * can be handed to a successor (hot restart).  Readers only stop between
+ * messages.  If that takes more than 'timeout' seconds, service resumes
+ * and -1 is returned with np_rerror () set to ETIMEDOUT.
+ */
+int
+np_srv_quiesce(Npsrv *srv, int timeout)
+{
+	struct timespec deadline, ts;
+	Npconn *cc;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	xpthread_mutex_lock(&srv->lock);
+	for (cc = srv->conns; cc != NULL; cc = cc->next) {
+		if (cc->reading)
+			pthread_cancel(cc->rthread);
+	}
+	/* Readers broadcast conncountcond as they stop, but requests
+	 * completing do not, so poll for those.
+	 */
+	while (_conns_busy(srv)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if (ts.tv_sec > deadline.tv_sec || (ts.tv_sec == deadline.tv_sec
+				    && ts.tv_nsec >= deadline.tv_nsec)) {
+			ret = -1;
+			break;
+		}
+		ts.tv_nsec += 10*1000*1000;
+		if (ts.tv_nsec >= 1000*1000*1000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000*1000*1000;
+		}
+		(void)pthread_cond_timedwait(&srv->conncountcond, &srv->lock,
+					     &ts);
+	}
+	xpthread_mutex_unlock(&srv->lock);
+
+	if (ret < 0) {
+		np_srv_resume(srv);
+		np_uerror(ETIMEDOUT);
+	}
+	return ret;
+}
+
+/* Restart readers stopped by np_srv_quiesce ().
+ */
+void
+np_srv_resume(Npsrv *srv)
+{
+	Npconn *cc, **conns = NULL;
+	int i, n = 0;
+
+	xpthread_mutex_lock(&srv->lock);
+	for (cc = srv->conns; cc != NULL; cc = cc->next)
+		n++;
+	if (n > 0 && !(conns = malloc(n * sizeof(*conns)))) {
+		np_logmsg(srv, "out of memory restarting readers");
+		n = 0;
+	}
+	if (n > 0) {
+		for (n = 0, cc = srv->conns; cc != NULL; cc = cc->next) {
+			if (!cc->reading && cc->trans) {
+				np_conn_incref(cc);
+				conns[n++] = cc;
+			}
+		}
+	}
+	xpthread_mutex_unlock(&srv->lock);
+
+	for (i = 0; i < n; i++) {
+		if (np_conn_start(conns[i]) != 0)
+			np_logmsg(srv, "failed to restart reader for %s",
+				  conns[i]->client_id);
+		np_conn_decref(conns[i]);
+	}
+	if (conns)
+		free(conns);
+}
+
 void
 np_srv_add_req(Npsrv *srv, Npreq *req)
 {
 	Nptpool *tp = NULL;
+	int spinning;
 
 	if (req->fid)
 		tp = req->fid->tpool;
@@ -185,8 +292,10 @@ np_srv_add_req(Npsrv *srv, Npreq *req)
 	tp->reqs_last = req;
 	if (!tp->reqs_first)
 		tp->reqs_first = req;
+	spinning = tp->nspinning;
 	xpthread_mutex_unlock(&tp->lock);
-	xpthread_cond_signal(&tp->reqcond);
+	if (!spinning)
+		xpthread_cond_signal(&tp->reqcond);
 }
 
 void
@@ -306,6 +415,7 @@ np_tpool_create(Npsrv *srv, char *name)
 	}
 	tp->srv = srv;
 	tp->refcount = 0;
+	tp->spin = srv->tpool_spin ? srv->tpool_spin (name) : -1;
 	pthread_mutex_init(&tp->stats.lock, NULL);
 	pthread_mutex_init(&tp->lock, NULL);
 	pthread_cond_init(&tp->reqcond, NULL);
@@ -331,35 +441,35 @@ np_tpool_incref (Nptpool *tp)
 }
 
 void
-np_tpool_select (Npreq *req)
+np_tpool_select (Npfid *fid)
 {
-	Npsrv *srv = req->conn->srv;
+	Npsrv *srv = fid->conn->srv;
 	Nptpool *tp;
 
 	if ((srv->flags & SRV_FLAGS_TPOOL_SINGLE))
 		return;
-	if (!req->fid || !req->fid->aname || *req->fid->aname != '/')
+	if (!fid->aname || *fid->aname != '/')
 		return;
-	if (req->fid->tpool)
+	if (fid->tpool)
 		return;
 
 	xpthread_mutex_lock (&srv->lock);
 	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
-		if (!strcmp (req->fid->aname, tp->name))
+		if (!strcmp (fid->aname, tp->name))
 			break;
 	}
 	if (!tp) {
-		tp = np_tpool_create(srv, req->fid->aname);
+		tp = np_tpool_create(srv, fid->aname);
 		if (tp) {
 			assert (srv->tpool); /* default tpool */
 			tp->next = srv->tpool->next;
 			srv->tpool->next = tp;
 		} else
-			np_logerr (srv, "np_tpool_create %s", req->fid->aname);
+			np_logerr (srv, "np_tpool_create %s", fid->aname);
 	}
 	if (tp) {
 		np_tpool_incref (tp);
-		req->fid->tpool = tp;
+		fid->tpool = tp;
 	}
 	xpthread_mutex_unlock (&srv->lock);
 }
@@ -479,7 +589,9 @@ np_preprocess_request(Npreq *req)
 			req->fid = np_fid_create (conn, tc->u.tauth.afid, NULL);
 			if (!req->fid)
 				break;
-			req->fid->aname = np_strdup (&tc->u.tauth.aname);
+			req->fid->aname = np_slab_strndup (conn->srv,
+						tc->u.tauth.aname.str,
+						tc->u.tauth.aname.len);
 			if (!req->fid->aname) {
 				np_fid_destroy(req->fid);
 				req->fid = NULL;
@@ -495,12 +607,15 @@ np_preprocess_request(Npreq *req)
 			req->fid = np_fid_create (conn, tc->u.tattach.fid,NULL);
 			if (!req->fid)
 				break;
-			req->fid->aname = np_strdup (&tc->u.tattach.aname);
+			req->fid->aname = np_slab_strndup (conn->srv,
+						tc->u.tattach.aname.str,
+						tc->u.tattach.aname.len);
 			if (!req->fid->aname) {
 				np_fid_destroy(req->fid);
 				req->fid = NULL;
 			}
-			np_tpool_select (req);
+			if (req->fid)
+				np_tpool_select (req->fid);
 			break;
 		case P9_TFLUSH:
 			break;
@@ -531,11 +646,16 @@ np_process_request(Npreq *req, Npstats *stats)
 {
 	Npfcall *rc = NULL;
 	Npfcall *tc = req->tcall;
+	u8 type = tc->type;
 	int ecode, valid_op = 1;
 	u64 rbytes = 0, wbytes = 0;
 
+	/* N.B. a handler that returns NULL without an error has handed req
+	 * to np_req_respond (), which may already have freed it, so don't
+	 * touch req or tc once the handler returns.
+	 */
 	np_uerror(0);
-	switch (tc->type) {
+	switch (type) {
 		case P9_TSTATFS:
 			rc = np_statfs(req, tc);
 			break;
@@ -604,11 +724,13 @@ np_process_request(Npreq *req, Npstats *stats)
 			break;
 		case P9_TREAD:
 			rc = np_read(req, tc);
-			rbytes = rc->u.rread.count;
+			if (rc)
+				rbytes = rc->u.rread.count;
 			break;
 		case P9_TWRITE:
 			rc = np_write(req, tc);
-			wbytes = rc->u.rwrite.count;
+			if (rc)
+				wbytes = rc->u.rwrite.count;
 			break;
 		case P9_TCLUNK:
 			rc = np_clunk(req, tc);
@@ -632,7 +754,7 @@ np_process_request(Npreq *req, Npstats *stats)
 		xpthread_mutex_lock (&stats->lock);
 		stats->rbytes += rbytes;
 		stats->wbytes += wbytes;
-		stats->nreqs[tc->type]++;
+		stats->nreqs[type]++;
 		xpthread_mutex_unlock (&stats->lock);
 	}
 
@@ -652,12 +774,19 @@ np_wthread_proc(void *a)
 		wt->state = WT_IDLE;
 		req = tp->reqs_first;
 		if (!req) {
+			if (np_wthread_spin(tp))
+				continue;
 			xpthread_cond_wait(&tp->reqcond, &tp->lock);
 			continue;
 		}
 
 		np_srv_remove_req(tp, req);
 		np_srv_add_workreq(tp, req);
+		/* np_srv_add_req () skips the wakeup while a thread is
+		 * polling, so pass along any backlog.
+		 */
+		if (tp->reqs_first && tp->nspinning == 0)
+			xpthread_cond_signal(&tp->reqcond);
 		xpthread_mutex_unlock(&tp->lock);
 
 		req->wthread = wt;
@@ -675,6 +804,71 @@ np_wthread_proc(void *a)
 	return NULL;
 }
 
+static u64
+_now_usec (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void
+_cpu_relax (void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__ ("pause" ::: "memory");
+#endif
+}
+
+/* Poll the request queue for up to the tpool's spin budget before the
+ * caller sleeps on reqcond.  The window adapts: it doubles (up to the
+ * budget) each time polling finds work, and halves (down to 1/16 of the
+ * budget) each time it times out, so idle tpools stop burning cycles.
+ * Polling is pointless with one CPU since the reader can't run meanwhile.
+ * Called and returns with tp->lock held.  Returns 1 if work is queued.
+ */
+static int
+np_wthread_spin(Nptpool *tp)
+{
+	static int ncpus = 0;
+	int budget = tp->spin >= 0 ? tp->spin : tp->srv->spin;
+	int win, found = 0;
+	u64 start;
+
+	if (budget <= 0)
+		return 0;
+	if (ncpus == 0)
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 2)
+		return 0;
+	if (tp->spinwin <= 0 || tp->spinwin > budget)
+		tp->spinwin = budget;
+	win = tp->spinwin;
+	tp->nspinning++;
+	xpthread_mutex_unlock(&tp->lock);
+
+	start = _now_usec();
+	do {
+		if (__atomic_load_n(&tp->reqs_first, __ATOMIC_ACQUIRE)) {
+			found = 1;
+			break;
+		}
+		_cpu_relax();
+	} while (_now_usec() - start < win);
+
+	xpthread_mutex_lock(&tp->lock);
+	tp->nspinning--;
+	if (found)
+		tp->spinwin = win * 2 < budget ? win * 2 : budget;
+	else
+		tp->spinwin = win / 2 > budget / 16 ? win / 2 : budget / 16;
+	if (tp->spinwin < 1)
+		tp->spinwin = 1;
+
+	return tp->reqs_first != NULL;
+}
+
 static void
 np_respond(Nptpool *tp, Npreq *req, Npfcall *rc)
 {
@@ -719,6 +913,118 @@ np_respond(Nptpool *tp, Npreq *req, Npfcall *rc)
 	np_req_unref(req);
 }
 
+/* Answer a request whose handler returned NULL without setting an error,
+ * deferring the reply.  May be called from any thread, even before the
+ * handler has returned.
+ */
+void
+np_req_respond(Npreq *req, Npfcall *rc)
+{
+	Nptpool *tp = req->wthread->tpool;
+
+	/* np_process_request () only counted the bytes of direct replies */
+	if (rc && (rc->type == P9_RREAD || rc->type == P9_RWRITE)) {
+		xpthread_mutex_lock(&tp->stats.lock);
+		if (rc->type == P9_RREAD)
+			tp->stats.rbytes += rc->u.rread.count;
+		else
+			tp->stats.wbytes += rc->u.rwrite.count;
+		xpthread_mutex_unlock(&tp->stats.lock);
+	}
+	np_respond(tp, req, rc);
+}
+
+void
+np_req_respond_error(Npreq *req, int ecode)
+{
+	np_req_respond(req, np_create_rlerror(ecode));
+}
+
+static int
+_req_extent(Npreq *req, u64 *offp, u32 *countp)
+{
+	Npfcall *tc = req->tcall;
+
+	switch (tc->type) {
+		case P9_TREAD:
+			*offp = tc->u.tread.offset;
+			*countp = tc->u.tread.count;
+			return 1;
+		case P9_TWRITE:
+			*offp = tc->u.twrite.offset;
+			*countp = tc->u.twrite.count;
+			return 1;
+	}
+	return 0;
+}
+
+/* Take requests still queued behind Tread or Twrite req that continue it
+ * on the same fid, each starting where the last left off, so the caller
+ * can do them with one system call.  Up to max are moved to the working
+ * list (as if a worker had picked them up) and stored in reqs in offset
+ * order; the caller must answer each with np_req_respond ().  The scan
+ * does not pass another kind of request on the fid.  Returns the number
+ * taken.
+ */
+int
+np_req_take_adjacent(Npreq *req, Npreq **reqs, int max)
+{
+	Nptpool *tp = req->wthread->tpool;
+	u8 type = req->tcall->type;
+	Npreq *r;
+	u64 end, off;
+	u32 count;
+	int n = 0;
+
+	if (!req->fid || !_req_extent(req, &end, &count))
+		return 0;
+	end += count;
+	xpthread_mutex_lock(&tp->lock);
+again:
+	for (r = tp->reqs_first; r != NULL && n < max; r = r->next) {
+		if (r->fid != req->fid)
+			continue;
+		if (r->tcall->type != type)
+			break;
+		if (!_req_extent(r, &off, &count) || off != end
+				|| count + P9_IOHDRSZ > r->conn->msize)
+			continue;
+		np_srv_remove_req(tp, r);
+		np_srv_add_workreq(tp, r);
+		r->wthread = req->wthread;
+		reqs[n++] = r;
+		end += count;
+		goto again;
+	}
+	xpthread_mutex_unlock(&tp->lock);
+	if (n > 0) {
+		xpthread_mutex_lock(&tp->stats.lock);
+		tp->stats.nreqs[type] += n;
+		xpthread_mutex_unlock(&tp->stats.lock);
+	}
+	return n;
+}
+
+/* Return nonzero if req has been flushed, or its connection is being
+ * reset.  A handler deferring its reply calls this once req is where
+ * srv->flush will find it, to catch a flush that came in before that.
+ */
+int
+np_req_flushed(Npreq *req)
+{
+	int ret;
+
+	xpthread_mutex_lock(&req->lock);
+	ret = (req->flushreq != NULL);
+	xpthread_mutex_unlock(&req->lock);
+	if (!ret) {
+		xpthread_mutex_lock(&req->conn->lock);
+		ret = req->conn->resetting;
+		xpthread_mutex_unlock(&req->conn->lock);
+	}
+	return ret;
+}
+
 Npreq *np_req_alloc(Npconn *conn, Npfcall *tc) {
 	Npreq *req;
 
@@ -863,6 +1169,33 @@ error_unlock:
 	return NULL;
 }
 
+/* Total memory attributable to connection state:
+ *   connections bytes
+ */
+static char *
+_ctl_get_connmem (void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npconn *cc;
+	char *s = NULL;
+	int len = 0, n = 0;
+	u64 bytes = 0;
+
+	xpthread_mutex_lock(&srv->lock);
+	for (cc = srv->conns; cc != NULL; cc = cc->next) {
+		xpthread_mutex_lock(&cc->lock);
+		bytes += np_conn_get_memsize (cc);
+		n++;
+		xpthread_mutex_unlock(&cc->lock);
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	if (aspf (&s, &len, "%d %"PRIu64"\n", n, bytes) < 0) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	return s;
+}
+
 static char *
 _ctl_get_tpools (void *a)
 {
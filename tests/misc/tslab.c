@@ -0,0 +1,108 @@
+/* tslab.c - exercise libnpfs slab allocator (valgrind me) */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "list.h"
+#include "diod_log.h"
+
+#define NOBJS       5000
+#define OBJSIZE     40
+
+static void
+_fill (char *p, int size, int seed)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        p[i] = (char)(seed + i);
+}
+
+static int
+_check (char *p, int size, int seed)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        if (p[i] != (char)(seed + i))
+            return 0;
+    return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    Npslab *slab;
+    char *obj[NOBJS];
+    char *s, *big;
+    int i, ok;
+
+    diod_log_init (argv[0]);
+
+    if (!(srv = np_srv_create (1, 0)))
+        errn_exit (np_rerror (), "np_srv_create");
+    srv->logmsg = diod_log_msg;
+
+    if (!(slab = np_slab_create (srv, "test", OBJSIZE)))
+        errn_exit (np_rerror (), "np_slab_create");
+
+    /* fill several chunks, free every other object, refill */
+    for (i = 0; i < NOBJS; i++) {
+        if (!(obj[i] = np_slab_alloc (slab)))
+            errn_exit (np_rerror (), "np_slab_alloc");
+        _fill (obj[i], OBJSIZE, i);
+    }
+    for (i = 0; i < NOBJS; i += 2)
+        np_slab_free (obj[i]);
+    for (i = 0; i < NOBJS; i += 2) {
+        if (!(obj[i] = np_slab_alloc (slab)))
+            errn_exit (np_rerror (), "np_slab_alloc");
+        _fill (obj[i], OBJSIZE, i);
+    }
+    for (ok = 1, i = 0; i < NOBJS; i++)
+        if (!_check (obj[i], OBJSIZE, i))
+            ok = 0;
+    msg ("objects intact: %s", ok ? "yes" : "no");
+    for (i = 0; i < NOBJS; i++)
+        np_slab_free (obj[i]);
+
+    /* string size classes, including one too large for any class */
+    if (!(s = np_slab_strdup (srv, "/tmp/foo/bar")))
+        errn_exit (np_rerror (), "np_slab_strdup");
+    msg ("strdup: %s", s);
+    np_slab_free (s);
+    if (!(s = np_slab_strndup (srv, "/tmp/foo/bar", 8)))
+        errn_exit (np_rerror (), "np_slab_strndup");
+    msg ("strndup: %s", s);
+    np_slab_free (s);
+    if (!(big = np_slab_stralloc (srv, 3*PATH_MAX)))
+        errn_exit (np_rerror (), "np_slab_stralloc");
+    memset (big, 'x', 3*PATH_MAX - 1);
+    big[3*PATH_MAX - 1] = '\0';
+    msg ("large string: %d bytes", (int)strlen (big));
+    np_slab_free (big);
+
+    np_srv_destroy (srv);
+
+    diod_log_fini ();
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,22 @@
+/* turing.c - can we set up an io_uring? */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+int
+main (int argc, char *argv[])
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset (&p, 0, sizeof (p));
+	if ((fd = syscall (__NR_io_uring_setup, 1, &p)) < 0)
+		return 1;
+	close (fd);
+	return 0;
+}
@@ -0,0 +1,195 @@
+/* tasyncio.c - read and write files concurrently, through io_uring on a miss */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NTHREADS    8
+#define CHUNK       4096
+#define NCHUNKS     256 /* per file */
+
+typedef struct {
+    Npcfid *root;
+    char *aname;
+    int i;
+    pthread_t t;
+} thd_t;
+
+typedef struct {
+    int rings;
+    uint64_t nowait, blocking, submitted, completed;
+    unsigned inflight;
+} Uringstats;
+
+static pthread_barrier_t barrier;
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tasyncio aname\n");
+    exit (1);
+}
+
+static void
+_fill (u8 *buf, int len, u64 offset, int seed)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (offset + i + seed) % 251;
+}
+
+/* Push the server's copy of the file at path out of the page cache.
+ */
+static void
+_uncache (char *path)
+{
+    int fd;
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        err_exit ("open %s", path);
+    if ((errno = posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED)))
+        err_exit ("posix_fadvise %s", path);
+    close (fd);
+}
+
+static void *
+client (void *arg)
+{
+    thd_t *t = arg;
+    u8 buf[CHUNK], cmp[CHUNK];
+    char name[16], path[PATH_MAX];
+    Npcfid *fid;
+    u64 offset;
+    int i;
+
+    snprintf (name, sizeof (name), "f%d", t->i);
+    if (!(fid = npc_create_bypath (t->root, name, O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    pthread_barrier_wait (&barrier);
+    for (i = 0; i < NCHUNKS; i++) {
+        offset = (u64)i * CHUNK;
+        _fill (buf, CHUNK, offset, t->i);
+        if (npc_pwrite (fid, buf, CHUNK, offset) != CHUNK)
+            errn_exit (np_rerror (), "npc_pwrite");
+    }
+    /* so that reads have to go to the disk */
+    if (npc_fsync (fid) < 0)
+        errn_exit (np_rerror (), "npc_fsync");
+    snprintf (path, sizeof (path), "%s/%s", t->aname, name);
+    _uncache (path);
+    for (i = 0; i < NCHUNKS; i++) {
+        offset = (u64)i * CHUNK;
+        if (npc_pread (fid, buf, CHUNK, offset) != CHUNK)
+            errn_exit (np_rerror (), "npc_pread");
+        _fill (cmp, CHUNK, offset, t->i);
+        if (memcmp (buf, cmp, CHUNK) != 0)
+            msg_exit ("%s: bad data at offset %"PRIu64, name, offset);
+    }
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    return NULL;
+}
+
+static void
+_stats (Npcfid *ctl, Uringstats *s)
+{
+    char buf[256];
+    unsigned max;
+    int n, entries;
+
+    if ((n = npc_get (ctl, "uring", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get uring");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %d %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64" %u %u",
+                &s->rings, &entries, &s->nowait, &s->blocking, &s->submitted,
+                &s->completed, &s->inflight, &max) != 8)
+        msg_exit ("could not parse uring: %s", buf);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid;
+    char *aname;
+    thd_t t[NTHREADS];
+    Uringstats s0, s1;
+    int i, err;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, NPC_MULTI_RPC)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    _stats (ctl, &s0);
+    if (s0.rings == 0)
+        msg_exit ("diod is not using io_uring");
+    pthread_barrier_init (&barrier, NULL, NTHREADS);
+    for (i = 0; i < NTHREADS; i++) {
+        t[i].root = root;
+        t[i].aname = aname;
+        t[i].i = i;
+        if ((err = pthread_create (&t[i].t, NULL, client, &t[i])))
+            errn_exit (err, "pthread_create");
+    }
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join (t[i].t, NULL);
+    msg ("%d threads each wrote and read back %d bytes", NTHREADS,
+         NCHUNKS * CHUNK);
+
+    /* reads that missed the page cache went through a ring */
+    _stats (ctl, &s1);
+    msg ("reads and writes: %"PRIu64, s1.nowait - s0.nowait
+                                      + s1.blocking - s0.blocking
+                                      + s1.submitted - s0.submitted);
+    msg ("submitted to a ring: %s", s1.submitted > s0.submitted ? "yes"
+                                                                 : "no");
+    msg ("all completed: %s", s1.completed == s1.submitted
+                           && s1.inflight == 0 ? "yes" : "no");
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,125 @@
+/* tattrcache.c - check that getattr is served from the attribute cache */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NGETATTR 10
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tattrcache aname\n");
+    exit (1);
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n, entries, limit;
+    uint64_t hits, misses, invals;
+
+    if ((n = npc_get (ctl, "attrcache", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get attrcache");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %d %"SCNu64" %"SCNu64" %"SCNu64, &entries, &limit,
+                &hits, &misses, &invals) != 5)
+        msg_exit ("could not parse attrcache: %s", buf);
+    msg ("hits %"PRIu64" misses %"PRIu64" invalidations %"PRIu64,
+         hits, misses, invals);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid;
+    char *aname, path[PATH_MAX];
+    struct stat sb;
+    int i, fd;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if ((fd = creat (path, 0644)) < 0)
+        err_exit ("creat %s", path);
+    close (fd);
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    /* walk fills the cache, so none of these should stat */
+    if (!(fid = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+    for (i = 0; i < NGETATTR; i++) {
+        if (npc_getattr (fid, &sb) < 0)
+            errn_exit (np_rerror (), "npc_getattr");
+    }
+    _stats (ctl);
+
+    /* a change made behind diod's back is noticed */
+    if (chmod (path, 0600) < 0)
+        err_exit ("chmod %s", path);
+    usleep (200000);
+    if (npc_getattr (fid, &sb) < 0)
+        errn_exit (np_rerror (), "npc_getattr");
+    msg ("mode after local chmod: 0%o", sb.st_mode & 0777);
+    _stats (ctl);
+
+    /* a change made through diod is seen immediately */
+    if (npc_open (fid, O_WRONLY) < 0)
+        errn_exit (np_rerror (), "npc_open");
+    if (npc_puts (fid, "hello") < 0)
+        errn_exit (np_rerror (), "npc_puts");
+    if (npc_getattr (fid, &sb) < 0)
+        errn_exit (np_rerror (), "npc_getattr");
+    msg ("size after write: %jd", (intmax_t)sb.st_size);
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,165 @@
+/* tcoalesce.c - stream a file through one fid from several threads */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NTHREADS    8
+#define CHUNK       4096
+#define NCHUNKS     1024
+
+typedef struct {
+    uint64_t rbatches, rmerged, wbatches, wmerged;
+} Coalescestats;
+
+static Npcfid *fid;
+static int next = 0;   /* next chunk to transfer */
+static int writing = 1;
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tcoalesce aname\n");
+    exit (1);
+}
+
+static void
+_fill (u8 *buf, int len, u64 offset)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (offset + i) % 251;
+}
+
+/* Take chunks in order until the file is done, so that the requests the
+ * threads have outstanding at any time are at consecutive offsets.
+ */
+static void *
+client (void *arg)
+{
+    u8 buf[CHUNK], cmp[CHUNK];
+    u64 offset;
+    int i;
+
+    while ((i = __atomic_fetch_add (&next, 1, __ATOMIC_RELAXED)) < NCHUNKS) {
+        offset = (u64)i * CHUNK;
+        _fill (cmp, CHUNK, offset);
+        if (writing) {
+            if (npc_pwrite (fid, cmp, CHUNK, offset) != CHUNK)
+                errn_exit (np_rerror (), "npc_pwrite");
+        } else {
+            if (npc_pread (fid, buf, CHUNK, offset) != CHUNK)
+                errn_exit (np_rerror (), "npc_pread");
+            if (memcmp (buf, cmp, CHUNK) != 0)
+                msg_exit ("bad data at offset %"PRIu64, offset);
+        }
+    }
+    return NULL;
+}
+
+static void
+_run (void)
+{
+    pthread_t t[NTHREADS];
+    int i, err;
+
+    next = 0;
+    for (i = 0; i < NTHREADS; i++) {
+        if ((err = pthread_create (&t[i], NULL, client, NULL)))
+            errn_exit (err, "pthread_create");
+    }
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join (t[i], NULL);
+}
+
+static void
+_stats (Npcfid *ctl, Coalescestats *s)
+{
+    char buf[256];
+    int n;
+
+    if ((n = npc_get (ctl, "coalesce", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get coalesce");
+    buf[n] = '\0';
+    if (sscanf (buf, "%"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64,
+                &s->rbatches, &s->rmerged, &s->wbatches, &s->wmerged) != 4)
+        msg_exit ("could not parse coalesce: %s", buf);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid;
+    char *aname;
+    Coalescestats s0, s1, s2;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, NPC_MULTI_RPC)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+    if (!(fid = npc_create_bypath (root, "f", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+
+    _stats (ctl, &s0);
+    _run ();
+    _stats (ctl, &s1);
+    writing = 0;
+    _run ();
+    _stats (ctl, &s2);
+    msg ("%d threads wrote and read back %d bytes", NTHREADS,
+         NCHUNKS * CHUNK);
+
+    /* with one worker, requests pile up behind it and are merged */
+    msg ("writes merged: %s", s1.wmerged > s0.wmerged
+                           && s1.wbatches > s0.wbatches ? "yes" : "no");
+    msg ("reads merged: %s", s2.rmerged > s1.rmerged
+                          && s2.rbatches > s1.rbatches ? "yes" : "no");
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,159 @@
+/* tdircache.c - check that concurrent listings share a directory snapshot */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NFILES  100
+#define NFIDS   4
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tdircache aname\n");
+    exit (1);
+}
+
+static void
+_creat (char *aname, int i)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf (path, sizeof (path), "%s/dir/f%d", aname, i);
+    if ((fd = creat (path, 0644)) < 0)
+        err_exit ("creat %s", path);
+    close (fd);
+}
+
+/* Count the entries of open directory fid, reading from the top.
+ */
+static int
+_count (Npcfid *fid)
+{
+    u8 buf[4096];
+    char name[PATH_MAX];
+    Npqid qid;
+    u64 off, offset = 0;
+    u8 type;
+    int i, n, len, count = 0;
+
+    while ((len = npc_readdir (fid, offset, buf, sizeof (buf))) > 0) {
+        for (i = 0; i < len; i += n) {
+            n = np_deserialize_p9dirent (&qid, &off, &type, name,
+                                         sizeof (name), buf + i, len - i);
+            if (n == 0)
+                msg_exit ("could not decode dirent");
+            count++;
+            offset = off;
+        }
+    }
+    if (len < 0)
+        errn_exit (np_rerror (), "npc_readdir");
+    return count;
+}
+
+static void
+_stats (Npcfid *root)
+{
+    char buf[256];
+    int n, snaps;
+    size_t size, limit;
+    uint64_t hits, misses, uncached;
+
+    if ((n = npc_get (root, "dircache", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get dircache");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %zu %zu %"SCNu64" %"SCNu64" %"SCNu64, &snaps,
+                &size, &limit, &hits, &misses, &uncached) != 6)
+        msg_exit ("could not parse dircache: %s", buf);
+    msg ("snapshots %d hits %"PRIu64" misses %"PRIu64" uncached %"PRIu64,
+         snaps, hits, misses, uncached);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid[NFIDS];
+    char *aname, path[PATH_MAX];
+    int i;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/dir", aname);
+    if (mkdir (path, 0755) < 0)
+        err_exit ("mkdir %s", path);
+    for (i = 0; i < NFILES; i++)
+        _creat (aname, i);
+    usleep (200000); /* let the directory's timestamps settle */
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    /* open all fids first, so the listings are concurrent streams */
+    for (i = 0; i < NFIDS; i++) {
+        if (!(fid[i] = npc_walk (root, "dir")))
+            errn_exit (np_rerror (), "npc_walk");
+        if (npc_open (fid[i], O_RDONLY) < 0)
+            errn_exit (np_rerror (), "npc_open");
+    }
+    for (i = 0; i < NFIDS; i++)
+        msg ("fid %d: %d entries", i, _count (fid[i]));
+    _stats (ctl);
+
+    /* a change to the directory invalidates the snapshot */
+    _creat (aname, NFILES);
+    usleep (200000);
+    msg ("after create: %d entries", _count (fid[0]));
+    _stats (ctl);
+
+    for (i = 0; i < NFIDS; i++) {
+        if (npc_clunk (fid[i]) < 0)
+            errn_exit (np_rerror (), "npc_clunk");
+    }
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
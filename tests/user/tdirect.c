@@ -0,0 +1,249 @@
+/* tdirect.c - move a file through a direct export and a buffered one */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define FILESIZE    (64*1024*1024)
+#define MSIZE       (4*1024*1024)
+
+/* Counters from the directio ctl file.
+ */
+typedef struct {
+    uint64_t rdirect, rbuffered, wdirect, wbuffered, fallbacks;
+} Diostats;
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tdirect [-v] aname\n");
+    exit (1);
+}
+
+static double
+_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+static void
+_fill (u8 *buf, int len, u64 offset)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (offset + i) % 251;
+}
+
+static void
+_stats (Npcfid *ctl, Diostats *s)
+{
+    char buf[256];
+    int n;
+
+    if ((n = npc_get (ctl, "directio", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get directio");
+    buf[n] = '\0';
+    if (sscanf (buf, "%"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64,
+                &s->rdirect, &s->rbuffered, &s->wdirect, &s->wbuffered,
+                &s->fallbacks) != 5)
+        msg_exit ("could not parse directio: %s", buf);
+}
+
+/* Return the percentage of the local file at path in the page cache.
+ */
+static int
+_resident (char *path)
+{
+    long pagesize = sysconf (_SC_PAGESIZE);
+    size_t i, pages = FILESIZE / pagesize, count = 0;
+    unsigned char *vec;
+    void *p;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        err_exit ("open %s", path);
+    if ((p = mmap (NULL, FILESIZE, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        err_exit ("mmap %s", path);
+    if (!(vec = malloc (pages)))
+        msg_exit ("out of memory");
+    if (mincore (p, FILESIZE, vec) < 0)
+        err_exit ("mincore %s", path);
+    for (i = 0; i < pages; i++)
+        if ((vec[i] & 1))
+            count++;
+    free (vec);
+    munmap (p, FILESIZE);
+    close (fd);
+    return count * 100 / pages;
+}
+
+/* Write then read back FILESIZE bytes of a new file in chunks of the
+ * largest power of two within the iounit.  Return the seconds each took.
+ */
+static void
+_transfer (Npcfid *root, char *name, u8 *buf, u8 *cmp, double *wp, double *rp)
+{
+    Npcfid *fid;
+    u64 offset;
+    double t;
+    int n, len;
+
+    if (!(fid = npc_create_bypath (root, name, O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath %s", name);
+    for (len = 4096; len * 2 <= fid->iounit && len * 2 <= FILESIZE; len *= 2)
+        ;
+    t = _now ();
+    for (offset = 0; offset < FILESIZE; offset += n) {
+        _fill (buf, len, offset);
+        if ((n = npc_pwrite (fid, buf, len, offset)) != len)
+            errn_exit (np_rerror (), "npc_pwrite %s", name);
+    }
+    *wp = _now () - t;
+    t = _now ();
+    for (offset = 0; offset < FILESIZE; offset += n) {
+        if ((n = npc_pread (fid, buf, len, offset)) != len)
+            errn_exit (np_rerror (), "npc_pread %s", name);
+        _fill (cmp, len, offset);
+        if (memcmp (buf, cmp, len) != 0)
+            msg_exit ("%s: bad data at offset %"PRIu64, name, offset);
+    }
+    *rp = _now () - t;
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+}
+
+/* Write a range that starts and ends off alignment, and read it back
+ * with a read that runs past the end of the file.
+ */
+static void
+_unaligned (Npcfid *root, u8 *buf, u8 *cmp)
+{
+    Npcfid *fid;
+    int n;
+
+    if (!(fid = npc_create_bypath (root, "unaligned", O_RDWR, 0644,
+                                   getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath unaligned");
+    _fill (buf, 10000, 1000);
+    if (npc_pwrite (fid, buf, 10000, 1000) != 10000)
+        errn_exit (np_rerror (), "npc_pwrite unaligned");
+    if ((n = npc_pread (fid, buf, 12000, 0)) < 0)
+        errn_exit (np_rerror (), "npc_pread unaligned");
+    memset (cmp, 0, 1000);
+    _fill (cmp + 1000, 10000, 1000);
+    msg ("unaligned: %s", n == 11000 && memcmp (buf, cmp, n) == 0 ? "ok"
+                                                                : "bad");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *afid, *root, *droot, *ctl;
+    Diostats s0, s1, s2;
+    char *aname, daname[PATH_MAX], path[PATH_MAX];
+    u8 *buf, *cmp;
+    double w, r;
+    int verbose = 0;
+
+    diod_log_init (argv[0]);
+
+    if (argc > 1 && !strcmp (argv[1], "-v")) {
+        verbose = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+    snprintf (daname, sizeof (daname), "%s/direct", aname);
+    if (!(buf = malloc (MSIZE)) || !(cmp = malloc (MSIZE)))
+        msg_exit ("out of memory");
+
+    if (!(fs = npc_start (0, MSIZE, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(droot = npc_attach (fs, afid, daname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach %s", daname);
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    _stats (ctl, &s0);
+    _transfer (root, "f", buf, cmp, &w, &r);
+    snprintf (path, sizeof (path), "%s/f", aname);
+    msg ("buffered: %s", _resident (path) > 50 ? "cached" : "not cached");
+    if (verbose)
+        msg ("buffered: write %.0f MB/s read %.0f MB/s",
+             FILESIZE / w / 1E6, FILESIZE / r / 1E6);
+
+    _transfer (droot, "f", buf, cmp, &w, &r);
+    snprintf (path, sizeof (path), "%s/f", daname);
+    msg ("direct: %s", _resident (path) > 50 ? "cached" : "not cached");
+    if (verbose)
+        msg ("direct: write %.0f MB/s read %.0f MB/s",
+             FILESIZE / w / 1E6, FILESIZE / r / 1E6);
+
+    /* only the direct export's bulk transfer went direct, all of it */
+    _stats (ctl, &s1);
+    msg ("bulk: %s", s1.rdirect - s0.rdirect == FILESIZE
+                  && s1.wdirect - s0.wdirect == FILESIZE
+                  && s1.rbuffered == s0.rbuffered
+                  && s1.wbuffered == s0.wbuffered ? "direct" : "not direct");
+
+    /* the unaligned head and tail of a write go through the page cache */
+    _unaligned (droot, buf, cmp);
+    _stats (ctl, &s2);
+    msg ("unaligned write: %s", s2.wdirect > s1.wdirect
+                             && s2.wbuffered > s1.wbuffered ? "split"
+                                                            : "not split");
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (droot) < 0)
+        errn_exit (np_rerror (), "npc_clunk droot");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+    free (buf);
+    free (cmp);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,258 @@
+/* televator.c - read and write files at random through an export's elevator */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NTHREADS    8
+#define NWORKERS    2   /* diod -w, from runtest */
+#define CHUNK       4096
+#define NCHUNKS     256 /* per file */
+
+typedef struct {
+    Npcfid *root;
+    char *aname;
+    int i;
+    pthread_t t;
+} thd_t;
+
+typedef struct {
+    int depth, active, waiting;
+    uint64_t dispatched, waited, expired;
+} Elvstats;
+
+static int running = NTHREADS;
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: televator aname\n");
+    exit (1);
+}
+
+static void
+_fill (u8 *buf, int len, u64 offset, int seed)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (offset + i + seed) % 251;
+}
+
+/* Fill order with 0..n-1 shuffled.
+ */
+static void
+_shuffle (int *order, int n, unsigned int *seedp)
+{
+    int i, j, tmp;
+
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        j = rand_r (seedp) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* Push the server's copy of the file at path out of the page cache.
+ */
+static void
+_uncache (char *path)
+{
+    int fd;
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        err_exit ("open %s", path);
+    if ((errno = posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED)))
+        err_exit ("posix_fadvise %s", path);
+    close (fd);
+}
+
+static void *
+client (void *arg)
+{
+    thd_t *t = arg;
+    u8 buf[CHUNK], cmp[CHUNK];
+    char name[16], path[PATH_MAX];
+    int order[NCHUNKS];
+    unsigned int seed = t->i;
+    Npcfid *fid;
+    u64 offset;
+    int i;
+
+    snprintf (name, sizeof (name), "f%d", t->i);
+    if (!(fid = npc_create_bypath (t->root, name, O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    _shuffle (order, NCHUNKS, &seed);
+    for (i = 0; i < NCHUNKS; i++) {
+        offset = (u64)order[i] * CHUNK;
+        _fill (buf, CHUNK, offset, t->i);
+        if (npc_pwrite (fid, buf, CHUNK, offset) != CHUNK)
+            errn_exit (np_rerror (), "npc_pwrite");
+    }
+    /* so that reads have to go to the disk */
+    if (npc_fsync (fid) < 0)
+        errn_exit (np_rerror (), "npc_fsync");
+    snprintf (path, sizeof (path), "%s/%s", t->aname, name);
+    _uncache (path);
+    _shuffle (order, NCHUNKS, &seed);
+    for (i = 0; i < NCHUNKS; i++) {
+        offset = (u64)order[i] * CHUNK;
+        if (npc_pread (fid, buf, CHUNK, offset) != CHUNK)
+            errn_exit (np_rerror (), "npc_pread");
+        _fill (cmp, CHUNK, offset, t->i);
+        if (memcmp (buf, cmp, CHUNK) != 0)
+            msg_exit ("%s: bad data at offset %"PRIu64, name, offset);
+    }
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    pthread_mutex_lock (&running_lock);
+    running--;
+    pthread_mutex_unlock (&running_lock);
+    return NULL;
+}
+
+/* Return the most reads and writes that have been in flight on one
+ * io_uring ring, or -1 if diod has no rings.
+ */
+static int
+_uring_maxinflight (Npcfid *ctl)
+{
+    char buf[256];
+    int n, rings, entries;
+    uint64_t nowait, blocking, submitted, completed;
+    unsigned inflight, maxinflight;
+
+    if ((n = npc_get (ctl, "uring", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get uring");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %d %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64" %u %u",
+                &rings, &entries, &nowait, &blocking, &submitted, &completed,
+                &inflight, &maxinflight) != 8)
+        msg_exit ("could not parse uring: %s", buf);
+    return rings > 0 ? maxinflight : -1;
+}
+
+/* Find the line for the export at aname in the elevator ctl file.
+ */
+static void
+_stats (Npcfid *ctl, char *aname, Elvstats *s)
+{
+    char buf[4096], path[PATH_MAX], *line;
+    int n;
+
+    if ((n = npc_get (ctl, "elevator", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get elevator");
+    buf[n] = '\0';
+    for (line = strtok (buf, "\n"); line; line = strtok (NULL, "\n")) {
+        if (sscanf (line, "%s %d %d %d %"SCNu64" %"SCNu64" %"SCNu64, path,
+                    &s->depth, &s->active, &s->waiting, &s->dispatched,
+                    &s->waited, &s->expired) != 7)
+            msg_exit ("could not parse elevator: %s", line);
+        if (!strcmp (path, aname))
+            return;
+    }
+    msg_exit ("%s has no elevator", aname);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid;
+    char *aname;
+    thd_t t[NTHREADS];
+    Elvstats s;
+    int i, err, n, maxwaiting = 0, maxinflight;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, NPC_MULTI_RPC)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    for (i = 0; i < NTHREADS; i++) {
+        t[i].root = root;
+        t[i].aname = aname;
+        t[i].i = i;
+        if ((err = pthread_create (&t[i].t, NULL, client, &t[i])))
+            errn_exit (err, "pthread_create");
+    }
+    /* Watch the queue while they run.  Reading the ctl file takes a
+     * worker, so it can only see more waiting than there are workers
+     * if waiting requests do not hold theirs.
+     */
+    do {
+        _stats (ctl, aname, &s);
+        if (s.waiting > maxwaiting)
+            maxwaiting = s.waiting;
+        usleep (1000);
+        pthread_mutex_lock (&running_lock);
+        n = running;
+        pthread_mutex_unlock (&running_lock);
+    } while (n > 0);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join (t[i].t, NULL);
+    msg ("%d threads each wrote and read back %d bytes at random",
+         NTHREADS, NCHUNKS * CHUNK);
+
+    _stats (ctl, aname, &s);
+    msg ("depth: %d", s.depth);
+    /* reads from the disk queued up behind the one let through */
+    msg ("requests waited their turn: %s", s.waited > 0 ? "yes" : "no");
+    msg ("more waited than there are workers: %s",
+         maxwaiting > NWORKERS ? "yes" : "no");
+    msg ("all dispatched: %s", s.active == 0 && s.waiting == 0
+                               && s.dispatched > 0 ? "yes" : "no");
+    /* an I/O handed to io_uring holds its slot until it completes */
+    maxinflight = _uring_maxinflight (ctl);
+    msg ("io_uring in flight within depth: %s",
+         maxinflight <= s.depth ? "yes" : "no");
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
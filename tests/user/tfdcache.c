@@ -0,0 +1,142 @@
+/* tfdcache.c - check that repeated opens share a file descriptor */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NOPEN   10
+#define TESTSTR "hello\n"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tfdcache aname\n");
+    exit (1);
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n, nopen, idle, limit;
+    uint64_t hits, misses;
+
+    if ((n = npc_get (ctl, "fdcache", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get fdcache");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %d %d %"SCNu64" %"SCNu64, &nopen, &idle, &limit,
+                &hits, &misses) != 5)
+        msg_exit ("could not parse fdcache: %s", buf);
+    msg ("hits %"PRIu64" misses %"PRIu64, hits, misses);
+}
+
+static char *
+_lockstatus (int status)
+{
+    switch (status) {
+        case P9_LOCK_SUCCESS:
+            return "success";
+        case P9_LOCK_BLOCKED:
+            return "blocked";
+        default:
+            return "error";
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid, *fid2;
+    char *aname, path[PATH_MAX], buf[sizeof (TESTSTR)];
+    int i, fd, n, ok = 1;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if ((fd = creat (path, 0644)) < 0)
+        err_exit ("creat %s", path);
+    if (write (fd, TESTSTR, strlen (TESTSTR)) < 0)
+        err_exit ("write %s", path);
+    close (fd);
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    /* only the first open should reach the file system */
+    for (i = 0; i < NOPEN; i++) {
+        if (!(fid = npc_open_bypath (root, "f", O_RDONLY)))
+            errn_exit (np_rerror (), "npc_open_bypath");
+        if ((n = npc_read (fid, buf, sizeof (buf) - 1)) < 0)
+            errn_exit (np_rerror (), "npc_read");
+        buf[n] = '\0';
+        if (strcmp (buf, TESTSTR) != 0)
+            ok = 0;
+        if (npc_clunk (fid) < 0)
+            errn_exit (np_rerror (), "npc_clunk");
+    }
+    msg ("%d opens read %s", NOPEN, ok ? "ok" : "bad data");
+    _stats (ctl);
+
+    /* fids sharing a descriptor must not share flocks */
+    if (!(fid = npc_open_bypath (root, "f", O_RDWR)))
+        errn_exit (np_rerror (), "npc_open_bypath");
+    if (!(fid2 = npc_open_bypath (root, "f", O_RDWR)))
+        errn_exit (np_rerror (), "npc_open_bypath");
+    if ((n = npc_lock (fid, F_WRLCK, 0, 0, 0)) < 0)
+        errn_exit (np_rerror (), "npc_lock");
+    msg ("first write lock: %s", _lockstatus (n));
+    if ((n = npc_lock (fid2, F_WRLCK, 0, 0, 0)) < 0)
+        errn_exit (np_rerror (), "npc_lock");
+    msg ("second write lock: %s", _lockstatus (n));
+    _stats (ctl);
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (fid2) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
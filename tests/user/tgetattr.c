@@ -0,0 +1,99 @@
+/* tgetattr.c - check that getattr returns what it is asked for */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define TESTSTR "hello\n"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tgetattr aname\n");
+    exit (1);
+}
+
+static char *
+_yesno (int b)
+{
+    return b ? "yes" : "no";
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *fid;
+    char *aname, path[PATH_MAX];
+    struct timespec btime;
+    struct stat sb, lsb;
+    u64 valid;
+    int fd;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if ((fd = creat (path, 0640)) < 0)
+        err_exit ("creat %s", path);
+    if (write (fd, TESTSTR, strlen (TESTSTR)) < 0)
+        err_exit ("write %s", path);
+    close (fd);
+    if (stat (path, &lsb) < 0)
+        err_exit ("stat %s", path);
+
+    if (!(root = npc_mount (0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+    if (!(fid = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+
+    if (npc_getattr_mask (fid, P9_GETATTR_MODE, &valid, &sb, NULL) < 0)
+        errn_exit (np_rerror (), "npc_getattr_mask");
+    msg ("mode only: mode valid %s, mode correct %s",
+         _yesno (valid & P9_GETATTR_MODE), _yesno (sb.st_mode == lsb.st_mode));
+
+    if (npc_getattr_mask (fid, P9_GETATTR_ALL, &valid, &sb, &btime) < 0)
+        errn_exit (np_rerror (), "npc_getattr_mask");
+    msg ("all: basic valid %s, size correct %s",
+         _yesno ((valid & P9_GETATTR_BASIC) == P9_GETATTR_BASIC),
+         _yesno (sb.st_size == lsb.st_size));
+    msg ("all: btime sane %s", _yesno (!(valid & P9_GETATTR_BTIME)
+                                       || (btime.tv_sec > 0
+                                        && btime.tv_sec <= sb.st_mtime)));
+    msg ("all: data version valid %s",
+         _yesno (valid & P9_GETATTR_DATA_VERSION));
+    msg ("all: gen valid on unopened fid %s", _yesno (valid & P9_GETATTR_GEN));
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    npc_umount (root);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,133 @@
+/* tgroupcommit.c - fsync files concurrently */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NTHREADS    8
+#define NSYNCS      4   /* per thread */
+#define TESTSTR     "hello\n"
+
+typedef struct {
+    Npcfid *root;
+    int i;
+    pthread_t t;
+} thd_t;
+
+static pthread_barrier_t barrier;
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tgroupcommit aname\n");
+    exit (1);
+}
+
+static void *
+client (void *arg)
+{
+    thd_t *t = arg;
+    char name[16];
+    Npcfid *fid;
+    int i;
+
+    snprintf (name, sizeof (name), "f%d", t->i);
+    if (!(fid = npc_create_bypath (t->root, name, O_WRONLY, 0644,
+                                   getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    pthread_barrier_wait (&barrier);
+    for (i = 0; i < NSYNCS; i++) {
+        if (npc_puts (fid, TESTSTR) < 0)
+            errn_exit (np_rerror (), "npc_puts");
+        if (npc_fsync (fid) < 0)
+            errn_exit (np_rerror (), "npc_fsync");
+    }
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid;
+    char *aname, buf[256];
+    thd_t t[NTHREADS];
+    uint64_t requests, commits, syncfs, mean, max;
+    int i, n, err;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, NPC_MULTI_RPC)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    pthread_barrier_init (&barrier, NULL, NTHREADS);
+    for (i = 0; i < NTHREADS; i++) {
+        t[i].root = root;
+        t[i].i = i;
+        if ((err = pthread_create (&t[i].t, NULL, client, &t[i])))
+            errn_exit (err, "pthread_create");
+    }
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join (t[i].t, NULL);
+    msg ("%d threads each wrote and synced %d times", NTHREADS, NSYNCS);
+
+    if ((n = npc_get (ctl, "fsync", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get fsync");
+    buf[n] = '\0';
+    if (sscanf (buf, "%"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64,
+                &requests, &commits, &syncfs, &mean, &max) != 5)
+        msg_exit ("could not parse fsync: %s", buf);
+    msg ("requests %"PRIu64, requests);
+    msg ("commits no more than requests: %s",
+         commits > 0 && commits <= requests ? "yes" : "no");
+    msg ("some commits shared: %s",
+         commits < requests || syncfs > 0 ? "yes" : "no");
+    msg ("max latency no less than mean: %s", max >= mean ? "yes" : "no");
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,143 @@
+/* thandle.c - check that walked fids follow their object, not its path */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+#include "npcimpl.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define TESTSTR "hello from a renamed directory\n"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: thandle aname\n");
+    exit (1);
+}
+
+static void
+_rename (char *aname, char *old, char *new)
+{
+    char opath[PATH_MAX], npath[PATH_MAX];
+
+    snprintf (opath, sizeof (opath), "%s/%s", aname, old);
+    snprintf (npath, sizeof (npath), "%s/%s", aname, new);
+    if (rename (opath, npath) < 0)
+        err_exit ("rename %s %s", opath, npath);
+}
+
+/* Walk fid to fid/name1/name2 in place (newfid == fid), in one Twalk.
+ * Return 0 on success, or -1 with np_rerror () set.
+ */
+static int
+_walk2 (Npcfid *fid, char *name1, char *name2)
+{
+    char *wnames[] = { name1, name2 };
+    Npfcall *tc, *rc = NULL;
+    int ret;
+
+    if (!(tc = np_create_twalk (fid->fid, fid->fid, 2, wnames)))
+        msg_exit ("out of memory");
+    ret = fid->fsys->rpc (fid->fsys, tc, &rc);
+    free (tc);
+    if (rc)
+        free (rc);
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *fid, *dfid, *odir;
+    char *aname, path[PATH_MAX];
+    char buf[sizeof (TESTSTR)];
+    struct stat sb;
+    int n;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(root = npc_mount (0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+
+    if (npc_mkdir_bypath (root, "a", 0755) < 0)
+        errn_exit (np_rerror (), "npc_mkdir_bypath");
+    if (!(fid = npc_create_bypath (root, "a/f", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (npc_puts (fid, TESTSTR) < 0)
+        errn_exit (np_rerror (), "npc_puts");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (!(fid = npc_walk (root, "a/f")))
+        errn_exit (np_rerror (), "npc_walk");
+    if (!(dfid = npc_walk (root, "a")))
+        errn_exit (np_rerror (), "npc_walk");
+
+    /* move the parent out from under both fids on the server side */
+    _rename (aname, "a", "b");
+
+    if (npc_getattr (fid, &sb) < 0)
+        errn_exit (np_rerror (), "npc_getattr");
+    msg ("getattr after rename: %s", S_ISREG (sb.st_mode) ? "ok" : "bad");
+    if (npc_open (fid, O_RDONLY) < 0)
+        errn_exit (np_rerror (), "npc_open");
+    if ((n = npc_read (fid, buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_read");
+    buf[n] = '\0';
+    msg ("read after rename: %s", !strcmp (buf, TESTSTR) ? "ok" : "bad");
+
+    /* an open fid cannot be walked in place, even two steps at once */
+    snprintf (path, sizeof (path), "%s/b/c", aname);
+    if (mkdir (path, 0755) < 0)
+        err_exit ("mkdir %s", path);
+    snprintf (path, sizeof (path), "%s/b/c/d", aname);
+    if (mkdir (path, 0755) < 0)
+        err_exit ("mkdir %s", path);
+    if (!(odir = npc_walk (root, "b")))
+        errn_exit (np_rerror (), "npc_walk");
+    if (npc_open (odir, O_RDONLY) < 0)
+        errn_exit (np_rerror (), "npc_open");
+    n = _walk2 (odir, "c", "d");
+    msg ("walk open fid in place: %s", n < 0 && np_rerror () == EBUSY
+                                       ? "busy" : "allowed");
+    if (npc_clunk (odir) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+
+    if (npc_create (dfid, "g", O_RDWR, 0644, getegid ()) < 0)
+        errn_exit (np_rerror (), "npc_create");
+    snprintf (path, sizeof (path), "%s/b/g", aname);
+    msg ("create after rename: %s", access (path, F_OK) == 0 ? "ok" : "bad");
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (dfid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    npc_umount (root);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,138 @@
+/* tlatency.c - measure round trip latency of small 9p requests */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tlatency [-v] [-w depth] count aname\n");
+    exit (1);
+}
+
+static uint64_t
+_now_nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+_cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Create a chain of depth nested directories and return its path.
+ */
+static char *
+_mkchain (Npcfid *root, int depth)
+{
+    char *path;
+    int i;
+
+    if (!(path = malloc (depth * 2 + 1)))
+        msg_exit ("out of memory");
+    path[0] = '\0';
+    for (i = 0; i < depth; i++) {
+        strcat (path, i == 0 ? "d" : "/d");
+        if (npc_mkdir_bypath (root, path, 0755) < 0)
+            errn_exit (np_rerror (), "npc_mkdir_bypath %s", path);
+    }
+    return path;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *fid;
+    struct stat sb;
+    uint64_t *lat, t;
+    char *aname, *path = NULL;
+    int i, count, verbose = 0, depth = 0;
+
+    diod_log_init (argv[0]);
+
+    if (argc > 1 && !strcmp (argv[1], "-v")) {
+        verbose = 1;
+        argc--;
+        argv++;
+    }
+    if (argc > 2 && !strcmp (argv[1], "-w")) {
+        depth = strtoul (argv[2], NULL, 10);
+        if (depth <= 0 || depth > P9_MAXWELEM)
+            usage ();
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3)
+        usage ();
+    count = strtoul (argv[1], NULL, 10);
+    aname = argv[2];
+    if (count <= 0)
+        usage ();
+    if (!(lat = malloc (count * sizeof (lat[0]))))
+        msg_exit ("out of memory");
+
+    if (!(root = npc_mount (0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+    if (depth > 0)
+        path = _mkchain (root, depth);
+    for (i = 0; i < count; i++) {
+        t = _now_nsec ();
+        if (path) {
+            /* one Twalk of depth components, then clunk */
+            if (!(fid = npc_walk (root, path)))
+                errn_exit (np_rerror (), "npc_walk %s", path);
+            if (npc_clunk (fid) < 0)
+                errn_exit (np_rerror (), "npc_clunk");
+        } else if (npc_getattr (root, &sb) < 0)
+            errn_exit (np_rerror (), "npc_getattr");
+        lat[i] = _now_nsec () - t;
+    }
+    npc_umount (root);
+
+    if (path)
+        msg ("%d walks of %d components", count, depth);
+    else
+        msg ("%d getattrs", count);
+    if (verbose) {
+        qsort (lat, count, sizeof (lat[0]), _cmp_u64);
+        msg ("p50 %.1fus p99 %.1fus max %.1fus",
+             lat[count / 2] / 1000.0,
+             lat[(count * 99) / 100] / 1000.0,
+             lat[count - 1] / 1000.0);
+    }
+    free (lat);
+    if (path)
+        free (path);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,138 @@
+/* tlock.c - check byte-range locking between fids */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tlock aname\n");
+    exit (1);
+}
+
+static char *
+_locktype (u8 type)
+{
+    switch (type) {
+        case F_RDLCK:
+            return "read lock";
+        case F_WRLCK:
+            return "write lock";
+        case F_UNLCK:
+            return "unlock";
+        default:
+            return "bad";
+    }
+}
+
+static void
+_lock (char *who, Npcfid *fid, u8 type, u64 start, u64 length)
+{
+    char *status;
+    int n;
+
+    if ((n = npc_lock (fid, type, 0, start, length)) < 0)
+        errn_exit (np_rerror (), "npc_lock");
+    switch (n) {
+        case P9_LOCK_SUCCESS:
+            status = "success";
+            break;
+        case P9_LOCK_BLOCKED:
+            status = "blocked";
+            break;
+        default:
+            status = "error";
+            break;
+    }
+    msg ("%s %s %"PRIu64"+%"PRIu64": %s", who, _locktype (type),
+         start, length, status);
+}
+
+static void
+_getlock (char *who, Npcfid *fid, u8 type, u64 start, u64 length)
+{
+    u32 proc_id;
+
+    if (npc_getlock (fid, &type, &start, &length, &proc_id) < 0)
+        errn_exit (np_rerror (), "npc_getlock");
+    if (type == F_UNLCK)
+        msg ("%s getlock: none", who);
+    else
+        msg ("%s getlock: %s %"PRIu64"+%"PRIu64" held by %s",
+             who, _locktype (type), start, length,
+             proc_id == getpid () ? "us" : "someone else");
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *a, *b;
+    char *aname;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(root = npc_mount (0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+    if (!(a = npc_create_bypath (root, "f", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (!(b = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+    if (npc_open (b, O_RDWR) < 0)
+        errn_exit (np_rerror (), "npc_open");
+
+    /* writers of disjoint ranges don't get in each other's way */
+    _lock ("a", a, F_WRLCK, 0, 100);
+    _lock ("b", b, F_WRLCK, 100, 100);
+    _lock ("b", b, F_WRLCK, 50, 10);
+    _getlock ("b", b, F_RDLCK, 0, 10);
+    _getlock ("b", b, F_WRLCK, 200, 0);
+    _getlock ("a", a, F_WRLCK, 50, 0);
+
+    /* readers share, and a range can be released in part */
+    _lock ("a", a, F_RDLCK, 0, 50);
+    _lock ("b", b, F_RDLCK, 0, 50);
+    _lock ("b", b, F_WRLCK, 50, 10);
+    _lock ("a", a, F_UNLCK, 50, 50);
+    _lock ("b", b, F_WRLCK, 50, 10);
+
+    /* clunking a fid releases whatever it held */
+    if (npc_clunk (b) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    _lock ("a", a, F_WRLCK, 0, 0);
+    _getlock ("a", a, F_WRLCK, 0, 0);
+
+    if (npc_clunk (a) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    npc_umount (root);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
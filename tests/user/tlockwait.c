@@ -0,0 +1,245 @@
+/* tlockwait.c - check that blocking locks wait on the server */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+#include "npcimpl.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define HOLD_MSEC   200 /* how long a conflicting lock is held */
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tlockwait aname\n");
+    exit (1);
+}
+
+/* Send tc without waiting for the reply, so replies can be read
+ * in whatever order the server sends them.
+ */
+static u16
+_send (Npcfsys *fs, Npfcall *tc)
+{
+    u16 tag;
+    int n;
+
+    if (!tc)
+        msg_exit ("out of memory");
+    tag = npc_get_id (fs->tagpool);
+    np_set_tag (tc, tag);
+    n = np_trans_write (fs->trans, tc->pkt, tc->size);
+    if (n < 0)
+        errn_exit (np_rerror (), "np_trans_write");
+    if (n != tc->size)
+        msg_exit ("np_trans_write came up unexpectedly short");
+    free (tc);
+    return tag;
+}
+
+static void
+_readn (Npcfsys *fs, u8 *buf, int count)
+{
+    int n;
+
+    while (count > 0) {
+        n = np_trans_read (fs->trans, buf, count);
+        if (n < 0)
+            errn_exit (np_rerror (), "np_trans_read");
+        if (n == 0)
+            msg_exit ("np_trans_read: unexpected EOF");
+        buf += n;
+        count -= n;
+    }
+}
+
+/* Read one reply, leaving any that follow it unread.
+ */
+static Npfcall *
+_recv (Npcfsys *fs)
+{
+    Npfcall *rc;
+    u32 size;
+
+    if (!(rc = malloc (sizeof (*rc) + fs->msize)))
+        msg_exit ("out of memory");
+    rc->pkt = (u8 *)rc + sizeof (*rc);
+    _readn (fs, rc->pkt, 4);
+    size = rc->pkt[0] | (rc->pkt[1] << 8) | (rc->pkt[2] << 16)
+                      | ((u32)rc->pkt[3] << 24);
+    if (size < 7 || size > fs->msize)
+        msg_exit ("bad reply size %"PRIu32, size);
+    _readn (fs, rc->pkt + 4, size - 4);
+    if (!np_deserialize (rc, rc->pkt))
+        msg_exit ("failed to deserialize response in one go");
+    npc_put_id (fs->tagpool, rc->tag);
+    return rc;
+}
+
+static u64
+_now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char *
+_describe (Npfcall *rc, u16 locktag, u16 unlocktag)
+{
+    char *who = rc->tag == locktag ? "blocking lock"
+              : rc->tag == unlocktag ? "unlock" : "flush";
+
+    switch (rc->type) {
+        case P9_RLOCK:
+            switch (rc->u.rlock.status) {
+                case P9_LOCK_SUCCESS:
+                    return rc->tag == locktag ? "blocking lock: success"
+                                              : "unlock: success";
+                case P9_LOCK_BLOCKED:
+                    return "blocking lock: blocked";
+                default:
+                    return "lock: error";
+            }
+        case P9_RFLUSH:
+            return "flush: done";
+        case P9_RLERROR:
+            if (rc->u.rlerror.ecode == EINTR)
+                return rc->tag == locktag ? "blocking lock: interrupted"
+                                          : "unexpected EINTR";
+            break;
+        default:
+            break;
+    }
+    msg_exit ("%s: unexpected reply", who);
+    /*NOTREACHED*/
+    return NULL;
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n, waiting;
+    uint64_t waits, granted, cancelled, mean, max;
+
+    if ((n = npc_get (ctl, "lockwait", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get lockwait");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64,
+                &waiting, &waits, &granted, &cancelled, &mean, &max) != 6)
+        msg_exit ("could not parse lockwait: %s", buf);
+    msg ("waiting %d waits %"PRIu64" granted %"PRIu64" cancelled %"PRIu64,
+         waiting, waits, granted, cancelled);
+    msg ("mean wait at least %d msec: %s", HOLD_MSEC,
+         mean >= HOLD_MSEC * 1000 ? "yes" : "no");
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *a, *b;
+    char *aname;
+    Npfcall *rc;
+    u16 locktag, unlocktag;
+    u64 start;
+    int n, i;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+    if (!(a = npc_create_bypath (root, "f", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (!(b = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+    if (npc_open (b, O_RDWR) < 0)
+        errn_exit (np_rerror (), "npc_open");
+
+    if ((n = npc_lock (a, F_WRLCK, 0, 0, 0)) != P9_LOCK_SUCCESS)
+        msg_exit ("first lock failed: %d", n);
+
+    /* a blocking lock gets no reply until it is flushed */
+    locktag = _send (fs, np_create_tlock (b->fid, F_WRLCK,
+                     P9_LOCK_FLAGS_BLOCK, 0, 0, getpid (), "tlockwait"));
+    usleep (HOLD_MSEC * 1000);
+    (void)_send (fs, np_create_tflush (locktag));
+    for (i = 0; i < 2; i++) {
+        rc = _recv (fs);
+        msg ("%s", _describe (rc, locktag, 0));
+        free (rc);
+    }
+
+    /* ... or until the conflicting lock goes away */
+    locktag = _send (fs, np_create_tlock (b->fid, F_WRLCK,
+                     P9_LOCK_FLAGS_BLOCK, 0, 0, getpid (), "tlockwait"));
+    usleep (HOLD_MSEC * 1000);
+    start = _now_usec ();
+    unlocktag = _send (fs, np_create_tlock (a->fid, F_UNLCK, 0, 0, 0,
+                       getpid (), "tlockwait"));
+    for (i = 0; i < 2; i++) {
+        rc = _recv (fs);
+        if (rc->tag == locktag) {
+            msg ("%s", _describe (rc, locktag, unlocktag));
+            msg ("granted within 100 msec of the unlock: %s",
+                 _now_usec () - start < 100000 ? "yes" : "no");
+        }
+        free (rc);
+    }
+    if ((n = npc_lock (a, F_WRLCK, 0, 0, 0)) < 0)
+        errn_exit (np_rerror (), "npc_lock");
+    msg ("lock held by other fid: %s",
+         n == P9_LOCK_BLOCKED ? "blocked" : "not blocked");
+    _stats (ctl);
+
+    if (npc_clunk (a) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (b) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
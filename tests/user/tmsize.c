@@ -0,0 +1,139 @@
+/* tmsize.c - move a file with several msizes and report the iounit */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define FILESIZE    (32*1024*1024)
+
+/* The server only lets a connection's msize shrink, so go largest first.
+ */
+static int msizes[] = { 16*1024*1024, 4*1024*1024, 1024*1024, 65536 };
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tmsize [-v] aname\n");
+    exit (1);
+}
+
+static double
+_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+static void
+_fill (u8 *buf, int len, u64 offset)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = (offset + i) % 251;
+}
+
+/* Write then read back FILESIZE bytes of a new file in iounit chunks.
+ * Return the seconds each took.
+ */
+static void
+_transfer (Npcfid *root, char *name, u8 *buf, u8 *cmp, double *wp, double *rp)
+{
+    Npcfid *fid;
+    u64 offset;
+    double t;
+    int n, len;
+
+    if (!(fid = npc_create_bypath (root, name, O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath %s", name);
+    t = _now ();
+    for (offset = 0; offset < FILESIZE; offset += n) {
+        len = fid->iounit;
+        if (len > FILESIZE - offset)
+            len = FILESIZE - offset;
+        _fill (buf, len, offset);
+        if ((n = npc_pwrite (fid, buf, len, offset)) != len)
+            errn_exit (np_rerror (), "npc_pwrite %s", name);
+    }
+    *wp = _now () - t;
+    t = _now ();
+    for (offset = 0; offset < FILESIZE; offset += n) {
+        len = fid->iounit;
+        if (len > FILESIZE - offset)
+            len = FILESIZE - offset;
+        if ((n = npc_pread (fid, buf, len, offset)) != len)
+            errn_exit (np_rerror (), "npc_pread %s", name);
+        _fill (cmp, len, offset);
+        if (memcmp (buf, cmp, len) != 0)
+            msg_exit ("%s: bad data at offset %"PRIu64, name, offset);
+    }
+    *rp = _now () - t;
+    msg ("%s: iounit %u", name, fid->iounit);
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root;
+    char *aname, name[32];
+    u8 *buf, *cmp;
+    double w, r;
+    int i, fd, verbose = 0;
+
+    diod_log_init (argv[0]);
+
+    if (argc > 1 && !strcmp (argv[1], "-v")) {
+        verbose = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+    if (!(buf = malloc (msizes[0])) || !(cmp = malloc (msizes[0])))
+        msg_exit ("out of memory");
+
+    for (i = 0; i < sizeof (msizes) / sizeof (msizes[0]); i++) {
+        if ((fd = dup (0)) < 0)
+            err_exit ("dup");
+        if (!(root = npc_mount (fd, msizes[i], aname, diod_auth)))
+            errn_exit (np_rerror (), "npc_mount");
+        snprintf (name, sizeof (name), "msize%d", msizes[i]);
+        _transfer (root, name, buf, cmp, &w, &r);
+        if (verbose)
+            msg ("%s: write %.0f MB/s read %.0f MB/s", name,
+                 FILESIZE / w / 1E6, FILESIZE / r / 1E6);
+        npc_umount (root);
+    }
+    free (buf);
+    free (cmp);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,137 @@
+/* tnegcache.c - check that repeated failed walks are answered from cache */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NWALK   10
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tnegcache aname\n");
+    exit (1);
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n, names, limit;
+    uint64_t suppressed, recorded;
+
+    if ((n = npc_get (ctl, "negcache", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get negcache");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %d %"SCNu64" %"SCNu64, &names, &limit,
+                &suppressed, &recorded) != 4)
+        msg_exit ("could not parse negcache: %s", buf);
+    msg ("suppressed %"PRIu64" recorded %"PRIu64, suppressed, recorded);
+}
+
+/* Walk to name, expecting ENOENT.
+ */
+static void
+_walk_missing (Npcfid *root, char *name)
+{
+    Npcfid *fid;
+
+    if ((fid = npc_walk (root, name)))
+        msg_exit ("walk %s succeeded unexpectedly", name);
+    if (np_rerror () != ENOENT)
+        errn_exit (np_rerror (), "npc_walk %s", name);
+}
+
+static void
+_walk_exists (Npcfid *root, char *name, char *when)
+{
+    Npcfid *fid;
+
+    if (!(fid = npc_walk (root, name)))
+        errn_exit (np_rerror (), "npc_walk %s", name);
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    msg ("walk %s: ok", when);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid;
+    char *aname, path[PATH_MAX];
+    int i, fd;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    /* the first miss caches the directory, the second records the name */
+    for (i = 0; i < NWALK; i++)
+        _walk_missing (root, "nope");
+    _stats (ctl);
+
+    /* a file created behind diod's back is noticed */
+    snprintf (path, sizeof (path), "%s/nope", aname);
+    if ((fd = creat (path, 0644)) < 0)
+        err_exit ("creat %s", path);
+    close (fd);
+    usleep (200000);
+    _walk_exists (root, "nope", "after local create");
+
+    /* a file created through diod is seen immediately */
+    _walk_missing (root, "made");
+    _walk_missing (root, "made");
+    if (!(fid = npc_create_bypath (root, "made", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    _walk_exists (root, "made", "after 9P create");
+    _stats (ctl);
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
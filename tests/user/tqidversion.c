@@ -0,0 +1,160 @@
+/* tqidversion.c - revalidate cached attributes with qid.version */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NROUNDS 10
+#define TESTSTR "hello\n"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tqidversion aname\n");
+    exit (1);
+}
+
+static void
+_append (char *path)
+{
+    int fd;
+
+    if ((fd = open (path, O_WRONLY | O_APPEND)) < 0)
+        err_exit ("open %s", path);
+    if (write (fd, TESTSTR, strlen (TESTSTR)) < 0)
+        err_exit ("write %s", path);
+    close (fd);
+}
+
+/* Count the Tgetattrs the server has handled.
+ */
+static uint64_t
+_getattrs (Npcfid *ctl)
+{
+    char buf[4096], *s, *p;
+    Npstats stats;
+    uint64_t count = 0;
+    int n;
+
+    if ((n = npc_get (ctl, "tpools", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get tpools");
+    buf[n] = '\0';
+    for (s = buf; (p = strchr (s, '\n')); s = p + 1) {
+        *p = '\0';
+        memset (&stats, 0, sizeof (stats));
+        if (np_decode_tpools_str (s, &stats) < 0)
+            msg_exit ("could not decode tpools line");
+        count += stats.nreqs[P9_TGETATTR];
+        free (stats.name);
+    }
+    return count;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid;
+    char *aname, path[PATH_MAX];
+    struct stat sb, cached;
+    u32 version = 0;
+    uint64_t before;
+    int i, fd, valid = 0, changes = 0, stale = 0;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if ((fd = creat (path, 0644)) < 0)
+        err_exit ("creat %s", path);
+    close (fd);
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    /* Like a caching client: look the file up each time, but only fetch
+     * attributes when the qid from the walk says the file has changed.
+     */
+    before = _getattrs (ctl);
+    for (i = 0; i < NROUNDS; i++) {
+        if (i == NROUNDS / 2)
+            _append (path);
+        if (!(fid = npc_walk (root, "f")))
+            errn_exit (np_rerror (), "npc_walk");
+        if (!valid || fid->qid.version != version) {
+            if (npc_getattr (fid, &cached) < 0)
+                errn_exit (np_rerror (), "npc_getattr");
+            if (valid)
+                changes++;
+            version = fid->qid.version;
+            valid = 1;
+        }
+        if (npc_clunk (fid) < 0)
+            errn_exit (np_rerror (), "npc_clunk");
+        if (stat (path, &sb) < 0)
+            err_exit ("stat %s", path);
+        if (sb.st_size != cached.st_size)
+            stale++;
+    }
+    msg ("%d lookups, %d version changes, %d stale sizes",
+         NROUNDS, changes, stale);
+    msg ("getattrs sent: %"PRIu64, _getattrs (ctl) - before);
+
+    /* The file changes between the walk and the open: the open's qid
+     * must report the file as it is now.
+     */
+    if (!(fid = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+    version = fid->qid.version;
+    _append (path);
+    if (npc_open (fid, O_RDONLY) < 0)
+        errn_exit (np_rerror (), "npc_open");
+    msg ("open after change reports new version: %s",
+         fid->qid.version != version ? "yes" : "no");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
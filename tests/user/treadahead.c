@@ -0,0 +1,129 @@
+/* treadahead.c - check that sequential reads are detected */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define CHUNK   32768
+#define NCHUNKS 32
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: treadahead aname\n");
+    exit (1);
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n;
+    uint64_t sequential, hits, random, advised;
+
+    if ((n = npc_get (ctl, "readahead", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get readahead");
+    buf[n] = '\0';
+    if (sscanf (buf, "%"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64, &sequential,
+                &hits, &random, &advised) != 4)
+        msg_exit ("could not parse readahead: %s", buf);
+    msg ("sequential %"PRIu64" hits %"PRIu64" random %"PRIu64
+         " advised %"PRIu64, sequential, hits, random, advised);
+}
+
+static void
+_read (Npcfid *fid, int i, char *buf)
+{
+    int n;
+
+    if ((n = npc_pread (fid, buf, CHUNK, (u64)i * CHUNK)) < 0)
+        errn_exit (np_rerror (), "npc_pread");
+    if (n != CHUNK || buf[0] != (char)i || buf[CHUNK - 1] != (char)i)
+        msg_exit ("chunk %d: bad data", i);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid;
+    char *aname, path[PATH_MAX], buf[CHUNK];
+    int i, fd;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if ((fd = creat (path, 0644)) < 0)
+        err_exit ("creat %s", path);
+    for (i = 0; i < NCHUNKS; i++) {
+        memset (buf, i, sizeof (buf));
+        if (write (fd, buf, sizeof (buf)) != sizeof (buf))
+            err_exit ("write %s", path);
+    }
+    close (fd);
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    if (!(fid = npc_open_bypath (root, "f", O_RDONLY)))
+        errn_exit (np_rerror (), "npc_open_bypath");
+
+    /* all but the first sequential read should already be advised */
+    for (i = 0; i < NCHUNKS; i++)
+        _read (fid, i, buf);
+    msg ("read %d chunks in order", NCHUNKS);
+    _stats (ctl);
+
+    /* reads that jump around advise nothing more */
+    for (i = NCHUNKS - 1; i >= 0; i -= 4)
+        _read (fid, i, buf);
+    msg ("read %d chunks out of order", NCHUNKS / 4);
+    _stats (ctl);
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,118 @@
+/* treaddir.c - list a large directory in small chunks */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NFILES  5000
+#define CHUNK   1000    /* bytes per Treaddir, so entries straddle replies */
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: treaddir aname\n");
+    exit (1);
+}
+
+/* Read fid's entries from offset to EOF, marking each file in seen[].
+ * Return the number of entries, and the offset following entry 'mark'.
+ */
+static int
+_list (Npcfid *fid, u64 offset, int *seen, int mark, u64 *markoffp)
+{
+    u8 buf[CHUNK];
+    char name[PATH_MAX];
+    Npqid qid;
+    u64 off;
+    u8 type;
+    int i, n, len, count = 0;
+
+    while ((len = npc_readdir (fid, offset, buf, sizeof (buf))) > 0) {
+        for (i = 0; i < len; i += n) {
+            n = np_deserialize_p9dirent (&qid, &off, &type, name,
+                                         sizeof (name), buf + i, len - i);
+            if (n == 0)
+                msg_exit ("could not decode dirent");
+            if (seen && name[0] == 'f')
+                seen[strtoul (name + 1, NULL, 10)]++;
+            if (count++ == mark && markoffp)
+                *markoffp = off;
+            offset = off;
+        }
+    }
+    if (len < 0)
+        errn_exit (np_rerror (), "npc_readdir");
+    return count;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *fid;
+    char *aname, path[PATH_MAX];
+    int i, fd, n, seen[NFILES], once;
+    u64 markoff = 0;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    snprintf (path, sizeof (path), "%s/big", aname);
+    if (mkdir (path, 0755) < 0)
+        err_exit ("mkdir %s", path);
+    for (i = 0; i < NFILES; i++) {
+        snprintf (path, sizeof (path), "%s/big/f%d", aname, i);
+        if ((fd = creat (path, 0644)) < 0)
+            err_exit ("creat %s", path);
+        close (fd);
+    }
+
+    if (!(root = npc_mount (0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+    if (!(fid = npc_walk (root, "big")))
+        errn_exit (np_rerror (), "npc_walk");
+    if (npc_open (fid, O_RDONLY) < 0)
+        errn_exit (np_rerror (), "npc_open");
+
+    memset (seen, 0, sizeof (seen));
+    n = _list (fid, 0, seen, NFILES / 2, &markoff);
+    for (once = 1, i = 0; i < NFILES; i++)
+        if (seen[i] != 1)
+            once = 0;
+    msg ("listed %d entries, each file %s", n, once ? "once" : "NOT once");
+
+    msg ("rewound: %d entries", _list (fid, 0, NULL, -1, NULL));
+    n = _list (fid, markoff, NULL, -1, NULL);
+    msg ("resumed after entry %d: %d entries", NFILES / 2, n);
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    npc_umount (root);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
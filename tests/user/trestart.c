@@ -0,0 +1,241 @@
+/* trestart.c - check that fids survive a diod hot restart */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+#include "npcimpl.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define TESTSTR "hello across restart\n"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: trestart sockpath logfile aname\n");
+    exit (1);
+}
+
+/* Send tc without waiting for the reply.
+ */
+static u16
+_send (Npcfsys *fs, Npfcall *tc)
+{
+    u16 tag;
+    int n;
+
+    if (!tc)
+        msg_exit ("out of memory");
+    tag = npc_get_id (fs->tagpool);
+    np_set_tag (tc, tag);
+    n = np_trans_write (fs->trans, tc->pkt, tc->size);
+    if (n < 0)
+        errn_exit (np_rerror (), "np_trans_write");
+    if (n != tc->size)
+        msg_exit ("np_trans_write came up unexpectedly short");
+    free (tc);
+    return tag;
+}
+
+static void
+_readn (Npcfsys *fs, u8 *buf, int count)
+{
+    int n;
+
+    while (count > 0) {
+        n = np_trans_read (fs->trans, buf, count);
+        if (n < 0)
+            errn_exit (np_rerror (), "np_trans_read");
+        if (n == 0)
+            msg_exit ("np_trans_read: unexpected EOF");
+        buf += n;
+        count -= n;
+    }
+}
+
+/* Read the reply to a request sent with _send ().
+ */
+static Npfcall *
+_recv (Npcfsys *fs)
+{
+    Npfcall *rc;
+    u32 size;
+
+    if (!(rc = malloc (sizeof (*rc) + fs->msize)))
+        msg_exit ("out of memory");
+    rc->pkt = (u8 *)rc + sizeof (*rc);
+    _readn (fs, rc->pkt, 4);
+    size = rc->pkt[0] | (rc->pkt[1] << 8) | (rc->pkt[2] << 16)
+                      | ((u32)rc->pkt[3] << 24);
+    if (size < 7 || size > fs->msize)
+        msg_exit ("bad reply size %"PRIu32, size);
+    _readn (fs, rc->pkt + 4, size - 4);
+    if (!np_deserialize (rc, rc->pkt))
+        msg_exit ("failed to deserialize response in one go");
+    npc_put_id (fs->tagpool, rc->tag);
+    return rc;
+}
+
+/* Start a second diod that takes over from the one we're talking to.
+ */
+static pid_t
+_start_successor (char *sockpath, char *logfile, char *aname)
+{
+    char *diod = getenv ("PATH_DIOD");
+    pid_t pid;
+
+    if (!diod)
+        msg_exit ("PATH_DIOD is not set");
+    switch ((pid = fork ())) {
+        case -1:
+            err_exit ("fork");
+        case 0:
+            close (0);
+            execl (diod, diod, "-f", "-n", "-c", "/dev/null", "-d", "1",
+                   "-L", logfile, "-l", "127.0.0.1:0", "-e", aname,
+                   "-H", sockpath, NULL);
+            err_exit ("exec %s", diod);
+        default:
+            break;
+    }
+    return pid;
+}
+
+/* The successor logs when it has received everything from us.
+ */
+static void
+_wait_takeover (char *logfile)
+{
+    char line[256];
+    FILE *f;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        if ((f = fopen (logfile, "r"))) {
+            while (fgets (line, sizeof (line), f)) {
+                if (strstr (line, "hot restart: took over")) {
+                    fclose (f);
+                    return;
+                }
+            }
+            fclose (f);
+        }
+        usleep (10000);
+    }
+    msg_exit ("timed out waiting for successor");
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *fid, *dfid, *lfid, *wfid;
+    Npfcall *rc;
+    char *sockpath, *logfile, *aname, path[PATH_MAX];
+    char buf[sizeof (TESTSTR)];
+    struct stat sb;
+    pid_t pid;
+    int n, status;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 4)
+        usage ();
+    sockpath = argv[1];
+    logfile = argv[2];
+    aname = argv[3];
+
+    if (!(root = npc_mount (0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+
+    /* an open file that will be unlinked, and a walked directory */
+    if (!(fid = npc_create_bypath (root, "foo", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (npc_puts (fid, TESTSTR) < 0)
+        errn_exit (np_rerror (), "npc_puts");
+    snprintf (path, sizeof (path), "%s/foo", aname);
+    if (unlink (path) < 0)
+        err_exit ("unlink %s", path);
+    if (npc_mkdir_bypath (root, "bar", 0755) < 0)
+        errn_exit (np_rerror (), "npc_mkdir_bypath");
+    if (!(dfid = npc_walk (root, "bar")))
+        errn_exit (np_rerror (), "npc_walk");
+
+    /* a blocking lock parked on the server behind a conflicting one */
+    if (!(lfid = npc_create_bypath (root, "lk", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (npc_lock (lfid, F_WRLCK, 0, 0, 0) != P9_LOCK_SUCCESS)
+        msg_exit ("first lock failed");
+    if (!(wfid = npc_walk (root, "lk")))
+        errn_exit (np_rerror (), "npc_walk");
+    if (npc_open (wfid, O_RDWR) < 0)
+        errn_exit (np_rerror (), "npc_open");
+    (void)_send (root->fsys, np_create_tlock (wfid->fid, F_WRLCK,
+                 P9_LOCK_FLAGS_BLOCK, 0, 0, getpid (), "trestart"));
+    usleep (100000);
+
+    (void)unlink (logfile);
+    pid = _start_successor (sockpath, logfile, aname);
+    _wait_takeover (logfile);
+    msg ("successor has taken over");
+
+    /* the restart answered it so the client will retry */
+    rc = _recv (root->fsys);
+    msg ("parked lock: %s", rc->type == P9_RLOCK
+                            && rc->u.rlock.status == P9_LOCK_BLOCKED
+                            ? "blocked" : "not blocked");
+    free (rc);
+
+    npc_lseek (fid, 0, SEEK_SET);
+    if ((n = npc_read (fid, buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_read");
+    buf[n] = '\0';
+    msg ("read unlinked file: %s", !strcmp (buf, TESTSTR) ? "ok" : "bad");
+    if (npc_getattr (dfid, &sb) < 0)
+        errn_exit (np_rerror (), "npc_getattr");
+    msg ("walked fid is a directory: %s", S_ISDIR (sb.st_mode) ? "yes" : "no");
+    if (npc_getattr_bypath (root, "bar", &sb) < 0)
+        errn_exit (np_rerror (), "npc_getattr_bypath");
+    msg ("new walk from root: ok");
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (dfid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (wfid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (lfid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    npc_umount (root);
+
+    if (kill (pid, SIGTERM) < 0)
+        err_exit ("kill");
+    if (waitpid (pid, &status, 0) < 0)
+        err_exit ("waitpid");
+    msg ("successor exited with rc=%d", WIFEXITED (status)
+                                        ? WEXITSTATUS (status) : -1);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
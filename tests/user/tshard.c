@@ -0,0 +1,195 @@
+/* tshard.c - check that a sharded diod looks like one server */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+#include "list.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+#include "diod_sock.h"
+
+#define NSHARDS 2
+#define NCONNS  4
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: tshard logfile aname\n");
+    exit (1);
+}
+
+/* Find a free port on the loopback interface.
+ */
+static void
+_free_port (char *port, int len)
+{
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof (sin);
+    int fd;
+
+    if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+        err_exit ("socket");
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if (bind (fd, (struct sockaddr *)&sin, sizeof (sin)) < 0)
+        err_exit ("bind");
+    if (getsockname (fd, (struct sockaddr *)&sin, &slen) < 0)
+        err_exit ("getsockname");
+    snprintf (port, len, "%d", ntohs (sin.sin_port));
+    close (fd);
+}
+
+static pid_t
+_start_diod (char *port, char *logfile, char *aname)
+{
+    char *diod = getenv ("PATH_DIOD");
+    char listen[64], shards[16];
+    pid_t pid;
+
+    if (!diod)
+        msg_exit ("PATH_DIOD is not set");
+    snprintf (listen, sizeof (listen), "127.0.0.1:%s", port);
+    snprintf (shards, sizeof (shards), "%d", NSHARDS);
+    switch ((pid = fork ())) {
+        case -1:
+            err_exit ("fork");
+        case 0:
+            close (0);
+            execl (diod, diod, "-f", "-n", "-c", "/dev/null", "-d", "1",
+                   "-L", logfile, "-l", listen, "-e", aname,
+                   "-P", shards, NULL);
+            err_exit ("exec %s", diod);
+        default:
+            break;
+    }
+    return pid;
+}
+
+static Npcfid *
+_mount (char *port, char *aname)
+{
+    Npcfid *root;
+    int i, fd = -1;
+
+    for (i = 0; i < 1000 && fd < 0; i++) {
+        if ((fd = diod_sock_connect ("127.0.0.1", port, DIOD_SOCK_QUIET)) < 0)
+            usleep (10000);
+    }
+    if (fd < 0)
+        msg_exit ("could not connect to diod on port %s", port);
+    if (!(root = npc_mount (fd, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount %s", aname);
+    return root;
+}
+
+static char *
+_get (Npcfid *ctl, char *name)
+{
+    static char buf[65536];
+    int n;
+
+    if ((n = npc_get (ctl, name, buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get %s", name);
+    buf[n] = '\0';
+    return buf;
+}
+
+static int
+_count_lines (char *s)
+{
+    int n = 0;
+
+    for (; *s; s++)
+        if (*s == '\n')
+            n++;
+    return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root[NCONNS], *ctl;
+    char *logfile, *aname, port[16], *s, *p;
+    Npstats stats;
+    int i, n, shard, spid, node, nconns, status;
+    u64 attaches = 0;
+    pid_t pid;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 3)
+        usage ();
+    logfile = argv[1];
+    aname = argv[2];
+
+    _free_port (port, sizeof (port));
+    pid = _start_diod (port, logfile, aname);
+
+    for (i = 0; i < NCONNS; i++)
+        root[i] = _mount (port, aname);
+    ctl = _mount (port, "ctl");
+
+    s = _get (ctl, "shards");
+    msg ("shards: %d", _count_lines (s));
+    for (; (n = sscanf (s, "%d %d %d %d", &shard, &spid, &node, &nconns)) == 4;
+                                                        s = p + 1) {
+        msg ("shard %d: %d connections", shard, nconns);
+        if (!(p = strchr (s, '\n')))
+            break;
+    }
+
+    msg ("connections: %d", _count_lines (_get (ctl, "connections")));
+
+    n = 0;
+    for (s = _get (ctl, "tpools"); *s; s = p + 1) {
+        if (!(p = strchr (s, '\n')))
+            break;
+        *p = '\0';
+        memset (&stats, 0, sizeof (stats));
+        if (np_decode_tpools_str (s, &stats) < 0)
+            msg_exit ("could not decode tpools line");
+        if (!strcmp (stats.name, aname)) {
+            n++;
+            attaches += stats.nreqs[P9_TATTACH];
+        }
+        free (stats.name);
+    }
+    msg ("tpools for export: %d, attaches: %"PRIu64, n, attaches);
+
+    npc_umount (ctl);
+    for (i = 0; i < NCONNS; i++)
+        npc_umount (root[i]);
+
+    if (kill (pid, SIGTERM) < 0)
+        err_exit ("kill");
+    if (waitpid (pid, &status, 0) < 0)
+        err_exit ("waitpid");
+    msg ("diod exited with rc=%d", WIFEXITED (status)
+                                   ? WEXITSTATUS (status) : -1);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,122 @@
+/* twritebehind.c - check that small writes are gathered on async exports */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define CHUNK   16384
+#define NCHUNKS 320     /* 5 MiB: one full buffer and part of another */
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: twritebehind aname\n");
+    exit (1);
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n;
+    size_t used, limit;
+    uint64_t writes, flushes, pressure, timeouts;
+
+    if ((n = npc_get (ctl, "writebehind", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get writebehind");
+    buf[n] = '\0';
+    if (sscanf (buf, "%zu %zu %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64, &used,
+                &limit, &writes, &flushes, &pressure, &timeouts) != 6)
+        msg_exit ("could not parse writebehind: %s", buf);
+    msg ("writes %"PRIu64" flushes %"PRIu64, writes, flushes);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid;
+    char *aname, path[PATH_MAX], buf[CHUNK], rbuf[CHUNK];
+    struct stat sb;
+    int i, fd, ok = 1;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    if (!(fid = npc_create_bypath (root, "f", O_WRONLY, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    for (i = 0; i < NCHUNKS; i++) {
+        memset (buf, i, sizeof (buf));
+        if (npc_pwrite (fid, buf, CHUNK, (u64)i * CHUNK) != CHUNK)
+            errn_exit (np_rerror (), "npc_pwrite");
+    }
+    msg ("wrote %d chunks", NCHUNKS);
+
+    /* getattr on the writing fid must see everything it wrote */
+    if (npc_getattr (fid, &sb) < 0)
+        errn_exit (np_rerror (), "npc_getattr");
+    msg ("size %lld", (long long)sb.st_size);
+    _stats (ctl);
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if ((fd = open (path, O_RDONLY)) < 0)
+        err_exit ("open %s", path);
+    for (i = 0; i < NCHUNKS; i++) {
+        memset (buf, i, sizeof (buf));
+        if (read (fd, rbuf, sizeof (rbuf)) != sizeof (rbuf)
+                                || memcmp (buf, rbuf, sizeof (buf)) != 0)
+            ok = 0;
+    }
+    close (fd);
+    msg ("file contents %s", ok ? "ok" : "bad");
+
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
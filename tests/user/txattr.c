@@ -0,0 +1,234 @@
+/* txattr.c - set and get extended attributes, and cache their absence */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define NWALK   10
+#define TESTVAL "some value"
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: txattr aname\n");
+    exit (1);
+}
+
+static void
+_stats (Npcfid *ctl)
+{
+    char buf[256];
+    int n, names, limit;
+    uint64_t hits, misses, recorded;
+
+    if ((n = npc_get (ctl, "xattrcache", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_get xattrcache");
+    buf[n] = '\0';
+    if (sscanf (buf, "%d %d %"SCNu64" %"SCNu64" %"SCNu64, &names, &limit,
+                &hits, &misses, &recorded) != 5)
+        msg_exit ("could not parse xattrcache: %s", buf);
+    msg ("hits %"PRIu64" misses %"PRIu64" recorded %"PRIu64,
+         hits, misses, recorded);
+}
+
+/* Read the value of attribute name of fid (the list of names if empty)
+ * into buf.  Return its length, or -1 with np_rerror () set.
+ */
+static int
+_get (Npcfid *fid, char *name, char *buf, int size)
+{
+    Npcfid *afid;
+    u64 len;
+    int n;
+
+    if (!(afid = npc_xattrwalk (fid, name, &len)))
+        return -1;
+    if (len > size)
+        msg_exit ("xattr %s is too big: %"PRIu64, name, len);
+    if ((n = npc_read (afid, buf, size)) != len)
+        msg_exit ("xattr %s: read %d of %"PRIu64" bytes", name, n, len);
+    if (npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    return n;
+}
+
+/* Set attribute name of path (remove it if value is NULL) through a
+ * fid walked from root.
+ */
+static void
+_set (Npcfid *root, char *path, char *name, char *value)
+{
+    Npcfid *fid;
+    int len = value ? strlen (value) : 0;
+
+    if (!(fid = npc_walk (root, path)))
+        errn_exit (np_rerror (), "npc_walk");
+    if (npc_xattrcreate (fid, name, len, 0) < 0)
+        errn_exit (np_rerror (), "npc_xattrcreate");
+    if (len > 0 && npc_pwrite (fid, value, len, 0) != len)
+        errn_exit (np_rerror (), "npc_pwrite");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk xattr %s", name);
+}
+
+static void
+_get_missing (Npcfid *fid, char *name)
+{
+    char buf[256];
+
+    if (_get (fid, name, buf, sizeof (buf)) >= 0)
+        msg_exit ("xattr %s exists unexpectedly", name);
+    if (np_rerror () != ENODATA)
+        errn_exit (np_rerror (), "npc_xattrwalk %s", name);
+}
+
+static void
+_get_exists (Npcfid *fid, char *name, char *when)
+{
+    char buf[256];
+
+    if (_get (fid, name, buf, sizeof (buf)) < 0)
+        errn_exit (np_rerror (), "npc_xattrwalk %s", name);
+    msg ("get %s %s: ok", name, when);
+}
+
+/* Return 1 if the packed list of names in buf contains name.
+ */
+static int
+_listed (char *buf, int len, char *name)
+{
+    int i;
+
+    for (i = 0; i < len; i += strlen (buf + i) + 1) {
+        if (!strcmp (buf + i, name))
+            return 1;
+    }
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *root, *ctl, *afid, *fid, *fid2;
+    char *aname, path[PATH_MAX], buf[256];
+    int i, n, len;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 2)
+        usage ();
+    aname = argv[1];
+
+    if (!(fs = npc_start (0, 65536+24, 0)))
+        errn_exit (np_rerror (), "npc_start");
+    if (!(afid = npc_auth (fs, aname, geteuid (), diod_auth))
+                                                && np_rerror () != 0)
+        errn_exit (np_rerror (), "npc_auth");
+    if (!(root = npc_attach (fs, afid, aname, geteuid ())))
+        errn_exit (np_rerror (), "npc_attach");
+    if (!(ctl = npc_attach (fs, afid, "ctl", geteuid ())))
+        errn_exit (np_rerror (), "npc_attach ctl");
+    if (afid && npc_clunk (afid) < 0)
+        errn_exit (np_rerror (), "npc_clunk afid");
+
+    if (!(fid = npc_create_bypath (root, "f", O_RDWR, 0644, getegid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (!(fid = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+    usleep (200000); /* let the file's ctime settle */
+
+    /* with attrcache, the first miss is recorded and the rest are
+     * answered from it; without it, none are
+     */
+    for (i = 0; i < NWALK; i++)
+        _get_missing (fid, "user.none");
+    _stats (ctl);
+
+    _set (root, "f", "user.test", TESTVAL);
+    if ((n = _get (fid, "user.test", buf, sizeof (buf) - 1)) < 0)
+        errn_exit (np_rerror (), "npc_xattrwalk user.test");
+    buf[n] = '\0';
+    msg ("get user.test: %s", !strcmp (buf, TESTVAL) ? "ok" : "bad");
+    if ((n = _get (fid, "", buf, sizeof (buf))) < 0)
+        errn_exit (np_rerror (), "npc_xattrwalk list");
+    msg ("list: user.test %s", _listed (buf, n, "user.test") ? "found"
+                                                             : "missing");
+
+    /* an attribute set through diod is seen immediately */
+    _set (root, "f", "user.none", TESTVAL);
+    _get_exists (fid, "user.none", "after 9P set");
+
+    /* one set behind diod's back changes the ctime */
+    usleep (200000);
+    _get_missing (fid, "user.local");
+    _get_missing (fid, "user.local");
+    snprintf (path, sizeof (path), "%s/f", aname);
+    if (setxattr (path, "user.local", TESTVAL, strlen (TESTVAL), 0) < 0)
+        err_exit ("setxattr %s", path);
+    usleep (100000); /* let an attrcache watch see it */
+    _get_exists (fid, "user.local", "after local set");
+
+    /* a zero length value removes the attribute */
+    _set (root, "f", "user.test", NULL);
+    _get_missing (fid, "user.test");
+    msg ("remove user.test: ok");
+
+    /* directories have attributes too */
+    _set (root, "", "user.dir", TESTVAL);
+    _get_exists (root, "user.dir", "on directory");
+    _stats (ctl);
+
+    /* a value written with a gap in it is refused, and not set */
+    if (!(fid2 = npc_walk (root, "f")))
+        errn_exit (np_rerror (), "npc_walk");
+    len = strlen (TESTVAL);
+    if (npc_xattrcreate (fid2, "user.gap", 2 * len, 0) < 0)
+        errn_exit (np_rerror (), "npc_xattrcreate");
+    n = npc_pwrite (fid2, TESTVAL, len, len);
+    msg ("write after a gap: %s", n < 0 && np_rerror () == EINVAL
+                                  ? "refused" : "accepted");
+    if (npc_pwrite (fid2, TESTVAL, len, 0) != len)
+        errn_exit (np_rerror (), "npc_pwrite");
+    if (npc_clunk (fid2) == 0 || np_rerror () != EINVAL)
+        msg_exit ("clunk of a partly written xattr did not fail");
+    _get_missing (fid, "user.gap");
+    msg ("partly written user.gap: not set");
+
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_clunk (ctl) < 0)
+        errn_exit (np_rerror (), "npc_clunk ctl");
+    if (npc_clunk (root) < 0)
+        errn_exit (np_rerror (), "npc_clunk root");
+    npc_finish (fs);
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */